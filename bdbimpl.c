@@ -61,8 +61,28 @@ Older versions:
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <time.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+//define HAVE_LZ4 and link liblz4 to allow compressing the logical log
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
 #include "server.h"
 
@@ -72,48 +92,417 @@ DB_ENV *env;
 
 #define ENV_DIRECTORY "ENV"
 
+/*
+ The catalog file records every create()d index as a KeyType byte, the index's 32-bit
+ incarnation number and the NUL-terminated index name, after an 8-byte header. create()
+ appends to it and dropIndex rewrites it. An index's files are named after its name and
+ incarnation, so an index re-created under a dropped one's name never opens files the
+ dropped one has yet to remove.
+ */
+#define CATALOG_FILE ENV_DIRECTORY "/catalog"
+#define CATALOG_MAGIC "IDXCAT2\n"
+#define CATALOG_MAGIC_LEN 8
+
 #define DEFAULT_HOMEDIR "./"
 
 pthread_mutex_t DBLINK_LOCK = PTHREAD_MUTEX_INITIALIZER;
 
+//victim selection used by the lock manager, fixed once the environment is created
+DeadlockPolicy deadlockPolicy = DEADLOCK_DETECT_DEFAULT;
+
+//default durability of commits, fixed once the environment is created
+Durability envDurability = DURABILITY_SYNC;
+uint32_t lossWindowMs = 10;
+
+//longest replay at startup the checkpointer aims for, in seconds; read without a lock
+uint32_t recoveryTargetSecs = 30;
+
+//conservative rate at which recovery replays log, used to turn the target into log volume
+#define REPLAY_KB_PER_SEC (16 * 1024)
+//longest sleep between checkpointer passes, in milliseconds
+#define CHECKPOINT_PERIOD_MS 1000
+//share of the cache the checkpointer keeps clean between checkpoints
+#define TRICKLE_CLEAN_PERCENT 20
+
+//entries in the io_uring submission queue; zero leaves file I/O to BDB
+uint32_t asyncIODepth;
+
+//threads replaying the logical log at startup, each for its share of the index ids;
+//zero uses one for every online processor
+uint32_t recoveryThreads;
+#define MAX_RECOVERY_THREADS 64
+
+//location of the most recent checkpoint taken by the checkpointer
+DB_LSN lastCheckpointLsn;
+
+//whether commits are made durable by the logical log rather than BDB's, and whether its blocks are compressed
+int logicalLog;
+int logCompress;
+//whether indices are opened with MVCC_OPEN_FLAGS and backups read with SNAPSHOT_TXN_FLAGS;
+//on by default where BDB supports it, so that a backup never holds up writers
+#ifdef DB_MULTIVERSION
+int multiversion = 1;
+#else
+int multiversion;
+#endif
+//whether every index keeps a counts DB, which countRange and getByRank need
+int recordCounts;
+//set once startup has replayed the logical log; operations are only logged from then on
+int logicalLogOpen;
+
+//size of the cache, zero for BDB's default, and the number of regions it is split into
+uint64_t cacheBytes;
+uint32_t cachePartitions = 1;
+//smallest cache region setCacheSize allows
+#define MIN_CACHE_PARTITION (1024 * 1024)
+
+//size of the log buffer when the log is kept only in memory; it must hold all active transactions
+#define IN_MEMORY_LOG_SIZE (64 * 1024 * 1024)
+
+//unless setMultiversion turns it off, indices are opened for multiversion reads, so that backups
+//read a snapshot without locking out writers; every write then copies the pages it changes
+#ifdef DB_MULTIVERSION
+#define MVCC_OPEN_FLAGS DB_MULTIVERSION
+#define SNAPSHOT_TXN_FLAGS DB_TXN_SNAPSHOT
+#else
+#define MVCC_OPEN_FLAGS 0
+#define SNAPSHOT_TXN_FLAGS 0
+#endif
+
+/*
+ Commits made without syncing are counted in commitsLogged; the flusher thread flushes
+ the log and advances commitsFlushed to the count its flush covered. Group commits queue
+ a FlushWaiter in commit order and the flusher hands each one covered by a flush that
+ flush's own result, so one flush releases every commit that arrived while the previous
+ flush was running and a later flush cannot change what an earlier one reported.
+ */
+typedef struct FlushWaiter {
+    uint64_t seq;
+    ErrCode status;
+    int done;
+    struct FlushWaiter *next;
+} FlushWaiter;
+
+pthread_mutex_t FLUSH_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flushNeeded = PTHREAD_COND_INITIALIZER;
+pthread_cond_t flushDone = PTHREAD_COND_INITIALIZER;
+uint64_t commitsLogged;
+uint64_t commitsFlushed;
+FlushWaiter *flushWaitersHead;
+FlushWaiter *flushWaitersTail;
+
 const char NULL_PAYLOAD[MAX_PAYLOAD_LEN + 1];
 
-typedef struct 
+struct DBLink;
+
+/*
+ A range of snapshot entries, from live up to but not including tombstoned, that had no
+ tombstones when transaction tid last looked. It holds only while tombstoneGen is still gen.
+ */
+typedef struct
+    {
+        const void  *snapshot;
+        DB_TXN      *tid;
+        uint64_t    gen;
+        uint64_t    live;
+        uint64_t    tombstoned;
+    } TombstoneRun;
+
+typedef struct BDBState
     {
-        DB          *dbp;
-        KeyType     type;
-        const char  *db_name;
-        uint32_t    tid;
-        Key         lastKey;
-        int         keyNotFound;
+        DB              *dbp;
+        KeyType         type;
+        const char      *db_name;
+        struct DBLink   *link;
+        uint32_t        tid;
+        Key             lastKey;
+        int             keyNotFound;
+        //last record returned while the index is served from a snapshot, as stored
+        int             positioned;
+        uint32_t        posKeySize;
+        uint32_t        posDataSize;
+        char            posKey[MAX_VARCHAR_LEN + 1];
+        char            posData[MAX_PAYLOAD_LEN + 1];
+        TombstoneRun    tombstones;     //snapshot entries getNext knows to be live
+        struct BDBState *nextSpare;     //next closed handle on the same spare list
+        uint32_t        generation;     //bumped whenever the handle is reopened
     } BDBState;
 
-typedef struct CursorLink
+/*
+ An IdxState is the address of its BDBState with the low bits of the handle's generation
+ in bits 48-55, which user-space addresses leave clear on 64-bit platforms (the top byte
+ is left alone for hardware pointer tags). A stale IdxState for a handle that has since
+ been reopened no longer matches its generation. 32-bit platforms hand out the bare address.
+ */
+#if UINTPTR_MAX > 0xffffffffu
+#define HANDLE_GEN_SHIFT 48
+#define HANDLE_GEN_MASK ((uintptr_t)0xff << HANDLE_GEN_SHIFT)
+
+IdxState *p_handleToken(BDBState *state)
+{
+    return (IdxState *)((uintptr_t)state | (((uintptr_t)state->generation << HANDLE_GEN_SHIFT) & HANDLE_GEN_MASK));
+}
+
+BDBState *p_handleState(IdxState *ident)
+{
+    return (BDBState *)((uintptr_t)ident & ~HANDLE_GEN_MASK);
+}
+
+/*
+ @return 1 if ident was handed out by the latest openIndex of its handle.
+ */
+int p_handleCurrent(IdxState *ident, BDBState *state)
+{
+    return ((uintptr_t)ident & HANDLE_GEN_MASK) == (((uintptr_t)state->generation << HANDLE_GEN_SHIFT) & HANDLE_GEN_MASK);
+}
+#else
+#define p_handleToken(state) ((IdxState *)(state))
+#define p_handleState(ident) ((BDBState *)(ident))
+#define p_handleCurrent(ident, state) 1
+#endif
+
+/*
+ Number of cursor slots kept inline in every TXNState; transactions touching indices
+ with larger ids move the cursor table to the heap.
+ */
+#define TXN_CURSOR_SLOTS 64
+
+/*
+ A cursor that getNext has moved forward READ_AHEAD_RUN times in a row reads the records
+ after it a buffer at a time with DB_MULTIPLE_KEY, and getNext hands them out from there.
+ A transaction reads ahead on one index at a time.
+ */
+#define READ_AHEAD_RUN 4
+//BDB wants bulk buffers at least a page long
+#define READ_AHEAD_SIZE (64 * 1024)
+
+typedef struct
     {
-        DBC                 *cursor;
-        DB                  *dbp;
-        struct CursorLink   *cursorLink;
-    } CursorLink;
+        uint32_t    id;         //DBLink id of the index whose cursor is read ahead
+        uint32_t    run;        //getNext calls in a row on that index
+        char        *buffer;
+        DBT         bulk;       //the records read ahead, in buffer
+        void        *next;      //DB_MULTIPLE position of the next record, NULL once drained
+        DBT         lastKey;    //the last record handed out, in buffer
+        DBT         lastData;
+    } ReadAhead;
 
 typedef struct
     {
-        CursorLink  *cursorLink;
+        DBC         **cursors;      //indexed by DBLink id
+        uint32_t    numCursors;     //capacity of cursors
+        uint32_t    cursorSpan;     //one past the highest id with a cursor
+        DBC         *inlineCursors[TXN_CURSOR_SLOTS];
         DB_TXN      *tid;
+        Durability  durability;
+        char        *logRecords;    //logical log records of the transaction, written out at commit
+        size_t      logUsed;
+        size_t      logCap;
+        char        *viewArena;     //chunk holding records read by getView and getNextView
+        size_t      viewUsed;
+        size_t      viewCap;
+        ReadAhead   readAhead;
+        struct DBLink *droppedLinks;    //dropped indices to close once the transaction ends
     } TXNState;
 
 typedef int bool;
 
+/*
+ A snapshot file holds a header, the entries, and then the file offset of every entry in
+ (key, payload) order. An entry is a 16-bit key length, a 16-bit payload length, the key
+ as it is stored in the index, and the payload including its NUL. Since the file only
+ refers to itself by offset, it is served straight from a read-only mapping.
+ */
+#define SNAPSHOT_MAGIC "IDXSNAP1"
+#define SNAPSHOT_MAGIC_LEN 8
+
+typedef struct
+    {
+        char        magic[SNAPSHOT_MAGIC_LEN];
+        uint32_t    type;
+        uint32_t    reserved;
+        uint64_t    count;
+        uint64_t    offsetsPos;
+    } SnapshotHeader;
+
+typedef struct
+    {
+        uint16_t    keySize;
+        uint16_t    dataSize;
+        char        bytes[];
+    } SnapshotEntry;
+
+typedef struct Snapshot
+    {
+        char            *map;
+        size_t          size;
+        uint64_t        count;
+        const uint64_t  *offsets;
+        uint32_t        seq;
+        struct Snapshot *retired;   //next snapshot the index replaced
+    } Snapshot;
+
+/*
+ An index with a snapshot keeps a side DB next to its own. Its SNAPSHOT_SEQ_KEY record
+ names the snapshot file in use, and a TOMBSTONE_TAG record marks a snapshot entry
+ deleted since; the index's own DB holds only what was inserted since. A range of entries
+ deleted at once is marked by one RANGE_TOMBSTONE_TAG record instead, keyed by the tag and
+ the big-endian number of the entry after the range, with the number of its first entry
+ as the payload. Ranges neither overlap nor hold entries with a TOMBSTONE_TAG record.
+ */
+#define SIDE_SUFFIX ".side"
+#define SNAPSHOT_SEQ_KEY 'S'
+#define TOMBSTONE_TAG 'T'
+#define RANGE_TOMBSTONE_TAG 'D'
+
+/*
+ With setRecordCounts, every index also keeps a counts DB, a DB_RECNUM btree with one
+ empty record for each record in the index's own DB and each tombstone. Its key is the
+ tag, the record's key, a NUL and the payload, which sorts the way the index and the
+ side DB do, since no key holds a NUL, so the record numbers BDB keeps in its internal
+ pages rank them. A DB_RECNUM btree cannot have duplicates, so the index's own DB
+ cannot keep the counts itself. COUNTS_DONE_KEY marks a counts DB that holds everything.
+ */
+#define COUNTS_SUFFIX ".counts"
+#define COUNTED_TAG 'R'
+#define COUNTS_DONE_KEY 'C'
+#define COUNT_KEY_LEN (MAX_VARCHAR_LEN + MAX_PAYLOAD_LEN + 3)
+
+/*
+ A DBLink counts one reference for every open handle, transaction cursor and whole-index
+ operation using it, plus one while it is in the catalog. Dropping an index gives up the
+ catalog's reference, and whoever gives up the last one closes and removes its files.
+ */
 typedef struct DBLink
     {
         char            *name;
+        char            *file;      //name of the DB file, unique to this incarnation
+        uint32_t        incarnation;
+        uint32_t        hash;
+        uint32_t        id;
         DB              *dbp;
         KeyType         type;
-        int             numOpenThreads;
-        struct DBLink   *link;
+        int             refs;
+        int             isOpen;
+        int             dropped;
+        DB              *side;      //NULL unless the index was loaded from a snapshot
+        DB              *counts;    //NULL unless setRecordCounts was called
+        Snapshot        *snapshot;
+        Snapshot        *retired;   //replaced snapshots, mapped until the last reference is gone
+        struct DBLink   *nextClosed;    //next dropped index a transaction has to close
+        struct DBLink   *successor;     //the new incarnation a truncate replaced this one with
     } DBLink;
 
-DBLink *dbLookup;
+/*
+ Open-addressed hash table of DBLinks keyed by index name. Readers probe it without
+ taking any lock; writers serialize on DBLINK_LOCK, publish each fully built DBLink
+ into an empty slot with a release store, and grow by publishing a whole new table.
+ Replaced tables are kept on the retired chain because readers may still be probing them.
+ */
+typedef struct DBTable
+    {
+        uint32_t        mask;
+        struct DBTable  *retired;
+        DBLink          *slots[];
+    } DBTable;
+
+#define DBTABLE_INITIAL_SIZE 64
+
+DBTable *dbTable;
+
+//stored in the slot of a dropped index, so that probe sequences passing through it stay intact
+DBLink droppedSlot;
+#define DROPPED_SLOT (&droppedSlot)
+
+//slots of dbTable holding either a DBLink or DROPPED_SLOT
+uint32_t tableUsed;
+//indices currently in the catalog
+uint32_t liveIndices;
+
+//ids of dropped indices nothing refers to any more, handed out again before new ones so ids stay dense
+uint32_t *freeIds;
+uint32_t numFreeIds;
+uint32_t freeIdsCap;
+
+/*
+ Per-thread cache of closed BDBStates, direct-mapped by index name hash, so that a
+ thread reopening an index it recently closed gets its old handle back without a malloc.
+ A handle evicted from its slot goes on the thread's spare list, and a thread that exits
+ hands all of its handles to handlePool. Both lists are capped and a handle closed when
+ its list is full is freed. Closing a handle a second time reports DB_DNE as long as the
+ handle is kept, whether it is still closed or has been reopened by another openIndex.
+ */
+#define HANDLE_CACHE_SIZE 16
+#define HANDLE_SPARE_MAX 64
+#define HANDLE_POOL_MAX 1024
+
+typedef struct
+    {
+        BDBState    *slots[HANDLE_CACHE_SIZE];
+        BDBState    *spare;
+        uint32_t    numSpare;
+    } HandleCache;
+
+pthread_key_t handleCacheKey;
+pthread_once_t handleCacheOnce = PTHREAD_ONCE_INIT;
+
+//closed handles left by exited threads, shared under HANDLE_POOL_LOCK
+BDBState *handlePool;
+uint32_t handlePoolSize;
+pthread_mutex_t HANDLE_POOL_LOCK = PTHREAD_MUTEX_INITIALIZER;
 
+//descriptor of the catalog file, opened for appending
+int catalogFd = -1;
+//contents of the catalog file as loaded at startup; loaded DBLinks point into it for their names
+char *catalogData;
+//incarnation of the next create()d index, above that of every index in the catalog
+uint32_t nextIncarnation;
+//bumped whenever a tombstone or snapshot may have changed, which invalidates every TombstoneRun
+uint64_t tombstoneGen;
+
+pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+ErrCode initResult = FAILURE;
+
+
+#pragma mark normalized keys
+
+/*
+ Keys are stored normalized, so that BDB's default bytewise comparison orders them: SHORT
+ and INT keys big-endian with the sign bit flipped, VARCHAR keys as their characters
+ without the NUL. An encoded integer key lives in the unused tail of its Key's charkey,
+ after the integer itself, so a DBT can point at it for as long as the Key lives.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define P_BIG32(x) (x)
+#define P_BIG64(x) (x)
+#else
+#define P_BIG32(x) __builtin_bswap32(x)
+#define P_BIG64(x) __builtin_bswap64(x)
+#endif
+
+void p_encodeShort(Key *k, DBT *key)
+{
+    uint32_t i = P_BIG32((uint32_t)k->keyval.shortkey ^ 0x80000000u);
+    memcpy(k->keyval.charkey + 4, &i, 4);
+    key->data = k->keyval.charkey + 4;
+    key->size = 4;
+}
+
+void p_encodeInt(Key *k, DBT *key)
+{
+    uint64_t i = P_BIG64((uint64_t)k->keyval.intkey ^ 0x8000000000000000ull);
+    memcpy(k->keyval.charkey + 8, &i, 8);
+    key->data = k->keyval.charkey + 8;
+    key->size = 8;
+}
+
+void p_encodeVarchar(Key *k, DBT *key)
+{
+    //the key is a <128-byte string
+    key->data = k->keyval.charkey;
+    key->size = strlen(k->keyval.charkey);
+    key->ulen = key->size;
+}
 
 /*
  Translates the information stored in Key k and inserts it into the DBT key's relevant fields.
@@ -123,832 +512,8485 @@ int p_setKeyDataFromKey(Key *k, DBT *key)
 {
     switch (k->type) {
         case SHORT:
-        {
-            //the key is a 32-bit integer
-            //hack: put the converted int after the plain int
-            uint8_t *data = ((uint8_t *) k->keyval.charkey) + 4;
-            uint32_t i = k->keyval.shortkey;
-            data[3] = (i & 0xFF);
-            data[2] = (i & 0xFF00) >> 8;
-            data[1] = (i & 0xFF0000) >> 16;
-            data[0] = (i & 0xFF000000) >> 24;
-            data[0] ^= 0x80;
-            key->data = data;
-            key->size = 4;
-            break;  
-        }
+            p_encodeShort(k, key);
+            return 0;
+        case INT:
+            p_encodeInt(k, key);
+            return 0;
+        case VARCHAR:
+            p_encodeVarchar(k, key);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/*
+ Encodes the keys of n records of the given type into the DBTs at out, stride bytes apart,
+ choosing the encoding once for the whole batch.
+ @return -1 if the type is invalid.
+ */
+int p_setKeyDataFromRecords(Record *records, int n, KeyType type, DBT *out, size_t stride)
+{
+    void (*encode)(Key *, DBT *);
+    switch (type) {
+        case SHORT:
+            encode = p_encodeShort;
+            break;
         case INT:
-        {
-            //the key is a 64-bit integer
-            //hack: put the converted int after the plain int
-            uint8_t *data = ((uint8_t *) k->keyval.charkey) + 8;
-            uint64_t i = k->keyval.intkey;
-            data[7] = (i & 0xFFLL);
-            data[6] = (i & 0xFF00LL) >> 8;
-            data[5] = (i & 0xFF0000LL) >> 16;
-            data[4] = (i & 0xFF000000LL) >> 24;
-            data[3] = (i & 0xFF00000000LL) >> 32;
-            data[2] = (i & 0xFF0000000000LL) >> 40;
-            data[1] = (i & 0xFF000000000000LL) >> 48;
-            data[0] = (i & 0xFF00000000000000LL) >> 56;
-            data[0] ^= 0x80;
-            key->data = data;
-            key->size = 8;
+            encode = p_encodeInt;
             break;
-        }
         case VARCHAR:
-            //the key is a <128-byte string
-            key->data = k->keyval.charkey;
-            key->size = strlen(k->keyval.charkey);
-            key->ulen = key->size;
+            encode = p_encodeVarchar;
             break;
         default:
             return -1;
     }
+    int i;
+    for (i = 0; i < n; i++) {
+        records[i].key.type = type;
+        encode(&records[i].key, (DBT *)((char *)out + i * stride));
+    }
     return 0;
 }
 
-ErrCode p_createEnv()
+/*
+ Translates a key as stored in the DBT key back into Key k; the inverse of p_setKeyDataFromKey.
+ */
+void p_setKeyFromKeyData(DBT *key, KeyType type, Key *k)
 {
-    int ret;
-    
-    //create the environment
-    if ((ret = db_env_create(&env, 0)) != 0) {
-        fprintf(stderrfile, "could not create environment. err = %d\n", ret);
-        pthread_mutex_unlock(&DBLINK_LOCK);
-        return FAILURE;
-    }
-    
-    //create a directory to store environment info into
-    struct stat sb;
-    if ((ret = stat(ENV_DIRECTORY, &sb)) != 0) { 
-        ret = mkdir(ENV_DIRECTORY, S_IRWXU);
-        
-        if (ret != 0) {
-            (void)env->close(env, 0);
-            fprintf(stderrfile, "could not create env directory. err = %d\n", ret);
-            pthread_mutex_unlock(&DBLINK_LOCK);
-            return FAILURE;
-        }
-    }
-    
-    if ((ret = env->set_lk_detect(env, DB_LOCK_DEFAULT)) != 0) {
-        env->err(env, ret, "set_lk_detect: DB_LOCK_DEFAULT");
-        pthread_mutex_unlock(&DBLINK_LOCK);
-        return FAILURE;
+    memset(k, 0, sizeof(Key));
+    k->type = type;
+    if (type == VARCHAR) {
+        memcpy(k->keyval.charkey, key->data, key->size < MAX_VARCHAR_LEN ? key->size : MAX_VARCHAR_LEN);
+    } else if (type == SHORT) {
+        uint32_t i;
+        memcpy(&i, key->data, 4);
+        k->keyval.shortkey = (int32_t)(P_BIG32(i) ^ 0x80000000u);
+    } else if (type == INT) {
+        uint64_t i;
+        memcpy(&i, key->data, 8);
+        k->keyval.intkey = (int64_t)(P_BIG64(i) ^ 0x8000000000000000ull);
     }
-    
-    //open the environment, giving it the directory
-    if ((ret = env->open(env, ENV_DIRECTORY, 
-                         DB_CREATE | DB_INIT_LOCK | DB_INIT_LOG |
-                         DB_INIT_MPOOL | DB_INIT_TXN | DB_RECOVER | DB_THREAD,
-                         S_IRUSR | S_IWUSR)) != 0) {
-        (void)env->close(env, 0);
-        fprintf(stderrfile, "env->open: %s: %s\n",
-                ENV_DIRECTORY, db_strerror(ret));
-        pthread_mutex_unlock(&DBLINK_LOCK);
-        return FAILURE;
+}
+
+/*
+ FNV-1a hash of an index name.
+ */
+uint32_t p_hashName(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name != '\0') {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
     }
-    
-    return SUCCESS;
+    return h;
 }
 
-ErrCode create(KeyType type, char *name)
+/*
+ Lock-free lookup of the DBLink for the index of the given name.
+ @return NULL if no index of that name has been create()d.
+ */
+DBLink *p_lookupIndex(const char *name)
 {
-    DB *dbp;
-    int ret;
-    //lock the dblink system
-    if ((ret = pthread_mutex_lock(&DBLINK_LOCK)) != 0) {
-        printf("can't acquire mutex lock: %d\n", ret);
+    DBTable *table = __atomic_load_n(&dbTable, __ATOMIC_ACQUIRE);
+    if (table == NULL) {
+        return NULL;
     }
     
-    //make sure that the name specified is not already in use
-    DBLink *link = dbLookup;
-    while (link != NULL) {
-        if (strcmp(name, link->name) == 0) {
-            break;
-        } else {
-            link = link->link;
+    uint32_t h = p_hashName(name);
+    uint32_t i = h & table->mask;
+    DBLink *link;
+    while ((link = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE)) != NULL) {
+        if (link != DROPPED_SLOT && link->hash == h && strcmp(name, link->name) == 0) {
+            return link;
         }
+        i = (i + 1) & table->mask;
     }
-    
-    if (link != NULL) {
-        pthread_mutex_unlock(&DBLINK_LOCK);
-        return DB_EXISTS;
+    return NULL;
+}
+
+/*
+ Places link into the first free or dropped slot of its probe sequence. The caller holds DBLINK_LOCK.
+ */
+void p_tablePut(DBTable *table, DBLink *link)
+{
+    uint32_t i = link->hash & table->mask;
+    while (table->slots[i] != NULL && table->slots[i] != DROPPED_SLOT) {
+        i = (i + 1) & table->mask;
     }
-    
-    //create a file to store error message for database
-    //(if doesn't already exist)
-    if (stderrfile == NULL) {
-        char errFileName[] = "error.log";
-        stderrfile = fopen(errFileName, "w");
-        if (stderrfile == NULL) {
-            pthread_mutex_unlock(&DBLINK_LOCK);
-            return FAILURE;
-        }
+    if (table->slots[i] == NULL) {
+        tableUsed++;
     }
-    
-    //if there is no environment, make one
-    if (env == NULL) {
-        ret = p_createEnv();
-        if (ret != SUCCESS) {
-            return ret;
+    __atomic_store_n(&table->slots[i], link, __ATOMIC_RELEASE);
+}
+
+/*
+ Adds a new DBLink to the catalog and assigns it a dense index id, reusing the id of a
+ dropped index when there is one. If the table would become more than 3/4 full it is
+ first rebuilt without its dropped slots, doubling until the live indices fill at most half.
+ The caller holds DBLINK_LOCK.
+ @return -1 if a larger table could not be allocated.
+ */
+int p_insertIndex(DBLink *link)
+{
+    DBTable *table = dbTable;
+    if (table == NULL || (tableUsed + 1) * 4 > (table->mask + 1) * 3) {
+        uint32_t size = DBTABLE_INITIAL_SIZE;
+        while ((liveIndices + 1) * 2 > size) {
+            size *= 2;
         }
+        DBTable *newTable = malloc(sizeof(DBTable) + size * sizeof(DBLink *));
+        if (newTable == NULL) {
+            return -1;
+        }
+        memset(newTable, 0, sizeof(DBTable) + size * sizeof(DBLink *));
+        newTable->mask = size - 1;
+        newTable->retired = table;
+        tableUsed = 0;
+        if (table != NULL) {
+            uint32_t i;
+            for (i = 0; i <= table->mask; i++) {
+                if (table->slots[i] != NULL && table->slots[i] != DROPPED_SLOT) {
+                    p_tablePut(newTable, table->slots[i]);
+                }
+            }
+        }
+        __atomic_store_n(&dbTable, newTable, __ATOMIC_RELEASE);
+        table = newTable;
     }
     
-    /* Initialize the DB handle */
-    if ((ret = db_create(&dbp, env, 0)) != 0) {
-        fprintf(stderrfile, "could not create DB. err = %d\n", ret);
-        pthread_mutex_unlock(&DBLINK_LOCK);
-        return FAILURE;
-    }
-    
-    
-    //set the error file for the DB
-    dbp->set_errfile(dbp, stderrfile);
-    
-    //set the db to handle duplicates (flag must be set before db is opened)
-    dbp->set_flags(dbp, DB_DUPSORT);
-    
-    //store the DB info in our db lookup list
-    
-    //make a new link object
-    DBLink *newLink = malloc(sizeof(DBLink));
-    memset(newLink, 0, sizeof(DBLink));
-    
-    //populate it
-    newLink->name = name;
-    newLink->dbp = dbp;
-    newLink->type = type;
-    newLink->numOpenThreads = 0;
-    newLink->link = NULL;
-    
-    //insert it into the linked list headed by dbLookup
-    if (dbLookup == NULL) {
-        dbLookup = newLink;
+    if (numFreeIds > 0) {
+        link->id = freeIds[--numFreeIds];
     } else {
-        DBLink *thisLink = dbLookup;
-        while (thisLink->link != NULL) {
-            thisLink = thisLink->link;
-        }
-        thisLink->link = newLink;
+        link->id = indexCt++;
     }
-    
-    //unlock the dblink system, because we're done editing it
-    pthread_mutex_unlock(&DBLINK_LOCK);
-    
-    //create a file to support the database
-    dbp->set_errpfx(dbp, name);
-    
-    return SUCCESS;
+    p_tablePut(table, link);
+    liveIndices++;
+    return 0;
 }
 
-ErrCode openIndex(const char *name, IdxState **idxState)
+/*
+ Makes a dropped index unreachable by name. Its id is only reused once its last
+ reference is gone, since until then transactions may still keep a cursor under it. The
+ DBLink itself is never freed, since lock-free readers and stale handles may still refer
+ to it. The caller holds DBLINK_LOCK.
+ */
+void p_removeIndex(DBLink *link)
 {
-    int ret;
-    DB *dbp;
-    //lock the dblink system
-    if ((ret = pthread_mutex_lock(&DBLINK_LOCK)) != 0) {
-        printf("can't acquire mutex lock: %d\n", ret);
+    DBTable *table = dbTable;
+    uint32_t i = link->hash & table->mask;
+    while (table->slots[i] != link) {
+        i = (i + 1) & table->mask;
     }
-    
-    //look up the DBLink for the index of that name
-    DBLink *link = dbLookup;
-    while (link != NULL) {
-        if (strcmp(name, link->name) == 0) {
-            break;
-        } else {
-            link = link->link;
+    __atomic_store_n(&table->slots[i], DROPPED_SLOT, __ATOMIC_RELEASE);
+    liveIndices--;
+}
+
+/*
+ Hands the id of a dropped index out again. The caller holds DBLINK_LOCK.
+ */
+void p_freeId(DBLink *link)
+{
+    if (numFreeIds == freeIdsCap) {
+        uint32_t cap = freeIdsCap == 0 ? 16 : freeIdsCap * 2;
+        uint32_t *ids = realloc(freeIds, cap * sizeof(uint32_t));
+        if (ids == NULL) {
+            //the id is simply not reused
+            return;
         }
+        freeIds = ids;
+        freeIdsCap = cap;
     }
-    
-    //if no link was found, index was never create()d
-    if (link == NULL) {
-        pthread_mutex_unlock(&DBLINK_LOCK);
-        return DB_DNE;
+    freeIds[numFreeIds++] = link->id;
+}
+
+/*
+ Puts a closed handle on a spare list holding size handles, or frees it if the list is full.
+ */
+void p_pushSpare(BDBState **list, uint32_t *size, uint32_t max, BDBState *state)
+{
+    if (*size >= max) {
+        free(state);
+        return;
     }
-    
-    //add this thread to the link's thread counter
-    link->numOpenThreads++;
-    
-    //if numOpenThreads == 1, we need to open the index
-    if (link->numOpenThreads == 1) {
-        dbp = link->dbp;
-        //open the DB here so that it only happens once
-        if ((ret = dbp->open(dbp,
-                             NULL,
-                             name,
-                             NULL,
-                             DB_BTREE,
-                             DB_AUTO_COMMIT | DB_CREATE | DB_THREAD, 
-                             S_IRUSR | S_IWUSR)) != 0) {
-            fprintf(stderrfile, "could not open index %s. errno %d. closing index.\n",link->name, ret);
-            if ((ret = dbp->close(dbp, 0)) != 0) {
-                fprintf(stderrfile,"could not close index %s, either. err: %i\n", link->name, ret);
-            }
-            pthread_mutex_unlock(&DBLINK_LOCK);
-            return FAILURE;
+    state->nextSpare = *list;
+    *list = state;
+    (*size)++;
+}
+
+/*
+ Hands every handle a thread still has cached to handlePool when that thread exits.
+ */
+void p_freeHandleCache(void *arg)
+{
+    HandleCache *cache = (HandleCache *)arg;
+    pthread_mutex_lock(&HANDLE_POOL_LOCK);
+    int i;
+    for (i = 0; i < HANDLE_CACHE_SIZE; i++) {
+        if (cache->slots[i] != NULL) {
+            p_pushSpare(&handlePool, &handlePoolSize, HANDLE_POOL_MAX, cache->slots[i]);
         }
     }
+    while (cache->spare != NULL) {
+        BDBState *state = cache->spare;
+        cache->spare = state->nextSpare;
+        p_pushSpare(&handlePool, &handlePoolSize, HANDLE_POOL_MAX, state);
+    }
+    pthread_mutex_unlock(&HANDLE_POOL_LOCK);
+    free(cache);
+}
+
+void p_initHandleCacheKey(void)
+{
+    pthread_key_create(&handleCacheKey, p_freeHandleCache);
+}
+
+/*
+ Returns the calling thread's handle cache, creating it on first use.
+ @return NULL if the cache could not be allocated.
+ */
+HandleCache *p_handleCache(void)
+{
+    pthread_once(&handleCacheOnce, p_initHandleCacheKey);
+    HandleCache *cache = pthread_getspecific(handleCacheKey);
+    if (cache == NULL) {
+        cache = malloc(sizeof(HandleCache));
+        if (cache == NULL) {
+            return NULL;
+        }
+        memset(cache, 0, sizeof(HandleCache));
+        pthread_setspecific(handleCacheKey, cache);
+    }
+    return cache;
+}
+
+#pragma mark io_uring I/O
+/*
+ BDB's file I/O can be routed through an io_uring instance. Every call waits for its own
+ operation and returns its result, but the calls of all threads share one ring, so
+ writeback from many threads overlaps on the device. Page writes in flight are tracked
+ per file: a read waits only for those overlapping the bytes it reads, and syncs and
+ closes wait for all of them.
+ */
+#ifdef HAVE_IO_URING
+
+//descriptors at or above this are left to the plain system calls
+#define IO_MAX_FDS 4096
+//longest the completion thread sleeps between polls of the ring while io_uring_enter keeps failing
+#define IO_MAX_BACKOFF_US (100 * 1000)
+
+typedef struct IORequest
+    {
+        int                 fd;
+        int                 listed;     //among the file's writes in flight
+        int                 done;
+        int                 result;
+        off_t               offset;
+        size_t              len;
+        struct IORequest    *prev;      //neighbours among the file's writes in flight
+        struct IORequest    *next;
+    } IORequest;
+
+typedef struct
+    {
+        IORequest   *writes;    //page writes submitted but not completed
+    } IOFile;
+
+pthread_mutex_t IO_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ioDone = PTHREAD_COND_INITIALIZER;
+int ringFd = -1;
+uint32_t ringEntries;
+uint32_t inFlight;
+unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+unsigned *cqHead, *cqTail, *cqMask;
+struct io_uring_sqe *sqes;
+struct io_uring_cqe *cqes;
+IOFile ioFiles[IO_MAX_FDS];
+
+/*
+ Takes a write off its file's list of writes in flight. The caller holds IO_LOCK.
+ */
+void p_ioUnlist(IORequest *req)
+{
+    if (!req->listed) {
+        return;
+    }
+    if (req->prev != NULL) {
+        req->prev->next = req->next;
+    } else {
+        ioFiles[req->fd].writes = req->next;
+    }
+    if (req->next != NULL) {
+        req->next->prev = req->prev;
+    }
+    req->listed = 0;
+}
+
+/*
+ Hands one operation to the kernel, first waiting for room in the ring. The caller holds IO_LOCK.
+ @return 0 if the operation was submitted; otherwise it is taken back off the ring and
+ out of its file's list, and the caller does it with the plain system call instead.
+ */
+int p_ioSubmit(IORequest *req, uint8_t opcode, const void *buf, size_t len, off_t offset, uint32_t fsyncFlags)
+{
+    while (inFlight >= ringEntries) {
+        pthread_cond_wait(&ioDone, &IO_LOCK);
+    }
     
-    //create a BDBState variable for this thread
-    BDBState *state = malloc(sizeof(BDBState));
-    memset(state, 0, sizeof(BDBState));
-    *idxState = (IdxState *) state;
-    state->dbp = link->dbp;
-    state->type = link->type;
-    state->db_name = name;
-    
-    //unlock the dblink system
-    pthread_mutex_unlock(&DBLINK_LOCK);
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = req->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->fsync_flags = fsyncFlags;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    inFlight++;
     
-    return SUCCESS;
+    int ret;
+    while ((ret = syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, NULL, 0)) < 0 &&
+           (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+        sched_yield();
+    }
+    if (ret < 0) {
+        fprintf(stderrfile, "io_uring_enter failed. errno %d; using plain I/O for this call\n", errno);
+        //submitters hold IO_LOCK, so an entry the kernel has not consumed is still ours to withdraw
+        if (__atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == tail) {
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+            inFlight--;
+            p_ioUnlist(req);
+            pthread_cond_broadcast(&ioDone);
+            return -1;
+        }
+    }
+    return 0;
 }
 
-ErrCode closeIndex(IdxState *ident)
+/*
+ Waits for an operation that was submitted by this thread. The caller holds IO_LOCK.
+ */
+int p_ioWait(IORequest *req)
 {
-    int ret;
-    BDBState *state = (BDBState*)ident;
-    DB *dbp = state->dbp;
-    
-    //lock the dblink system
-    if ((ret = pthread_mutex_lock(&DBLINK_LOCK)) != 0) {
-        printf("can't acquire mutex lock: %d\n", ret);
+    while (!req->done) {
+        pthread_cond_wait(&ioDone, &IO_LOCK);
     }
-    
-    //check to see if the DB currently exists
-    DBLink *prevLink = NULL;
-    DBLink *link = dbLookup;
-    while (link != NULL) {
-        if (strcmp(state->db_name, link->name) == 0) {
-            break;
+    return req->result;
+}
+
+/*
+ Waits until no write in flight on a file overlaps len bytes at offset; a negative offset
+ waits for every write on it. The caller holds IO_LOCK.
+ */
+void p_ioWaitOverlap(int fd, off_t offset, size_t len)
+{
+    IORequest *w = ioFiles[fd].writes;
+    while (w != NULL) {
+        if (offset < 0 || (w->offset < offset + (off_t)len && offset < w->offset + (off_t)w->len)) {
+            pthread_cond_wait(&ioDone, &IO_LOCK);
+            w = ioFiles[fd].writes;
         } else {
-            prevLink = link;
-            link = link->link;
+            w = w->next;
         }
     }
-    
-    //if the DB isn't in our linked list, it never existed
-    if (link == NULL) {
-        fprintf(stderrfile, "closeIndex called on an index that does not exist\n");
-        pthread_mutex_unlock(&DBLINK_LOCK);
-        return DB_DNE;
+}
+
+/*
+ Completion thread: retires finished operations, waking the threads waiting for them.
+ While io_uring_enter fails it polls the ring instead, backing off up to IO_MAX_BACKOFF_US.
+ */
+void *p_ioComplete(void *arg)
+{
+    useconds_t backoff = 0;
+    while (1) {
+        if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            if (backoff == 0) {
+                fprintf(stderrfile, "io_uring_enter failed while waiting. errno %d\n", errno);
+                backoff = 1000;
+            } else if (backoff < IO_MAX_BACKOFF_US) {
+                backoff *= 2;
+            }
+            usleep(backoff);
+        } else {
+            backoff = 0;
+        }
+        
+        pthread_mutex_lock(&IO_LOCK);
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+            IORequest *req = (IORequest *)(uintptr_t)cqe->user_data;
+            inFlight--;
+            p_ioUnlist(req);
+            req->result = cqe->res;
+            req->done = 1;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&ioDone);
+        pthread_mutex_unlock(&IO_LOCK);
+    }
+    return NULL;
+}
+
+ssize_t p_ioPwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    if (fd < 0 || fd >= IO_MAX_FDS || len > UINT32_MAX) {
+        return pwrite(fd, buf, len, offset);
     }
+    IORequest req;
+    memset(&req, 0, sizeof(IORequest));
+    req.fd = fd;
+    req.listed = 1;
+    req.offset = offset;
+    req.len = len;
     
-    //don't try to close the index even if no threads are using it because it's too slow
-    state->dbp = NULL;
-    pthread_mutex_unlock(&DBLINK_LOCK);
-    return SUCCESS;
+    pthread_mutex_lock(&IO_LOCK);
+    //writes in flight together may land in any order, so an overlapping one has to finish first
+    p_ioWaitOverlap(fd, offset, len);
+    IOFile *file = &ioFiles[fd];
+    req.next = file->writes;
+    if (file->writes != NULL) {
+        file->writes->prev = &req;
+    }
+    file->writes = &req;
+    if (p_ioSubmit(&req, IORING_OP_WRITE, buf, len, offset, 0) != 0) {
+        pthread_mutex_unlock(&IO_LOCK);
+        return pwrite(fd, buf, len, offset);
+    }
+    p_ioWait(&req);
+    pthread_mutex_unlock(&IO_LOCK);
     
-    /*
-    //decrement the number of threads for whom this index is open
-    link->numOpenThreads--;
-    //remove this DBP from this thread's state
-    state->dbp = NULL;
+    if (req.result < 0) {
+        errno = -req.result;
+        return -1;
+    }
+    return req.result;
+}
+
+ssize_t p_ioWrite(int fd, const void *buf, size_t len)
+{
+    if (fd < 0 || fd >= IO_MAX_FDS || len > UINT32_MAX) {
+        return write(fd, buf, len);
+    }
+    IORequest req;
+    memset(&req, 0, sizeof(IORequest));
+    req.fd = fd;
     
-    // if there are still threads using this index, don't close it
-    if (link->numOpenThreads > 0) {
-        pthread_mutex_unlock(&DBLINK_LOCK);
-        return SUCCESS;
+    //an offset of -1 writes at, and advances, the file position like write() does
+    pthread_mutex_lock(&IO_LOCK);
+    p_ioWaitOverlap(fd, -1, 0);
+    if (p_ioSubmit(&req, IORING_OP_WRITE, buf, len, (off_t)-1, 0) != 0) {
+        pthread_mutex_unlock(&IO_LOCK);
+        return write(fd, buf, len);
     }
+    p_ioWait(&req);
+    pthread_mutex_unlock(&IO_LOCK);
     
-    if ((ret = dbp->close(dbp, 0)) != 0) {
-        fprintf(stderrfile, "could not close index. errno %d\n", ret);
-        pthread_mutex_unlock(&DBLINK_LOCK);
-        return FAILURE;
+    if (req.result == -EINVAL) {
+        //kernels before 5.6 cannot write at the file position through the ring
+        return write(fd, buf, len);
+    } else if (req.result < 0) {
+        errno = -req.result;
+        return -1;
+    }
+    return req.result;
+}
+
+int p_ioFsync(int fd)
+{
+    if (fd < 0 || fd >= IO_MAX_FDS) {
+        return fdatasync(fd);
     }
+    IORequest req;
+    memset(&req, 0, sizeof(IORequest));
+    req.fd = fd;
     
-    if (link->numOpenThreads < 0) {
-        printf("link->numOpenThreads somehow got to < 0. Resetting to 0.\n");
-        link->numOpenThreads = 0;
+    pthread_mutex_lock(&IO_LOCK);
+    p_ioWaitOverlap(fd, -1, 0);
+    if (p_ioSubmit(&req, IORING_OP_FSYNC, NULL, 0, 0, IORING_FSYNC_DATASYNC) != 0) {
+        pthread_mutex_unlock(&IO_LOCK);
+        return fdatasync(fd);
     }
+    p_ioWait(&req);
+    pthread_mutex_unlock(&IO_LOCK);
     
-    pthread_mutex_unlock(&DBLINK_LOCK);
-    return SUCCESS;    
-     */
+    if (req.result < 0) {
+        errno = -req.result;
+        return -1;
+    }
+    return 0;
 }
 
+ssize_t p_ioPread(int fd, void *buf, size_t len, off_t offset)
+{
+    if (fd >= 0 && fd < IO_MAX_FDS) {
+        pthread_mutex_lock(&IO_LOCK);
+        p_ioWaitOverlap(fd, offset, len);
+        pthread_mutex_unlock(&IO_LOCK);
+    }
+    return pread(fd, buf, len, offset);
+}
 
-ErrCode beginTransaction(TxnState **txn)
+ssize_t p_ioRead(int fd, void *buf, size_t len)
 {
-    int ret;
-    //create the state variable for this transaction
-    TXNState *txnState = malloc(sizeof(TXNState));
-    DB_TXN *tid = NULL;
-    
-    //if this is the first call, we need to make the environment
-    if (env == NULL) {
-        ret = p_createEnv();
-        if (ret != SUCCESS) {
-            free(txnState);
-            return ret;
-        }
+    if (fd >= 0 && fd < IO_MAX_FDS) {
+        //a file whose position is unknown waits for all of its writes
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        pthread_mutex_lock(&IO_LOCK);
+        p_ioWaitOverlap(fd, offset, len);
+        pthread_mutex_unlock(&IO_LOCK);
     }
-    
-    //begin the transaction
-    if ((ret = env->txn_begin(env, NULL, &tid, 0)) != 0) {
-        env->err(env, ret, "DB_ENV->txn_begin");
-        if (ret == DB_LOCK_DEADLOCK) {
-            free(txnState);
-            return DEADLOCK;
-        }
-        free(txnState);
-        return FAILURE;
+    return read(fd, buf, len);
+}
+
+int p_ioClose(int fd)
+{
+    if (fd >= 0 && fd < IO_MAX_FDS) {
+        pthread_mutex_lock(&IO_LOCK);
+        p_ioWaitOverlap(fd, -1, 0);
+        pthread_mutex_unlock(&IO_LOCK);
     }
-    
-    txnState->cursorLink = NULL;
-    *txn = (TxnState*)txnState;
-    txnState->tid = tid;
-    
-    return SUCCESS;
+    return close(fd);
 }
 
-ErrCode abortTransaction(TxnState *txn)
+/*
+ Unmaps whichever parts of the ring were mapped and closes it.
+ */
+void p_closeRing(char *sq, size_t sqSize, char *cq, size_t cqSize, size_t sqesSize)
 {
-    int ret;
-    TXNState *txnState = (TXNState*)txn;
-    DB_TXN *tid = txnState->tid;
-    
-    if (tid == NULL) {//if there is no transaction to abort, that's confusing
-        fprintf(stderrfile, "cannot abort transaction because none has begun\n");
-        return TXN_DNE;
+    if (sq != MAP_FAILED) {
+        munmap(sq, sqSize);
     }
-    
-    if (env == NULL) { //shouldn't ever be able to get into this state
-        fprintf(stderrfile, "cannot abort transaction before environment is initialized\n");
+    if (cq != MAP_FAILED && cq != sq) {
+        munmap(cq, cqSize);
+    }
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqesSize);
+    }
+    close(ringFd);
+    ringFd = -1;
+}
+
+/*
+ Sets up the ring and its completion thread and installs the I/O functions above in BDB.
+ Returns FAILURE, leaving BDB to its own system calls, if the kernel refuses the ring.
+ */
+ErrCode p_startIO()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if ((ringFd = syscall(__NR_io_uring_setup, asyncIODepth, &params)) < 0) {
+        fprintf(stderrfile, "io_uring is not available, errno %d; using plain I/O\n", errno);
         return FAILURE;
     }
     
-    //close all of the txn's cursors
-    CursorLink *cursorLink = txnState->cursorLink;
-    while (cursorLink != NULL) {
-        DBC *cursor = cursorLink->cursor;
-#if DB_VERSION_MINOR>=7
-        if ((ret = cursor->close(cursor)) != 0) {
-#else
-        if ((ret = cursor->c_close(cursor)) != 0) {
-#endif
-            env->err(env, ret, "DB_TXN->abort, cursor->close");
-            if (ret == DB_LOCK_DEADLOCK) {
-                return DEADLOCK;
-            }
-            return FAILURE;
-        }
-        CursorLink *oldLink = cursorLink;
-        txnState->cursorLink = cursorLink->cursorLink;
-        cursorLink = cursorLink->cursorLink;
-        free(oldLink);
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+    }
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
     }
+    size_t sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        fprintf(stderrfile, "could not map io_uring. errno %d; using plain I/O\n", errno);
+        p_closeRing(sq, sqSize, cq, cqSize, sqesSize);
+        return FAILURE;
+    }
+    sqHead = (unsigned *)(sq + params.sq_off.head);
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ringEntries = params.sq_entries;
     
-    //abort the txn
-    if ((ret = tid->abort(tid)) != 0) {
-        env->err(env, ret, "DB_TXN->abort");
-        if (ret == DB_LOCK_DEADLOCK) {
-            return DEADLOCK;
-        }
+    pthread_t completer;
+    if (pthread_create(&completer, NULL, p_ioComplete, NULL) != 0) {
+        fprintf(stderrfile, "could not start io_uring completion thread; using plain I/O\n");
+        p_closeRing(sq, sqSize, cq, cqSize, sqesSize);
         return FAILURE;
     }
+    pthread_detach(completer);
     
-    free(txnState);
+    db_env_set_func_pwrite(p_ioPwrite);
+    db_env_set_func_write(p_ioWrite);
+    db_env_set_func_fsync(p_ioFsync);
+    db_env_set_func_pread(p_ioPread);
+    db_env_set_func_read(p_ioRead);
+    db_env_set_func_close(p_ioClose);
     return SUCCESS;
 }
 
-#pragma mark commitTransaction
-ErrCode commitTransaction(TxnState *txn)
+#else
+
+ErrCode p_startIO()
+{
+    fprintf(stderrfile, "built without io_uring; using plain I/O\n");
+    return FAILURE;
+}
+
+#endif
+
+ErrCode p_createEnv()
 {
     int ret;
-    TXNState *txnState = (TXNState*)txn;
-    DB_TXN *tid = txnState->tid;
     
-    if (tid == NULL) {//if there is no txn to end, that's confusing
-        fprintf(stderrfile, "cannot end transaction because none exist\n");
-        return TXN_DNE;
+    //BDB's I/O functions are replaced for the whole process, before any environment opens a file
+    if (asyncIODepth > 0) {
+        p_startIO();
     }
     
-    if (env == NULL) { //shouldn't be able to reach this state
-        fprintf(stderrfile, "cannot end transaction before environment is initialized\n");
+    //create the environment
+    if ((ret = db_env_create(&env, 0)) != 0) {
+        fprintf(stderrfile, "could not create environment. err = %d\n", ret);
         return FAILURE;
     }
     
-    //close all of the txn's cursors
-    CursorLink *cursorLink = txnState->cursorLink;
-    while (cursorLink != NULL) {
-        DBC *cursor = cursorLink->cursor;
-#if DB_VERSION_MINOR>=7
-        if ((ret = cursor->close(cursor)) != 0) {
-#else
-        if ((ret = cursor->c_close(cursor)) != 0) {
-#endif
-            env->err(env, ret, "DB_TXN->abort, cursor->close");
-            if (ret == DB_LOCK_DEADLOCK) {
-                return DEADLOCK;
-            }
+    //create a directory to store environment info into
+    struct stat sb;
+    if ((ret = stat(ENV_DIRECTORY, &sb)) != 0) { 
+        ret = mkdir(ENV_DIRECTORY, S_IRWXU);
+        
+        if (ret != 0) {
+            (void)env->close(env, 0);
+            fprintf(stderrfile, "could not create env directory. err = %d\n", ret);
             return FAILURE;
         }
-        CursorLink *oldLink = cursorLink;
-        txnState->cursorLink = cursorLink->cursorLink;
-        cursorLink = cursorLink->cursorLink;
-        free(oldLink);
     }
     
-    //commit the txn, which also ends it
-    if ((ret = tid->commit(tid, 0)) != 0) {
-        env->err(env, ret, "DB_TXN->commit");
-        if (ret == DB_LOCK_DEADLOCK) {
-            return DEADLOCK;
-        }
+    //run the detector whenever a lock request blocks, choosing the victim by policy.
+    //BDB transaction ids increase with begin time, so DB_LOCK_YOUNGEST always aborts
+    //the most recently begun transaction in the cycle and older ones make progress
+    u_int32_t detect;
+    switch (deadlockPolicy) {
+        case DEADLOCK_ABORT_YOUNGEST:
+            detect = DB_LOCK_YOUNGEST;
+            break;
+        case DEADLOCK_ABORT_MINWRITE:
+            detect = DB_LOCK_MINWRITE;
+            break;
+        default:
+            detect = DB_LOCK_DEFAULT;
+            break;
+    }
+    
+    if ((ret = env->set_lk_detect(env, detect)) != 0) {
+        env->err(env, ret, "set_lk_detect: %u", detect);
         return FAILURE;
     }
     
-    free(txnState);
-    return SUCCESS;
-}
+    //each cache region has its own hash table and latches
+    if (cacheBytes > 0) {
+        if ((ret = env->set_cachesize(env, (u_int32_t)(cacheBytes >> 30),
+                                      (u_int32_t)(cacheBytes & ((1 << 30) - 1)), cachePartitions)) != 0) {
+            env->err(env, ret, "set_cachesize");
+            return FAILURE;
+        }
+    }
     
+    //commits that are not explicitly synced (including auto-commits) only write the log
+    if (envDurability != DURABILITY_SYNC) {
+        if ((ret = env->set_flags(env, DB_TXN_NOSYNC, 1)) != 0) {
+            env->err(env, ret, "set_flags: DB_TXN_NOSYNC");
+            return FAILURE;
+        }
+    }
     
-#pragma mark p_prepTxnCursor
-/*
-Determine if a transaction is currently in progress. If not, create one (keeping *txn's value NULL). 
-Then check to see if there's a cursor for this index, and creates & adds to index/txn state if not, 
+    //an in-memory log leaves nothing to recover from at startup; with the logical log,
+    //BDB's own log only has to support aborts and the indices are rebuilt from the logical one
+    u_int32_t recover = DB_RECOVER;
+    if (envDurability == DURABILITY_IN_MEMORY || logicalLog) {
+#if DB_VERSION_MAJOR > 4 || DB_VERSION_MINOR >= 7
+        ret = env->log_set_config(env, DB_LOG_IN_MEMORY, 1);
+#else
+        ret = env->set_flags(env, DB_LOG_INMEMORY, 1);
+#endif
+        if (ret != 0 || (ret = env->set_lg_bsize(env, IN_MEMORY_LOG_SIZE)) != 0) {
+            env->err(env, ret, "configuring in-memory log");
+            return FAILURE;
+        }
+        recover = 0;
+    }
+    
+    //open the environment, giving it the directory
+    if ((ret = env->open(env, ENV_DIRECTORY, 
+                         DB_CREATE | DB_INIT_LOCK | DB_INIT_LOG |
+                         DB_INIT_MPOOL | DB_INIT_TXN | recover | DB_THREAD,
+                         S_IRUSR | S_IWUSR)) != 0) {
+        (void)env->close(env, 0);
+        fprintf(stderrfile, "env->open: %s: %s\n",
+                ENV_DIRECTORY, db_strerror(ret));
+        return FAILURE;
+    }
+    
+    return SUCCESS;
+}
+
+/*
+ Name of the DB file of one incarnation of an index; the caller frees it.
+ */
+char *p_fileName(const char *name, uint32_t incarnation)
+{
+    size_t len = strlen(name) + 16;
+    char *file = malloc(len);
+    if (file != NULL) {
+        snprintf(file, len, "%s.%u", name, incarnation);
+    }
+    return file;
+}
+
+/*
+ Allocates the DBLink for an index and publishes it in the catalog table. The DB
+ handle itself is only created when the index is first opened. The caller holds DBLINK_LOCK.
+ @return NULL if the link could not be allocated or published.
+ */
+DBLink *p_addIndex(KeyType type, char *name, uint32_t incarnation)
+{
+    DBLink *newLink = malloc(sizeof(DBLink));
+    if (newLink == NULL) {
+        return NULL;
+    }
+    memset(newLink, 0, sizeof(DBLink));
+    if ((newLink->file = p_fileName(name, incarnation)) == NULL) {
+        free(newLink);
+        return NULL;
+    }
+    
+    //populate it; the catalog holds the first reference
+    newLink->name = name;
+    newLink->incarnation = incarnation;
+    newLink->hash = p_hashName(name);
+    newLink->dbp = NULL;
+    newLink->type = type;
+    newLink->refs = 1;
+    newLink->isOpen = 0;
+    
+    //publish it to lock-free readers only once it is fully populated
+    if (p_insertIndex(newLink) != 0) {
+        free(newLink->file);
+        free(newLink);
+        return NULL;
+    }
+    return newLink;
+}
+
+/*
+ Syncs ENV_DIRECTORY, so that a file created or renamed in it survives a crash.
+ */
+ErrCode p_syncEnvDirectory()
+{
+    int fd = open(ENV_DIRECTORY, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        fprintf(stderrfile, "could not open %s to sync it\n", ENV_DIRECTORY);
+        return FAILURE;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    if (ret != 0) {
+        fprintf(stderrfile, "could not sync %s\n", ENV_DIRECTORY);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/*
+ Reads the whole catalog file with a single read and registers every index it
+ lists, without opening any of them. A torn record left at the end by a crash
+ during create() is cut off so later appends start on a record boundary.
+ */
+ErrCode p_loadCatalog()
+{
+    struct stat sb;
+    if ((catalogFd = open(CATALOG_FILE, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR)) < 0) {
+        fprintf(stderrfile, "could not open catalog %s\n", CATALOG_FILE);
+        return FAILURE;
+    }
+    if (fstat(catalogFd, &sb) != 0) {
+        fprintf(stderrfile, "could not stat catalog %s\n", CATALOG_FILE);
+        return FAILURE;
+    }
+    
+    //a new catalog only gets its header, and its directory entry is synced before
+    //p_appendCatalog relies on it to make create()s durable
+    if (sb.st_size < CATALOG_MAGIC_LEN) {
+        if (ftruncate(catalogFd, 0) != 0 ||
+            write(catalogFd, CATALOG_MAGIC, CATALOG_MAGIC_LEN) != CATALOG_MAGIC_LEN ||
+            fdatasync(catalogFd) != 0) {
+            fprintf(stderrfile, "could not initialize catalog %s\n", CATALOG_FILE);
+            return FAILURE;
+        }
+        return p_syncEnvDirectory();
+    }
+    
+    size_t size = sb.st_size;
+    if ((catalogData = malloc(size)) == NULL) {
+        return FAILURE;
+    }
+    if (pread(catalogFd, catalogData, size, 0) != (ssize_t)size ||
+        memcmp(catalogData, CATALOG_MAGIC, CATALOG_MAGIC_LEN) != 0) {
+        fprintf(stderrfile, "catalog %s is unreadable\n", CATALOG_FILE);
+        free(catalogData);
+        catalogData = NULL;
+        return FAILURE;
+    }
+    
+    pthread_mutex_lock(&DBLINK_LOCK);
+    char *p = catalogData + CATALOG_MAGIC_LEN;
+    char *end = catalogData + size;
+    while (end - p > 1 + (ptrdiff_t)sizeof(uint32_t)) {
+        uint32_t incarnation;
+        char *name = p + 1 + sizeof(incarnation);
+        char *nul = memchr(name, '\0', end - name);
+        KeyType type = (KeyType)(uint8_t)*p;
+        if (nul == NULL || (type != SHORT && type != INT && type != VARCHAR)) {
+            break;
+        }
+        memcpy(&incarnation, p + 1, sizeof(incarnation));
+        if (p_addIndex(type, name, incarnation) == NULL) {
+            pthread_mutex_unlock(&DBLINK_LOCK);
+            return FAILURE;
+        }
+        if (incarnation >= nextIncarnation) {
+            nextIncarnation = incarnation + 1;
+        }
+        p = nul + 1;
+    }
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    if (p < end) {
+        fprintf(stderrfile, "discarding torn catalog record at offset %ld\n", (long)(p - catalogData));
+        if (ftruncate(catalogFd, p - catalogData) != 0) {
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ Cuts the catalog back to the given size, taking back a record whose create() failed.
+ The caller holds DBLINK_LOCK.
+ */
+void p_truncateCatalog(off_t size)
+{
+    if (ftruncate(catalogFd, size) != 0 || fdatasync(catalogFd) != 0) {
+        fprintf(stderrfile, "could not take back catalog record at offset %ld\n", (long)size);
+    }
+}
+
+/*
+ Durably appends a record for a newly created index to the catalog file, and stores
+ where it starts in start. The record goes out in one write so concurrent appends
+ cannot interleave, and is taken back if it could not be written whole.
+ The caller holds DBLINK_LOCK.
+ */
+ErrCode p_appendCatalog(KeyType type, uint32_t incarnation, const char *name, off_t *start)
+{
+    if ((*start = lseek(catalogFd, 0, SEEK_END)) < 0) {
+        fprintf(stderrfile, "could not find the end of catalog %s\n", CATALOG_FILE);
+        return FAILURE;
+    }
+    
+    uint8_t typeByte = (uint8_t)type;
+    struct iovec iov[3];
+    iov[0].iov_base = &typeByte;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = &incarnation;
+    iov[1].iov_len = sizeof(incarnation);
+    iov[2].iov_base = (void *)name;
+    iov[2].iov_len = strlen(name) + 1;
+    
+    if (writev(catalogFd, iov, 3) != (ssize_t)(iov[0].iov_len + iov[1].iov_len + iov[2].iov_len)) {
+        fprintf(stderrfile, "could not append %s to catalog\n", name);
+        p_truncateCatalog(*start);
+        return FAILURE;
+    }
+    if (fdatasync(catalogFd) != 0) {
+        fprintf(stderrfile, "could not sync catalog after adding %s\n", name);
+        p_truncateCatalog(*start);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/*
+ Replaces the catalog file with one listing every index except skip, written to a
+ temporary file in one write and renamed over the old catalog, then syncs ENV_DIRECTORY.
+ A failure of that last sync leaves the new catalog in place, though a crash may undo it.
+ The caller holds DBLINK_LOCK.
+ */
+ErrCode p_rewriteCatalog(DBLink *skip)
+{
+    DBTable *table = dbTable;
+    size_t size = CATALOG_MAGIC_LEN;
+    uint32_t i;
+    for (i = 0; i <= table->mask; i++) {
+        DBLink *link = table->slots[i];
+        if (link != NULL && link != DROPPED_SLOT && link != skip) {
+            size += 1 + sizeof(link->incarnation) + strlen(link->name) + 1;
+        }
+    }
+    
+    char *data = malloc(size);
+    if (data == NULL) {
+        return FAILURE;
+    }
+    char *p = data;
+    memcpy(p, CATALOG_MAGIC, CATALOG_MAGIC_LEN);
+    p += CATALOG_MAGIC_LEN;
+    for (i = 0; i <= table->mask; i++) {
+        DBLink *link = table->slots[i];
+        if (link != NULL && link != DROPPED_SLOT && link != skip) {
+            size_t len = strlen(link->name) + 1;
+            *p++ = (char)link->type;
+            memcpy(p, &link->incarnation, sizeof(link->incarnation));
+            p += sizeof(link->incarnation);
+            memcpy(p, link->name, len);
+            p += len;
+        }
+    }
+    
+    int fd = open(CATALOG_FILE ".tmp", O_RDWR | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        fprintf(stderrfile, "could not create %s.tmp\n", CATALOG_FILE);
+        free(data);
+        return FAILURE;
+    }
+    if (write(fd, data, size) != (ssize_t)size || fdatasync(fd) != 0 ||
+        rename(CATALOG_FILE ".tmp", CATALOG_FILE) != 0) {
+        fprintf(stderrfile, "could not rewrite catalog %s\n", CATALOG_FILE);
+        close(fd);
+        unlink(CATALOG_FILE ".tmp");
+        free(data);
+        return FAILURE;
+    }
+    free(data);
+    
+    //later appends go to the new file
+    close(catalogFd);
+    catalogFd = fd;
+    
+    //the rename only lasts once the directory is synced
+    return p_syncEnvDirectory();
+}
+
+#pragma mark logical log
+
+/*
+ The logical log is a sequence of files LOGICAL_PREFIX<generation>, each a sequence of
+ frames. A frame is a LogFrame header and a block of records, LZ4-compressed when that
+ makes it smaller, and only ever holds whole transactions. A record is an op byte, then
+ the index id, the length of the key as stored in the index followed by the key, and the
+ length of the payload followed by the payload, with every number as a varint.
+ LOG_DEFINE binds an id to the incarnation of the index named by its key, whose payload
+ is its KeyType byte followed by the incarnation; replay skips records for ids that are
+ not bound, or are bound to an incarnation that has since been dropped. LOG_DELETE_RANGE keys a range
+ by a byte of LOG_RANGE_ flags followed by the low bound, with the high bound as payload.
+ LOGICAL_MARKER holds the generation replay starts from, on top of the snapshots taken by
+ the last checkpoint.
+ */
+#define LOGICAL_PREFIX ENV_DIRECTORY "/logical."
+#define LOGICAL_MARKER ENV_DIRECTORY "/logical.ckpt"
+#define CHECKPOINT_SUFFIX ".ckpt.snap"
+#define LOGICAL_BUFFER_SIZE (1024 * 1024)
+#define LOG_FRAME_LZ4 1
+
+#define LOG_INSERT 1
+#define LOG_DELETE 2
+#define LOG_DELETE_KEY 3
+#define LOG_TRUNCATE 4
+#define LOG_DEFINE 5
+#define LOG_DELETE_RANGE 6
+
+//the bounds a LOG_DELETE_RANGE record has, in the first byte of its key
+#define LOG_RANGE_LO 1
+#define LOG_RANGE_HI 2
+
+//longest encoding of a record's op byte and its three varints
+#define LOG_RECORD_OVERHEAD 16
+//longest payload of a LOG_DEFINE record
+#define LOG_DEFINE_PAYLOAD 6
+
+typedef struct
+    {
+        uint32_t    rawLen;
+        uint32_t    storedLen;
+        uint32_t    flags;
+        uint32_t    checksum;   //FNV-1a of the stored bytes
+    } LogFrame;
+
+/*
+ Committing transactions append their records to logBuffer under LOG_LOCK. A flush takes
+ LOG_WRITE_LOCK, swaps logBuffer with logSpare and writes the full one out as a frame,
+ so appends carry on while it writes.
+ */
+pthread_mutex_t LOG_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t LOG_WRITE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+char *logBuffer;
+size_t logFill;
+char *logSpare;
+//frame being written, with room for a full buffer that did not compress
+char *logFrame;
+int logFd = -1;
+uint32_t logGen;
+off_t logOffset;
+//whether frames were written since the last sync
+int logUnsynced;
+//uncompressed bytes logged since the last checkpoint; read without a lock
+uint64_t logBytesSinceCheckpoint;
+
+//defined with the rest of the logical log's recovery, which applies records through the API
+ErrCode p_recoverLogical(void);
+ErrCode p_checkpointLogical(void);
+
+uint32_t p_fnv1a(const char *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+size_t p_putVarint(char *out, uint32_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (char)v;
+    return n;
+}
+
+/*
+ Reads a varint, advancing *p past it.
+ @return -1 if the varint is malformed or runs past end.
+ */
+int p_getVarint(const char **p, const char *end, uint32_t *v)
+{
+    uint32_t result = 0;
+    int shift;
+    for (shift = 0; shift < 35 && *p < end; shift += 7) {
+        uint8_t b = (uint8_t)*(*p)++;
+        result |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ Encodes one record into out, which has room for LOG_RECORD_OVERHEAD more bytes than
+ the key and payload.
+ @return the length of the record.
+ */
+size_t p_encodeRecord(char *out, uint8_t op, uint32_t id, const void *key, uint32_t keyLen,
+                      const void *data, uint32_t dataLen)
+{
+    size_t n = 0;
+    out[n++] = (char)op;
+    n += p_putVarint(out + n, id);
+    n += p_putVarint(out + n, keyLen);
+    if (keyLen > 0) {
+        memcpy(out + n, key, keyLen);
+        n += keyLen;
+    }
+    n += p_putVarint(out + n, dataLen);
+    if (dataLen > 0) {
+        memcpy(out + n, data, dataLen);
+        n += dataLen;
+    }
+    return n;
+}
+
+/*
+ Adds a record for an operation the transaction has just made; it is logged when the
+ transaction commits. A NULL data logs an empty payload.
+ */
+ErrCode p_logRecord(TXNState *txnState, uint8_t op, uint32_t id, const DBT *key, const DBT *data)
+{
+    uint32_t dataLen = data == NULL ? 0 : data->size;
+    size_t need = txnState->logUsed + LOG_RECORD_OVERHEAD + key->size + dataLen;
+    if (need > txnState->logCap) {
+        size_t cap = txnState->logCap == 0 ? 512 : txnState->logCap * 2;
+        while (cap < need) {
+            cap *= 2;
+        }
+        char *grown = realloc(txnState->logRecords, cap);
+        if (grown == NULL) {
+            return FAILURE;
+        }
+        txnState->logRecords = grown;
+        txnState->logCap = cap;
+    }
+    txnState->logUsed += p_encodeRecord(txnState->logRecords + txnState->logUsed, op, id,
+                                        key->data, key->size, data == NULL ? NULL : data->data, dataLen);
+    return SUCCESS;
+}
+
+/*
+ Largest frame body a block of len bytes can turn into.
+ */
+size_t p_frameBound(size_t len, int compress)
+{
+#ifdef HAVE_LZ4
+    if (compress) {
+        return LZ4_compressBound((int)len);
+    }
+#endif
+    return len;
+}
+
+ErrCode p_writeAll(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return FAILURE;
+        }
+        buf += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+/*
+ Builds a frame holding a block of records in frame, which has room for a LogFrame and
+ p_frameBound(len, compress) more bytes. Without LZ4, compress is ignored.
+ @return the size of the frame.
+ */
+size_t p_encodeFrame(const char *data, size_t len, int compress, char *frame)
+{
+    LogFrame header;
+    header.rawLen = (uint32_t)len;
+    header.storedLen = (uint32_t)len;
+    header.flags = 0;
+#ifdef HAVE_LZ4
+    if (compress) {
+        int n = LZ4_compress_default(data, frame + sizeof(LogFrame), (int)len, (int)p_frameBound(len, compress));
+        if (n > 0 && (size_t)n < len) {
+            header.storedLen = n;
+            header.flags = LOG_FRAME_LZ4;
+        }
+    }
+#endif
+    if (!(header.flags & LOG_FRAME_LZ4)) {
+        memcpy(frame + sizeof(LogFrame), data, len);
+    }
+    header.checksum = p_fnv1a(frame + sizeof(LogFrame), header.storedLen);
+    memcpy(frame, &header, sizeof(LogFrame));
+    return sizeof(LogFrame) + header.storedLen;
+}
+
+/*
+ Checks the body of a frame against its header, whose storedLen the caller has already
+ made sure is all there, and decompresses it into *raw if need be.
+ @return 0 with *records pointing at the frame's records, -1 if the frame is damaged,
+ or 1 if it cannot be read here, for want of LZ4 or of memory to decompress it into.
+ */
+int p_decodeFrame(const LogFrame *header, const char *body, char **raw, size_t *rawCap, const char **records)
+{
+    if ((header->flags == 0 && header->storedLen != header->rawLen) ||
+        (header->flags != 0 && header->flags != LOG_FRAME_LZ4) ||
+        p_fnv1a(body, header->storedLen) != header->checksum) {
+        return -1;
+    }
+    *records = body;
+    if (header->flags == LOG_FRAME_LZ4) {
+#ifdef HAVE_LZ4
+        if (header->rawLen > *rawCap) {
+            char *grown = realloc(*raw, header->rawLen);
+            if (grown == NULL) {
+                return 1;
+            }
+            *raw = grown;
+            *rawCap = header->rawLen;
+        }
+        if (LZ4_decompress_safe(body, *raw, (int)header->storedLen, (int)header->rawLen) != (int)header->rawLen) {
+            return -1;
+        }
+        *records = *raw;
+#else
+        return 1;
+#endif
+    }
+    return 0;
+}
+
+/*
+ Reads one record, advancing *p past it. The key and payload point into the frame.
+ @return -1 if the record is malformed or runs past end.
+ */
+int p_decodeRecord(const char **p, const char *end, uint8_t *op, uint32_t *id,
+                   const char **key, uint32_t *keyLen, const char **data, uint32_t *dataLen)
+{
+    *op = (uint8_t)*(*p)++;
+    if (*op < LOG_INSERT || *op > LOG_DELETE_RANGE || p_getVarint(p, end, id) != 0 ||
+        p_getVarint(p, end, keyLen) != 0 || *keyLen > (size_t)(end - *p)) {
+        return -1;
+    }
+    *key = *p;
+    *p += *keyLen;
+    if (p_getVarint(p, end, dataLen) != 0 || *dataLen > (size_t)(end - *p)) {
+        return -1;
+    }
+    *data = *p;
+    *p += *dataLen;
+    return 0;
+}
+
+/*
+ Writes a block of records to the current log file as one frame. A frame that could not
+ be written completely is cut off again, so the file stays readable up to its end. The
+ caller holds LOG_WRITE_LOCK.
+ */
+ErrCode p_writeFrame(const char *data, size_t len)
+{
+    char *frame = logFrame;
+    if (len > LOGICAL_BUFFER_SIZE && (frame = malloc(sizeof(LogFrame) + p_frameBound(len, logCompress))) == NULL) {
+        return FAILURE;
+    }
+    
+    size_t size = p_encodeFrame(data, len, logCompress, frame);
+    ErrCode ret = p_writeAll(logFd, frame, size);
+    if (frame != logFrame) {
+        free(frame);
+    }
+    if (ret != SUCCESS) {
+        fprintf(stderrfile, "could not write logical log %u. errno %d\n", logGen, errno);
+        if (ftruncate(logFd, logOffset) != 0) {
+            fprintf(stderrfile, "could not cut torn frame from logical log %u\n", logGen);
+        }
+        return FAILURE;
+    }
+    logOffset += size;
+    logUnsynced = 1;
+    __atomic_add_fetch(&logBytesSinceCheckpoint, len, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+/*
+ Writes out everything appended so far. The caller holds LOG_WRITE_LOCK.
+ */
+ErrCode p_drainLogical()
+{
+    pthread_mutex_lock(&LOG_LOCK);
+    char *full = logBuffer;
+    size_t fill = logFill;
+    logBuffer = logSpare;
+    logFill = 0;
+    pthread_mutex_unlock(&LOG_LOCK);
+    logSpare = full;
+    
+    if (fill == 0) {
+        return SUCCESS;
+    }
+    return p_writeFrame(full, fill);
+}
+
+/*
+ Syncs the frames written since the last sync. The caller holds LOG_WRITE_LOCK.
+ */
+ErrCode p_syncLogical()
+{
+    if (!logUnsynced) {
+        return SUCCESS;
+    }
+    if (fdatasync(logFd) != 0) {
+        fprintf(stderrfile, "could not sync logical log %u. errno %d\n", logGen, errno);
+        return FAILURE;
+    }
+    logUnsynced = 0;
+    return SUCCESS;
+}
+
+/*
+ Writes out everything appended so far, followed by extra as a frame of its own if
+ extraLen is not zero, and syncs the log if asked to.
+ */
+ErrCode p_flushLogical(int sync, const char *extra, size_t extraLen)
+{
+    pthread_mutex_lock(&LOG_WRITE_LOCK);
+    ErrCode ret = p_drainLogical();
+    if (ret == SUCCESS && extraLen > 0) {
+        ret = p_writeFrame(extra, extraLen);
+    }
+    if (ret == SUCCESS && sync) {
+        ret = p_syncLogical();
+    }
+    pthread_mutex_unlock(&LOG_WRITE_LOCK);
+    return ret;
+}
+
+/*
+ Appends a committing transaction's records to the log buffer in one piece, writing the
+ buffer out first if they do not fit. Records larger than the whole buffer are written
+ straight out as their own frame.
+ */
+ErrCode p_appendLogical(const char *records, size_t len)
+{
+    pthread_mutex_lock(&LOG_LOCK);
+    while (logFill + len > LOGICAL_BUFFER_SIZE) {
+        pthread_mutex_unlock(&LOG_LOCK);
+        if (len > LOGICAL_BUFFER_SIZE) {
+            return p_flushLogical(0, records, len);
+        }
+        if (p_flushLogical(0, NULL, 0) != SUCCESS) {
+            return FAILURE;
+        }
+        pthread_mutex_lock(&LOG_LOCK);
+    }
+    memcpy(logBuffer + logFill, records, len);
+    logFill += len;
+    pthread_mutex_unlock(&LOG_LOCK);
+    return SUCCESS;
+}
+
+/*
+ Commits a transaction and appends its records while holding LOG_LOCK, so transactions
+ are logged in the order they committed and a transaction whose commit failed leaves
+ nothing in the log. Records larger than the whole buffer are written out as their own
+ frame under LOG_WRITE_LOCK instead. *written is set to FAILURE if they could not be.
+ @return the BDB error code of the commit, or -1 with the transaction still open if no
+ room could be made for its records.
+ */
+int p_commitLogical(DB_TXN *tid, u_int32_t flags, const char *records, size_t len, ErrCode *written)
+{
+    int ret;
+    *written = SUCCESS;
+    if (len > LOGICAL_BUFFER_SIZE) {
+        pthread_mutex_lock(&LOG_WRITE_LOCK);
+        if (p_drainLogical() != SUCCESS) {
+            pthread_mutex_unlock(&LOG_WRITE_LOCK);
+            return -1;
+        }
+        if ((ret = tid->commit(tid, flags)) == 0) {
+            *written = p_writeFrame(records, len);
+        }
+        pthread_mutex_unlock(&LOG_WRITE_LOCK);
+        return ret;
+    }
+    
+    pthread_mutex_lock(&LOG_LOCK);
+    while (logFill + len > LOGICAL_BUFFER_SIZE) {
+        pthread_mutex_unlock(&LOG_LOCK);
+        if (p_flushLogical(0, NULL, 0) != SUCCESS) {
+            return -1;
+        }
+        pthread_mutex_lock(&LOG_LOCK);
+    }
+    if ((ret = tid->commit(tid, flags)) == 0) {
+        memcpy(logBuffer + logFill, records, len);
+        logFill += len;
+    }
+    pthread_mutex_unlock(&LOG_LOCK);
+    return ret;
+}
+
+/*
+ Appends a record made outside of any transaction, such as the definition of an index.
+ */
+ErrCode p_appendRecord(uint8_t op, uint32_t id, const void *key, uint32_t keyLen, const void *data, uint32_t dataLen)
+{
+    char *record = malloc(LOG_RECORD_OVERHEAD + keyLen + dataLen);
+    if (record == NULL) {
+        return FAILURE;
+    }
+    size_t len = p_encodeRecord(record, op, id, key, keyLen, data, dataLen);
+    ErrCode ret = p_appendLogical(record, len);
+    free(record);
+    return ret;
+}
+
+/*
+ Fills in the payload of a LOG_DEFINE record for an index, which has room for LOG_DEFINE_PAYLOAD bytes.
+ @return the length of the payload.
+ */
+uint32_t p_definePayload(const DBLink *link, char *out)
+{
+    out[0] = (char)(uint8_t)link->type;
+    return 1 + (uint32_t)p_putVarint(out + 1, link->incarnation);
+}
+
+/*
+ Binds id to the index in the log, so replay applies the records that follow to it.
+ */
+ErrCode p_logDefine(DBLink *link)
+{
+    char payload[LOG_DEFINE_PAYLOAD];
+    uint32_t len = p_definePayload(link, payload);
+    return p_appendRecord(LOG_DEFINE, link->id, link->name, strlen(link->name), payload, len);
+}
+
+/*
+ Background log flusher. It flushes as soon as a group commit asks for it, and otherwise
+ at least every lossWindowMs while unflushed commits exist.
+ */
+void *p_flushLog(void *arg)
+{
+    pthread_mutex_lock(&FLUSH_LOCK);
+    while (1) {
+        if (commitsFlushed == commitsLogged) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += lossWindowMs / 1000;
+            deadline.tv_nsec += (long)(lossWindowMs % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&flushNeeded, &FLUSH_LOCK, &deadline);
+            if (commitsFlushed == commitsLogged) {
+                continue;
+            }
+        }
+        
+        //everything counted so far has already been written to the log buffer
+        uint64_t upTo = commitsLogged;
+        pthread_mutex_unlock(&FLUSH_LOCK);
+        int failed = 0;
+        if (logicalLog) {
+            failed = p_flushLogical(1, NULL, 0) != SUCCESS;
+        } else {
+            int ret = env->log_flush(env, NULL);
+            if (ret != 0) {
+                env->err(env, ret, "DB_ENV->log_flush");
+                failed = 1;
+            }
+        }
+        pthread_mutex_lock(&FLUSH_LOCK);
+        
+        //waiters are queued in seq order, so the ones this flush covered are at the head
+        while (flushWaitersHead != NULL && flushWaitersHead->seq <= upTo) {
+            FlushWaiter *waiter = flushWaitersHead;
+            flushWaitersHead = waiter->next;
+            waiter->status = failed ? FAILURE : SUCCESS;
+            waiter->done = 1;
+        }
+        if (flushWaitersHead == NULL) {
+            flushWaitersTail = NULL;
+        }
+        commitsFlushed = upTo;
+        pthread_cond_broadcast(&flushDone);
+    }
+    return NULL;
+}
+
+/*
+ Records a commit that was logged without syncing and, for DURABILITY_GROUP, waits until
+ a flush of the log has covered it. Under the logical log, sync commits are flushed here.
+ */
+ErrCode p_logCommitted(Durability durability)
+{
+    //a sync commit flushes the logical log itself, along with whatever else is waiting
+    if (durability == DURABILITY_SYNC && logicalLog) {
+        return p_flushLogical(1, NULL, 0);
+    }
+    if (durability != DURABILITY_GROUP && durability != DURABILITY_ASYNC) {
+        return SUCCESS;
+    }
+    
+    pthread_mutex_lock(&FLUSH_LOCK);
+    uint64_t seq = ++commitsLogged;
+    if (durability == DURABILITY_ASYNC) {
+        pthread_mutex_unlock(&FLUSH_LOCK);
+        return SUCCESS;
+    }
+    
+    FlushWaiter waiter = {seq, SUCCESS, 0, NULL};
+    if (flushWaitersTail != NULL) {
+        flushWaitersTail->next = &waiter;
+    } else {
+        flushWaitersHead = &waiter;
+    }
+    flushWaitersTail = &waiter;
+    
+    pthread_cond_signal(&flushNeeded);
+    while (!waiter.done) {
+        pthread_cond_wait(&flushDone, &FLUSH_LOCK);
+    }
+    pthread_mutex_unlock(&FLUSH_LOCK);
+    return waiter.status;
+}
+
+/*
+ Background checkpointer. Dirty pages are written out a few at a time by memp_trickle so
+ that a checkpoint has little left to flush, and a checkpoint is taken whenever more log
+ has been written since the last one than recovery could replay within the target time.
+ Neither step blocks running transactions. Log files that no longer matter for recovery
+ are removed after each new checkpoint.
+ */
+void *p_checkpoint(void *arg)
+{
+    int ret;
+    while (1) {
+        uint32_t target = __atomic_load_n(&recoveryTargetSecs, __ATOMIC_RELAXED);
+        
+        //check several times per target so the bound is not overshot by a whole period
+        uint32_t periodMs = target * 1000 / 4;
+        if (periodMs == 0 || periodMs > CHECKPOINT_PERIOD_MS) {
+            periodMs = CHECKPOINT_PERIOD_MS;
+        }
+        usleep(periodMs * 1000);
+        
+        //with the logical log, checkpoints are snapshots of the indices and BDB's log is not kept
+        if (logicalLog) {
+            uint64_t limit = (uint64_t)target * REPLAY_KB_PER_SEC * 1024;
+            if (__atomic_load_n(&logBytesSinceCheckpoint, __ATOMIC_RELAXED) >= limit) {
+                p_checkpointLogical();
+            }
+            continue;
+        }
+        
+        int written;
+        if ((ret = env->memp_trickle(env, TRICKLE_CLEAN_PERCENT, &written)) != 0) {
+            env->err(env, ret, "DB_ENV->memp_trickle");
+        }
+        
+        uint64_t kbyte = (uint64_t)target * REPLAY_KB_PER_SEC;
+        if (kbyte > UINT32_MAX) {
+            kbyte = UINT32_MAX;
+        }
+        if ((ret = env->txn_checkpoint(env, (u_int32_t)kbyte, 0, 0)) != 0) {
+            env->err(env, ret, "DB_ENV->txn_checkpoint");
+            continue;
+        }
+        
+        DB_TXN_STAT *stat;
+        if ((ret = env->txn_stat(env, &stat, 0)) != 0) {
+            env->err(env, ret, "DB_ENV->txn_stat");
+            continue;
+        }
+        DB_LSN ckp = stat->st_last_ckp;
+        free(stat);
+        
+        //no new checkpoint means no more log became removable
+        if (ckp.file == lastCheckpointLsn.file && ckp.offset == lastCheckpointLsn.offset) {
+            continue;
+        }
+        lastCheckpointLsn = ckp;
+        
+        if ((ret = env->log_archive(env, NULL, DB_ARCH_REMOVE)) != 0) {
+            env->err(env, ret, "DB_ENV->log_archive");
+        }
+    }
+    return NULL;
+}
+
+/*
+ Path of the snapshot file with the given sequence number in the environment; the caller frees it.
+ */
+char *p_snapshotPath(const char *name, uint32_t seq)
+{
+    size_t len = strlen(ENV_DIRECTORY) + strlen(name) + 32;
+    char *path = malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, ENV_DIRECTORY "/%s.%u.snap", name, seq);
+    }
+    return path;
+}
+
+/*
+ Name of an index's side DB; the caller frees it.
+ */
+char *p_sideName(const char *name)
+{
+    char *sideName = malloc(strlen(name) + sizeof(SIDE_SUFFIX));
+    if (sideName != NULL) {
+        strcpy(sideName, name);
+        strcat(sideName, SIDE_SUFFIX);
+    }
+    return sideName;
+}
+
+/*
+ Name of an index's counts DB; the caller frees it.
+ */
+char *p_countsName(const char *name)
+{
+    char *countsName = malloc(strlen(name) + sizeof(COUNTS_SUFFIX));
+    if (countsName != NULL) {
+        strcpy(countsName, name);
+        strcat(countsName, COUNTS_SUFFIX);
+    }
+    return countsName;
+}
+
+/*
+ Path of the snapshot an index was last checkpointed to under the logical log; the caller frees it.
+ */
+char *p_checkpointPath(const char *name)
+{
+    char *path = malloc(strlen(ENV_DIRECTORY) + 1 + strlen(name) + sizeof(CHECKPOINT_SUFFIX));
+    if (path != NULL) {
+        sprintf(path, ENV_DIRECTORY "/%s" CHECKPOINT_SUFFIX, name);
+    }
+    return path;
+}
+
+/*
+ Reads the lengths of the snapshot entry at entry, which is only byte-aligned in the file,
+ and returns where its key starts.
+ */
+const char *p_entryBytes(const char *entry, uint16_t *keySize, uint16_t *dataSize)
+{
+    memcpy(keySize, entry + offsetof(SnapshotEntry, keySize), sizeof(uint16_t));
+    memcpy(dataSize, entry + offsetof(SnapshotEntry, dataSize), sizeof(uint16_t));
+    return entry + offsetof(SnapshotEntry, bytes);
+}
+
+/*
+ Maps a snapshot file for an index of the given type. Files from outside the environment
+ are validated entry by entry first; files in it were validated when they were imported,
+ so mapping them touches nothing but the header.
+ */
+ErrCode p_mapSnapshot(const char *path, KeyType type, int validate, Snapshot **out)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderrfile, "could not open snapshot %s. errno %d\n", path, errno);
+        return FAILURE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SnapshotHeader)) {
+        fprintf(stderrfile, "snapshot %s is too short\n", path);
+        close(fd);
+        return FAILURE;
+    }
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderrfile, "could not map snapshot %s. errno %d\n", path, errno);
+        return FAILURE;
+    }
+    
+    //the offsets have to fit between the entries and the end of the file
+    const SnapshotHeader *header = (const SnapshotHeader *)map;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0 || header->type != (uint32_t)type ||
+        header->offsetsPos < sizeof(SnapshotHeader) || header->offsetsPos % sizeof(uint64_t) != 0 ||
+        header->offsetsPos > size || header->count > (size - header->offsetsPos) / sizeof(uint64_t)) {
+        fprintf(stderrfile, "%s is not a snapshot of a %d index\n", path, type);
+        munmap(map, size);
+        return FAILURE;
+    }
+    const uint64_t *offsets = (const uint64_t *)(map + header->offsetsPos);
+    
+    //every entry has to lie within the entry area, fit a Record, and sort after the one before it
+    uint64_t i;
+    const char *prev = NULL;
+    uint16_t prevKeySize = 0, prevDataSize = 0;
+    for (i = 0; validate && i < header->count; i++) {
+        uint64_t off = offsets[i];
+        if (off < sizeof(SnapshotHeader) || off > header->offsetsPos - sizeof(SnapshotEntry)) {
+            break;
+        }
+        uint16_t keySize, dataSize;
+        const char *bytes = p_entryBytes(map + off, &keySize, &dataSize);
+        if (keySize > MAX_VARCHAR_LEN || dataSize == 0 || dataSize > MAX_PAYLOAD_LEN + 1 ||
+            off + sizeof(SnapshotEntry) + keySize + dataSize > header->offsetsPos ||
+            bytes[keySize + dataSize - 1] != '\0' ||
+            (type == SHORT && keySize != 4) || (type == INT && keySize != 8)) {
+            break;
+        }
+        if (prev != NULL) {
+            uint16_t len = prevKeySize < keySize ? prevKeySize : keySize;
+            int c = memcmp(prev, bytes, len);
+            if (c == 0) {
+                c = prevKeySize - keySize;
+            }
+            if (c == 0) {
+                len = prevDataSize < dataSize ? prevDataSize : dataSize;
+                c = memcmp(prev + prevKeySize, bytes + keySize, len);
+                if (c == 0) {
+                    c = prevDataSize - dataSize;
+                }
+            }
+            if (c >= 0) {
+                break;
+            }
+        }
+        prev = bytes;
+        prevKeySize = keySize;
+        prevDataSize = dataSize;
+    }
+    if (validate && i < header->count) {
+        fprintf(stderrfile, "snapshot %s has a bad entry at %llu\n", path, (unsigned long long)i);
+        munmap(map, size);
+        return FAILURE;
+    }
+    
+    Snapshot *snap = malloc(sizeof(Snapshot));
+    if (snap == NULL) {
+        munmap(map, size);
+        return FAILURE;
+    }
+    snap->map = map;
+    snap->size = size;
+    snap->count = header->count;
+    snap->offsets = offsets;
+    snap->seq = 0;
+    snap->retired = NULL;
+    *out = snap;
+    return SUCCESS;
+}
+
+void p_unmapSnapshot(Snapshot *snap)
+{
+    munmap(snap->map, snap->size);
+    free(snap);
+}
+
+/*
+ Opens an index's side DB, creating it if asked, and maps the snapshot it names.
+ An index that was never loaded from a snapshot has no side DB and is left without one.
+ */
+ErrCode p_openSide(DBLink *link, u_int32_t create)
+{
+    DB *side;
+    int ret;
+    
+    char *sideName = p_sideName(link->file);
+    if (sideName == NULL) {
+        return FAILURE;
+    }
+    if ((ret = db_create(&side, env, 0)) != 0) {
+        fprintf(stderrfile, "could not create DB. err = %d\n", ret);
+        free(sideName);
+        return FAILURE;
+    }
+    side->set_errfile(side, stderrfile);
+    side->set_errpfx(side, link->name);
+    side->set_flags(side, DB_DUPSORT);
+    
+    ret = side->open(side, NULL, sideName, NULL, DB_BTREE, DB_AUTO_COMMIT | DB_THREAD | (multiversion ? MVCC_OPEN_FLAGS : 0) | create, S_IRUSR | S_IWUSR);
+    free(sideName);
+    if (ret != 0) {
+        side->close(side, 0);
+        if (ret == ENOENT && !create) {
+            return SUCCESS;
+        }
+        fprintf(stderrfile, "could not open side DB of %s. err: %i\n", link->name, ret);
+        return FAILURE;
+    }
+    
+    //find which snapshot the index was last loaded from, if any
+    char tag = SNAPSHOT_SEQ_KEY;
+    uint32_t seq;
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = &tag;
+    key.size = 1;
+    data.data = &seq;
+    data.ulen = sizeof(seq);
+    data.flags = DB_DBT_USERMEM;
+    if ((ret = side->get(side, NULL, &key, &data, 0)) == 0) {
+        char *path = p_snapshotPath(link->file, seq);
+        if (path == NULL || p_mapSnapshot(path, link->type, 0, &link->snapshot) != SUCCESS) {
+            free(path);
+            side->close(side, 0);
+            return FAILURE;
+        }
+        free(path);
+        link->snapshot->seq = seq;
+    } else if (ret != DB_NOTFOUND) {
+        side->err(side, ret, "reading snapshot sequence");
+        side->close(side, 0);
+        return FAILURE;
+    }
+    
+    link->side = side;
+    return SUCCESS;
+}
+
+void p_initOnce(void)
+{
+    //create a file to store error messages for the databases
+    stderrfile = fopen("error.log", "w");
+    if (stderrfile == NULL) {
+        return;
+    }
+    
+    if (p_createEnv() != SUCCESS) {
+        return;
+    }
+    
+    if (p_loadCatalog() != SUCCESS) {
+        return;
+    }
+    
+    //rebuild the indices from the last checkpoint and the logical log before anything reads them
+    if (logicalLog && p_recoverLogical() != SUCCESS) {
+        return;
+    }
+    
+    //transactions may ask for group or async commits even when the default is sync
+    if (envDurability != DURABILITY_IN_MEMORY) {
+        pthread_t flusher;
+        if (pthread_create(&flusher, NULL, p_flushLog, NULL) != 0) {
+            fprintf(stderrfile, "could not start log flusher thread\n");
+            return;
+        }
+        pthread_detach(flusher);
+        
+        pthread_t checkpointer;
+        if (pthread_create(&checkpointer, NULL, p_checkpoint, NULL) != 0) {
+            fprintf(stderrfile, "could not start checkpointer thread\n");
+            return;
+        }
+        pthread_detach(checkpointer);
+    }
+    
+    initResult = SUCCESS;
+}
+
+/*
+ Opens the error log and the environment and loads the index catalog, exactly once
+ per process, on the first call into the API.
+ */
+ErrCode p_init()
+{
+    pthread_once(&initOnce, p_initOnce);
+    return initResult;
+}
+
+ErrCode setDeadlockPolicy(DeadlockPolicy policy)
+{
+    if (policy != DEADLOCK_DETECT_DEFAULT && policy != DEADLOCK_ABORT_YOUNGEST &&
+        policy != DEADLOCK_ABORT_MINWRITE) {
+        return FAILURE;
+    }
+    
+    pthread_mutex_lock(&DBLINK_LOCK);
+    //the detector mode can only be chosen before the environment is opened
+    if (env != NULL) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    deadlockPolicy = policy;
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    return SUCCESS;
+}
+
+ErrCode setDurability(Durability mode, uint32_t windowMs)
+{
+    if (mode != DURABILITY_SYNC && mode != DURABILITY_GROUP &&
+        mode != DURABILITY_ASYNC && mode != DURABILITY_IN_MEMORY) {
+        return FAILURE;
+    }
+    if (mode == DURABILITY_ASYNC && windowMs == 0) {
+        return FAILURE;
+    }
+    
+    pthread_mutex_lock(&DBLINK_LOCK);
+    //the log can only be configured before the environment is opened, and the logical log has to be kept on disk
+    if (env != NULL || (mode == DURABILITY_IN_MEMORY && logicalLog)) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    envDurability = mode;
+    if (mode == DURABILITY_ASYNC) {
+        lossWindowMs = windowMs;
+    }
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    return SUCCESS;
+}
+
+ErrCode setAsyncIO(uint32_t queueDepth)
+{
+    if (queueDepth == 0) {
+        return FAILURE;
+    }
+    
+    pthread_mutex_lock(&DBLINK_LOCK);
+    //BDB's I/O functions can only be replaced before it opens any file
+    if (env != NULL) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    asyncIODepth = queueDepth;
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    return SUCCESS;
+}
+
+ErrCode setLogicalLog(int compress)
+{
+#ifndef HAVE_LZ4
+    if (compress) {
+        return FAILURE;
+    }
+#endif
+    
+    pthread_mutex_lock(&DBLINK_LOCK);
+    //which log the environment keeps is decided when it is opened
+    if (env != NULL || envDurability == DURABILITY_IN_MEMORY) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    logicalLog = 1;
+    logCompress = compress != 0;
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    return SUCCESS;
+}
+
+ErrCode setMultiversion(int enable)
+{
+#ifndef DB_MULTIVERSION
+    if (enable) {
+        return FAILURE;
+    }
+#endif
+    
+    pthread_mutex_lock(&DBLINK_LOCK);
+    //every index has to be opened the same way
+    if (env != NULL) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    multiversion = enable != 0;
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    return SUCCESS;
+}
+
+ErrCode setRecordCounts(int enable)
+{
+    pthread_mutex_lock(&DBLINK_LOCK);
+    //indices opened without counts would not have kept them
+    if (env != NULL) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    recordCounts = enable != 0;
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    return SUCCESS;
+}
+
+ErrCode setRecoveryThreads(uint32_t threads)
+{
+    if (threads == 0) {
+        return FAILURE;
+    }
+    
+    pthread_mutex_lock(&DBLINK_LOCK);
+    //startup work has already been done once the environment exists
+    if (env != NULL) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    recoveryThreads = threads;
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    return SUCCESS;
+}
+
+ErrCode setRecoveryTarget(uint32_t seconds)
+{
+    if (seconds == 0 || seconds > UINT32_MAX / REPLAY_KB_PER_SEC) {
+        return FAILURE;
+    }
+    __atomic_store_n(&recoveryTargetSecs, seconds, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+ErrCode setCacheSize(uint64_t bytes, uint32_t partitions)
+{
+    if (partitions == 0 || bytes / partitions < MIN_CACHE_PARTITION) {
+        return FAILURE;
+    }
+    
+    pthread_mutex_lock(&DBLINK_LOCK);
+    //the cache is created along with the environment
+    if (env != NULL) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    cacheBytes = bytes;
+    cachePartitions = partitions;
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    return SUCCESS;
+}
+
+ErrCode getCacheStats(CacheStats *stats)
+{
+    int ret;
+    if ((ret = p_init()) != SUCCESS) {
+        return ret;
+    }
+    
+    DB_MPOOL_STAT *mpool;
+    if ((ret = env->memp_stat(env, &mpool, NULL, 0)) != 0) {
+        env->err(env, ret, "DB_ENV->memp_stat");
+        return FAILURE;
+    }
+    stats->hits = mpool->st_cache_hit;
+    stats->misses = mpool->st_cache_miss;
+    stats->evictions = mpool->st_ro_evict + mpool->st_rw_evict;
+    stats->cacheBytes = ((uint64_t)mpool->st_gbytes << 30) + mpool->st_bytes;
+    stats->partitions = mpool->st_ncache;
+    free(mpool);
+    
+    return SUCCESS;
+}
+
+/*
+ Picks the incarnation of a newly created index: one no index in the catalog has used,
+ whose file was not left behind by a drop that a crash interrupted. The caller holds DBLINK_LOCK.
+ */
+uint32_t p_newIncarnation(const char *name)
+{
+    for (;;) {
+        uint32_t incarnation = nextIncarnation++;
+        char *file = p_fileName(name, incarnation);
+        if (file == NULL) {
+            return incarnation;
+        }
+        char *path = malloc(strlen(ENV_DIRECTORY) + 1 + strlen(file) + 1);
+        int taken = 0;
+        if (path != NULL) {
+            sprintf(path, ENV_DIRECTORY "/%s", file);
+            taken = access(path, F_OK) == 0;
+        }
+        free(path);
+        free(file);
+        if (!taken) {
+            return incarnation;
+        }
+    }
+}
+
+/*
+ Takes a reference to an index for a caller that does not already hold one.
+ @return 0 if the index was dropped and its last reference is already gone.
+ */
+int p_acquireLink(DBLink *link)
+{
+    int refs = __atomic_load_n(&link->refs, __ATOMIC_RELAXED);
+    do {
+        if (refs == 0) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&link->refs, &refs, refs + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+ Gives up a reference to an index.
+ @return 1 if it was the last one, and the caller has to p_closeDropped the index.
+ */
+int p_dropRef(DBLink *link)
+{
+    return __atomic_sub_fetch(&link->refs, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+/*
+ Closes a dropped index nothing refers to any more, releases its pages all at once by
+ removing its files, and frees its id. The caller holds DBLINK_LOCK.
+ */
+void p_closeDropped(DBLink *link)
+{
+    int ret;
+    if (link->isOpen) {
+        if ((ret = link->dbp->close(link->dbp, 0)) != 0) {
+            fprintf(stderrfile, "could not close dropped index %s. err: %i\n", link->name, ret);
+        }
+        link->dbp = NULL;
+        link->isOpen = 0;
+    }
+    if ((ret = env->dbremove(env, NULL, link->file, NULL, DB_AUTO_COMMIT)) != 0 && ret != ENOENT) {
+        //an index that was never opened has no file to remove
+        env->err(env, ret, "DB_ENV->dbremove: %s", link->name);
+    }
+    
+    //an index that was loaded from a snapshot also has a side DB and a snapshot file, one
+    //keeping record counts has a counts DB, and one checkpointed under the logical log
+    //has a checkpoint snapshot
+    char *sideName = p_sideName(link->file);
+    if (link->side != NULL) {
+        link->side->close(link->side, 0);
+        link->side = NULL;
+    }
+    if (sideName != NULL && (ret = env->dbremove(env, NULL, sideName, NULL, DB_AUTO_COMMIT)) != 0 && ret != ENOENT) {
+        env->err(env, ret, "DB_ENV->dbremove: %s", sideName);
+    }
+    free(sideName);
+    char *countsName = p_countsName(link->file);
+    if (link->counts != NULL) {
+        link->counts->close(link->counts, 0);
+        link->counts = NULL;
+    }
+    if (countsName != NULL && (ret = env->dbremove(env, NULL, countsName, NULL, DB_AUTO_COMMIT)) != 0 && ret != ENOENT) {
+        env->err(env, ret, "DB_ENV->dbremove: %s", countsName);
+    }
+    free(countsName);
+    if (link->snapshot != NULL) {
+        char *path = p_snapshotPath(link->file, link->snapshot->seq);
+        if (path != NULL) {
+            unlink(path);
+        }
+        free(path);
+        p_unmapSnapshot(link->snapshot);
+        link->snapshot = NULL;
+    }
+    while (link->retired != NULL) {
+        Snapshot *next = link->retired->retired;
+        p_unmapSnapshot(link->retired);
+        link->retired = next;
+    }
+    char *ckpt = p_checkpointPath(link->file);
+    if (ckpt != NULL) {
+        unlink(ckpt);
+    }
+    free(ckpt);
+    
+    p_freeId(link);
+}
+
+/*
+ Gives up a reference to an index for a caller that does not hold DBLINK_LOCK, closing
+ the index if it was dropped and this was the last reference.
+ */
+void p_releaseLink(DBLink *link)
+{
+    if (p_dropRef(link)) {
+        pthread_mutex_lock(&DBLINK_LOCK);
+        p_closeDropped(link);
+        pthread_mutex_unlock(&DBLINK_LOCK);
+    }
+}
+
+/*
+ Follows a dropped index to the incarnation that replaced it when it was truncated.
+ @return the index itself if it was not dropped, or NULL if it was dropped for good.
+ */
+DBLink *p_liveLink(DBLink *link)
+{
+    while (link != NULL && __atomic_load_n(&link->dropped, __ATOMIC_ACQUIRE)) {
+        link = __atomic_load_n(&link->successor, __ATOMIC_ACQUIRE);
+    }
+    return link;
+}
+
+/*
+ Checks that the index a handle refers to still exists. A handle on an index truncated
+ since moves over to the new incarnation, forgetting its position in the old one.
+ @return DB_DNE if the index was dropped.
+ */
+ErrCode p_checkHandle(BDBState *state)
+{
+    DBLink *link = state->link;
+    if (!__atomic_load_n(&link->dropped, __ATOMIC_ACQUIRE)) {
+        return SUCCESS;
+    }
+    
+    //an incarnation whose last reference went before this took one was replaced in turn
+    do {
+        if ((link = p_liveLink(link)) == NULL) {
+            return DB_DNE;
+        }
+    } while (!p_acquireLink(link));
+    p_releaseLink(state->link);
+    
+    BDBState *nextSpare = state->nextSpare;
+    uint32_t generation = state->generation;
+    memset(state, 0, sizeof(BDBState));
+    state->dbp = link->dbp;
+    state->type = link->type;
+    state->db_name = link->name;
+    state->link = link;
+    state->nextSpare = nextSpare;
+    state->generation = generation;
+    return SUCCESS;
+}
+
+ErrCode create(KeyType type, char *name)
+{
+    int ret;
+    
+    //if there is no environment, make one and load the catalog
+    if ((ret = p_init()) != SUCCESS) {
+        return ret;
+    }
+    
+    //lock the dblink system
+    if ((ret = pthread_mutex_lock(&DBLINK_LOCK)) != 0) {
+        printf("can't acquire mutex lock: %d\n", ret);
+    }
+    
+    //make sure that the name specified is not already in use
+    if (p_lookupIndex(name) != NULL) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return DB_EXISTS;
+    }
+    
+    //record the index persistently before it becomes visible; if anything after this
+    //fails, the record is taken back so the index does not reappear after a restart
+    uint32_t incarnation = p_newIncarnation(name);
+    off_t catalogEnd;
+    if (p_appendCatalog(type, incarnation, name, &catalogEnd) != SUCCESS) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    
+    //store the DB info in our db lookup table
+    DBLink *link = p_addIndex(type, name, incarnation);
+    if (link == NULL) {
+        fprintf(stderrfile, "could not add %s to the index table\n", name);
+        p_truncateCatalog(catalogEnd);
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    
+    //replay applies the index's records to it from here on
+    if (logicalLogOpen && p_logDefine(link) != SUCCESS) {
+        __atomic_store_n(&link->dropped, 1, __ATOMIC_RELEASE);
+        p_removeIndex(link);
+        if (p_dropRef(link)) {
+            p_closeDropped(link);
+        }
+        p_truncateCatalog(catalogEnd);
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    
+    //unlock the dblink system, because we're done editing it
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    return SUCCESS;
+}
+
+//defined with the rest of the record counts, which are read and written with the cursor helpers
+ErrCode p_openCounts(DBLink *link, DB *dbp);
+int p_truncateCounts(DBLink *link, DB_TXN *tid);
+
+/*
+ Creates and opens the DB handle for an index on its first openIndex. The caller holds DBLINK_LOCK.
+ */
+ErrCode p_openLink(DBLink *link)
+{
+    DB *dbp;
+    int ret;
+    
+    /* Initialize the DB handle */
+    if ((ret = db_create(&dbp, env, 0)) != 0) {
+        fprintf(stderrfile, "could not create DB. err = %d\n", ret);
+        return FAILURE;
+    }
+    
+    //set the error file for the DB
+    dbp->set_errfile(dbp, stderrfile);
+    dbp->set_errpfx(dbp, link->name);
+    
+    //set the db to handle duplicates (flag must be set before db is opened)
+    dbp->set_flags(dbp, DB_DUPSORT);
+    
+    //create a file to support the database, or open the one left by a previous run
+    if ((ret = dbp->open(dbp,
+                         NULL,
+                         link->file,
+                         NULL,
+                         DB_BTREE,
+                         DB_AUTO_COMMIT | DB_CREATE | DB_THREAD | (multiversion ? MVCC_OPEN_FLAGS : 0), 
+                         S_IRUSR | S_IWUSR)) != 0) {
+        fprintf(stderrfile, "could not open index %s. errno %d. closing index.\n",link->name, ret);
+        if ((ret = dbp->close(dbp, 0)) != 0) {
+            fprintf(stderrfile,"could not close index %s, either. err: %i\n", link->name, ret);
+        }
+        return FAILURE;
+    }
+    
+    //an index loaded from a snapshot is served from it as well
+    if (p_openSide(link, 0) != SUCCESS) {
+        dbp->close(dbp, 0);
+        return FAILURE;
+    }
+    if (p_openCounts(link, dbp) != SUCCESS) {
+        if (link->side != NULL) {
+            link->side->close(link->side, 0);
+            link->side = NULL;
+        }
+        if (link->snapshot != NULL) {
+            p_unmapSnapshot(link->snapshot);
+            link->snapshot = NULL;
+        }
+        dbp->close(dbp, 0);
+        return FAILURE;
+    }
+    
+    //transaction cursors find their way back to the index through it
+    dbp->app_private = link;
+    link->dbp = dbp;
+    return SUCCESS;
+}
+
+ErrCode openIndex(const char *name, IdxState **idxState)
+{
+    int ret;
+    
+    //after a restart, the catalog has to be loaded before any index can be found
+    if ((ret = p_init()) != SUCCESS) {
+        return ret;
+    }
+    
+    //look up the DBLink for the index of that name without taking any lock
+    DBLink *link = p_lookupIndex(name);
+    
+    //if no link was found, index was never create()d
+    if (link == NULL) {
+        return DB_DNE;
+    }
+    
+    //the handle holds a reference to the index, which keeps its DB open even if it is
+    //dropped; an index dropped and closed since it was looked up is gone, unless it was
+    //truncated and its name now belongs to the new incarnation
+    if (!p_acquireLink(link)) {
+        return p_liveLink(link) == NULL ? DB_DNE : openIndex(name, idxState);
+    }
+    
+    //the first thread to open the index has to open the underlying DB, under the
+    //dblink lock so that it only happens once
+    if (!__atomic_load_n(&link->isOpen, __ATOMIC_ACQUIRE)) {
+        if ((ret = pthread_mutex_lock(&DBLINK_LOCK)) != 0) {
+            printf("can't acquire mutex lock: %d\n", ret);
+        }
+        
+        //the index may have been dropped since it was looked up, or truncated, which
+        //puts a new incarnation under its name
+        if (link->dropped) {
+            int truncated = link->successor != NULL;
+            if (p_dropRef(link)) {
+                p_closeDropped(link);
+            }
+            pthread_mutex_unlock(&DBLINK_LOCK);
+            if (truncated) {
+                return openIndex(name, idxState);
+            }
+            return DB_DNE;
+        }
+        
+        if (!link->isOpen) {
+            if (p_openLink(link) != SUCCESS) {
+                p_dropRef(link);
+                pthread_mutex_unlock(&DBLINK_LOCK);
+                return FAILURE;
+            }
+            __atomic_store_n(&link->isOpen, 1, __ATOMIC_RELEASE);
+        }
+        
+        //unlock the dblink system
+        pthread_mutex_unlock(&DBLINK_LOCK);
+    }
+    
+    //reuse this thread's handle for the index if it closed one recently, then any
+    //closed handle, and only otherwise create a BDBState variable for this thread
+    HandleCache *cache = p_handleCache();
+    BDBState *state = NULL;
+    if (cache != NULL) {
+        BDBState **slot = &cache->slots[link->hash & (HANDLE_CACHE_SIZE - 1)];
+        if (*slot != NULL && (*slot)->link == link) {
+            state = *slot;
+            *slot = NULL;
+        } else if (cache->spare != NULL) {
+            state = cache->spare;
+            cache->spare = state->nextSpare;
+            cache->numSpare--;
+        }
+    }
+    if (state == NULL && __atomic_load_n(&handlePool, __ATOMIC_RELAXED) != NULL) {
+        pthread_mutex_lock(&HANDLE_POOL_LOCK);
+        if ((state = handlePool) != NULL) {
+            handlePool = state->nextSpare;
+            handlePoolSize--;
+        }
+        pthread_mutex_unlock(&HANDLE_POOL_LOCK);
+    }
+    uint32_t generation = 0;
+    if (state == NULL) {
+        state = malloc(sizeof(BDBState));
+        if (state == NULL) {
+            p_releaseLink(link);
+            return FAILURE;
+        }
+    } else {
+        generation = state->generation + 1;
+    }
+    memset(state, 0, sizeof(BDBState));
+    state->generation = generation;
+    *idxState = p_handleToken(state);
+    state->dbp = link->dbp;
+    state->type = link->type;
+    state->db_name = link->name;
+    state->link = link;
+    
+    return SUCCESS;
+}
+
+ErrCode closeIndex(IdxState *ident)
+{
+    BDBState *state = p_handleState(ident);
+    DBLink *link = state->link;
+    
+    //a handle that was already closed no longer refers to any index, and one reopened
+    //since belongs to whoever reopened it
+    if (!p_handleCurrent(ident, state) || link == NULL || state->dbp == NULL) {
+        fprintf(stderrfile, "closeIndex called on an index that does not exist\n");
+        return DB_DNE;
+    }
+    
+    //don't try to close the index even if no threads are using it because it's too slow;
+    //only a dropped index is closed, by whoever gives up its last reference
+    state->dbp = NULL;
+    
+    //the index was dropped while this handle was open, so it is closed as usual but
+    //reports that the index is gone; a truncated index is still there
+    ErrCode result = p_liveLink(link) == NULL ? DB_DNE : SUCCESS;
+    p_releaseLink(link);
+    
+    //park the handle in this thread's cache for the next openIndex of the same index,
+    //moving whatever handle occupied its slot to the spare list
+    HandleCache *cache = p_handleCache();
+    if (cache == NULL) {
+        pthread_mutex_lock(&HANDLE_POOL_LOCK);
+        p_pushSpare(&handlePool, &handlePoolSize, HANDLE_POOL_MAX, state);
+        pthread_mutex_unlock(&HANDLE_POOL_LOCK);
+        return result;
+    }
+    BDBState **slot = &cache->slots[link->hash & (HANDLE_CACHE_SIZE - 1)];
+    if (*slot != NULL) {
+        p_pushSpare(&cache->spare, &cache->numSpare, HANDLE_SPARE_MAX, *slot);
+    }
+    *slot = state;
+    return result;
+}
+
+
+/*
+ Looks up an index for a whole-index operation and opens it if nobody has yet.
+ The caller holds DBLINK_LOCK.
+ */
+ErrCode p_lookupOpenIndex(const char *name, DBLink **out)
+{
+    DBLink *link = p_lookupIndex(name);
+    if (link == NULL) {
+        return DB_DNE;
+    }
+    if (!link->isOpen) {
+        if (p_openLink(link) != SUCCESS) {
+            return FAILURE;
+        }
+        __atomic_store_n(&link->isOpen, 1, __ATOMIC_RELEASE);
+    }
+    *out = link;
+    return SUCCESS;
+}
+
+ErrCode dropIndex(const char *name)
+{
+    int ret;
+    if ((ret = p_init()) != SUCCESS) {
+        return ret;
+    }
+    
+    //lock the dblink system
+    if ((ret = pthread_mutex_lock(&DBLINK_LOCK)) != 0) {
+        printf("can't acquire mutex lock: %d\n", ret);
+    }
+    
+    DBLink *link = p_lookupIndex(name);
+    if (link == NULL) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return DB_DNE;
+    }
+    
+    //forget the index persistently first, so a failure leaves everything as it was; files
+    //a crash leaves behind after this are never opened again, since a later index of the
+    //same name is a new incarnation
+    if (p_rewriteCatalog(link) != SUCCESS) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    
+    //replay empties the index here, before a later index can take over its name or id;
+    //a drop that cannot be logged fails and puts the index back in the catalog
+    if (logicalLogOpen && p_appendRecord(LOG_TRUNCATE, link->id, NULL, 0, NULL, 0) != SUCCESS) {
+        fprintf(stderrfile, "could not log the drop of %s\n", name);
+        if (p_rewriteCatalog(NULL) != SUCCESS) {
+            fprintf(stderrfile, "could not put %s back in the catalog\n", name);
+        }
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    
+    //invalidate every handle still referring to the index, then make the name unreachable
+    __atomic_store_n(&link->dropped, 1, __ATOMIC_RELEASE);
+    p_removeIndex(link);
+    
+    //calls in progress, open handles and transactions with a cursor in the index keep it
+    //open; the last of them to let go closes it and removes its files
+    if (p_dropRef(link)) {
+        p_closeDropped(link);
+    }
+    
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    return SUCCESS;
+}
+
+/*
+ Frees every page of an index in one operation instead of deleting record by record,
+ within transaction tid; an index loaded from a snapshot also loses its tombstones and
+ snapshot sequence, and one keeping record counts its counts. The caller holds
+ DBLINK_LOCK and calls p_forgetSnapshot once tid commits.
+ @return the BDB error code.
+ */
+int p_truncateLink(DBLink *link, DB_TXN *tid)
+{
+    u_int32_t count;
+    int ret = link->dbp->truncate(link->dbp, tid, &count, 0);
+    if (ret == 0 && link->side != NULL) {
+        ret = link->side->truncate(link->side, tid, &count, 0);
+    }
+    if (ret == 0) {
+        ret = p_truncateCounts(link, tid);
+    }
+    return ret;
+}
+
+/*
+ Removes the file of a snapshot the index no longer serves from. Readers do not take
+ DBLINK_LOCK and may still be reading the mapping, so it stays on the link's retired
+ chain until the link's last reference is gone. The caller holds DBLINK_LOCK.
+ */
+void p_retireSnapshot(DBLink *link, Snapshot *old)
+{
+    char *path = p_snapshotPath(link->file, old->seq);
+    if (path != NULL) {
+        unlink(path);
+    }
+    free(path);
+    old->retired = link->retired;
+    link->retired = old;
+}
+
+/*
+ Stops serving an index from its snapshot and removes the snapshot file. The caller holds DBLINK_LOCK.
+ */
+void p_forgetSnapshot(DBLink *link)
+{
+    Snapshot *old = link->snapshot;
+    if (old == NULL) {
+        return;
+    }
+    __atomic_store_n(&link->snapshot, NULL, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&tombstoneGen, 1, __ATOMIC_RELEASE);
+    p_retireSnapshot(link, old);
+}
+
+ErrCode truncateIndex(const char *name)
+{
+    int ret;
+    if ((ret = p_init()) != SUCCESS) {
+        return ret;
+    }
+    
+    //lock the dblink system
+    if ((ret = pthread_mutex_lock(&DBLINK_LOCK)) != 0) {
+        printf("can't acquire mutex lock: %d\n", ret);
+    }
+    
+    DBLink *link = p_lookupIndex(name);
+    if (link == NULL) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return DB_DNE;
+    }
+    
+    //rather than DB->truncate, which waits for every transaction with locks or a cursor
+    //in the index while this holds DBLINK_LOCK, the index is replaced by a new, empty
+    //incarnation under its name, and the old one is dropped as dropIndex does
+    DBLink *next = p_addIndex(link->type, link->name, p_newIncarnation(link->name));
+    if (next == NULL) {
+        fprintf(stderrfile, "could not add a new incarnation of %s to the index table\n", name);
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    
+    //replay applies the index's records to the new incarnation from its definition on,
+    //and skips the old one's once the catalog lists only the new one
+    int failed = p_openLink(next) != SUCCESS;
+    if (!failed) {
+        __atomic_store_n(&next->isOpen, 1, __ATOMIC_RELEASE);
+        failed = (logicalLogOpen && p_logDefine(next) != SUCCESS) || p_rewriteCatalog(link) != SUCCESS;
+    }
+    if (failed) {
+        __atomic_store_n(&next->dropped, 1, __ATOMIC_RELEASE);
+        p_removeIndex(next);
+        if (p_dropRef(next)) {
+            p_closeDropped(next);
+        }
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return FAILURE;
+    }
+    
+    //handles on the old incarnation move over to the new one on their next call, while
+    //transactions with a cursor in it keep it open until they end
+    __atomic_store_n(&link->successor, next, __ATOMIC_RELEASE);
+    __atomic_store_n(&link->dropped, 1, __ATOMIC_RELEASE);
+    p_removeIndex(link);
+    if (p_dropRef(link)) {
+        p_closeDropped(link);
+    }
+    
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    return p_logCommitted(envDurability);
+}
+
+/*
+ Begins a transaction once the environment exists; recovery uses it while p_init is still running.
+ */
+ErrCode p_beginTransaction(TxnState **txn)
+{
+    int ret;
+    //create the state variable for this transaction
+    TXNState *txnState = malloc(sizeof(TXNState));
+    DB_TXN *tid = NULL;
+    if (txnState == NULL) {
+        return FAILURE;
+    }
+    
+    //begin the transaction
+    if ((ret = env->txn_begin(env, NULL, &tid, 0)) != 0) {
+        env->err(env, ret, "DB_ENV->txn_begin");
+        if (ret == DB_LOCK_DEADLOCK) {
+            free(txnState);
+            return DEADLOCK;
+        }
+        free(txnState);
+        return FAILURE;
+    }
+    
+    txnState->durability = envDurability;
+    memset(txnState->inlineCursors, 0, sizeof(txnState->inlineCursors));
+    txnState->cursors = txnState->inlineCursors;
+    txnState->numCursors = TXN_CURSOR_SLOTS;
+    txnState->cursorSpan = 0;
+    txnState->logRecords = NULL;
+    txnState->logUsed = 0;
+    txnState->logCap = 0;
+    txnState->viewArena = NULL;
+    txnState->viewUsed = 0;
+    txnState->viewCap = 0;
+    txnState->droppedLinks = NULL;
+    memset(&txnState->readAhead, 0, sizeof(ReadAhead));
+    *txn = (TxnState*)txnState;
+    txnState->tid = tid;
+    
+    return SUCCESS;
+}
+
+ErrCode beginTransaction(TxnState **txn)
+{
+    int ret;
+    
+    //if this is the first call, we need to make the environment
+    if ((ret = p_init()) != SUCCESS) {
+        return ret;
+    }
+    return p_beginTransaction(txn);
+}
+
+/*
+ Closes every cursor the transaction opened, leaving its cursor table empty, and gives up
+ the references the cursors held. A dropped index this was the last reference to is only
+ closed by p_closeDroppedLinks, once the transaction no longer holds locks in it.
+ */
+ErrCode p_closeTxnCursors(TXNState *txnState)
+{
+    int ret;
+    uint32_t i;
+    for (i = 0; i < txnState->cursorSpan; i++) {
+        DBC *cursor = txnState->cursors[i];
+        if (cursor == NULL) {
+            continue;
+        }
+        DBLink *link = cursor->dbp->app_private;
+#if DB_VERSION_MINOR>=7
+        if ((ret = cursor->close(cursor)) != 0) {
+#else
+        if ((ret = cursor->c_close(cursor)) != 0) {
+#endif
+            env->err(env, ret, "DB_TXN->abort, cursor->close");
+            if (ret == DB_LOCK_DEADLOCK) {
+                return DEADLOCK;
+            }
+            return FAILURE;
+        }
+        txnState->cursors[i] = NULL;
+        if (p_dropRef(link)) {
+            link->nextClosed = txnState->droppedLinks;
+            txnState->droppedLinks = link;
+        }
+    }
+    txnState->cursorSpan = 0;
+    return SUCCESS;
+}
+
+/*
+ Closes the dropped indices whose last reference the transaction's cursors held, once it has ended.
+ */
+void p_closeDroppedLinks(TXNState *txnState)
+{
+    if (txnState->droppedLinks == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&DBLINK_LOCK);
+    while (txnState->droppedLinks != NULL) {
+        DBLink *link = txnState->droppedLinks;
+        txnState->droppedLinks = link->nextClosed;
+        p_closeDropped(link);
+    }
+    pthread_mutex_unlock(&DBLINK_LOCK);
+}
+
+void p_freeTxnState(TXNState *txnState)
+{
+    if (txnState->cursors != txnState->inlineCursors) {
+        free(txnState->cursors);
+    }
+    free(txnState->logRecords);
+    free(txnState->readAhead.buffer);
+    //each view chunk starts with a pointer to the chunk filled before it
+    while (txnState->viewArena != NULL) {
+        char *previous = *(char **)txnState->viewArena;
+        free(txnState->viewArena);
+        txnState->viewArena = previous;
+    }
+    free(txnState);
+}
+
+ErrCode abortTransaction(TxnState *txn)
+{
+    int ret;
+    TXNState *txnState = (TXNState*)txn;
+    DB_TXN *tid = txnState->tid;
+    
+    if (tid == NULL) {//if there is no transaction to abort, that's confusing
+        fprintf(stderrfile, "cannot abort transaction because none has begun\n");
+        return TXN_DNE;
+    }
+    
+    if (env == NULL) { //shouldn't ever be able to get into this state
+        fprintf(stderrfile, "cannot abort transaction before environment is initialized\n");
+        return FAILURE;
+    }
+    
+    //close all of the txn's cursors
+    if ((ret = p_closeTxnCursors(txnState)) != SUCCESS) {
+        return ret;
+    }
+    
+    //abort the txn, which takes back its tombstones
+    ret = tid->abort(tid);
+    __atomic_add_fetch(&tombstoneGen, 1, __ATOMIC_RELEASE);
+    p_closeDroppedLinks(txnState);
+    if (ret != 0) {
+        env->err(env, ret, "DB_TXN->abort");
+        if (ret == DB_LOCK_DEADLOCK) {
+            return DEADLOCK;
+        }
+        return FAILURE;
+    }
+    
+    p_freeTxnState(txnState);
+    return SUCCESS;
+}
+
+#pragma mark commitTransaction
+ErrCode commitTransaction(TxnState *txn)
+{
+    int ret;
+    TXNState *txnState = (TXNState*)txn;
+    DB_TXN *tid = txnState->tid;
+    
+    if (tid == NULL) {//if there is no txn to end, that's confusing
+        fprintf(stderrfile, "cannot end transaction because none exist\n");
+        return TXN_DNE;
+    }
+    
+    if (env == NULL) { //shouldn't be able to reach this state
+        fprintf(stderrfile, "cannot end transaction before environment is initialized\n");
+        return FAILURE;
+    }
+    
+    //close all of the txn's cursors
+    if ((ret = p_closeTxnCursors(txnState)) != SUCCESS) {
+        return ret;
+    }
+    
+    //commit the txn, which also ends it; only sync commits flush the log themselves
+    Durability durability = txnState->durability;
+    u_int32_t flags = 0;
+    if (durability == DURABILITY_SYNC) {
+        flags = DB_TXN_SYNC;
+    } else if (durability == DURABILITY_GROUP || durability == DURABILITY_ASYNC) {
+        flags = DB_TXN_NOSYNC;
+    }
+    
+    //the transaction's logical records go out together with its commit, while it still
+    //holds its locks, so they are logged in the order in which conflicting transactions
+    //were serialized and only once the commit has succeeded
+    int logged = txnState->logUsed > 0;
+    ErrCode written = SUCCESS;
+    if (logged) {
+        ret = p_commitLogical(tid, flags, txnState->logRecords, txnState->logUsed, &written);
+        if (ret == -1) {
+            abortTransaction(txn);
+            return FAILURE;
+        }
+    } else {
+        ret = tid->commit(tid, flags);
+    }
+    p_closeDroppedLinks(txnState);
+    if (ret != 0) {
+        //a failed commit aborts, taking back the transaction's tombstones
+        __atomic_add_fetch(&tombstoneGen, 1, __ATOMIC_RELEASE);
+        env->err(env, ret, "DB_TXN->commit");
+        if (ret == DB_LOCK_DEADLOCK) {
+            return DEADLOCK;
+        }
+        return FAILURE;
+    }
+    
+    p_freeTxnState(txnState);
+    if (written != SUCCESS) {
+        return FAILURE;
+    }
+    //a transaction that changed nothing has nothing in the logical log to wait for
+    if (logicalLog && !logged) {
+        return SUCCESS;
+    }
+    return p_logCommitted(durability);
+}
+    
+    
+ErrCode setTransactionDurability(TxnState *txn, Durability mode)
+{
+    TXNState *txnState = (TXNState*)txn;
+    if (txnState == NULL) {
+        return TXN_DNE;
+    }
+    if (mode != DURABILITY_SYNC && mode != DURABILITY_GROUP && mode != DURABILITY_ASYNC) {
+        return FAILURE;
+    }
+    
+    //with an in-memory log every commit is already as cheap as it gets
+    if (envDurability != DURABILITY_IN_MEMORY) {
+        txnState->durability = mode;
+    }
+    return SUCCESS;
+}
+    
+#pragma mark p_prepTxnCursor
+
+/*
+ Stops the transaction reading ahead on index id. Its cursor has read past the last record
+ getNext handed out, so it is put back on that record for whatever uses it next.
+ @return ErrCode
+ DEADLOCK or FAILURE if the cursor could not be put back, and would go on from the wrong record.
+ */
+ErrCode p_dropReadAhead(TXNState *txnState, uint32_t id)
+{
+    ReadAhead *ra = &txnState->readAhead;
+    if (ra->id != id) {
+        return SUCCESS;
+    }
+    ra->run = 0;
+    if (ra->next == NULL) {
+        return SUCCESS;
+    }
+    ra->next = NULL;
+    
+    DBC *cursor = txnState->cursors[id];
+    DBT key = ra->lastKey;
+    DBT data = ra->lastData;
+#if DB_VERSION_MINOR>=7
+    int ret = cursor->get(cursor, &key, &data, DB_GET_BOTH);
+#else
+    int ret = cursor->c_get(cursor, &key, &data, DB_GET_BOTH);
+#endif
+    if (ret == DB_LOCK_DEADLOCK) {
+        return DEADLOCK;
+    } else if (ret != 0) {
+        cursor->dbp->err(cursor->dbp, ret, "putting cursor back after read-ahead");
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/*
+Determine if a transaction is currently in progress. If not, create one (keeping *txn's value NULL). 
+Then check to see if there's a cursor for this index, and creates & adds to index/txn state if not, 
 and places the cursor in the **cursor parameter.
  */
-ErrCode p_prepTxnCursor(BDBState *state, TxnState *txn, TXNState **txnState, DBC **cursor) {
+ErrCode p_prepTxnCursor(BDBState *state, TxnState *txn, TXNState **txnState, DBC **cursor) {
+    int ret;
+    DB *dbp = state->dbp;
+    //if this is not part of a larger transaction, temporarily create one to use
+    if (txn == NULL) {
+        ret = beginTransaction((TxnState**)txnState);
+        if (ret != SUCCESS) {
+            return ret;
+        }
+    } else {
+        txnState = (TXNState**)&txn;
+    }
+    
+    //determine if a cursor exists for this transaction/index combo already
+    TXNState *ts = *txnState;
+    uint32_t id = state->link->id;
+    if (id < ts->numCursors) {
+        *cursor = ts->cursors[id];
+    }
+    if ((ret = p_dropReadAhead(ts, id)) != SUCCESS) {
+        return ret;
+    }
+    
+    //if the txnState variable didn't have a cursor for this index, make one
+    if (*cursor == NULL) {
+        state->keyNotFound = 0;
+        state->positioned = 0;
+        
+        //grow the cursor table so that it has a slot for this index
+        if (id >= ts->numCursors) {
+            uint32_t size = ts->numCursors * 2;
+            while (size <= id) {
+                size *= 2;
+            }
+            DBC **cursors = malloc(size * sizeof(DBC *));
+            if (cursors == NULL) {
+                return FAILURE;
+            }
+            memset(cursors, 0, size * sizeof(DBC *));
+            memcpy(cursors, ts->cursors, ts->numCursors * sizeof(DBC *));
+            if (ts->cursors != ts->inlineCursors) {
+                free(ts->cursors);
+            }
+            ts->cursors = cursors;
+            ts->numCursors = size;
+        }
+        
+        if ((ret = dbp->cursor(dbp, ts->tid, cursor, 0)) != 0) {
+            dbp->err(dbp, ret, "Creating new cursor in get()");
+            return FAILURE;
+        }
+        
+        //record the cursor in the TXNState's slot for this index; it holds a reference to
+        //the index until it is closed, so the id is not handed to another index meanwhile
+        ts->cursors[id] = *cursor;
+        __atomic_add_fetch(&state->link->refs, 1, __ATOMIC_RELAXED);
+        if (id >= ts->cursorSpan) {
+            ts->cursorSpan = id + 1;
+        }
+    }
+    
+    //put the cursor and transaction information into the index state variable
+    state->tid = (*txnState)->tid->id((*txnState)->tid);
+    
+    return SUCCESS;
+}
+
+/*
+ Pages a cursor lets go of after a scan step are put at the cold end of the cache, and
+ after a point lookup where they would normally go, so a scan passes through the cache
+ without evicting the pages that lookups keep coming back to.
+ */
+void p_setCursorPriority(DBC *cursor, int scanning)
+{
+#if DB_VERSION_MAJOR > 4 || DB_VERSION_MINOR >= 6
+    cursor->set_priority(cursor, scanning ? DB_PRIORITY_VERY_LOW : DB_PRIORITY_DEFAULT);
+#endif
+}
+
+    
+#pragma mark snapshot reads and writes
+/*
+ Cursor get, put and delete for either version of the BDB cursor API.
+ */
+int p_cursorGet(DBC *cursor, DBT *key, DBT *data, u_int32_t flags)
+{
+#if DB_VERSION_MINOR>=7
+    return cursor->get(cursor, key, data, flags);
+#else
+    return cursor->c_get(cursor, key, data, flags);
+#endif
+}
+
+int p_cursorPut(DBC *cursor, DBT *key, DBT *data, u_int32_t flags)
+{
+#if DB_VERSION_MINOR>=7
+    return cursor->put(cursor, key, data, flags);
+#else
+    return cursor->c_put(cursor, key, data, flags);
+#endif
+}
+
+int p_cursorDel(DBC *cursor)
+{
+#if DB_VERSION_MINOR>=7
+    return cursor->del(cursor, 0);
+#else
+    return cursor->c_del(cursor, 0);
+#endif
+}
+
+/*
+ Orders byte strings the way BDB's default btree and duplicate comparisons do.
+ */
+int p_compareBytes(const DBT *a, const DBT *b)
+{
+    uint32_t len = a->size < b->size ? a->size : b->size;
+    int c = memcmp(a->data, b->data, len);
+    if (c != 0) {
+        return c;
+    }
+    return a->size < b->size ? -1 : a->size > b->size;
+}
+
+/*
+ Orders records by key, then by payload; a NULL payload compares by key alone.
+ */
+int p_compareRecord(const DBT *key, const DBT *data, const DBT *otherKey, const DBT *otherData)
+{
+    int c = p_compareBytes(key, otherKey);
+    if (c != 0 || data == NULL) {
+        return c;
+    }
+    return p_compareBytes(data, otherData);
+}
+
+/*
+ Points key and data at snapshot entry i, inside the mapping.
+ */
+void p_snapEntry(const Snapshot *snap, uint64_t i, DBT *key, DBT *data)
+{
+    uint16_t keySize, dataSize;
+    const char *bytes = p_entryBytes(snap->map + snap->offsets[i], &keySize, &dataSize);
+    key->data = (void *)bytes;
+    key->size = keySize;
+    data->data = (void *)(bytes + keySize);
+    data->size = dataSize;
+}
+
+/*
+ Binary search for the first snapshot entry at or after (key, data), or strictly after it.
+ */
+uint64_t p_snapshotSeek(const Snapshot *snap, const DBT *key, const DBT *data, int strict)
+{
+    uint64_t lo = 0, hi = snap->count;
+    DBT entryKey, entryData;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        p_snapEntry(snap, mid, &entryKey, &entryData);
+        int c = p_compareRecord(key, data, &entryKey, &entryData);
+        if (c > 0 || (strict && c == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+#pragma mark record counts
+
+/*
+ Builds the counts DB key of record (key, data) in buf, which holds COUNT_KEY_LEN bytes.
+ */
+void p_countKey(char tag, const DBT *key, const DBT *data, char *buf, DBT *out)
+{
+    memset(out, 0, sizeof(DBT));
+    buf[0] = tag;
+    memcpy(buf + 1, key->data, key->size);
+    buf[1 + key->size] = '\0';
+    memcpy(buf + 2 + key->size, data->data, data->size);
+    out->data = buf;
+    out->size = key->size + 2 + data->size;
+}
+
+/*
+ Builds in buf a counts DB key that sorts before every counted record of the tag with the
+ given key, or after them all if after is set; a NULL key bounds all the records of the tag.
+ */
+void p_countBound(char tag, const DBT *key, int after, char *buf, DBT *out)
+{
+    memset(out, 0, sizeof(DBT));
+    buf[0] = tag;
+    out->data = buf;
+    out->size = 1;
+    if (key == NULL) {
+        buf[0] += after;
+        return;
+    }
+    //the NUL after the key sorts before any payload, and anything above it after them all
+    memcpy(buf + 1, key->data, key->size);
+    buf[1 + key->size] = after ? 1 : 0;
+    out->size += key->size + 1;
+}
+
+/*
+ Removes the entries of a counts DB from from up to, but not including, to.
+ @return the BDB error code.
+ */
+int p_uncountRange(DB *counts, DB_TXN *tid, const DBT *from, const DBT *to)
+{
+    char buf[COUNT_KEY_LEN];
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    memcpy(buf, from->data, from->size);
+    key.data = buf;
+    key.size = from->size;
+    key.ulen = sizeof(buf);
+    key.flags = DB_DBT_USERMEM;
+    data.flags = DB_DBT_PARTIAL;
+    
+    DBC *cursor;
+    int ret;
+    if ((ret = counts->cursor(counts, tid, &cursor, 0)) != 0) {
+        return ret;
+    }
+    ret = p_cursorGet(cursor, &key, &data, DB_SET_RANGE);
+    while (ret == 0 && p_compareBytes(&key, to) < 0) {
+#if DB_VERSION_MINOR>=7
+        if ((ret = cursor->del(cursor, 0)) != 0) {
+#else
+        if ((ret = cursor->c_del(cursor, 0)) != 0) {
+#endif
+            break;
+        }
+        ret = p_cursorGet(cursor, &key, &data, DB_NEXT);
+    }
+#if DB_VERSION_MINOR>=7
+    cursor->close(cursor);
+#else
+    cursor->c_close(cursor);
+#endif
+    return ret == DB_NOTFOUND ? 0 : ret;
+}
+
+/*
+ Counts a record just put into the index's own DB, or a tombstone just put into its side
+ DB when tag is TOMBSTONE_TAG, or stops counting one just deleted; a NULL data stops
+ counting every record with the key. Does nothing for an index that keeps no counts.
+ @return the BDB error code.
+ */
+#define COUNT_REMOVE 0
+#define COUNT_ADD 1
+int p_countRecord(DBLink *link, DB_TXN *tid, char tag, const DBT *key, const DBT *data, int add)
+{
+    DB *counts = link->counts;
+    if (counts == NULL) {
+        return 0;
+    }
+    char buf[COUNT_KEY_LEN];
+    DBT counted, empty;
+    memset(&empty, 0, sizeof(DBT));
+    if (data == NULL) {
+        char toBuf[COUNT_KEY_LEN];
+        DBT to;
+        p_countBound(tag, key, 0, buf, &counted);
+        p_countBound(tag, key, 1, toBuf, &to);
+        return p_uncountRange(counts, tid, &counted, &to);
+    }
+    p_countKey(tag, key, data, buf, &counted);
+    if (add) {
+        return counts->put(counts, tid, &counted, &empty, 0);
+    }
+    return counts->del(counts, tid, &counted, 0);
+}
+
+/*
+ Stops counting the records of the tag with keys from lo to hi, both included and either
+ NULL for no bound.
+ @return the BDB error code.
+ */
+int p_uncountKeys(DBLink *link, DB_TXN *tid, char tag, const DBT *lo, const DBT *hi)
+{
+    if (link->counts == NULL) {
+        return 0;
+    }
+    char fromBuf[COUNT_KEY_LEN];
+    char toBuf[COUNT_KEY_LEN];
+    DBT from, to;
+    p_countBound(tag, lo, 0, fromBuf, &from);
+    p_countBound(tag, hi, 1, toBuf, &to);
+    return p_uncountRange(link->counts, tid, &from, &to);
+}
+
+/*
+ Marks a counts DB as holding every record and tombstone of its index.
+ @return the BDB error code.
+ */
+int p_markCounted(DB *counts, DB_TXN *tid)
+{
+    char done = COUNTS_DONE_KEY;
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = &done;
+    key.size = 1;
+    return counts->put(counts, tid, &key, &data, 0);
+}
+
+/*
+ Empties the counts DB of an index that is being emptied within tid.
+ @return the BDB error code.
+ */
+int p_truncateCounts(DBLink *link, DB_TXN *tid)
+{
+    u_int32_t count;
+    int ret;
+    if (link->counts == NULL) {
+        return 0;
+    }
+    if ((ret = link->counts->truncate(link->counts, tid, &count, 0)) != 0) {
+        return ret;
+    }
+    return p_markCounted(link->counts, tid);
+}
+
+/*
+ Counts every record of from under tag. Tombstones are the side DB's records keyed by
+ their tag, so for TOMBSTONE_TAG only those are read, and counted by the key after it.
+ @return the BDB error code.
+ */
+int p_fillCounts(DB *counts, DB_TXN *tid, DB *from, char tag)
+{
+    char keyBuf[MAX_VARCHAR_LEN + 2];
+    char dataBuf[MAX_PAYLOAD_LEN + 1];
+    char buf[COUNT_KEY_LEN];
+    DBT key, data, stored, counted, empty;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    memset(&stored, 0, sizeof(DBT));
+    memset(&empty, 0, sizeof(DBT));
+    key.data = keyBuf;
+    key.ulen = sizeof(keyBuf);
+    key.flags = DB_DBT_USERMEM;
+    data.data = dataBuf;
+    data.ulen = sizeof(dataBuf);
+    data.flags = DB_DBT_USERMEM;
+    
+    DBC *cursor;
+    int ret;
+    if ((ret = from->cursor(from, tid, &cursor, 0)) != 0) {
+        return ret;
+    }
+    uint32_t skip = tag == TOMBSTONE_TAG;
+    if (skip) {
+        keyBuf[0] = tag;
+        key.size = 1;
+        ret = p_cursorGet(cursor, &key, &data, DB_SET_RANGE);
+    } else {
+        ret = p_cursorGet(cursor, &key, &data, DB_FIRST);
+    }
+    while (ret == 0 && (!skip || keyBuf[0] == tag)) {
+        stored.data = keyBuf + skip;
+        stored.size = key.size - skip;
+        p_countKey(tag, &stored, &data, buf, &counted);
+        if ((ret = counts->put(counts, tid, &counted, &empty, 0)) != 0) {
+            break;
+        }
+        ret = p_cursorGet(cursor, &key, &data, DB_NEXT);
+    }
+#if DB_VERSION_MINOR>=7
+    cursor->close(cursor);
+#else
+    cursor->c_close(cursor);
+#endif
+    return ret == DB_NOTFOUND ? 0 : ret;
+}
+
+/*
+ Opens an index's counts DB once its own DB and side DB are open. A counts DB an earlier
+ run did not keep, or did not finish filling, is filled from them in one transaction.
+ Without setRecordCounts, a counts DB left by an earlier run is removed instead, as
+ nothing would keep it up to date. The caller holds DBLINK_LOCK.
+ */
+ErrCode p_openCounts(DBLink *link, DB *dbp)
+{
+    DB *counts;
+    int ret;
+    
+    char *countsName = p_countsName(link->file);
+    if (countsName == NULL) {
+        return FAILURE;
+    }
+    if (!recordCounts) {
+        if ((ret = env->dbremove(env, NULL, countsName, NULL, DB_AUTO_COMMIT)) != 0 && ret != ENOENT) {
+            env->err(env, ret, "DB_ENV->dbremove: %s", countsName);
+        }
+        free(countsName);
+        return SUCCESS;
+    }
+    if ((ret = db_create(&counts, env, 0)) != 0) {
+        fprintf(stderrfile, "could not create DB. err = %d\n", ret);
+        free(countsName);
+        return FAILURE;
+    }
+    counts->set_errfile(counts, stderrfile);
+    counts->set_errpfx(counts, link->name);
+    counts->set_flags(counts, DB_RECNUM);
+    
+    ret = counts->open(counts, NULL, countsName, NULL, DB_BTREE, DB_AUTO_COMMIT | DB_CREATE | DB_THREAD | (multiversion ? MVCC_OPEN_FLAGS : 0), S_IRUSR | S_IWUSR);
+    free(countsName);
+    if (ret != 0) {
+        fprintf(stderrfile, "could not open counts DB of %s. err: %i\n", link->name, ret);
+        counts->close(counts, 0);
+        return FAILURE;
+    }
+    
+    char done = COUNTS_DONE_KEY;
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = &done;
+    key.size = 1;
+    data.flags = DB_DBT_PARTIAL;
+    if ((ret = counts->get(counts, NULL, &key, &data, 0)) == DB_NOTFOUND) {
+        DB_TXN *tid;
+        u_int32_t count;
+        if ((ret = env->txn_begin(env, NULL, &tid, 0)) == 0) {
+            if ((ret = counts->truncate(counts, tid, &count, 0)) != 0 ||
+                (ret = p_fillCounts(counts, tid, dbp, COUNTED_TAG)) != 0 ||
+                (link->side != NULL && (ret = p_fillCounts(counts, tid, link->side, TOMBSTONE_TAG)) != 0) ||
+                (ret = p_markCounted(counts, tid)) != 0) {
+                tid->abort(tid);
+            } else {
+                ret = tid->commit(tid, 0);
+            }
+        }
+    }
+    if (ret != 0) {
+        counts->err(counts, ret, "counting the records of %s", link->name);
+        counts->close(counts, 0);
+        return FAILURE;
+    }
+    
+    link->counts = counts;
+    return SUCCESS;
+}
+
+#pragma mark snapshot tombstones and merged reads
+
+/*
+ Reads, adds or removes the tombstone of snapshot record (key, data) in the side DB.
+ Returns the BDB error code, DB_NOTFOUND if there was no tombstone to read or remove,
+ and DB_KEYEXIST if there already was one to add.
+ */
+#define TOMBSTONE_GET 0
+#define TOMBSTONE_PUT 1
+#define TOMBSTONE_DEL 2
+int p_tombstone(DBLink *link, DB_TXN *tid, const DBT *key, const DBT *data, int op)
+{
+    char tagged[MAX_VARCHAR_LEN + 2];
+    char payload[MAX_PAYLOAD_LEN + 1];
+    DBT tkey, tdata;
+    memset(&tkey, 0, sizeof(DBT));
+    memset(&tdata, 0, sizeof(DBT));
+    tagged[0] = TOMBSTONE_TAG;
+    memcpy(tagged + 1, key->data, key->size);
+    memcpy(payload, data->data, data->size);
+    tkey.data = tagged;
+    tkey.size = key->size + 1;
+    tkey.ulen = sizeof(tagged);
+    tkey.flags = DB_DBT_USERMEM;
+    tdata.data = payload;
+    tdata.size = data->size;
+    tdata.ulen = sizeof(payload);
+    tdata.flags = DB_DBT_USERMEM;
+    
+    DB *side = link->side;
+    int ret;
+    if (op == TOMBSTONE_GET) {
+        return side->get(side, tid, &tkey, &tdata, DB_GET_BOTH);
+    } else if (op == TOMBSTONE_PUT) {
+        if ((ret = side->put(side, tid, &tkey, &tdata, DB_NODUPDATA)) == 0) {
+            __atomic_add_fetch(&tombstoneGen, 1, __ATOMIC_RELEASE);
+            ret = p_countRecord(link, tid, TOMBSTONE_TAG, key, data, COUNT_ADD);
+        }
+        return ret;
+    }
+    
+    DBC *cursor;
+    if ((ret = side->cursor(side, tid, &cursor, 0)) != 0) {
+        return ret;
+    }
+    if ((ret = p_cursorGet(cursor, &tkey, &tdata, DB_GET_BOTH)) == 0) {
+#if DB_VERSION_MINOR>=7
+        ret = cursor->del(cursor, 0);
+#else
+        ret = cursor->c_del(cursor, 0);
+#endif
+    }
+#if DB_VERSION_MINOR>=7
+    cursor->close(cursor);
+#else
+    cursor->c_close(cursor);
+#endif
+    if (ret == 0) {
+        __atomic_add_fetch(&tombstoneGen, 1, __ATOMIC_RELEASE);
+        ret = p_countRecord(link, tid, TOMBSTONE_TAG, key, data, COUNT_REMOVE);
+    }
+    return ret;
+}
+
+/*
+ Reads the range tombstone at the side DB cursor, moved there with flags, into start and
+ end. When seeking with DB_SET_RANGE, it finds the first range that ends after entry i.
+ @return the BDB error code, DB_NOTFOUND if there is no such range.
+ */
+int p_rangeGet(DBC *cursor, u_int32_t flags, uint64_t i, uint64_t *start, uint64_t *end)
+{
+    char keyBuf[MAX_VARCHAR_LEN + 2];
+    char dataBuf[MAX_PAYLOAD_LEN + 1];
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = keyBuf;
+    key.ulen = sizeof(keyBuf);
+    key.flags = DB_DBT_USERMEM;
+    data.data = dataBuf;
+    data.ulen = sizeof(dataBuf);
+    data.flags = DB_DBT_USERMEM;
+    if (flags == DB_SET_RANGE) {
+        uint64_t after = P_BIG64(i + 1);
+        keyBuf[0] = RANGE_TOMBSTONE_TAG;
+        memcpy(keyBuf + 1, &after, 8);
+        key.size = 9;
+    }
+    
+    int ret = p_cursorGet(cursor, &key, &data, flags);
+    if (ret != 0) {
+        return ret;
+    } else if (keyBuf[0] != RANGE_TOMBSTONE_TAG) {
+        return DB_NOTFOUND;
+    }
+    memcpy(end, keyBuf + 1, 8);
+    memcpy(start, dataBuf, 8);
+    *end = P_BIG64(*end);
+    *start = P_BIG64(*start);
+    return 0;
+}
+
+/*
+ Adds the range tombstone for entries start to end, not including end.
+ @return the BDB error code.
+ */
+int p_rangePut(DB *side, DB_TXN *tid, uint64_t start, uint64_t end)
+{
+    char keyBuf[9];
+    uint64_t first = P_BIG64(start);
+    uint64_t after = P_BIG64(end);
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    keyBuf[0] = RANGE_TOMBSTONE_TAG;
+    memcpy(keyBuf + 1, &after, 8);
+    key.data = keyBuf;
+    key.size = sizeof(keyBuf);
+    data.data = &first;
+    data.size = sizeof(first);
+    return side->put(side, tid, &key, &data, 0);
+}
+
+/*
+ Takes entry i out of the range tombstone for entries start to end, leaving the entries
+ on either side of it deleted.
+ @return the BDB error code.
+ */
+int p_rangeSplit(DB *side, DB_TXN *tid, uint64_t start, uint64_t end, uint64_t i)
+{
+    char keyBuf[9];
+    uint64_t after = P_BIG64(end);
+    DBT key;
+    memset(&key, 0, sizeof(DBT));
+    keyBuf[0] = RANGE_TOMBSTONE_TAG;
+    memcpy(keyBuf + 1, &after, 8);
+    key.data = keyBuf;
+    key.size = sizeof(keyBuf);
+    
+    int ret = side->del(side, tid, &key, 0);
+    if (ret == 0 && start < i) {
+        ret = p_rangePut(side, tid, start, i);
+    }
+    if (ret == 0 && i + 1 < end) {
+        ret = p_rangePut(side, tid, i + 1, end);
+    }
+    if (ret == 0) {
+        __atomic_add_fetch(&tombstoneGen, 1, __ATOMIC_RELEASE);
+    }
+    return ret;
+}
+
+/*
+ Finds whether snapshot entry i lies in a range tombstone, and if so sets start and end to
+ that range.
+ @return the BDB error code, DB_NOTFOUND if no range holds the entry.
+ */
+int p_rangeTombstone(DBLink *link, DB_TXN *tid, uint64_t i, uint64_t *start, uint64_t *end)
+{
+    DB *side = link->side;
+    DBC *cursor;
+    int ret;
+    if ((ret = side->cursor(side, tid, &cursor, 0)) != 0) {
+        return ret;
+    }
+    ret = p_rangeGet(cursor, DB_SET_RANGE, i, start, end);
+    if (ret == 0 && *start > i) {
+        ret = DB_NOTFOUND;
+    }
+#if DB_VERSION_MINOR>=7
+    cursor->close(cursor);
+#else
+    cursor->c_close(cursor);
+#endif
+    return ret;
+}
+
+/*
+ Finds whether snapshot entry i, with the given key and data, is deleted, either by its
+ own tombstone or by a range tombstone, and sets start and end to the deleted entries
+ around it that can be skipped at once.
+ @return the BDB error code, DB_NOTFOUND if the entry is live.
+ */
+int p_entryDeleted(DBLink *link, DB_TXN *tid, uint64_t i, const DBT *key, const DBT *data, uint64_t *start, uint64_t *end)
+{
+    int ret = p_tombstone(link, tid, key, data, TOMBSTONE_GET);
+    if (ret == 0) {
+        *start = i;
+        *end = i + 1;
+        return 0;
+    } else if (ret != DB_NOTFOUND) {
+        return ret;
+    }
+    return p_rangeTombstone(link, tid, i, start, end);
+}
+
+/*
+ Sets count to the number of snapshot entries from first up to but not including last
+ that range tombstones delete. Entries with tombstones of their own are counted apart.
+ @return the BDB error code.
+ */
+int p_countRangeTombstones(DBLink *link, DB_TXN *tid, uint64_t first, uint64_t last, uint64_t *count)
+{
+    *count = 0;
+    if (first >= last) {
+        return 0;
+    }
+    DB *side = link->side;
+    DBC *cursor;
+    int ret;
+    if ((ret = side->cursor(side, tid, &cursor, 0)) != 0) {
+        return ret;
+    }
+    uint64_t start, end;
+    ret = p_rangeGet(cursor, DB_SET_RANGE, first, &start, &end);
+    while (ret == 0 && start < last) {
+        uint64_t from = start > first ? start : first;
+        uint64_t to = end < last ? end : last;
+        *count += to - from;
+        ret = p_rangeGet(cursor, DB_NEXT, 0, &start, &end);
+    }
+#if DB_VERSION_MINOR>=7
+    cursor->close(cursor);
+#else
+    cursor->c_close(cursor);
+#endif
+    return ret == DB_NOTFOUND ? 0 : ret;
+}
+
+/*
+ Moves the cursor to the first record of its DB at or after (key, data), or strictly after
+ it; a NULL key finds the first record and a NULL data compares by key alone. The record
+ is copied into outKey and outData, which must be DB_DBT_USERMEM buffers large enough for
+ any key and payload.
+ */
+int p_dbSeek(DBC *cursor, const DBT *key, const DBT *data, int strict, DBT *outKey, DBT *outData)
+{
+    int ret;
+    if (key == NULL) {
+        ret = p_cursorGet(cursor, outKey, outData, DB_FIRST);
+    } else {
+        memcpy(outKey->data, key->data, key->size);
+        outKey->size = key->size;
+        if (data != NULL) {
+            memcpy(outData->data, data->data, data->size);
+            outData->size = data->size;
+            ret = p_cursorGet(cursor, outKey, outData, DB_GET_BOTH_RANGE);
+            if (ret == 0 && strict && p_compareBytes(outData, data) == 0) {
+                ret = p_cursorGet(cursor, outKey, outData, DB_NEXT);
+            }
+        }
+        //no duplicate of the key sorts after the payload, so move on to the keys after it
+        if (data == NULL || ret == DB_NOTFOUND) {
+            memcpy(outKey->data, key->data, key->size);
+            outKey->size = key->size;
+            ret = p_cursorGet(cursor, outKey, outData, DB_SET_RANGE);
+            if (ret == 0 && (strict || data != NULL) && p_compareBytes(outKey, key) == 0) {
+                ret = p_cursorGet(cursor, outKey, outData, DB_NEXT_NODUP);
+            }
+        }
+    }
+    return ret;
+}
+
+/*
+ Reads the entry tombstones from snapshot entry i on with one side DB cursor, merging them
+ with the entries, and moves i to the first entry without one and end to the next entry
+ with one, or the end of the snapshot.
+ @return the BDB error code.
+ */
+int p_entryTombstoneRun(DBLink *link, DB_TXN *tid, const Snapshot *snap, uint64_t *i, uint64_t *end)
+{
+    char tagged[MAX_VARCHAR_LEN + 2];
+    char foundTagged[MAX_VARCHAR_LEN + 2];
+    char foundPayload[MAX_PAYLOAD_LEN + 1];
+    DBT key, data, tkey, foundKey, foundData;
+    memset(&tkey, 0, sizeof(DBT));
+    memset(&foundKey, 0, sizeof(DBT));
+    memset(&foundData, 0, sizeof(DBT));
+    foundKey.data = foundTagged;
+    foundKey.ulen = sizeof(foundTagged);
+    foundKey.flags = DB_DBT_USERMEM;
+    foundData.data = foundPayload;
+    foundData.ulen = sizeof(foundPayload);
+    foundData.flags = DB_DBT_USERMEM;
+    
+    DB *side = link->side;
+    DBC *cursor;
+    int ret;
+    if ((ret = side->cursor(side, tid, &cursor, 0)) != 0) {
+        return ret;
+    }
+    p_snapEntry(snap, *i, &key, &data);
+    tagged[0] = TOMBSTONE_TAG;
+    memcpy(tagged + 1, key.data, key.size);
+    tkey.data = tagged;
+    tkey.size = key.size + 1;
+    ret = p_dbSeek(cursor, &tkey, &data, 0, &foundKey, &foundData);
+    
+    //every tombstone marks a snapshot entry, so each one either deletes entry i or ends its run
+    *end = snap->count;
+    while (ret == 0 && foundTagged[0] == TOMBSTONE_TAG) {
+        DBT deleted;
+        memset(&deleted, 0, sizeof(DBT));
+        deleted.data = foundTagged + 1;
+        deleted.size = foundKey.size - 1;
+        *end = p_snapshotSeek(snap, &deleted, &foundData, 0);
+        if (*end > *i) {
+            break;
+        }
+        *end = snap->count;
+        if (++*i == snap->count) {
+            break;
+        }
+        ret = p_cursorGet(cursor, &foundKey, &foundData, DB_NEXT);
+    }
+#if DB_VERSION_MINOR>=7
+    cursor->close(cursor);
+#else
+    cursor->c_close(cursor);
+#endif
+    return ret == DB_NOTFOUND ? 0 : ret;
+}
+
+/*
+ Reads the tombstones from snapshot entry i on and sets run to the first range of live
+ entries found. A range tombstone is passed over at once, so a run costs a lookup for each
+ range it passes rather than for each entry in it.
+ @return the BDB error code, DB_NOTFOUND if every entry from i on is deleted.
+ */
+int p_readTombstoneRun(DBLink *link, DB_TXN *tid, const Snapshot *snap, uint64_t i, TombstoneRun *run)
+{
+    uint64_t gen = __atomic_load_n(&tombstoneGen, __ATOMIC_ACQUIRE);
+    uint64_t end, rangeStart, rangeEnd;
+    int ret;
+    while (i < snap->count) {
+        if ((ret = p_rangeTombstone(link, tid, i, &rangeStart, &rangeEnd)) == 0) {
+            i = rangeEnd;
+            continue;
+        } else if (ret != DB_NOTFOUND) {
+            return ret;
+        }
+        if ((ret = p_entryTombstoneRun(link, tid, snap, &i, &end)) != 0) {
+            return ret;
+        }
+        //no entry tombstone lies in a range, so the entries found live run up to the next range
+        DB *side = link->side;
+        DBC *cursor;
+        if (i < snap->count && (ret = side->cursor(side, tid, &cursor, 0)) == 0) {
+            ret = p_rangeGet(cursor, DB_SET_RANGE, i, &rangeStart, &rangeEnd);
+#if DB_VERSION_MINOR>=7
+            cursor->close(cursor);
+#else
+            cursor->c_close(cursor);
+#endif
+        }
+        if (ret == DB_NOTFOUND || i == snap->count) {
+            rangeStart = snap->count;
+        } else if (ret != 0) {
+            return ret;
+        }
+        if (i < rangeStart) {
+            run->snapshot = snap;
+            run->tid = tid;
+            run->gen = gen;
+            run->live = i;
+            run->tombstoned = end < rangeStart ? end : rangeStart;
+            return 0;
+        }
+    }
+    return DB_NOTFOUND;
+}
+
+/*
+ Advances *i past deleted snapshot entries and points key and data at the first live one.
+ A run remembers which entries were live, so reading on through it only goes back to the
+ side DB at the next tombstone; a NULL run looks every entry up on its own.
+ Returns DB_NOTFOUND at the end of the snapshot.
+ */
+int p_liveEntry(DBLink *link, const Snapshot *snap, DB_TXN *tid, uint64_t *i, DBT *key, DBT *data, TombstoneRun *run)
+{
+    int ret;
+    if (*i >= snap->count) {
+        return DB_NOTFOUND;
+    }
+    if (run != NULL) {
+        if (run->snapshot != snap || run->tid != tid || run->gen != __atomic_load_n(&tombstoneGen, __ATOMIC_ACQUIRE) ||
+            *i < run->live || *i >= run->tombstoned) {
+            if ((ret = p_readTombstoneRun(link, tid, snap, *i, run)) != 0) {
+                return ret;
+            }
+            *i = run->live;
+        }
+        p_snapEntry(snap, *i, key, data);
+        return 0;
+    }
+    uint64_t start, end;
+    while (*i < snap->count) {
+        p_snapEntry(snap, *i, key, data);
+        if ((ret = p_entryDeleted(link, tid, *i, key, data, &start, &end)) == DB_NOTFOUND) {
+            return 0;
+        } else if (ret != 0) {
+            return ret;
+        }
+        *i = end;
+    }
+    return DB_NOTFOUND;
+}
+
+/*
+ Finds the first record of an index loaded from a snapshot at or after (key, data), or
+ strictly after it, among both the live snapshot entries and the records in the index's
+ own DB; a NULL key finds the first record. The record is copied into outKey and outData
+ as p_dbSeek does.
+ */
+int p_mergedSeek(DBLink *link, const Snapshot *snap, DB_TXN *tid, DBC *cursor, const DBT *key, const DBT *data, int strict,
+                 DBT *outKey, DBT *outData, TombstoneRun *run)
+{
+    //the first record in the index's own DB past the target
+    int ret = p_dbSeek(cursor, key, data, strict, outKey, outData);
+    if (ret != 0 && ret != DB_NOTFOUND) {
+        return ret;
+    }
+    
+    //the first live snapshot entry past the target
+    uint64_t i = key == NULL ? 0 : p_snapshotSeek(snap, key, data, strict);
+    DBT entryKey, entryData;
+    int entryRet = p_liveEntry(link, snap, tid, &i, &entryKey, &entryData, run);
+    if (entryRet == DB_NOTFOUND) {
+        return ret;
+    } else if (entryRet != 0) {
+        return entryRet;
+    }
+    
+    if (ret == 0 && p_compareRecord(outKey, outData, &entryKey, &entryData) < 0) {
+        return 0;
+    }
+    memcpy(outKey->data, entryKey.data, entryKey.size);
+    outKey->size = entryKey.size;
+    memcpy(outData->data, entryData.data, entryData.size);
+    outData->size = entryData.size;
+    return 0;
+}
+
+/*
+ Moves the cursor to the last record of its DB before (key, data), or at or before it if
+ inclusive; a NULL key finds the last record. The record is copied as by p_dbSeek.
+ */
+int p_dbSeekBack(DBC *cursor, const DBT *key, const DBT *data, int inclusive, DBT *outKey, DBT *outData)
+{
+    if (key != NULL) {
+        //step back from the first record past the target
+        int ret = p_dbSeek(cursor, key, data, inclusive, outKey, outData);
+        if (ret == 0) {
+            return p_cursorGet(cursor, outKey, outData, DB_PREV);
+        } else if (ret != DB_NOTFOUND) {
+            return ret;
+        }
+    }
+    return p_cursorGet(cursor, outKey, outData, DB_LAST);
+}
+
+/*
+ Moves *i back to the last live snapshot entry before it and points key and data at it.
+ Returns DB_NOTFOUND at the start of the snapshot.
+ */
+int p_liveEntryBefore(DBLink *link, const Snapshot *snap, DB_TXN *tid, uint64_t *i, DBT *key, DBT *data)
+{
+    int ret;
+    uint64_t start, end;
+    while (*i > 0) {
+        (*i)--;
+        p_snapEntry(snap, *i, key, data);
+        if ((ret = p_entryDeleted(link, tid, *i, key, data, &start, &end)) == DB_NOTFOUND) {
+            return 0;
+        } else if (ret != 0) {
+            return ret;
+        }
+        *i = start;
+    }
+    return DB_NOTFOUND;
+}
+
+/*
+ The mirror image of p_mergedSeek: finds the last record of an index loaded from a
+ snapshot before (key, data), or at or before it if inclusive; a NULL key finds the last.
+ */
+int p_mergedSeekBack(DBLink *link, const Snapshot *snap, DB_TXN *tid, DBC *cursor, const DBT *key, const DBT *data, int inclusive,
+                     DBT *outKey, DBT *outData)
+{
+    int ret = p_dbSeekBack(cursor, key, data, inclusive, outKey, outData);
+    if (ret != 0 && ret != DB_NOTFOUND) {
+        return ret;
+    }
+    
+    uint64_t i = key == NULL ? snap->count : p_snapshotSeek(snap, key, data, inclusive);
+    DBT entryKey, entryData;
+    int entryRet = p_liveEntryBefore(link, snap, tid, &i, &entryKey, &entryData);
+    if (entryRet == DB_NOTFOUND) {
+        return ret;
+    } else if (entryRet != 0) {
+        return entryRet;
+    }
+    
+    if (ret == 0 && p_compareRecord(outKey, outData, &entryKey, &entryData) > 0) {
+        return 0;
+    }
+    memcpy(outKey->data, entryKey.data, entryKey.size);
+    outKey->size = entryKey.size;
+    memcpy(outData->data, entryData.data, entryData.size);
+    outData->size = entryData.size;
+    return 0;
+}
+
+/*
+ Finds the next record of an index loaded from a snapshot for get or getNext, and makes
+ it the handle's position. A NULL key continues from the handle's position.
+ */
+ErrCode p_snapshotNext(BDBState *state, const Snapshot *snap, DB_TXN *tid, DBC *cursor, DBT *key, Record *record)
+{
+    char keyBuf[MAX_VARCHAR_LEN + 1];
+    char dataBuf[MAX_PAYLOAD_LEN + 1];
+    DBT outKey, outData;
+    memset(&outKey, 0, sizeof(DBT));
+    memset(&outData, 0, sizeof(DBT));
+    outKey.data = keyBuf;
+    outKey.ulen = sizeof(keyBuf);
+    outKey.flags = DB_DBT_USERMEM;
+    outData.data = dataBuf;
+    outData.ulen = sizeof(dataBuf);
+    outData.flags = DB_DBT_USERMEM;
+    
+    int ret;
+    if (key != NULL) {
+        ret = p_mergedSeek(state->link, snap, tid, cursor, key, NULL, 0, &outKey, &outData, &state->tombstones);
+    } else if (state->positioned) {
+        DBT posKey, posData;
+        memset(&posKey, 0, sizeof(DBT));
+        memset(&posData, 0, sizeof(DBT));
+        posKey.data = state->posKey;
+        posKey.size = state->posKeySize;
+        posData.data = state->posData;
+        posData.size = state->posDataSize;
+        ret = p_mergedSeek(state->link, snap, tid, cursor, &posKey, &posData, 1, &outKey, &outData, &state->tombstones);
+    } else {
+        ret = p_mergedSeek(state->link, snap, tid, cursor, NULL, NULL, 0, &outKey, &outData, &state->tombstones);
+    }
+    
+    if (ret == DB_NOTFOUND) {
+        return DB_END;
+    } else if (ret == DB_LOCK_DEADLOCK) {
+        return DEADLOCK;
+    } else if (ret != 0) {
+        state->dbp->err(state->dbp, ret, "reading snapshot index");
+        return FAILURE;
+    }
+    
+    memcpy(state->posKey, keyBuf, outKey.size);
+    state->posKeySize = outKey.size;
+    memcpy(state->posData, dataBuf, outData.size);
+    state->posDataSize = outData.size;
+    state->positioned = 1;
+    
+    p_setKeyFromKeyData(&outKey, state->type, &record->key);
+    memcpy(record->payload, dataBuf, outData.size < MAX_PAYLOAD_LEN ? outData.size : MAX_PAYLOAD_LEN);
+    return SUCCESS;
+}
+
+/*
+ Inserts into an index loaded from a snapshot. A record already in the snapshot can only
+ be inserted again after it was deleted, which just removes its tombstone, or splits the
+ range tombstone it lies in around it.
+ */
+ErrCode p_snapshotInsert(BDBState *state, const Snapshot *snap, TxnState *txn, DBT *key, DBT *data)
+{
+    TXNState *txnState = (TXNState*)txn;
+    DBLink *link = state->link;
+    int ret;
+    
+    if (txn == NULL && (ret = beginTransaction((TxnState**)&txnState)) != SUCCESS) {
+        return ret;
+    }
+    
+    uint64_t i = p_snapshotSeek(snap, key, data, 0);
+    DBT entryKey, entryData;
+    if (i < snap->count) {
+        p_snapEntry(snap, i, &entryKey, &entryData);
+    }
+    if (i < snap->count && p_compareRecord(key, data, &entryKey, &entryData) == 0) {
+        ret = p_tombstone(link, txnState->tid, key, data, TOMBSTONE_DEL);
+        uint64_t start, end;
+        if (ret == DB_NOTFOUND && (ret = p_rangeTombstone(link, txnState->tid, i, &start, &end)) == 0) {
+            ret = p_rangeSplit(link->side, txnState->tid, start, end, i);
+        }
+        if (ret == DB_NOTFOUND) {
+            ret = DB_KEYEXIST;
+        }
+    } else if ((ret = state->dbp->put(state->dbp, txnState->tid, key, data, 0)) == 0) {
+        ret = p_countRecord(link, txnState->tid, COUNTED_TAG, key, data, COUNT_ADD);
+    }
+    
+    if (ret == 0) {
+        ret = SUCCESS;
+    } else if (ret == DB_KEYEXIST) {
+        ret = ENTRY_EXISTS;
+    } else if (ret == DB_LOCK_DEADLOCK) {
+        ret = DEADLOCK;
+    } else {
+        state->dbp->err(state->dbp, ret, "inserting into snapshot index");
+        ret = FAILURE;
+    }
+    
+    if (txn == NULL) {
+        if (ret == SUCCESS) {
+            ret = commitTransaction((TxnState*)txnState);
+        } else {
+            abortTransaction((TxnState*)txnState);
+        }
+    }
+    return ret;
+}
+
+/*
+ Deletes from an index loaded from a snapshot. Records in the index's own DB are deleted
+ from it; snapshot entries are marked with tombstones. A NULL data deletes every record
+ with the key.
+ */
+ErrCode p_snapshotDelete(BDBState *state, const Snapshot *snap, TxnState *txn, DBT *key, DBT *data)
+{
+    TXNState *txnState = (TXNState*)txn;
+    DBLink *link = state->link;
+    DB *dbp = state->dbp;
+    int ret;
+    int deleted = 0;
+    
+    if (txn == NULL && (ret = beginTransaction((TxnState**)&txnState)) != SUCCESS) {
+        return ret;
+    }
+    DB_TXN *tid = txnState->tid;
+    
+    if (data == NULL) {
+        ret = dbp->del(dbp, tid, key, 0);
+    } else {
+        char keyBuf[MAX_VARCHAR_LEN + 1];
+        char dataBuf[MAX_PAYLOAD_LEN + 1];
+        DBT k, d;
+        memset(&k, 0, sizeof(DBT));
+        memset(&d, 0, sizeof(DBT));
+        memcpy(keyBuf, key->data, key->size);
+        memcpy(dataBuf, data->data, data->size);
+        k.data = keyBuf;
+        k.size = key->size;
+        k.ulen = sizeof(keyBuf);
+        k.flags = DB_DBT_USERMEM;
+        d.data = dataBuf;
+        d.size = data->size;
+        d.ulen = sizeof(dataBuf);
+        d.flags = DB_DBT_USERMEM;
+        
+        DBC *cursor;
+        if ((ret = dbp->cursor(dbp, tid, &cursor, 0)) == 0) {
+            if ((ret = p_cursorGet(cursor, &k, &d, DB_GET_BOTH)) == 0) {
+#if DB_VERSION_MINOR>=7
+                ret = cursor->del(cursor, 0);
+#else
+                ret = cursor->c_del(cursor, 0);
+#endif
+            }
+#if DB_VERSION_MINOR>=7
+            cursor->close(cursor);
+#else
+            cursor->c_close(cursor);
+#endif
+        }
+    }
+    if (ret == 0) {
+        ret = p_countRecord(link, tid, COUNTED_TAG, key, data, COUNT_REMOVE);
+    }
+    if (ret == 0) {
+        deleted = 1;
+    } else if (ret != DB_NOTFOUND) {
+        goto finish;
+    }
+    
+    //tombstone the matching snapshot entries that are still live, leaving those a range
+    //tombstone already deletes
+    if (!deleted || data == NULL) {
+        uint64_t i = p_snapshotSeek(snap, key, data, 0);
+        uint64_t start, end;
+        DBT entryKey, entryData;
+        ret = 0;
+        for (; i < snap->count; i++) {
+            p_snapEntry(snap, i, &entryKey, &entryData);
+            if (p_compareRecord(key, data, &entryKey, &entryData) != 0) {
+                break;
+            }
+            if ((ret = p_rangeTombstone(link, tid, i, &start, &end)) == 0) {
+                continue;
+            } else if (ret != DB_NOTFOUND) {
+                goto finish;
+            }
+            if ((ret = p_tombstone(link, tid, &entryKey, &entryData, TOMBSTONE_PUT)) == 0) {
+                deleted = 1;
+            } else if (ret != DB_KEYEXIST) {
+                goto finish;
+            }
+            ret = 0;
+        }
+    }
+    
+finish:
+    if (ret == DB_LOCK_DEADLOCK) {
+        ret = DEADLOCK;
+    } else if (ret != 0 && ret != DB_NOTFOUND) {
+        dbp->err(dbp, ret, "deleting from snapshot index");
+        ret = FAILURE;
+    } else if (!deleted) {
+        ret = data == NULL ? KEY_NOTFOUND : ENTRY_DNE;
+    } else {
+        ret = SUCCESS;
+    }
+    
+    if (txn == NULL) {
+        if (ret == SUCCESS) {
+            ret = commitTransaction((TxnState*)txnState);
+        } else {
+            abortTransaction((TxnState*)txnState);
+        }
+    }
+    return ret;
+}
+
+#pragma mark get
+ErrCode get(IdxState *ident, TxnState *txn, Record *record)
+{
+    BDBState *state = p_handleState(ident);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    
+    //save the key into the state so that getNext will behave properly if key is not found
+    memcpy(&(state->lastKey), &(record->key), sizeof(Key));
+    //make it clear when get() was unable to find a valid key
+    state->keyNotFound = 0;
+
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    //the payload is read straight into the record
+    data.data = record->payload;
+    data.ulen = MAX_PAYLOAD_LEN+1;
+    data.flags = DB_DBT_USERMEM;
+    
+    record->key.type = state->type;
+    if (p_setKeyDataFromKey(&record->key, &key) < 0) {
+        dbp->errx(dbp,"bad insert key type");
+        memset(record->payload, 0, MAX_PAYLOAD_LEN);
+        return KEY_NOTFOUND;
+    }
+    
+    TXNState *txnState;
+    DBC *cursor = NULL;
+    ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
+    if (ret != SUCCESS) {
+        goto finish;
+    }
+    p_setCursorPriority(cursor, 0);
+    
+    //an index loaded from a snapshot finds the first record at or after the key in both
+    //the snapshot and its own DB
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        DB_TXN *tid = txn == NULL ? txnState->tid : ((TXNState*)txn)->tid;
+        //the record is overwritten by whatever is found, so search with a copy of its key
+        Key k = record->key;
+        p_setKeyDataFromKey(&k, &key);
+        ret = p_snapshotNext(state, snap, tid, cursor, &key, record);
+        if (ret == SUCCESS && state->posKeySize == key.size && memcmp(state->posKey, key.data, key.size) == 0) {
+            goto finish;
+        }
+        record->key = k;
+        memset(record->payload, 0, MAX_PAYLOAD_LEN);
+        state->positioned = 0;
+        if (ret == SUCCESS || ret == DB_END) {
+            state->keyNotFound = 1;
+            ret = KEY_NOTFOUND;
+        }
+        goto finish;
+    }
+    
+#if DB_VERSION_MINOR>=7
+    if ((ret = cursor->get(cursor, &key, &data, DB_SET)) != 0) {
+#else
+    if ((ret = cursor->c_get(cursor, &key, &data, DB_SET)) != 0) {
+#endif
+        memset(record->payload, 0, MAX_PAYLOAD_LEN);
+        if (ret == DB_LOCK_DEADLOCK) {
+            ret = DEADLOCK;
+            goto finish;
+        }
+        state->keyNotFound = 1;
+        ret = KEY_NOTFOUND;
+        goto finish;
+    }
+        
+    ret = SUCCESS;
+    
+    //whether return value is success or failure, if we opened a transaction for this function call
+    //we need to close it before we return
+finish:
+    //if we opened a transaction for this call, close it
+    if (txn == NULL) {
+        if (ret == SUCCESS) {
+            if (txnState == NULL) {
+            }
+            ret = commitTransaction((TxnState*)txnState);
+        } else {
+            abortTransaction((TxnState*)txnState);
+        }
+    }
+    //return the ErrCode
+    return ret;
+}
+    
+#pragma mark getBatch
+
+//lookups getBatch sorts without allocating
+#define BATCH_INLINE_KEYS 64
+
+typedef struct
+    {
+        DBT         key;        //the record's key as stored in the index
+        const char  *payload;   //NULL when only keys are compared
+        int         index;      //position of the record in the caller's array
+    } BatchKey;
+
+int p_compareBatchKey(const void *a, const void *b)
+{
+    const BatchKey *x = a, *y = b;
+    int cmp = p_compareBytes(&x->key, &y->key);
+    if (cmp == 0 && x->payload != NULL) {
+        cmp = strcmp(x->payload, y->payload);
+    }
+    if (cmp != 0) {
+        return cmp;
+    }
+    return x->index - y->index;
+}
+
+/*
+ Fills in keys from the records and sorts them into index order, by key and, if
+ withPayload is set, payload; records that compare equal keep the caller's order.
+ @return FAILURE if a key cannot be encoded.
+ */
+ErrCode p_sortBatch(BDBState *state, Record *records, int n, int withPayload, BatchKey *keys)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        memset(&keys[i].key, 0, sizeof(DBT));
+        keys[i].payload = withPayload ? records[i].payload : NULL;
+        keys[i].index = i;
+    }
+    if (p_setKeyDataFromRecords(records, n, state->type, &keys[0].key, sizeof(BatchKey)) < 0) {
+        return FAILURE;
+    }
+    qsort(keys, n, sizeof(BatchKey), p_compareBatchKey);
+    return SUCCESS;
+}
+
+ErrCode getBatch(IdxState *idxState, TxnState *txn, Record *records, int n, ErrCode *results)
+{
+    BDBState *state = p_handleState(idxState);
+    DB *dbp = state->dbp;
+    ErrCode ret;
+    int i;
+    
+    if (n < 0) {
+        return FAILURE;
+    }
+    if (p_checkHandle(state) != SUCCESS) {
+        for (i = 0; i < n; i++) {
+            results[i] = DB_DNE;
+        }
+        return DB_DNE;
+    }
+    
+    BatchKey inlineKeys[BATCH_INLINE_KEYS];
+    BatchKey *keys = inlineKeys;
+    if (n > BATCH_INLINE_KEYS && (keys = malloc(n * sizeof(BatchKey))) == NULL) {
+        for (i = 0; i < n; i++) {
+            results[i] = FAILURE;
+        }
+        return FAILURE;
+    }
+    
+    //look the keys up in index order, so each descent goes through the pages the last one
+    //left in the CPU cache, and each distinct key only once
+    i = 0;
+    if ((ret = p_sortBatch(state, records, n, 0, keys)) != SUCCESS) {
+        goto finish;
+    }
+    
+    //the whole batch shares one transaction and one cursor
+    TxnState *batchTxn = txn;
+    if (txn == NULL && (ret = beginTransaction(&batchTxn)) != SUCCESS) {
+        goto finish;
+    }
+    TXNState *txnState = (TXNState*)batchTxn;
+    DBC *cursor = NULL;
+    if ((ret = p_prepTxnCursor(state, batchTxn, &txnState, &cursor)) != SUCCESS) {
+        goto finishTxn;
+    }
+    p_setCursorPriority(cursor, 0);
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    
+    DBT data;
+    memset(&data, 0, sizeof(DBT));
+    data.ulen = MAX_PAYLOAD_LEN+1;
+    data.flags = DB_DBT_USERMEM;
+    for (; i < n; i++) {
+        Record *record = &records[keys[i].index];
+        ErrCode *result = &results[keys[i].index];
+        if (i > 0 && p_compareBytes(&keys[i].key, &keys[i - 1].key) == 0) {
+            Record *first = &records[keys[i - 1].index];
+            memcpy(record->payload, first->payload, sizeof(record->payload));
+            *result = results[keys[i - 1].index];
+            continue;
+        }
+        
+        record->key.type = state->type;
+        if (snap != NULL) {
+            //as in get, the first record at or after the key is found in the snapshot and the DB;
+            //the record is overwritten by whatever is found, so search with a copy of its key
+            Key k = record->key;
+            char keyBuf[MAX_VARCHAR_LEN + 1];
+            DBT key = keys[i].key;
+            memcpy(keyBuf, key.data, key.size);
+            key.data = keyBuf;
+            *result = p_snapshotNext(state, snap, txnState->tid, cursor, &key, record);
+            if (*result == SUCCESS && state->posKeySize == key.size && memcmp(state->posKey, key.data, key.size) == 0) {
+                continue;
+            }
+            record->key = k;
+            memset(record->payload, 0, MAX_PAYLOAD_LEN);
+            state->positioned = 0;
+            if (*result == SUCCESS || *result == DB_END) {
+                *result = KEY_NOTFOUND;
+            }
+        } else {
+            //the payload is read straight into the record
+            data.data = record->payload;
+            int err = p_cursorGet(cursor, &keys[i].key, &data, DB_SET);
+            if (err == 0) {
+                *result = SUCCESS;
+            } else {
+                memset(record->payload, 0, MAX_PAYLOAD_LEN);
+                if (err == DB_LOCK_DEADLOCK) {
+                    *result = DEADLOCK;
+                } else if (err == DB_NOTFOUND) {
+                    *result = KEY_NOTFOUND;
+                } else {
+                    dbp->err(dbp, err, "DBcursor->get in getBatch");
+                    *result = FAILURE;
+                }
+            }
+        }
+        if (*result != SUCCESS && *result != KEY_NOTFOUND) {
+            ret = *result;
+            i++;
+            break;
+        }
+    }
+    
+    //a following getNext carries on from the last key looked up, as it would after get
+    if (i > 0) {
+        Record *last = &records[keys[i - 1].index];
+        memcpy(&state->lastKey, &last->key, sizeof(Key));
+        state->keyNotFound = results[keys[i - 1].index] != SUCCESS;
+    }
+    
+finishTxn:
+    if (txn == NULL) {
+        if (ret == SUCCESS) {
+            ret = commitTransaction(batchTxn);
+        } else {
+            abortTransaction(batchTxn);
+        }
+    }
+    
+finish:
+    //keys the batch did not get to share its ErrCode
+    for (; i < n; i++) {
+        results[keys[i].index] = ret;
+    }
+    if (keys != inlineKeys) {
+        free(keys);
+    }
+    return ret;
+}
+
+#pragma mark getNext
+
+/*
+ Hands out the next record read ahead into the transaction's buffer.
+ @return DB_END once the buffer is drained.
+ */
+ErrCode p_readAheadNext(BDBState *state, ReadAhead *ra, Record *record)
+{
+    void *k, *d;
+    u_int32_t klen, dlen;
+    DB_MULTIPLE_KEY_NEXT(ra->next, &ra->bulk, k, klen, d, dlen);
+    if (ra->next == NULL) {
+        return DB_END;
+    }
+    ra->lastKey.data = k;
+    ra->lastKey.size = klen;
+    ra->lastData.data = d;
+    ra->lastData.size = dlen;
+    p_setKeyFromKeyData(&ra->lastKey, state->type, &record->key);
+    memcpy(record->payload, d, dlen < sizeof(record->payload) ? dlen : sizeof(record->payload));
+    return SUCCESS;
+}
+
+/*
+ Reads the records after the cursor into the transaction's read-ahead buffer.
+ @return the BDB error code, or ENOMEM if the buffer could not be allocated.
+ */
+int p_readAheadFill(ReadAhead *ra, DBC *cursor)
+{
+    int ret;
+    if (ra->buffer == NULL && (ra->buffer = malloc(READ_AHEAD_SIZE)) == NULL) {
+        return ENOMEM;
+    }
+    DBT key;
+    memset(&key, 0, sizeof(key));
+    memset(&ra->bulk, 0, sizeof(DBT));
+    ra->bulk.data = ra->buffer;
+    ra->bulk.ulen = READ_AHEAD_SIZE;
+    ra->bulk.flags = DB_DBT_USERMEM;
+#if DB_VERSION_MINOR>=7
+    if ((ret = cursor->get(cursor, &key, &ra->bulk, DB_NEXT | DB_MULTIPLE_KEY)) == 0) {
+#else
+    if ((ret = cursor->c_get(cursor, &key, &ra->bulk, DB_NEXT | DB_MULTIPLE_KEY)) == 0) {
+#endif
+        DB_MULTIPLE_INIT(ra->next, &ra->bulk);
+    }
+    return ret;
+}
+ErrCode getNext(IdxState *idxState, TxnState *txn, Record *record)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    
+    DBT key, data;
+    memset(&key, 0, sizeof(key));
+    memset(&data, 0, sizeof(data));
+    //the payload is read straight into the record
+    data.data = record->payload;
+    data.ulen = MAX_PAYLOAD_LEN+1;
+    data.flags = DB_DBT_USERMEM;
+    
+    //a transaction reading ahead on this index hands out the records it already has
+    ReadAhead *ra = txn == NULL ? NULL : &((TXNState*)txn)->readAhead;
+    uint32_t run = 0;
+    if (ra != NULL && ra->id == state->link->id) {
+        if (ra->next != NULL && state->keyNotFound == 0 && p_readAheadNext(state, ra, record) == SUCCESS) {
+            return SUCCESS;
+        }
+        run = ra->run;
+    }
+    
+    //retrieve or create a cursor for this index/txn combination (creating a txn if necessary)
+    TXNState *txnState;
+    DBC *cursor = NULL;
+    ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
+    if (ret != SUCCESS) {
+        goto finish;
+    }
+    p_setCursorPriority(cursor, 1);
+    
+    //an index loaded from a snapshot continues from the handle's position instead of the cursor's
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        DB_TXN *tid = txn == NULL ? txnState->tid : ((TXNState*)txn)->tid;
+        if (state->keyNotFound == 1) {
+            state->keyNotFound = 0;
+            Key k = state->lastKey;
+            p_setKeyDataFromKey(&k, &key);
+            ret = p_snapshotNext(state, snap, tid, cursor, &key, record);
+        } else {
+            ret = p_snapshotNext(state, snap, tid, cursor, NULL, record);
+        }
+        if (ret != SUCCESS) {
+            memset(record->payload, 0, MAX_PAYLOAD_LEN);
+        }
+        goto finish;
+    }
+    
+    //if the last call to get() was given a key not in the DB, getNext() should find
+    //the first key in the DB after that key, rather than starting at the beginning
+    if (state->keyNotFound == 1) {
+        state->keyNotFound = 0;
+        if (p_setKeyDataFromKey(&state->lastKey, &key) < 0) {
+            dbp->errx(dbp,"bad insert key type");
+            memset(record->payload, 0, MAX_PAYLOAD_LEN);
+            return KEY_NOTFOUND;
+        }
+#if DB_VERSION_MINOR>=7
+        if ((ret = cursor->get(cursor, &key, &data, DB_SET_RANGE)) != 0) {
+#else
+        if ((ret = cursor->c_get(cursor, &key, &data, DB_SET_RANGE)) != 0) {
+#endif
+            dbp->err(dbp, ret, "DBcursor->get");
+            memset(record->payload, 0, MAX_PAYLOAD_LEN);
+            if (ret == DB_LOCK_DEADLOCK) {
+                ret = DEADLOCK;
+                goto finish;
+            }
+            ret = DB_END;
+            goto finish;
+        }
+    } else if (ra != NULL && run + 1 >= READ_AHEAD_RUN) {
+        //the cursor is being read sequentially, so read the records after it in bulk
+        if ((ret = p_readAheadFill(ra, cursor)) != 0) {
+            memset(record->payload, 0, MAX_PAYLOAD_LEN);
+            if (ret == DB_LOCK_DEADLOCK) {
+                ret = DEADLOCK;
+            } else if (ret == DB_NOTFOUND) {
+                ret = DB_END;
+            } else {
+                dbp->err(dbp, ret, "DBcursor->get in read-ahead");
+                ret = FAILURE;
+            }
+            goto finish;
+        }
+        ra->id = state->link->id;
+        ra->run = run + 1;
+        return p_readAheadNext(state, ra, record);
+    } else {
+#if DB_VERSION_MINOR>=7
+        if ((ret = cursor->get(cursor, &key, &data, DB_NEXT)) != 0) {
+#else
+        if ((ret = cursor->c_get(cursor, &key, &data, DB_NEXT)) != 0) {
+#endif
+            dbp->err(dbp, ret, "DBcursor->get");
+            memset(record->payload, 0, MAX_PAYLOAD_LEN);
+            
+            if (ret == DB_LOCK_DEADLOCK) {
+                ret = DEADLOCK;
+                goto finish;
+            }
+            ret = DB_END;
+            goto finish;
+        }
+        //count the run of getNext calls on this index, leaving any other index's read-ahead behind
+        if (ra != NULL) {
+            if (ra->id != state->link->id) {
+                if ((ret = p_dropReadAhead((TXNState*)txn, ra->id)) != SUCCESS) {
+                    goto finish;
+                }
+                ra->id = state->link->id;
+            }
+            ra->run = run + 1;
+        }
+    }
+    
+    //insert the retrieved data into a Record and return it
+    p_setKeyFromKeyData(&key, state->type, &record->key);
+    
+    ret = SUCCESS;
+        
+    //whether return value is success or failure, if we opened a transaction for this function call
+    //we need to close it before we return
+finish:
+    //if we opened a transaction for this call, close it
+    if (txn == NULL) {
+        if (ret == SUCCESS) {
+            ret = commitTransaction((TxnState*)txnState);
+        } else {
+            abortTransaction((TxnState*)txnState);
+        }
+    }
+    //return the ErrCode
+    return ret;
+}
+
+#pragma mark scanRange
+
+//bulk buffer range scans read through; BDB wants it at least a page long
+#define SCAN_BUFFER_SIZE (64 * 1024)
+
+/*
+ Receives the records of a range scan in order.
+ @return nonzero to stop the scan after this record.
+ */
+typedef int (*ScanSink)(void *context, const Record *record);
+
+/*
+ Passes the records with keys from lo to hi, both included and either NULL for no bound,
+ to sink in index order. An index's own DB is read a buffer of records at a time. The
+ index is left positioned for getNext after the last record passed.
+ @return DB_END if the range was scanned to its end, SUCCESS if the sink stopped it.
+ */
+ErrCode p_scanRange(BDBState *state, TxnState *txn, const Key *lo, const Key *hi, ScanSink sink, void *context)
+{
+    char *buffer = NULL;
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    
+    Key loKey, hiKey;
+    DBT loData, hiData;
+    memset(&loData, 0, sizeof(DBT));
+    memset(&hiData, 0, sizeof(DBT));
+    if (lo != NULL) {
+        loKey = *lo;
+        loKey.type = state->type;
+        if (p_setKeyDataFromKey(&loKey, &loData) < 0) {
+            return FAILURE;
+        }
+    }
+    if (hi != NULL) {
+        hiKey = *hi;
+        hiKey.type = state->type;
+        if (p_setKeyDataFromKey(&hiKey, &hiData) < 0) {
+            return FAILURE;
+        }
+    }
+    
+    TXNState *txnState = NULL;
+    DBC *cursor = NULL;
+    ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
+    if (ret != SUCCESS) {
+        goto finish;
+    }
+    p_setCursorPriority(cursor, 1);
+    state->keyNotFound = 0;
+    
+    Record record;
+    DBT recKey, recData;
+    memset(&recKey, 0, sizeof(DBT));
+    memset(&recData, 0, sizeof(DBT));
+    
+    //an index loaded from a snapshot is scanned a record at a time from the handle's position
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        DB_TXN *tid = txn == NULL ? txnState->tid : ((TXNState*)txn)->tid;
+        state->positioned = 0;
+        ret = p_snapshotNext(state, snap, tid, cursor, lo == NULL ? NULL : &loData, &record);
+        while (ret == SUCCESS) {
+            recKey.data = state->posKey;
+            recKey.size = state->posKeySize;
+            if (hi != NULL && p_compareBytes(&recKey, &hiData) > 0) {
+                break;
+            }
+            if (sink(context, &record)) {
+                goto finish;
+            }
+            ret = p_snapshotNext(state, snap, tid, cursor, NULL, &record);
+        }
+        if (ret == SUCCESS) {
+            goto pastRange;
+        }
+        goto finish;
+    }
+    
+    if ((buffer = malloc(SCAN_BUFFER_SIZE)) == NULL) {
+        ret = FAILURE;
+        goto finish;
+    }
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    data.data = buffer;
+    data.ulen = SCAN_BUFFER_SIZE;
+    data.flags = DB_DBT_USERMEM;
+    u_int32_t op = DB_FIRST;
+    if (lo != NULL) {
+        key = loData;
+        op = DB_SET_RANGE;
+    }
+    
+    for (;;) {
+#if DB_VERSION_MINOR>=7
+        ret = cursor->get(cursor, &key, &data, op | DB_MULTIPLE_KEY);
+#else
+        ret = cursor->c_get(cursor, &key, &data, op | DB_MULTIPLE_KEY);
+#endif
+        if (ret != 0) {
+            if (ret == DB_NOTFOUND) {
+                ret = DB_END;
+            } else {
+                dbp->err(dbp, ret, "DBcursor->get in scanRange");
+                ret = ret == DB_LOCK_DEADLOCK ? DEADLOCK : FAILURE;
+            }
+            goto finish;
+        }
+        op = DB_NEXT;
+        
+        void *p;
+        DB_MULTIPLE_INIT(p, &data);
+        for (;;) {
+            void *k, *d;
+            u_int32_t klen, dlen;
+            DB_MULTIPLE_KEY_NEXT(p, &data, k, klen, d, dlen);
+            if (p == NULL) {
+                break;
+            }
+            recKey.data = k;
+            recKey.size = klen;
+            if (hi != NULL && p_compareBytes(&recKey, &hiData) > 0) {
+                p_setKeyFromKeyData(&recKey, state->type, &record.key);
+                goto pastRange;
+            }
+            p_setKeyFromKeyData(&recKey, state->type, &record.key);
+            memcpy(record.payload, d, dlen < sizeof(record.payload) ? dlen : sizeof(record.payload));
+            if (sink(context, &record)) {
+                //the cursor has read ahead of the record the scan stopped at
+                recData.data = d;
+                recData.size = dlen;
+#if DB_VERSION_MINOR>=7
+                ret = cursor->get(cursor, &recKey, &recData, DB_GET_BOTH);
+#else
+                ret = cursor->c_get(cursor, &recKey, &recData, DB_GET_BOTH);
+#endif
+                if (ret != 0) {
+                    dbp->err(dbp, ret, "repositioning cursor in scanRange");
+                    ret = ret == DB_LOCK_DEADLOCK ? DEADLOCK : FAILURE;
+                    goto finish;
+                }
+                ret = SUCCESS;
+                goto finish;
+            }
+        }
+    }
+    
+pastRange:
+    //getNext goes on from the first record past the range, which has not been passed
+    state->lastKey = record.key;
+    state->keyNotFound = 1;
+    ret = DB_END;
+    
+finish:
+    free(buffer);
+    //if we opened a transaction for this call, close it
+    if (txn == NULL) {
+        if (ret == SUCCESS || ret == DB_END) {
+            ErrCode committed = commitTransaction((TxnState*)txnState);
+            if (committed != SUCCESS) {
+                ret = committed;
+            }
+        } else if (txnState != NULL) {
+            abortTransaction((TxnState*)txnState);
+        }
+    }
+    return ret;
+}
+
+typedef struct
+    {
+        Record  *out;
+        int     max;
+        int     count;
+    } ScanBuffer;
+
+int p_fillScanBuffer(void *context, const Record *record)
+{
+    ScanBuffer *buffer = context;
+    buffer->out[buffer->count++] = *record;
+    return buffer->count == buffer->max;
+}
+
+ErrCode scanRange(IdxState *idxState, TxnState *txn, const Key *lo, const Key *hi, Record *out, int max, int *count)
+{
+    *count = 0;
+    if (max <= 0) {
+        return FAILURE;
+    }
+    ScanBuffer buffer;
+    buffer.out = out;
+    buffer.max = max;
+    buffer.count = 0;
+    ErrCode ret = p_scanRange(p_handleState(idxState), txn, lo, hi, p_fillScanBuffer, &buffer);
+    *count = buffer.count;
+    return ret;
+}
+
+typedef struct
+    {
+        RecordCallback  callback;
+        void            *context;
+        ErrCode         result;
+    } ScanCallback;
+
+int p_callScanCallback(void *context, const Record *record)
+{
+    ScanCallback *scan = context;
+    scan->result = scan->callback(scan->context, record);
+    return scan->result != SUCCESS;
+}
+
+ErrCode scanRangeCallback(IdxState *idxState, TxnState *txn, const Key *lo, const Key *hi,
+                          RecordCallback callback, void *context)
+{
+    ScanCallback scan;
+    scan.callback = callback;
+    scan.context = context;
+    scan.result = SUCCESS;
+    ErrCode ret = p_scanRange(p_handleState(idxState), txn, lo, hi, p_callScanCallback, &scan);
+    if (ret == DB_END) {
+        return SUCCESS;
+    }
+    return ret == SUCCESS ? scan.result : ret;
+}
+
+#pragma mark getPrev and scanRangeReverse
+
+//what p_prevRecord looks for
+#define PREV_STEP 0         //the record before the handle's position
+#define PREV_BELOW 1        //the last record with a key below the one given
+#define PREV_AT_MOST 2      //the last record with a key no greater than the one given, or the last record
+
+/*
+ Finds the record mode asks for and makes it the handle's position.
+ @return DB_END if there is no such record.
+ */
+ErrCode p_prevRecord(BDBState *state, DB_TXN *tid, DBC *cursor, int mode, const DBT *from, Record *record)
+{
+    DB *dbp = state->dbp;
+    char keyBuf[MAX_VARCHAR_LEN + 1];
+    DBT outKey, outData;
+    memset(&outKey, 0, sizeof(DBT));
+    memset(&outData, 0, sizeof(DBT));
+    outKey.data = keyBuf;
+    outKey.ulen = sizeof(keyBuf);
+    outKey.flags = DB_DBT_USERMEM;
+    outData.data = record->payload;
+    outData.ulen = MAX_PAYLOAD_LEN+1;
+    outData.flags = DB_DBT_USERMEM;
+    
+    int ret;
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        //an index loaded from a snapshot steps back from the handle's position
+        if (mode == PREV_STEP && state->positioned) {
+            DBT posKey, posData;
+            memset(&posKey, 0, sizeof(DBT));
+            memset(&posData, 0, sizeof(DBT));
+            posKey.data = state->posKey;
+            posKey.size = state->posKeySize;
+            posData.data = state->posData;
+            posData.size = state->posDataSize;
+            ret = p_mergedSeekBack(state->link, snap, tid, cursor, &posKey, &posData, 0, &outKey, &outData);
+        } else {
+            ret = p_mergedSeekBack(state->link, snap, tid, cursor, mode == PREV_STEP ? NULL : from, NULL,
+                                   mode == PREV_AT_MOST, &outKey, &outData);
+        }
+    } else if (mode == PREV_STEP) {
+        //a cursor that has not been positioned yet steps back to the last record
+        ret = p_cursorGet(cursor, &outKey, &outData, DB_PREV);
+    } else {
+        ret = p_dbSeekBack(cursor, from, NULL, mode == PREV_AT_MOST, &outKey, &outData);
+    }
+    
+    if (ret != 0) {
+        memset(record->payload, 0, MAX_PAYLOAD_LEN);
+        if (ret == DB_NOTFOUND) {
+            return DB_END;
+        }
+        dbp->err(dbp, ret, "DBcursor->get in getPrev");
+        return ret == DB_LOCK_DEADLOCK ? DEADLOCK : FAILURE;
+    }
+    
+    if (snap != NULL) {
+        memcpy(state->posKey, keyBuf, outKey.size);
+        state->posKeySize = outKey.size;
+        memcpy(state->posData, record->payload, outData.size);
+        state->posDataSize = outData.size;
+        state->positioned = 1;
+    }
+    p_setKeyFromKeyData(&outKey, state->type, &record->key);
+    return SUCCESS;
+}
+
+ErrCode getPrev(IdxState *idxState, TxnState *txn, Record *record)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    
+    TXNState *txnState;
+    DBC *cursor = NULL;
+    ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
+    if (ret != SUCCESS) {
+        goto finish;
+    }
+    p_setCursorPriority(cursor, 1);
+    DB_TXN *tid = txn == NULL ? txnState->tid : ((TXNState*)txn)->tid;
+    
+    //if the last call to get() was given a key not in the DB, getPrev() should find
+    //the last key in the DB before that key, rather than starting at the end
+    if (state->keyNotFound == 1) {
+        state->keyNotFound = 0;
+        DBT key;
+        memset(&key, 0, sizeof(key));
+        if (p_setKeyDataFromKey(&state->lastKey, &key) < 0) {
+            dbp->errx(dbp,"bad insert key type");
+            memset(record->payload, 0, MAX_PAYLOAD_LEN);
+            ret = KEY_NOTFOUND;
+            goto finish;
+        }
+        ret = p_prevRecord(state, tid, cursor, PREV_BELOW, &key, record);
+    } else {
+        ret = p_prevRecord(state, tid, cursor, PREV_STEP, NULL, record);
+    }
+    
+finish:
+    //if we opened a transaction for this call, close it
+    if (txn == NULL) {
+        if (ret == SUCCESS) {
+            ret = commitTransaction((TxnState*)txnState);
+        } else {
+            abortTransaction((TxnState*)txnState);
+        }
+    }
+    return ret;
+}
+
+ErrCode scanRangeReverse(IdxState *idxState, TxnState *txn, const Key *lo, const Key *hi,
+                         Record *out, int max, int *count)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    *count = 0;
+    if (max <= 0) {
+        return FAILURE;
+    }
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    
+    Key loKey, hiKey;
+    DBT loData, hiData;
+    memset(&loData, 0, sizeof(DBT));
+    memset(&hiData, 0, sizeof(DBT));
+    if (lo != NULL) {
+        loKey = *lo;
+        loKey.type = state->type;
+        if (p_setKeyDataFromKey(&loKey, &loData) < 0) {
+            return FAILURE;
+        }
+    }
+    if (hi != NULL) {
+        hiKey = *hi;
+        hiKey.type = state->type;
+        if (p_setKeyDataFromKey(&hiKey, &hiData) < 0) {
+            return FAILURE;
+        }
+    }
+    
+    TXNState *txnState = NULL;
+    DBC *cursor = NULL;
+    ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
+    if (ret != SUCCESS) {
+        goto finish;
+    }
+    p_setCursorPriority(cursor, 1);
+    state->keyNotFound = 0;
+    DB_TXN *tid = txn == NULL ? txnState->tid : ((TXNState*)txn)->tid;
+    
+    //BDB has no bulk reads backwards, so the range is read a record at a time
+    int n = 0;
+    ret = p_prevRecord(state, tid, cursor, PREV_AT_MOST, hi == NULL ? NULL : &hiData, &out[0]);
+    while (ret == SUCCESS) {
+        if (lo != NULL) {
+            Key k = out[n].key;
+            DBT found;
+            memset(&found, 0, sizeof(DBT));
+            p_setKeyDataFromKey(&k, &found);
+            if (p_compareBytes(&found, &loData) < 0) {
+                ret = DB_END;
+                break;
+            }
+        }
+        if (++n == max) {
+            break;
+        }
+        ret = p_prevRecord(state, tid, cursor, PREV_STEP, NULL, &out[n]);
+    }
+    *count = n;
+    
+    //getPrev goes on from the first record below the range, which has not been returned
+    if (ret == DB_END && lo != NULL) {
+        state->lastKey = loKey;
+        state->keyNotFound = 1;
+    }
+    
+finish:
+    //if we opened a transaction for this call, close it
+    if (txn == NULL) {
+        if (ret == SUCCESS || ret == DB_END) {
+            ErrCode committed = commitTransaction((TxnState*)txnState);
+            if (committed != SUCCESS) {
+                ret = committed;
+            }
+        } else if (txnState != NULL) {
+            abortTransaction((TxnState*)txnState);
+        }
+    }
+    return ret;
+}
+
+#pragma mark getView and getNextView
+
+/*
+ BDB copies whatever it returns out of its pages, so a view cannot point into the cache.
+ Instead the record is read once, by BDB itself, into a chunk owned by the transaction,
+ and stays there until the transaction ends.
+ */
+#define VIEW_ARENA_CHUNK (16 * 1024)
+//room for the largest key and payload, each with its NUL
+#define VIEW_MAX_SIZE (MAX_VARCHAR_LEN + 1 + MAX_PAYLOAD_LEN + 1)
+
+/*
+ @return room in the transaction's view chunk for one more record, or NULL if out of memory.
+ */
+char *p_viewSpace(TXNState *txnState)
+{
+    if (txnState->viewArena == NULL || txnState->viewCap - txnState->viewUsed < VIEW_MAX_SIZE) {
+        char *chunk = malloc(VIEW_ARENA_CHUNK);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        *(char **)chunk = txnState->viewArena;
+        txnState->viewArena = chunk;
+        txnState->viewUsed = sizeof(char *);
+        txnState->viewCap = VIEW_ARENA_CHUNK;
+    }
+    return txnState->viewArena + txnState->viewUsed;
+}
+
+/*
+ Reads the record the cursor finds with op into the transaction's view chunk. For DB_SET
+ and DB_SET_RANGE, from is the key to search for; otherwise it is NULL.
+ @return DB_END if there is no such record.
+ */
+ErrCode p_readView(BDBState *state, TXNState *txnState, DBC *cursor, u_int32_t op, Key *from, RecordView *view)
+{
+    DB *dbp = state->dbp;
+    int ret;
+    char *space = p_viewSpace(txnState);
+    if (space == NULL) {
+        return FAILURE;
+    }
+    
+    //integer keys have a fixed size, so only a VARCHAR key needs room for the longest one
+    u_int32_t keyRoom = state->type == SHORT ? 4 : state->type == INT ? 8 : MAX_VARCHAR_LEN;
+    
+    DBT key, data;
+    memset(&key, 0, sizeof(key));
+    memset(&data, 0, sizeof(data));
+    key.data = space;
+    key.ulen = keyRoom;
+    key.flags = DB_DBT_USERMEM;
+    if (from != NULL) {
+        DBT search;
+        memset(&search, 0, sizeof(search));
+        from->type = state->type;
+        if (p_setKeyDataFromKey(from, &search) < 0) {
+            dbp->errx(dbp, "bad view key type");
+            return FAILURE;
+        }
+        memcpy(space, search.data, search.size);
+        key.size = search.size;
+    }
+    data.data = space + keyRoom + 1;
+    data.ulen = MAX_PAYLOAD_LEN + 1;
+    data.flags = DB_DBT_USERMEM;
+    
+#if DB_VERSION_MINOR>=7
+    if ((ret = cursor->get(cursor, &key, &data, op)) != 0) {
+#else
+    if ((ret = cursor->c_get(cursor, &key, &data, op)) != 0) {
+#endif
+        if (ret == DB_NOTFOUND) {
+            return DB_END;
+        }
+        dbp->err(dbp, ret, "DBcursor->get in view");
+        return ret == DB_LOCK_DEADLOCK ? DEADLOCK : FAILURE;
+    }
+    
+    space[key.size] = '\0';
+    view->key = space;
+    view->keyLen = key.size;
+    view->payload = data.data;
+    view->payloadLen = data.size > 0 ? data.size - 1 : 0;
+    txnState->viewUsed += keyRoom + 1 + data.size;
+    return SUCCESS;
+}
+
+/*
+ Copies a record read from an index with a snapshot into the transaction's view chunk.
+ */
+ErrCode p_viewFromRecord(TXNState *txnState, Record *record, RecordView *view)
+{
+    char *space = p_viewSpace(txnState);
+    if (space == NULL) {
+        return FAILURE;
+    }
+    DBT key;
+    memset(&key, 0, sizeof(key));
+    p_setKeyDataFromKey(&record->key, &key);
+    memcpy(space, key.data, key.size);
+    space[key.size] = '\0';
+    size_t payloadLen = strlen(record->payload);
+    memcpy(space + key.size + 1, record->payload, payloadLen + 1);
+    
+    view->key = space;
+    view->keyLen = key.size;
+    view->payload = space + key.size + 1;
+    view->payloadLen = payloadLen;
+    txnState->viewUsed += key.size + 1 + payloadLen + 1;
+    return SUCCESS;
+}
+
+ErrCode getView(IdxState *idxState, TxnState *txn, const Key *k, RecordView *view)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    //a view lives only as long as its transaction
+    if (txn == NULL) {
+        return TXN_DNE;
+    }
+    
+    //an index loaded from a snapshot merges two sources, so its record is read by get
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        Record record;
+        record.key = *k;
+        if ((ret = get(idxState, txn, &record)) != SUCCESS) {
+            return ret;
+        }
+        return p_viewFromRecord((TXNState*)txn, &record, view);
+    }
+    
+    TXNState *txnState;
+    DBC *cursor = NULL;
+    ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+    p_setCursorPriority(cursor, 0);
+    
+    //as with get, a following getNext starts after the key if it is not found
+    memcpy(&(state->lastKey), k, sizeof(Key));
+    state->lastKey.type = state->type;
+    state->keyNotFound = 0;
+    
+    Key key = *k;
+    ret = p_readView(state, (TXNState*)txn, cursor, DB_SET, &key, view);
+    if (ret == DB_END) {
+        state->keyNotFound = 1;
+        return KEY_NOTFOUND;
+    }
+    return ret;
+}
+
+ErrCode getNextView(IdxState *idxState, TxnState *txn, RecordView *view)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    if (txn == NULL) {
+        return TXN_DNE;
+    }
+    
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        Record record;
+        if ((ret = getNext(idxState, txn, &record)) != SUCCESS) {
+            return ret;
+        }
+        return p_viewFromRecord((TXNState*)txn, &record, view);
+    }
+    
+    TXNState *txnState;
+    DBC *cursor = NULL;
+    ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+    p_setCursorPriority(cursor, 1);
+    
+    //continue after a key get() did not find, as getNext does
+    if (state->keyNotFound == 1) {
+        state->keyNotFound = 0;
+        Key key = state->lastKey;
+        return p_readView(state, (TXNState*)txn, cursor, DB_SET_RANGE, &key, view);
+    }
+    return p_readView(state, (TXNState*)txn, cursor, DB_NEXT, NULL, view);
+}
+
+void keyFromView(const RecordView *view, KeyType type, Key *key)
+{
+    DBT stored;
+    memset(&stored, 0, sizeof(stored));
+    stored.data = (void *)view->key;
+    stored.size = view->keyLen;
+    p_setKeyFromKeyData(&stored, type, key);
+}
+
+#pragma mark countRange and getByRank
+
+/*
+ Both read the counts DB. The entries before a counts DB key are numbered by the record
+ number of the first entry at or after it, so a range of one tag is counted with two
+ lookups and the record of a given rank is found with one, however large the index. An
+ index loaded from a snapshot adds its snapshot entries, found by binary search, less the
+ tombstones counted among them and the entries of the range tombstones, which are read
+ from the side DB one range at a time.
+ */
+
+/*
+ Sets before to the number of entries of a counts DB that sort before bound.
+ @return the BDB error code.
+ */
+int p_countBefore(DBC *cursor, const DBT *bound, uint64_t *before)
+{
+    char buf[COUNT_KEY_LEN];
+    db_recno_t recno;
+    DBT key, data, number;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    memset(&number, 0, sizeof(DBT));
+    memcpy(buf, bound->data, bound->size);
+    key.data = buf;
+    key.size = bound->size;
+    key.ulen = sizeof(buf);
+    key.flags = DB_DBT_USERMEM;
+    data.flags = DB_DBT_PARTIAL;
+    number.data = &recno;
+    number.ulen = sizeof(recno);
+    number.flags = DB_DBT_USERMEM;
+    
+    //COUNTS_DONE_KEY is always there, so past the last entry every entry sorts before the bound
+    int ret = p_cursorGet(cursor, &key, &data, DB_SET_RANGE);
+    int past = ret == DB_NOTFOUND;
+    if (past) {
+        ret = p_cursorGet(cursor, &key, &data, DB_LAST);
+    }
+    if (ret == 0) {
+        ret = p_cursorGet(cursor, &key, &number, DB_GET_RECNO);
+    }
+    if (ret == 0) {
+        *before = past ? recno : recno - 1;
+    }
+    return ret;
+}
+
+/*
+ Sets count to the number of counted records of the tag with keys from lo to hi, both
+ included and either NULL for no bound.
+ @return the BDB error code.
+ */
+int p_countKeys(DBC *cursor, char tag, const DBT *lo, const DBT *hi, uint64_t *count)
+{
+    char fromBuf[COUNT_KEY_LEN];
+    char toBuf[COUNT_KEY_LEN];
+    DBT from, to;
+    uint64_t first, last;
+    int ret;
+    p_countBound(tag, lo, 0, fromBuf, &from);
+    p_countBound(tag, hi, 1, toBuf, &to);
+    if ((ret = p_countBefore(cursor, &from, &first)) != 0 || (ret = p_countBefore(cursor, &to, &last)) != 0) {
+        return ret;
+    }
+    *count = last > first ? last - first : 0;
+    return 0;
+}
+
+/*
+ Reads the counted record of the tag with the given rank among them into buf, which
+ holds COUNT_KEY_LEN bytes, given the number of entries before the tag's first, and
+ points key and data at it.
+ @return DB_NOTFOUND if the tag has no more than rank records.
+ */
+int p_countedAt(DBC *cursor, char tag, uint64_t base, uint64_t rank, KeyType type, char *buf, DBT *key, DBT *data)
+{
+    //BDB numbers records with 32 bits
+    if (base + rank >= UINT32_MAX) {
+        return DB_NOTFOUND;
+    }
+    db_recno_t recno = base + rank + 1;
+    DBT counted, empty;
+    memset(&counted, 0, sizeof(DBT));
+    memset(&empty, 0, sizeof(DBT));
+    memcpy(buf, &recno, sizeof(recno));
+    counted.data = buf;
+    counted.size = sizeof(recno);
+    counted.ulen = COUNT_KEY_LEN;
+    counted.flags = DB_DBT_USERMEM;
+    empty.flags = DB_DBT_PARTIAL;
+    
+    int ret = p_cursorGet(cursor, &counted, &empty, DB_SET_RECNO);
+    if (ret != 0) {
+        return ret;
+    } else if (buf[0] != tag) {
+        return DB_NOTFOUND;
+    }
+    //integer keys may hold NULs of their own, so only a VARCHAR key is measured up to its NUL
+    uint32_t keySize = type == VARCHAR ? strlen(buf + 1) : type == INT ? 8 : 4;
+    memset(key, 0, sizeof(DBT));
+    memset(data, 0, sizeof(DBT));
+    key->data = buf + 1;
+    key->size = keySize;
+    data->data = buf + 2 + keySize;
+    data->size = counted.size - 2 - keySize;
+    return 0;
+}
+
+/*
+ Finds the record of an index with the given rank, reading the counts DB with cursor, and
+ leaves it in buf as p_countedAt does. The live entries of a snapshot are ranked among the
+ index's own records by a binary search over the snapshot for the last entry with no more
+ than rank live records before it; the record is either that entry or one of the index's
+ own between it and the next entry, so the search costs two lookups per step and a pass
+ over the range tombstones before the entry.
+ @return DB_NOTFOUND if the index has no more than rank records.
+ */
+int p_rankedRecord(DBLink *link, const Snapshot *snap, DB_TXN *tid, DBC *cursor, uint64_t rank,
+                   char *buf, DBT *key, DBT *data)
+{
+    char bound[COUNT_KEY_LEN];
+    DBT probe;
+    uint64_t countedBase, tombstoneBase;
+    int ret;
+    p_countBound(COUNTED_TAG, NULL, 0, bound, &probe);
+    if ((ret = p_countBefore(cursor, &probe, &countedBase)) != 0) {
+        return ret;
+    }
+    if (snap == NULL || snap->count == 0) {
+        return p_countedAt(cursor, COUNTED_TAG, countedBase, rank, link->type, buf, key, data);
+    }
+    p_countBound(TOMBSTONE_TAG, NULL, 0, bound, &probe);
+    if ((ret = p_countBefore(cursor, &probe, &tombstoneBase)) != 0) {
+        return ret;
+    }
+    
+    //before entry i come the index's own records before it and the entries before it,
+    //less those with tombstones
+    DBT entryKey, entryData;
+    uint64_t lo = 0, hi = snap->count;
+    uint64_t ownBefore = 0, liveBefore = 0;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        uint64_t own, deleted, ranged;
+        p_snapEntry(snap, mid, &entryKey, &entryData);
+        p_countKey(COUNTED_TAG, &entryKey, &entryData, bound, &probe);
+        if ((ret = p_countBefore(cursor, &probe, &own)) != 0) {
+            return ret;
+        }
+        p_countKey(TOMBSTONE_TAG, &entryKey, &entryData, bound, &probe);
+        if ((ret = p_countBefore(cursor, &probe, &deleted)) != 0) {
+            return ret;
+        }
+        if ((ret = p_countRangeTombstones(link, tid, 0, mid, &ranged)) != 0) {
+            return ret;
+        }
+        uint64_t live = own - countedBase + mid - (deleted - tombstoneBase) - ranged;
+        if (live <= rank) {
+            lo = mid + 1;
+            ownBefore = own - countedBase;
+            liveBefore = live;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return p_countedAt(cursor, COUNTED_TAG, countedBase, rank, link->type, buf, key, data);
+    }
+    
+    uint64_t start, end;
+    p_snapEntry(snap, lo - 1, &entryKey, &entryData);
+    ret = p_entryDeleted(link, tid, lo - 1, &entryKey, &entryData, &start, &end);
+    if (ret != 0 && ret != DB_NOTFOUND) {
+        return ret;
+    }
+    uint64_t isLive = ret == DB_NOTFOUND;
+    if (isLive && liveBefore == rank) {
+        p_countKey(COUNTED_TAG, &entryKey, &entryData, buf, &probe);
+        memset(key, 0, sizeof(DBT));
+        memset(data, 0, sizeof(DBT));
+        key->data = buf + 1;
+        key->size = entryKey.size;
+        data->data = buf + 2 + entryKey.size;
+        data->size = entryData.size;
+        return 0;
+    }
+    return p_countedAt(cursor, COUNTED_TAG, countedBase, ownBefore + rank - liveBefore - isLive, link->type, buf, key, data);
+}
+
+ErrCode countRange(IdxState *idxState, TxnState *txn, const Key *lo, const Key *hi, uint64_t *count)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    DB *counts = state->link->counts;
+    if (counts == NULL) {
+        dbp->errx(dbp, "countRange needs setRecordCounts");
+        return FAILURE;
+    }
+    
+    Key loCopy, hiCopy;
+    DBT loKey, hiKey;
+    memset(&loKey, 0, sizeof(DBT));
+    memset(&hiKey, 0, sizeof(DBT));
+    if (lo != NULL) {
+        loCopy = *lo;
+        loCopy.type = state->type;
+        if (p_setKeyDataFromKey(&loCopy, &loKey) < 0) {
+            return FAILURE;
+        }
+    }
+    if (hi != NULL) {
+        hiCopy = *hi;
+        hiCopy.type = state->type;
+        if (p_setKeyDataFromKey(&hiCopy, &hiKey) < 0) {
+            return FAILURE;
+        }
+    }
+    
+    //count in a cursor of its own, so that the handle keeps its getNext position
+    TxnState *ownTxn = NULL;
+    if (txn == NULL) {
+        if ((ret = beginTransaction(&ownTxn)) != SUCCESS) {
+            return ret;
+        }
+    }
+    DB_TXN *tid = ((TXNState*)(txn == NULL ? ownTxn : txn))->tid;
+    DBC *cursor;
+    if ((ret = counts->cursor(counts, tid, &cursor, 0)) != 0) {
+        dbp->err(dbp, ret, "Creating cursor in countRange");
+        ret = FAILURE;
+        goto finish;
+    }
+    
+    uint64_t own = 0, deleted = 0;
+    ret = p_countKeys(cursor, COUNTED_TAG, lo == NULL ? NULL : &loKey, hi == NULL ? NULL : &hiKey, &own);
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (ret == 0 && snap != NULL) {
+        ret = p_countKeys(cursor, TOMBSTONE_TAG, lo == NULL ? NULL : &loKey, hi == NULL ? NULL : &hiKey, &deleted);
+    }
+    if (ret == 0) {
+        *count = own;
+        if (snap != NULL) {
+            uint64_t first = lo == NULL ? 0 : p_snapshotSeek(snap, &loKey, NULL, 0);
+            uint64_t last = hi == NULL ? snap->count : p_snapshotSeek(snap, &hiKey, NULL, 1);
+            uint64_t ranged = 0;
+            ret = p_countRangeTombstones(state->link, tid, first, last, &ranged);
+            *count += last > first ? last - first - deleted - ranged : 0;
+        }
+    }
+#if DB_VERSION_MINOR>=7
+    cursor->close(cursor);
+#else
+    cursor->c_close(cursor);
+#endif
+    if (ret != 0) {
+        dbp->err(dbp, ret, "counting records");
+        ret = ret == DB_LOCK_DEADLOCK ? DEADLOCK : FAILURE;
+    }
+    
+finish:
+    if (ownTxn != NULL) {
+        if (ret == SUCCESS) {
+            ret = commitTransaction(ownTxn);
+        } else {
+            abortTransaction(ownTxn);
+        }
+    }
+    return ret;
+}
+
+ErrCode getByRank(IdxState *idxState, TxnState *txn, uint64_t rank, Record *record)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    DB *counts = state->link->counts;
+    if (counts == NULL) {
+        dbp->errx(dbp, "getByRank needs setRecordCounts");
+        return FAILURE;
+    }
+    
+    TXNState *txnState;
+    DBC *cursor = NULL;
+    ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
+    if (ret != SUCCESS) {
+        goto finish;
+    }
+    p_setCursorPriority(cursor, 0);
+    state->keyNotFound = 0;
+    DB_TXN *tid = txn == NULL ? txnState->tid : ((TXNState*)txn)->tid;
+    
+    char buf[COUNT_KEY_LEN];
+    DBT key, data;
+    DBC *countsCursor;
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if ((ret = counts->cursor(counts, tid, &countsCursor, 0)) == 0) {
+        ret = p_rankedRecord(state->link, snap, tid, countsCursor, rank, buf, &key, &data);
+#if DB_VERSION_MINOR>=7
+        countsCursor->close(countsCursor);
+#else
+        countsCursor->c_close(countsCursor);
+#endif
+    }
+    
+    if (ret == 0 && snap != NULL) {
+        //getNext goes on from the record as it does after p_snapshotNext
+        memcpy(state->posKey, key.data, key.size);
+        state->posKeySize = key.size;
+        memcpy(state->posData, data.data, data.size);
+        state->posDataSize = data.size;
+        state->positioned = 1;
+    } else if (ret == 0) {
+        //getNext goes on from the transaction's cursor, so it is moved to the record
+        char keyBuf[MAX_VARCHAR_LEN + 1];
+        char dataBuf[MAX_PAYLOAD_LEN + 1];
+        DBT found, foundData;
+        memset(&found, 0, sizeof(DBT));
+        memset(&foundData, 0, sizeof(DBT));
+        memcpy(keyBuf, key.data, key.size);
+        memcpy(dataBuf, data.data, data.size);
+        found.data = keyBuf;
+        found.size = key.size;
+        found.ulen = sizeof(keyBuf);
+        found.flags = DB_DBT_USERMEM;
+        foundData.data = dataBuf;
+        foundData.size = data.size;
+        foundData.ulen = sizeof(dataBuf);
+        foundData.flags = DB_DBT_USERMEM;
+        ret = p_cursorGet(cursor, &found, &foundData, DB_GET_BOTH);
+    }
+    if (ret != 0) {
+        memset(record->payload, 0, MAX_PAYLOAD_LEN);
+        if (ret == DB_LOCK_DEADLOCK) {
+            ret = DEADLOCK;
+        } else if (ret == DB_NOTFOUND) {
+            ret = DB_END;
+        } else {
+            dbp->err(dbp, ret, "getByRank");
+            ret = FAILURE;
+        }
+        goto finish;
+    }
+    p_setKeyFromKeyData(&key, state->type, &record->key);
+    memset(record->payload, 0, MAX_PAYLOAD_LEN);
+    memcpy(record->payload, data.data, data.size < MAX_PAYLOAD_LEN ? data.size : MAX_PAYLOAD_LEN);
+    ret = SUCCESS;
+    
+finish:
+    //if we opened a transaction for this call, close it
+    if (txn == NULL) {
+        if (ret == SUCCESS) {
+            ret = commitTransaction((TxnState*)txnState);
+        } else {
+            abortTransaction((TxnState*)txnState);
+        }
+    }
+    return ret;
+}
+
+#pragma mark insertRecord
+ErrCode insertRecord(IdxState *ident, TxnState *txn, Key *k, const char* payload)
+{
+    BDBState *state = p_handleState(ident);
+    TXNState *txnState = (TXNState*)txn;
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    
+    //the logical log writes records out when their transaction commits, and record
+    //counts change along with the index, so an auto-committed insert gets a transaction
+    //of its own under either
+    if (txn == NULL && (logicalLogOpen || state->link->counts != NULL)) {
+        if ((ret = beginTransaction(&txn)) != SUCCESS) {
+            return ret;
+        }
+        if ((ret = insertRecord(ident, txn, k, payload)) != SUCCESS) {
+            abortTransaction(txn);
+            return ret;
+        }
+        return commitTransaction(txn);
+    }
+    
+    //records read ahead before the insert would leave it out
+    if (txnState != NULL && (ret = p_dropReadAhead(txnState, state->link->id)) != SUCCESS) {
+        return ret;
+    }
+    
+    //prepare the key and data for insert
+    DBT key, data;
+    memset(&key, 0, sizeof(key));
+    memset(&data, 0, sizeof(data));
+    
+    if (p_setKeyDataFromKey(k, &key) < 0) {
+        dbp->errx(dbp,"bad insert key type");
+        return FAILURE;
+    }
+    
+    //make a non-const copy of the payload to give to the BDB library
+    char payload_copy[MAX_PAYLOAD_LEN + 1];
+    memcpy(payload_copy, payload, strlen(payload)+1);
+    data.data = payload_copy;
+    data.size = strlen(payload)+1;
+    
+    //insert key and data, into the snapshot's overlay if the index has one
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        ret = p_snapshotInsert(state, snap, txn, &key, &data);
+        if (ret != SUCCESS || txn == NULL) {
+            return ret;
+        }
+    } else if ((ret = dbp->put(dbp, txnState == NULL ? NULL : txnState->tid, &key, &data, 0)) != 0 ||
+               (ret = p_countRecord(state->link, txnState == NULL ? NULL : txnState->tid, COUNTED_TAG, &key, &data, COUNT_ADD)) != 0) {
+        dbp->err(dbp, ret, "DB->put");
+        if (ret == DB_KEYEXIST) {
+            dbp->errx(dbp, "entry (%s, %s) exists", k->keyval.charkey, payload);
+            return ENTRY_EXISTS;
+        } else if (ret == DB_LOCK_DEADLOCK) {
+            return DEADLOCK;
+        }
+        return FAILURE;
+    }
+    
+    if (logicalLogOpen) {
+        return p_logRecord(txnState, LOG_INSERT, state->link->id, &key, &data);
+    }
+    
+    //an auto-committed insert is as durable as the environment's commits
+    if (txnState == NULL) {
+        return p_logCommitted(envDurability);
+    }
+    return SUCCESS;
+}
+
+        
+#pragma mark deleteRecord
+ErrCode deleteRecord(IdxState *ident, TxnState *txn, Record *theRecord)
+{
+    BDBState *state = p_handleState(ident);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    
+    //as for inserts, an auto-committed delete under the logical log or with record counts
+    //gets a transaction of its own
+    if (txn == NULL && (logicalLogOpen || state->link->counts != NULL)) {
+        if ((ret = beginTransaction(&txn)) != SUCCESS) {
+            return ret;
+        }
+        if ((ret = deleteRecord(ident, txn, theRecord)) != SUCCESS) {
+            abortTransaction(txn);
+            return ret;
+        }
+        return commitTransaction(txn);
+    }
+    
+    //records read ahead before the delete may include the one deleted
+    if (txn != NULL && (ret = p_dropReadAhead((TXNState*)txn, state->link->id)) != SUCCESS) {
+        return ret;
+    }
+    
+    Key k = theRecord->key;
+
+    DBT key, data;
+    memset(&key, 0, sizeof(key));
+    memset(&data, 0, sizeof(data));
+    
+    if (p_setKeyDataFromKey(&k, &key) < 0) {
+        dbp->errx(dbp,"bad insert key type");
+        return KEY_NOTFOUND;
+    }
+    
+    TXNState *txnState = (TXNState*)txn;
+    DBC *cursor = NULL;
+    
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        DBT *match = NULL;
+        if (memcmp(theRecord->payload, NULL_PAYLOAD, MAX_PAYLOAD_LEN) != 0) {
+            data.data = theRecord->payload;
+            data.size = strlen(theRecord->payload)+1;
+            match = &data;
+        }
+        ret = p_snapshotDelete(state, snap, txn, &key, match);
+        if (ret == SUCCESS && logicalLogOpen) {
+            ret = p_logRecord(txnState, match == NULL ? LOG_DELETE_KEY : LOG_DELETE, state->link->id, &key, match);
+        }
+        return ret;
+    }
+    
+    if (memcmp(theRecord->payload, NULL_PAYLOAD, MAX_PAYLOAD_LEN) == 0) {
+        //delete all records associated with the key if no payload is specified
+        if ((ret = dbp->del(dbp, txnState == NULL ? NULL : txnState->tid, &key, 0)) != 0 ||
+            (ret = p_countRecord(state->link, txnState == NULL ? NULL : txnState->tid, COUNTED_TAG, &key, NULL, COUNT_REMOVE)) != 0) {
+            dbp->err(dbp, ret, "dbp->del");
+            if (ret == DB_NOTFOUND) {
+                return KEY_NOTFOUND;
+            } else if (ret == DB_LOCK_DEADLOCK) {
+                return DEADLOCK;
+            }
+            return FAILURE;
+        }
+        
+        if (logicalLogOpen) {
+            return p_logRecord(txnState, LOG_DELETE_KEY, state->link->id, &key, NULL);
+        }
+        
+        //an auto-committed delete is as durable as the environment's commits
+        if (txnState == NULL) {
+            return p_logCommitted(envDurability);
+        }
+        return SUCCESS;
+    } else {
+        //otherwise delete a specific pair with a cursor
+        data.data = theRecord->payload;
+        data.size = strlen(theRecord->payload)+1;
+        //the cursor get may point the DBTs elsewhere; the log gets the record as given
+        DBT logKey = key;
+        DBT logData = data;
+        
+        ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
+        if (ret != SUCCESS) {
+            goto finish;
+        }
+        
+        
+        //point the cursor at the entry to be deleted
+#if DB_VERSION_MINOR>=7
+        if ((ret = cursor->get(cursor, &key, &data, DB_GET_BOTH)) != 0) {
+#else
+        if ((ret = cursor->c_get(cursor, &key, &data, DB_GET_BOTH)) != 0) {
+#endif
+            dbp->err(dbp, ret, "cursor->get in delete");
+            
+            if (ret == DB_LOCK_DEADLOCK) {
+                ret = DEADLOCK;
+                goto finish;
+            }
+            
+            ret = ENTRY_DNE;
+            goto finish;
+        }
+        
+        //delete the entry pointed to by the cursor
+#if DB_VERSION_MINOR>=7
+        if ((ret = cursor->del(cursor, 0)) != 0) {
+#else
+        if ((ret = cursor->c_del(cursor, 0)) != 0) {
+#endif
+            dbp->err(dbp, ret, "cursor->del");
+            
+            if (ret == DB_LOCK_DEADLOCK) {
+                ret = DEADLOCK;
+                goto finish;
+            }
+            ret = FAILURE;
+            goto finish;
+        }
+        
+        if ((ret = p_countRecord(state->link, txnState->tid, COUNTED_TAG, &logKey, &logData, COUNT_REMOVE)) != 0) {
+            dbp->err(dbp, ret, "counting delete");
+            ret = ret == DB_LOCK_DEADLOCK ? DEADLOCK : FAILURE;
+            goto finish;
+        }
+        
+        ret = SUCCESS;
+        if (logicalLogOpen) {
+            ret = p_logRecord(txnState, LOG_DELETE, state->link->id, &logKey, &logData);
+        }
+    }
+            
+    //whether return value is success or failure, if we opened a transaction for this function call
+    //we need to close it before we return
+finish:
+    //if we opened a transaction for this call, close it
+    if (txn == NULL) {
+        if (ret == SUCCESS) {
+            ret = commitTransaction((TxnState*)txnState);
+        } else {
+            abortTransaction((TxnState*)txnState);
+        }
+    }
+    //return the ErrCode
+    return ret;
+}
+
+
+
+#pragma mark deleteRange
+
+/*
+ Deletes the records of the cursor's DB from lo to hi, both included and either NULL for
+ no bound.
+ @return the BDB error code.
+ */
+int p_deleteDBRange(DBC *cursor, const DBT *lo, const DBT *hi)
+{
+    char keyBuf[MAX_VARCHAR_LEN + 1];
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = keyBuf;
+    key.ulen = sizeof(keyBuf);
+    key.flags = DB_DBT_USERMEM;
+    //only the keys are needed
+    data.flags = DB_DBT_PARTIAL;
+    
+    int ret;
+    if (lo == NULL) {
+        ret = p_cursorGet(cursor, &key, &data, DB_FIRST);
+    } else {
+        memcpy(keyBuf, lo->data, lo->size);
+        key.size = lo->size;
+        ret = p_cursorGet(cursor, &key, &data, DB_SET_RANGE);
+    }
+    while (ret == 0 && (hi == NULL || p_compareBytes(&key, hi) <= 0)) {
+#if DB_VERSION_MINOR>=7
+        if ((ret = cursor->del(cursor, 0)) != 0) {
+#else
+        if ((ret = cursor->c_del(cursor, 0)) != 0) {
+#endif
+            return ret;
+        }
+        ret = p_cursorGet(cursor, &key, &data, DB_NEXT);
+    }
+    return ret == DB_NOTFOUND ? 0 : ret;
+}
+
+/*
+ Tombstones the snapshot entries from lo to hi, both included and either NULL for no bound,
+ with one range tombstone. The range is found by binary search; the tombstones of single
+ entries in it are removed and the range tombstones it overlaps or touches merged into it,
+ so the cost does not grow with the number of entries deleted.
+ @return the BDB error code.
+ */
+int p_tombstoneRange(DBLink *link, const Snapshot *snap, DB_TXN *tid, const DBT *lo, const DBT *hi)
+{
+    uint64_t first = lo == NULL ? 0 : p_snapshotSeek(snap, lo, NULL, 0);
+    uint64_t last = hi == NULL ? snap->count : p_snapshotSeek(snap, hi, NULL, 1);
+    if (first >= last) {
+        return 0;
+    }
+    
+    char tagged[MAX_VARCHAR_LEN + 2];
+    char dataBuf[MAX_PAYLOAD_LEN + 1];
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = tagged;
+    key.ulen = sizeof(tagged);
+    key.flags = DB_DBT_USERMEM;
+    data.data = dataBuf;
+    data.ulen = sizeof(dataBuf);
+    data.flags = DB_DBT_USERMEM;
+    
+    DB *side = link->side;
+    DBC *cursor;
+    int ret;
+    if ((ret = side->cursor(side, tid, &cursor, 0)) != 0) {
+        return ret;
+    }
+    
+    //the entry tombstones in the range go, and with them their counts
+    tagged[0] = TOMBSTONE_TAG;
+    key.size = 1;
+    if (lo != NULL) {
+        memcpy(tagged + 1, lo->data, lo->size);
+        key.size += lo->size;
+    }
+    ret = p_cursorGet(cursor, &key, &data, DB_SET_RANGE);
+    while (ret == 0 && tagged[0] == TOMBSTONE_TAG) {
+        DBT deleted;
+        memset(&deleted, 0, sizeof(DBT));
+        deleted.data = tagged + 1;
+        deleted.size = key.size - 1;
+        if (hi != NULL && p_compareBytes(&deleted, hi) > 0) {
+            break;
+        }
+        if ((ret = p_cursorDel(cursor)) != 0 ||
+            (ret = p_countRecord(link, tid, TOMBSTONE_TAG, &deleted, &data, COUNT_REMOVE)) != 0) {
+            goto finish;
+        }
+        ret = p_cursorGet(cursor, &key, &data, DB_NEXT);
+    }
+    if (ret != 0 && ret != DB_NOTFOUND) {
+        goto finish;
+    }
+    
+    //range tombstones that overlap or touch the range are merged into it
+    uint64_t start, end;
+    ret = p_rangeGet(cursor, DB_SET_RANGE, first > 0 ? first - 1 : 0, &start, &end);
+    while (ret == 0 && start <= last) {
+        first = start < first ? start : first;
+        last = end > last ? end : last;
+        if ((ret = p_cursorDel(cursor)) != 0) {
+            goto finish;
+        }
+        ret = p_rangeGet(cursor, DB_NEXT, 0, &start, &end);
+    }
+    if (ret == 0 || ret == DB_NOTFOUND) {
+        ret = p_rangePut(side, tid, first, last);
+    }
+    
+finish:
+#if DB_VERSION_MINOR>=7
+    cursor->close(cursor);
+#else
+    cursor->c_close(cursor);
+#endif
+    if (ret == 0) {
+        __atomic_add_fetch(&tombstoneGen, 1, __ATOMIC_RELEASE);
+    }
+    return ret;
+}
+
+/*
+ Empties the index's own DB with DB->truncate when the range from lo to hi, either NULL for
+ no bound, takes in every record in it, which frees its pages instead of deleting record by
+ record. DB->truncate refuses a DB with open cursors, so it is not tried while the
+ transaction has one on the index, and one refused for another transaction's is left to
+ the caller.
+ @return the BDB error code, DB_NOTFOUND if the DB was not truncated.
+ */
+int p_truncateRange(BDBState *state, TXNState *txnState, const DBT *lo, const DBT *hi)
+{
+    DB *dbp = state->dbp;
+    uint32_t id = state->link->id;
+    int ret;
+    if (id < txnState->numCursors && txnState->cursors[id] != NULL) {
+        return DB_NOTFOUND;
+    }
+    
+    if (lo != NULL || hi != NULL) {
+        char keyBuf[MAX_VARCHAR_LEN + 1];
+        DBT key, data;
+        memset(&key, 0, sizeof(DBT));
+        memset(&data, 0, sizeof(DBT));
+        key.data = keyBuf;
+        key.ulen = sizeof(keyBuf);
+        key.flags = DB_DBT_USERMEM;
+        data.flags = DB_DBT_PARTIAL;
+        DBC *cursor;
+        if ((ret = dbp->cursor(dbp, txnState->tid, &cursor, 0)) != 0) {
+            return ret;
+        }
+        ret = p_cursorGet(cursor, &key, &data, DB_FIRST);
+        if (ret == 0 && lo != NULL && p_compareBytes(&key, lo) < 0) {
+            ret = DB_NOTFOUND;
+        }
+        if (ret == 0) {
+            ret = p_cursorGet(cursor, &key, &data, DB_LAST);
+        }
+        if (ret == 0 && hi != NULL && p_compareBytes(&key, hi) > 0) {
+            ret = DB_NOTFOUND;
+        }
+#if DB_VERSION_MINOR>=7
+        cursor->close(cursor);
+#else
+        cursor->c_close(cursor);
+#endif
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    
+    u_int32_t count;
+    ret = dbp->truncate(dbp, txnState->tid, &count, 0);
+    return ret == EINVAL ? DB_NOTFOUND : ret;
+}
+
+ErrCode deleteRange(IdxState *idxState, TxnState *txn, const Key *lo, const Key *hi)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    
+    //a range is deleted all at once, so an auto-committed delete gets a transaction of its own
+    if (txn == NULL) {
+        if ((ret = beginTransaction(&txn)) != SUCCESS) {
+            return ret;
+        }
+        if ((ret = deleteRange(idxState, txn, lo, hi)) != SUCCESS) {
+            abortTransaction(txn);
+            return ret;
+        }
+        return commitTransaction(txn);
+    }
+    
+    Key loKey, hiKey;
+    DBT loData, hiData;
+    memset(&loData, 0, sizeof(DBT));
+    memset(&hiData, 0, sizeof(DBT));
+    if (lo != NULL) {
+        loKey = *lo;
+        loKey.type = state->type;
+        if (p_setKeyDataFromKey(&loKey, &loData) < 0) {
+            return FAILURE;
+        }
+    }
+    if (hi != NULL) {
+        hiKey = *hi;
+        hiKey.type = state->type;
+        if (p_setKeyDataFromKey(&hiKey, &hiData) < 0) {
+            return FAILURE;
+        }
+    }
+    
+    //a range that takes in the whole of the index's own DB truncates it; others are deleted record by record
+    ret = p_truncateRange(state, (TXNState*)txn, lo == NULL ? NULL : &loData, hi == NULL ? NULL : &hiData);
+    if (ret == DB_NOTFOUND) {
+        TXNState *txnState;
+        DBC *cursor = NULL;
+        if ((ret = p_prepTxnCursor(state, txn, &txnState, &cursor)) != SUCCESS) {
+            return ret;
+        }
+        ret = p_deleteDBRange(cursor, lo == NULL ? NULL : &loData, hi == NULL ? NULL : &hiData);
+    }
+    if (ret == 0) {
+        ret = p_uncountKeys(state->link, ((TXNState*)txn)->tid, COUNTED_TAG,
+                            lo == NULL ? NULL : &loData, hi == NULL ? NULL : &hiData);
+    }
+    Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (ret == 0 && snap != NULL) {
+        ret = p_tombstoneRange(state->link, snap, ((TXNState*)txn)->tid,
+                               lo == NULL ? NULL : &loData, hi == NULL ? NULL : &hiData);
+    }
+    if (ret != 0) {
+        dbp->err(dbp, ret, "deleting range");
+        return ret == DB_LOCK_DEADLOCK ? DEADLOCK : FAILURE;
+    }
+    
+    //the whole range is logged as one record: which bounds there are and the low bound as
+    //its key, and the high bound as its payload
+    if (logicalLogOpen) {
+        char bounds[MAX_VARCHAR_LEN + 2];
+        DBT boundsData;
+        memset(&boundsData, 0, sizeof(DBT));
+        bounds[0] = (lo != NULL ? LOG_RANGE_LO : 0) | (hi != NULL ? LOG_RANGE_HI : 0);
+        memcpy(bounds + 1, loData.data, loData.size);
+        boundsData.data = bounds;
+        boundsData.size = 1 + loData.size;
+        return p_logRecord((TXNState*)txn, LOG_DELETE_RANGE, state->link->id, &boundsData, hi == NULL ? NULL : &hiData);
+    }
+    return SUCCESS;
+}
+
+#pragma mark upsertRecord, insertIfAbsent and compareAndSwap
+
+/*
+ These find the key once with the handle's cursor, reading it with DB_RMW so that the
+ pages they go on to change are write-locked from the start rather than upgraded, and
+ change the index through the same cursor. An index loaded from a snapshot is changed
+ through p_snapshotInsert and p_snapshotDelete instead. Each is logged as the inserts
+ and deletes it amounts to.
+ */
+
+/*
+ Maps the BDB error code of one of these writes to an ErrCode.
+ */
+ErrCode p_writeResult(DB *dbp, int ret, const char *what)
+{
+    if (ret == 0) {
+        return SUCCESS;
+    } else if (ret == DB_LOCK_DEADLOCK) {
+        return DEADLOCK;
+    }
+    dbp->err(dbp, ret, "%s", what);
+    return FAILURE;
+}
+
+/*
+ Points data at a copy of payload, including its NUL, as the BDB library wants it.
+ */
+void p_payloadData(const char *payload, char *copy, DBT *data)
+{
+    size_t len = strlen(payload) + 1;
+    memset(data, 0, sizeof(DBT));
+    memcpy(copy, payload, len);
+    data->data = copy;
+    data->size = len;
+}
+
+/*
+ Sets up key and data as DB_DBT_USERMEM buffers for a record found in the index, with
+ key holding the key to look for.
+ */
+void p_foundData(const DBT *search, char *keyBuf, char *dataBuf, DBT *key, DBT *data)
+{
+    memset(key, 0, sizeof(DBT));
+    memset(data, 0, sizeof(DBT));
+    memcpy(keyBuf, search->data, search->size);
+    key->data = keyBuf;
+    key->size = search->size;
+    key->ulen = MAX_VARCHAR_LEN + 1;
+    key->flags = DB_DBT_USERMEM;
+    data->data = dataBuf;
+    data->ulen = MAX_PAYLOAD_LEN + 1;
+    data->flags = DB_DBT_USERMEM;
+}
+
+ErrCode upsertRecord(IdxState *idxState, TxnState *txn, Key *k, const char *payload)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    
+    //the old payloads go and the new one comes in at once, so an auto-committed upsert
+    //gets a transaction of its own
+    if (txn == NULL) {
+        if ((ret = beginTransaction(&txn)) != SUCCESS) {
+            return ret;
+        }
+        if ((ret = upsertRecord(idxState, txn, k, payload)) != SUCCESS) {
+            abortTransaction(txn);
+            return ret;
+        }
+        return commitTransaction(txn);
+    }
+    
+    Key copy = *k;
+    copy.type = state->type;
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    if (p_setKeyDataFromKey(&copy, &key) < 0) {
+        dbp->errx(dbp, "bad upsert key type");
+        return FAILURE;
+    }
+    char payloadCopy[MAX_PAYLOAD_LEN + 1];
+    p_payloadData(payload, payloadCopy, &data);
+    
+    TXNState *txnState;
+    DBC *cursor = NULL;
+    if ((ret = p_prepTxnCursor(state, txn, &txnState, &cursor)) != SUCCESS) {
+        return ret;
+    }
+    
+    int replaced = 0;
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        ret = p_snapshotDelete(state, snap, txn, &key, NULL);
+        if (ret != SUCCESS && ret != KEY_NOTFOUND) {
+            return ret;
+        }
+        replaced = ret == SUCCESS;
+        if ((ret = p_snapshotInsert(state, snap, txn, &key, &data)) != SUCCESS) {
+            return ret;
+        }
+    } else {
+        char keyBuf[MAX_VARCHAR_LEN + 1];
+        char dataBuf[MAX_PAYLOAD_LEN + 1];
+        DBT found, foundData;
+        p_foundData(&key, keyBuf, dataBuf, &found, &foundData);
+        
+        //delete every payload of the key, then put the new one where they were
+        ret = p_cursorGet(cursor, &found, &foundData, DB_SET | DB_RMW);
+        while (ret == 0) {
+            if ((ret = p_cursorDel(cursor)) != 0) {
+                break;
+            }
+            replaced = 1;
+            ret = p_cursorGet(cursor, &found, &foundData, DB_NEXT_DUP);
+        }
+        DB_TXN *tid = ((TXNState*)txn)->tid;
+        if (ret == DB_NOTFOUND) {
+            ret = replaced ? p_countRecord(state->link, tid, COUNTED_TAG, &key, NULL, COUNT_REMOVE) : 0;
+        }
+        if (ret == 0 && (ret = p_cursorPut(cursor, &key, &data, DB_KEYFIRST)) == 0) {
+            ret = p_countRecord(state->link, tid, COUNTED_TAG, &key, &data, COUNT_ADD);
+        }
+        if ((ret = p_writeResult(dbp, ret, "upsertRecord")) != SUCCESS) {
+            return ret;
+        }
+    }
+    
+    if (logicalLogOpen) {
+        if (replaced && (ret = p_logRecord((TXNState*)txn, LOG_DELETE_KEY, state->link->id, &key, NULL)) != SUCCESS) {
+            return ret;
+        }
+        return p_logRecord((TXNState*)txn, LOG_INSERT, state->link->id, &key, &data);
+    }
+    return SUCCESS;
+}
+
+ErrCode insertIfAbsent(IdxState *idxState, TxnState *txn, Key *k, const char *payload)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    
+    //the key is looked for and inserted in one transaction
+    if (txn == NULL) {
+        if ((ret = beginTransaction(&txn)) != SUCCESS) {
+            return ret;
+        }
+        if ((ret = insertIfAbsent(idxState, txn, k, payload)) != SUCCESS) {
+            abortTransaction(txn);
+            return ret;
+        }
+        return commitTransaction(txn);
+    }
+    
+    Key copy = *k;
+    copy.type = state->type;
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    if (p_setKeyDataFromKey(&copy, &key) < 0) {
+        dbp->errx(dbp, "bad insert key type");
+        return FAILURE;
+    }
+    char payloadCopy[MAX_PAYLOAD_LEN + 1];
+    p_payloadData(payload, payloadCopy, &data);
+    
+    TXNState *txnState;
+    DBC *cursor = NULL;
+    if ((ret = p_prepTxnCursor(state, txn, &txnState, &cursor)) != SUCCESS) {
+        return ret;
+    }
+    
+    char keyBuf[MAX_VARCHAR_LEN + 1];
+    char dataBuf[MAX_PAYLOAD_LEN + 1];
+    DBT found, foundData;
+    p_foundData(&key, keyBuf, dataBuf, &found, &foundData);
+    
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        ret = p_mergedSeek(state->link, snap, ((TXNState*)txn)->tid, cursor, &key, NULL, 0, &found, &foundData, NULL);
+        if (ret == 0 && p_compareBytes(&found, &key) == 0) {
+            return ENTRY_EXISTS;
+        } else if (ret != 0 && ret != DB_NOTFOUND) {
+            return p_writeResult(dbp, ret, "insertIfAbsent");
+        }
+        if ((ret = p_snapshotInsert(state, snap, txn, &key, &data)) != SUCCESS) {
+            return ret;
+        }
+    } else {
+        ret = p_cursorGet(cursor, &found, &foundData, DB_SET | DB_RMW);
+        if (ret == 0) {
+            return ENTRY_EXISTS;
+        } else if (ret == DB_NOTFOUND && (ret = p_cursorPut(cursor, &key, &data, DB_KEYFIRST)) == 0) {
+            ret = p_countRecord(state->link, ((TXNState*)txn)->tid, COUNTED_TAG, &key, &data, COUNT_ADD);
+        }
+        if ((ret = p_writeResult(dbp, ret, "insertIfAbsent")) != SUCCESS) {
+            return ret;
+        }
+    }
+    
+    if (logicalLogOpen) {
+        return p_logRecord((TXNState*)txn, LOG_INSERT, state->link->id, &key, &data);
+    }
+    return SUCCESS;
+}
+
+ErrCode compareAndSwap(IdxState *idxState, TxnState *txn, Key *k, const char *expected, const char *replacement)
+{
+    BDBState *state = p_handleState(idxState);
+    int ret;
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    DB *dbp = state->dbp;
+    
+    //the swap happens in one transaction
+    if (txn == NULL) {
+        if ((ret = beginTransaction(&txn)) != SUCCESS) {
+            return ret;
+        }
+        if ((ret = compareAndSwap(idxState, txn, k, expected, replacement)) != SUCCESS) {
+            abortTransaction(txn);
+            return ret;
+        }
+        return commitTransaction(txn);
+    }
+    
+    Key copy = *k;
+    copy.type = state->type;
+    DBT key, oldData, newData;
+    memset(&key, 0, sizeof(DBT));
+    if (p_setKeyDataFromKey(&copy, &key) < 0) {
+        dbp->errx(dbp, "bad swap key type");
+        return FAILURE;
+    }
+    char oldCopy[MAX_PAYLOAD_LEN + 1];
+    char newCopy[MAX_PAYLOAD_LEN + 1];
+    p_payloadData(expected, oldCopy, &oldData);
+    p_payloadData(replacement, newCopy, &newData);
+    
+    TXNState *txnState;
+    DBC *cursor = NULL;
+    if ((ret = p_prepTxnCursor(state, txn, &txnState, &cursor)) != SUCCESS) {
+        return ret;
+    }
+    
+    //a replacement the key already has leaves the expected payload where it was
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    if (snap != NULL) {
+        if ((ret = p_snapshotDelete(state, snap, txn, &key, &oldData)) != SUCCESS) {
+            return ret;
+        }
+        if ((ret = p_snapshotInsert(state, snap, txn, &key, &newData)) != SUCCESS) {
+            if (ret == ENTRY_EXISTS) {
+                ErrCode undone = p_snapshotInsert(state, snap, txn, &key, &oldData);
+                return undone == SUCCESS ? ENTRY_EXISTS : undone;
+            }
+            return ret;
+        }
+    } else {
+        char keyBuf[MAX_VARCHAR_LEN + 1];
+        char dataBuf[MAX_PAYLOAD_LEN + 1];
+        DBT found, foundData;
+        p_foundData(&key, keyBuf, dataBuf, &found, &foundData);
+        memcpy(dataBuf, oldData.data, oldData.size);
+        foundData.size = oldData.size;
+        
+        ret = p_cursorGet(cursor, &found, &foundData, DB_GET_BOTH | DB_RMW);
+        if (ret == DB_NOTFOUND) {
+            return ENTRY_DNE;
+        }
+        if (ret == 0 && (ret = p_cursorDel(cursor)) == 0) {
+            ret = p_cursorPut(cursor, &key, &newData, DB_KEYFIRST);
+            if (ret == DB_KEYEXIST) {
+                ret = p_cursorPut(cursor, &key, &oldData, DB_KEYFIRST);
+                if (ret == 0) {
+                    return ENTRY_EXISTS;
+                }
+            } else if (ret == 0 &&
+                       (ret = p_countRecord(state->link, ((TXNState*)txn)->tid, COUNTED_TAG, &key, &oldData, COUNT_REMOVE)) == 0) {
+                ret = p_countRecord(state->link, ((TXNState*)txn)->tid, COUNTED_TAG, &key, &newData, COUNT_ADD);
+            }
+        }
+        if ((ret = p_writeResult(dbp, ret, "compareAndSwap")) != SUCCESS) {
+            return ret;
+        }
+    }
+    
+    if (logicalLogOpen) {
+        if ((ret = p_logRecord((TXNState*)txn, LOG_DELETE, state->link->id, &key, &oldData)) != SUCCESS) {
+            return ret;
+        }
+        return p_logRecord((TXNState*)txn, LOG_INSERT, state->link->id, &key, &newData);
+    }
+    return SUCCESS;
+}
+
+#pragma mark insertRecords and deleteRecords
+
+/*
+ Inserts or deletes a batch of records in index order, within one transaction if the
+ caller has none, so that consecutive records find the pages they change already latched
+ into the cache by the one before, and the batch is logged and committed once. One
+ cursor makes every change, with the keys p_sortBatch encoded; an index loaded from a
+ snapshot goes through insertRecord and deleteRecord, which maintain its overlay.
+ */
+
+/*
+ Makes one change of a batch through the batch's cursor and counts and logs it.
+ @return the ErrCode insertRecord or deleteRecord would have returned for it.
+ */
+ErrCode p_writeBatchRecord(BDBState *state, TXNState *txnState, DBC *cursor, DBT *key, const char *payload, int insert)
+{
+    DB *dbp = state->dbp;
+    DB_TXN *tid = txnState->tid;
+    char keyBuf[MAX_VARCHAR_LEN + 1];
+    char dataBuf[MAX_PAYLOAD_LEN + 1];
+    DBT data, foundKey, foundData;
+    int ret;
+    
+    if (insert) {
+        p_payloadData(payload, dataBuf, &data);
+        ret = p_cursorPut(cursor, key, &data, DB_KEYFIRST);
+        if (ret == 0) {
+            ret = p_countRecord(state->link, tid, COUNTED_TAG, key, &data, COUNT_ADD);
+        }
+        if (ret == DB_KEYEXIST) {
+            return ENTRY_EXISTS;
+        } else if (ret != 0) {
+            return p_writeResult(dbp, ret, "cursor->put in insertRecords");
+        }
+        return logicalLogOpen ? p_logRecord(txnState, LOG_INSERT, state->link->id, key, &data) : SUCCESS;
+    }
+    
+    p_foundData(key, keyBuf, dataBuf, &foundKey, &foundData);
+    if (memcmp(payload, NULL_PAYLOAD, MAX_PAYLOAD_LEN) == 0) {
+        //every record with the key goes, so only the keys are read
+        foundData.flags |= DB_DBT_PARTIAL;
+        foundData.dlen = 0;
+        ret = p_cursorGet(cursor, &foundKey, &foundData, DB_SET);
+        if (ret == DB_NOTFOUND) {
+            return KEY_NOTFOUND;
+        }
+        while (ret == 0 && (ret = p_cursorDel(cursor)) == 0) {
+            ret = p_cursorGet(cursor, &foundKey, &foundData, DB_NEXT_DUP);
+        }
+        if (ret == DB_NOTFOUND) {
+            ret = p_countRecord(state->link, tid, COUNTED_TAG, key, NULL, COUNT_REMOVE);
+        }
+        if (ret != 0) {
+            return p_writeResult(dbp, ret, "cursor->del in deleteRecords");
+        }
+        return logicalLogOpen ? p_logRecord(txnState, LOG_DELETE_KEY, state->link->id, key, NULL) : SUCCESS;
+    }
+    
+    p_payloadData(payload, dataBuf, &data);
+    foundData.size = data.size;
+    ret = p_cursorGet(cursor, &foundKey, &foundData, DB_GET_BOTH);
+    if (ret == DB_NOTFOUND) {
+        return ENTRY_DNE;
+    }
+    if (ret == 0 && (ret = p_cursorDel(cursor)) == 0) {
+        ret = p_countRecord(state->link, tid, COUNTED_TAG, key, &data, COUNT_REMOVE);
+    }
+    if (ret != 0) {
+        return p_writeResult(dbp, ret, "cursor->del in deleteRecords");
+    }
+    return logicalLogOpen ? p_logRecord(txnState, LOG_DELETE, state->link->id, key, &data) : SUCCESS;
+}
+
+ErrCode p_writeBatch(IdxState *idxState, TxnState *txn, Record *records, int n, ErrCode *results, int insert)
+{
+    BDBState *state = p_handleState(idxState);
+    DB *dbp = state->dbp;
+    ErrCode ret;
+    int i;
+    
+    if (n < 0) {
+        return FAILURE;
+    }
+    if (p_checkHandle(state) != SUCCESS) {
+        for (i = 0; i < n; i++) {
+            results[i] = DB_DNE;
+        }
+        return DB_DNE;
+    }
+    
+    BatchKey inlineKeys[BATCH_INLINE_KEYS];
+    BatchKey *keys = inlineKeys;
+    if (n > BATCH_INLINE_KEYS && (keys = malloc(n * sizeof(BatchKey))) == NULL) {
+        for (i = 0; i < n; i++) {
+            results[i] = FAILURE;
+        }
+        return FAILURE;
+    }
+    i = 0;
+    if ((ret = p_sortBatch(state, records, n, 1, keys)) != SUCCESS) {
+        goto finish;
+    }
+    
+    TxnState *batchTxn = txn;
+    if (txn == NULL && (ret = beginTransaction(&batchTxn)) != SUCCESS) {
+        goto finish;
+    }
+    TXNState *txnState = (TXNState*)batchTxn;
+    
+    //records read ahead before the batch would miss its changes
+    if ((ret = p_dropReadAhead(txnState, state->link->id)) != SUCCESS) {
+        goto finishTxn;
+    }
+    
+    const Snapshot *snap = __atomic_load_n(&state->link->snapshot, __ATOMIC_ACQUIRE);
+    DBC *cursor = NULL;
+    int err;
+    if (snap == NULL && (err = dbp->cursor(dbp, txnState->tid, &cursor, 0)) != 0) {
+        ret = p_writeResult(dbp, err, "DB->cursor in insertRecords");
+        goto finishTxn;
+    }
+    
+    for (; i < n; i++) {
+        Record *record = &records[keys[i].index];
+        ErrCode result;
+        if (snap != NULL && insert) {
+            result = insertRecord(idxState, batchTxn, &record->key, record->payload);
+        } else if (snap != NULL) {
+            result = deleteRecord(idxState, batchTxn, record);
+        } else {
+            result = p_writeBatchRecord(state, txnState, cursor, &keys[i].key, record->payload, insert);
+        }
+        results[keys[i].index] = result;
+        if (result != SUCCESS && result != ENTRY_EXISTS && result != ENTRY_DNE && result != KEY_NOTFOUND) {
+            ret = result;
+            i++;
+            break;
+        }
+    }
+    
+    if (cursor != NULL) {
+#if DB_VERSION_MINOR>=7
+        cursor->close(cursor);
+#else
+        cursor->c_close(cursor);
+#endif
+    }
+    
+finishTxn:
+    if (txn == NULL) {
+        if (ret == SUCCESS) {
+            ret = commitTransaction(batchTxn);
+        } else {
+            abortTransaction(batchTxn);
+        }
+    }
+    
+finish:
+    //records the batch did not get to share its ErrCode
+    for (; i < n; i++) {
+        results[keys[i].index] = ret;
+    }
+    if (keys != inlineKeys) {
+        free(keys);
+    }
+    return ret;
+}
+
+ErrCode insertRecords(IdxState *idxState, TxnState *txn, Record *records, int n, ErrCode *results)
+{
+    return p_writeBatch(idxState, txn, records, n, results, 1);
+}
+
+ErrCode deleteRecords(IdxState *idxState, TxnState *txn, Record *records, int n, ErrCode *results)
+{
+    return p_writeBatch(idxState, txn, records, n, results, 0);
+}
+
+#pragma mark bulkLoad
+/*
+ bulkLoad collects its input into runs of BULK_RUN_ENTRIES and sorts each in memory. When
+ the input takes more than one run, every sorted run is spilled to an unlinked temporary
+ file and the runs are merged. The sorted records are inserted BULK_BATCH_ENTRIES per
+ transaction, handed to BDB in one bulk put where it has them, so BDB fills each leaf by
+ appending to it and a batch costs one call and one commit.
+ */
+#define BULK_RUN_ENTRIES (64 * 1024)
+#define BULK_BATCH_ENTRIES 4096
+#define BULK_TEMP_TEMPLATE ENV_DIRECTORY "/bulk.XXXXXX"
+
+typedef struct
+    {
+        uint8_t     keySize;
+        uint8_t     dataSize;
+        char        key[MAX_VARCHAR_LEN];   //as stored in the index
+        char        data[MAX_PAYLOAD_LEN + 1];
+    } BulkEntry;
+
+typedef struct
+    {
+        BDBState    *state;
+        BulkEntry   *batch;     //kept until the batch commits, so a deadlocked batch can be retried
+        uint32_t    numBatch;
+    } BulkWriter;
+
+/*
+ Orders BulkEntry pointers as the index orders records: by key, then by payload.
+ */
+int p_compareBulkEntry(const void *a, const void *b)
+{
+    const BulkEntry *x = *(BulkEntry * const *)a;
+    const BulkEntry *y = *(BulkEntry * const *)b;
+    int c = memcmp(x->key, y->key, x->keySize < y->keySize ? x->keySize : y->keySize);
+    if (c != 0) {
+        return c;
+    }
+    if (x->keySize != y->keySize) {
+        return x->keySize < y->keySize ? -1 : 1;
+    }
+    c = memcmp(x->data, y->data, x->dataSize < y->dataSize ? x->dataSize : y->dataSize);
+    if (c != 0) {
+        return c;
+    }
+    return x->dataSize < y->dataSize ? -1 : x->dataSize > y->dataSize;
+}
+
+#if DB_VERSION_MAJOR > 4 || DB_VERSION_MINOR >= 8
+/*
+ Inserts the batch into the index's own DB with bulk puts, each handing BDB every
+ remaining record in one DB_MULTIPLE_KEY buffer. A record the index already has stops a
+ bulk put, as ENTRY_EXISTS would stop insertRecord, so the records after it go in with the
+ next one. The records written are counted and logged as insertRecord would.
+ */
+ErrCode p_bulkPut(BulkWriter *writer, TXNState *txnState)
+{
+    BDBState *state = writer->state;
+    DB *dbp = state->dbp;
+    size_t size = sizeof(u_int32_t);
+    uint32_t i;
+    for (i = 0; i < writer->numBatch; i++) {
+        size += writer->batch[i].keySize + writer->batch[i].dataSize + 4 * sizeof(u_int32_t);
+    }
+    void *buf = malloc(size);
+    if (buf == NULL) {
+        return FAILURE;
+    }
+    
+    ErrCode result = SUCCESS;
+    uint32_t from = 0;
+    while (from < writer->numBatch) {
+        DBT multiple, empty;
+        memset(&multiple, 0, sizeof(DBT));
+        memset(&empty, 0, sizeof(DBT));
+        multiple.data = buf;
+        multiple.ulen = size;
+        multiple.flags = DB_DBT_USERMEM;
+        void *pointer;
+        DB_MULTIPLE_WRITE_INIT(pointer, &multiple);
+        for (i = from; i < writer->numBatch; i++) {
+            BulkEntry *entry = &writer->batch[i];
+            DB_MULTIPLE_KEY_WRITE_NEXT(pointer, &multiple, entry->key, entry->keySize, entry->data, entry->dataSize);
+        }
+        
+        int ret = dbp->put(dbp, txnState->tid, &multiple, &empty, DB_MULTIPLE_KEY);
+        uint32_t written = ret == 0 ? writer->numBatch - from : multiple.doff;
+        for (i = from; i < from + written && result == SUCCESS; i++) {
+            BulkEntry *entry = &writer->batch[i];
+            DBT key, data;
+            memset(&key, 0, sizeof(DBT));
+            memset(&data, 0, sizeof(DBT));
+            key.data = entry->key;
+            key.size = entry->keySize;
+            data.data = entry->data;
+            data.size = entry->dataSize;
+            int err = p_countRecord(state->link, txnState->tid, COUNTED_TAG, &key, &data, COUNT_ADD);
+            if (err != 0) {
+                result = p_writeResult(dbp, err, "counting bulk load");
+            } else if (logicalLogOpen) {
+                result = p_logRecord(txnState, LOG_INSERT, state->link->id, &key, &data);
+            }
+        }
+        if (result != SUCCESS) {
+            break;
+        } else if (ret == DB_KEYEXIST) {
+            from += written + 1;
+        } else if (ret != 0) {
+            result = p_writeResult(dbp, ret, "DB->put in bulk load");
+            break;
+        } else {
+            from = writer->numBatch;
+        }
+    }
+    free(buf);
+    return result;
+}
+#endif
+
+/*
+ Inserts the batch one record at a time through insertRecord, which an index loaded from
+ a snapshot needs so that its tombstones are kept.
+ */
+ErrCode p_bulkInsertEach(BulkWriter *writer, TxnState *txn)
+{
+    BDBState *state = writer->state;
+    uint32_t i;
+    for (i = 0; i < writer->numBatch; i++) {
+        BulkEntry *entry = &writer->batch[i];
+        Key k;
+        DBT key;
+        memset(&key, 0, sizeof(DBT));
+        key.data = entry->key;
+        key.size = entry->keySize;
+        p_setKeyFromKeyData(&key, state->type, &k);
+        ErrCode ret = insertRecord((IdxState*)state, txn, &k, entry->data);
+        if (ret != SUCCESS && ret != ENTRY_EXISTS) {
+            return ret;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ Inserts the pending batch in one transaction, starting it over after a deadlock.
+ */
+ErrCode p_bulkCommit(BulkWriter *writer)
+{
+    ErrCode ret = SUCCESS;
+    
+    //the batch is sorted, so a record repeated within it comes right after the first
+    uint32_t i, n = 0;
+    for (i = 0; i < writer->numBatch; i++) {
+        BulkEntry *entry = &writer->batch[i];
+        if (n > 0) {
+            BulkEntry *last = &writer->batch[n - 1];
+            if (p_compareBulkEntry(&last, &entry) == 0) {
+                continue;
+            }
+        }
+        if (n != i) {
+            writer->batch[n] = *entry;
+        }
+        n++;
+    }
+    writer->numBatch = n;
+    
+    while (writer->numBatch > 0) {
+        //the environment exists already, and recovery loads checkpoints before p_init returns
+        TxnState *txn;
+        if ((ret = p_beginTransaction(&txn)) != SUCCESS) {
+            return ret;
+        }
+        
+#if DB_VERSION_MAJOR > 4 || DB_VERSION_MINOR >= 8
+        if (__atomic_load_n(&writer->state->link->snapshot, __ATOMIC_ACQUIRE) == NULL) {
+            ret = p_bulkPut(writer, (TXNState*)txn);
+        } else {
+            ret = p_bulkInsertEach(writer, txn);
+        }
+#else
+        ret = p_bulkInsertEach(writer, txn);
+#endif
+        
+        if (ret != SUCCESS) {
+            abortTransaction(txn);
+        } else if ((ret = commitTransaction(txn)) == SUCCESS) {
+            writer->numBatch = 0;
+        }
+        if (ret != SUCCESS && ret != DEADLOCK) {
+            return ret;
+        }
+    }
+    return SUCCESS;
+}
+
+ErrCode p_bulkAdd(BulkWriter *writer, const BulkEntry *entry)
+{
+    writer->batch[writer->numBatch++] = *entry;
+    if (writer->numBatch == BULK_BATCH_ENTRIES) {
+        return p_bulkCommit(writer);
+    }
+    return SUCCESS;
+}
+
+/*
+ Writes a sorted run to an unlinked temporary file, positioned for reading it back, and
+ adds it to the runs.
+ */
+ErrCode p_spillRun(FILE ***runs, uint32_t *numRuns, BulkEntry **order, uint32_t n)
+{
+    FILE **grown = realloc(*runs, (*numRuns + 1) * sizeof(FILE *));
+    if (grown == NULL) {
+        return FAILURE;
+    }
+    *runs = grown;
+    
+    char path[] = BULK_TEMP_TEMPLATE;
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderrfile, "could not create bulk load run. errno %d\n", errno);
+        return FAILURE;
+    }
+    unlink(path);
+    FILE *run = fdopen(fd, "w+");
+    if (run == NULL) {
+        close(fd);
+        return FAILURE;
+    }
+    
+    uint32_t i;
+    for (i = 0; i < n; i++) {
+        if (fwrite(order[i], sizeof(BulkEntry), 1, run) != 1) {
+            fclose(run);
+            return FAILURE;
+        }
+    }
+    if (fflush(run) != 0 || fseek(run, 0, SEEK_SET) != 0) {
+        fclose(run);
+        return FAILURE;
+    }
+    (*runs)[(*numRuns)++] = run;
+    return SUCCESS;
+}
+
+/*
+ Restores the heap order of the runs below slot i of heap, which orders runs by their
+ head records, smallest first.
+ */
+void p_siftRun(uint32_t *heap, uint32_t n, uint32_t i, BulkEntry *heads)
+{
+    while (1) {
+        uint32_t least = i, child = 2 * i + 1;
+        uint32_t c;
+        for (c = child; c < child + 2 && c < n; c++) {
+            BulkEntry *a = &heads[heap[c]], *b = &heads[heap[least]];
+            if (p_compareBulkEntry(&a, &b) < 0) {
+                least = c;
+            }
+        }
+        if (least == i) {
+            return;
+        }
+        uint32_t swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+/*
+ Merges the spilled runs into the writer, taking the smallest head among them each time
+ from a binary heap of the runs.
+ */
+ErrCode p_mergeRuns(BulkWriter *writer, FILE **runs, uint32_t numRuns)
+{
+    BulkEntry *heads = malloc(numRuns * sizeof(BulkEntry));
+    uint32_t *heap = malloc(numRuns * sizeof(uint32_t));
+    if (heads == NULL || heap == NULL) {
+        free(heads);
+        free(heap);
+        return FAILURE;
+    }
+    uint32_t i, n = 0;
+    for (i = 0; i < numRuns; i++) {
+        if (fread(&heads[i], sizeof(BulkEntry), 1, runs[i]) == 1) {
+            heap[n++] = i;
+        }
+    }
+    for (i = n / 2; i-- > 0;) {
+        p_siftRun(heap, n, i, heads);
+    }
+    
+    ErrCode ret = SUCCESS;
+    while (ret == SUCCESS && n > 0) {
+        uint32_t from = heap[0];
+        ret = p_bulkAdd(writer, &heads[from]);
+        //an exhausted run leaves the heap, the last run taking its place
+        if (fread(&heads[from], sizeof(BulkEntry), 1, runs[from]) != 1) {
+            heap[0] = heap[--n];
+        }
+        p_siftRun(heap, n, 0, heads);
+    }
+    
+    for (i = 0; i < numRuns && ret == SUCCESS; i++) {
+        if (ferror(runs[i])) {
+            ret = FAILURE;
+        }
+    }
+    free(heads);
+    free(heap);
+    return ret;
+}
+
+ErrCode bulkLoad(IdxState *idxState, RecordIterator next, void *context)
+{
+    BDBState *state = p_handleState(idxState);
+    
+    //the index may have been dropped or truncated since this handle was opened
+    if (p_checkHandle(state) != SUCCESS) {
+        return DB_DNE;
+    }
+    
+    BulkEntry *entries = malloc(BULK_RUN_ENTRIES * sizeof(BulkEntry));
+    BulkEntry **order = malloc(BULK_RUN_ENTRIES * sizeof(BulkEntry *));
+    BulkWriter writer;
+    writer.state = state;
+    writer.batch = malloc(BULK_BATCH_ENTRIES * sizeof(BulkEntry));
+    writer.numBatch = 0;
+    FILE **runs = NULL;
+    uint32_t numRuns = 0, i;
+    ErrCode ret = SUCCESS;
+    if (entries == NULL || order == NULL || writer.batch == NULL) {
+        ret = FAILURE;
+        goto finish;
+    }
+    
+    //read and sort the input, spilling every full run
+    uint32_t n = 0;
+    Record record;
+    while (1) {
+        memset(&record, 0, sizeof(Record));
+        if ((ret = next(context, &record)) != SUCCESS) {
+            if (ret == DB_END) {
+                ret = SUCCESS;
+                break;
+            }
+            goto finish;
+        }
+        
+        DBT key;
+        memset(&key, 0, sizeof(DBT));
+        if (record.key.type != state->type || p_setKeyDataFromKey(&record.key, &key) < 0 ||
+            key.size > MAX_VARCHAR_LEN) {
+            state->dbp->errx(state->dbp, "bad bulk load key");
+            ret = FAILURE;
+            goto finish;
+        }
+        BulkEntry *entry = &entries[n];
+        size_t len = strnlen(record.payload, MAX_PAYLOAD_LEN);
+        entry->keySize = key.size;
+        memcpy(entry->key, key.data, key.size);
+        entry->dataSize = len + 1;
+        memcpy(entry->data, record.payload, len);
+        entry->data[len] = '\0';
+        order[n++] = entry;
+        
+        if (n == BULK_RUN_ENTRIES) {
+            qsort(order, n, sizeof(BulkEntry *), p_compareBulkEntry);
+            if ((ret = p_spillRun(&runs, &numRuns, order, n)) != SUCCESS) {
+                goto finish;
+            }
+            n = 0;
+        }
+    }
+    qsort(order, n, sizeof(BulkEntry *), p_compareBulkEntry);
+    
+    //input that fit in one run is inserted straight from memory
+    if (numRuns == 0) {
+        for (i = 0; i < n && ret == SUCCESS; i++) {
+            ret = p_bulkAdd(&writer, order[i]);
+        }
+    } else {
+        if (n > 0 && (ret = p_spillRun(&runs, &numRuns, order, n)) != SUCCESS) {
+            goto finish;
+        }
+        ret = p_mergeRuns(&writer, runs, numRuns);
+    }
+    if (ret == SUCCESS) {
+        ret = p_bulkCommit(&writer);
+    }
+    
+finish:
+    for (i = 0; i < numRuns; i++) {
+        fclose(runs[i]);
+    }
+    free(runs);
+    free(entries);
+    free(order);
+    free(writer.batch);
+    return ret;
+}
+
+ErrCode p_readRecordFile(void *context, Record *record)
+{
+    size_t n = fread(record, 1, sizeof(Record), (FILE *)context);
+    if (n == sizeof(Record)) {
+        return SUCCESS;
+    }
+    //a partial record at the end means the file is damaged
+    return n == 0 && !ferror((FILE *)context) ? DB_END : FAILURE;
+}
+
+ErrCode bulkLoadFile(IdxState *idxState, const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderrfile, "could not open %s for bulk load. errno %d\n", path, errno);
+        return FAILURE;
+    }
+    ErrCode ret = bulkLoad(idxState, p_readRecordFile, in);
+    fclose(in);
+    return ret;
+}
+
+/*
+ Receives the records of an index in order from p_scanLink.
+ */
+typedef ErrCode (*EntrySink)(void *context, const DBT *key, const DBT *data);
+
+/*
+ Passes every record of an open index to sink in index order, merging the index's own
+ DB with the live entries of its snapshot, if any, and reading both within tid.
+ @return the sink's error if it fails.
+ */
+ErrCode p_scanLink(DBLink *link, DB_TXN *tid, EntrySink sink, void *context)
+{
     int ret;
-    DB *dbp = state->dbp;
-    //if this is not part of a larger transaction, temporarily create one to use
-    if (txn == NULL) {
-        ret = beginTransaction((TxnState**)txnState);
+    DB *dbp = link->dbp;
+    DBC *cursor;
+    if ((ret = dbp->cursor(dbp, tid, &cursor, 0)) != 0) {
+        dbp->err(dbp, ret, "Creating cursor in p_scanLink");
+        return FAILURE;
+    }
+    p_setCursorPriority(cursor, 1);
+    
+    char keyBuf[MAX_VARCHAR_LEN + 1];
+    char dataBuf[MAX_PAYLOAD_LEN + 1];
+    DBT key, data, entryKey, entryData;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = keyBuf;
+    key.ulen = sizeof(keyBuf);
+    key.flags = DB_DBT_USERMEM;
+    data.data = dataBuf;
+    data.ulen = sizeof(dataBuf);
+    data.flags = DB_DBT_USERMEM;
+    uint64_t i = 0;
+    TombstoneRun run;
+    memset(&run, 0, sizeof(run));
+    ErrCode result = SUCCESS;
+    
+    int dbRet = p_cursorGet(cursor, &key, &data, DB_FIRST);
+    const Snapshot *snap = __atomic_load_n(&link->snapshot, __ATOMIC_ACQUIRE);
+    int entryRet = snap == NULL ? DB_NOTFOUND : p_liveEntry(link, snap, tid, &i, &entryKey, &entryData, &run);
+    while (dbRet == 0 || entryRet == 0) {
+        if (entryRet == 0 && (dbRet != 0 || p_compareRecord(&entryKey, &entryData, &key, &data) < 0)) {
+            if ((result = sink(context, &entryKey, &entryData)) != SUCCESS) {
+                break;
+            }
+            i++;
+            entryRet = p_liveEntry(link, snap, tid, &i, &entryKey, &entryData, &run);
+        } else {
+            if ((result = sink(context, &key, &data)) != SUCCESS) {
+                break;
+            }
+            dbRet = p_cursorGet(cursor, &key, &data, DB_NEXT);
+        }
+    }
+    if (result == SUCCESS && (dbRet != DB_NOTFOUND || entryRet != DB_NOTFOUND)) {
+        dbp->err(dbp, dbRet != DB_NOTFOUND ? dbRet : entryRet, "reading index %s", link->name);
+        result = dbRet == DB_LOCK_DEADLOCK || entryRet == DB_LOCK_DEADLOCK ? DEADLOCK : FAILURE;
+    }
+    
+#if DB_VERSION_MINOR>=7
+    cursor->close(cursor);
+#else
+    cursor->c_close(cursor);
+#endif
+    return result;
+}
+
+typedef struct
+    {
+        FILE        *out;
+        uint64_t    pos;
+        uint64_t    *offsets;
+        uint64_t    count;
+        uint64_t    cap;
+    } SnapshotWriter;
+
+/*
+ Writes one snapshot entry, recording its offset.
+ */
+ErrCode p_writeSnapshotEntry(void *context, const DBT *key, const DBT *data)
+{
+    SnapshotWriter *writer = context;
+    if (writer->count == writer->cap) {
+        uint64_t size = writer->cap == 0 ? 1024 : writer->cap * 2;
+        uint64_t *grown = realloc(writer->offsets, size * sizeof(uint64_t));
+        if (grown == NULL) {
+            return FAILURE;
+        }
+        writer->offsets = grown;
+        writer->cap = size;
+    }
+    writer->offsets[writer->count++] = writer->pos;
+    
+    SnapshotEntry entry;
+    entry.keySize = key->size;
+    entry.dataSize = data->size;
+    if (fwrite(&entry, sizeof(entry), 1, writer->out) != 1 ||
+        fwrite(key->data, 1, key->size, writer->out) != key->size ||
+        fwrite(data->data, 1, data->size, writer->out) != data->size) {
+        return FAILURE;
+    }
+    writer->pos += sizeof(entry) + key->size + data->size;
+    return SUCCESS;
+}
+
+/*
+ Writes an open index to a snapshot file, reading it in a transaction begun with txnFlags.
+ The caller holds DBLINK_LOCK or a reference to the index.
+ */
+ErrCode p_saveSnapshot(DBLink *link, const char *path, u_int32_t txnFlags)
+{
+    int ret;
+    char *tmpPath = malloc(strlen(path) + 5);
+    if (tmpPath == NULL) {
+        return FAILURE;
+    }
+    strcpy(tmpPath, path);
+    strcat(tmpPath, ".tmp");
+    
+    DB_TXN *tid = NULL;
+    SnapshotWriter writer;
+    memset(&writer, 0, sizeof(SnapshotWriter));
+    ErrCode result = FAILURE;
+    
+    //read everything in one transaction, which is consistent unless txnFlags relax its locking
+    if ((ret = env->txn_begin(env, NULL, &tid, txnFlags)) != 0) {
+        env->err(env, ret, "txn_begin in saveSnapshot");
+        tid = NULL;
+        goto finish;
+    }
+    if ((writer.out = fopen(tmpPath, "w")) == NULL) {
+        fprintf(stderrfile, "could not create snapshot %s. errno %d\n", tmpPath, errno);
+        goto finish;
+    }
+    
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(SnapshotHeader));
+    if (fwrite(&header, sizeof(SnapshotHeader), 1, writer.out) != 1) {
+        goto finish;
+    }
+    writer.pos = sizeof(SnapshotHeader);
+    if (p_scanLink(link, tid, p_writeSnapshotEntry, &writer) != SUCCESS) {
+        goto finish;
+    }
+    
+    //the offsets follow the entries, aligned for direct use from the mapping
+    static const char padding[sizeof(uint64_t)];
+    size_t pad = (sizeof(uint64_t) - writer.pos % sizeof(uint64_t)) % sizeof(uint64_t);
+    if (fwrite(padding, 1, pad, writer.out) != pad ||
+        fwrite(writer.offsets, sizeof(uint64_t), writer.count, writer.out) != writer.count) {
+        goto finish;
+    }
+    memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    header.type = link->type;
+    header.count = writer.count;
+    header.offsetsPos = writer.pos + pad;
+    if (fseek(writer.out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(SnapshotHeader), 1, writer.out) != 1 ||
+        fflush(writer.out) != 0 || fdatasync(fileno(writer.out)) != 0) {
+        goto finish;
+    }
+    
+    ret = fclose(writer.out);
+    writer.out = NULL;
+    if (ret != 0) {
+        goto finish;
+    }
+    if (rename(tmpPath, path) != 0) {
+        fprintf(stderrfile, "could not rename snapshot to %s. errno %d\n", path, errno);
+        goto finish;
+    }
+    result = SUCCESS;
+    
+finish:
+    if (writer.out != NULL) {
+        fclose(writer.out);
+    }
+    if (result != SUCCESS) {
+        unlink(tmpPath);
+    }
+    if (tid != NULL) {
+        tid->commit(tid, 0);
+    }
+    free(writer.offsets);
+    free(tmpPath);
+    return result;
+}
+
+#pragma mark saveSnapshot
+ErrCode saveSnapshot(const char *name, const char *path)
+{
+    int ret;
+    if ((ret = p_init()) != SUCCESS) {
+        return ret;
+    }
+    
+    //hold the dblink lock so the index cannot be dropped while it is being written out
+    if ((ret = pthread_mutex_lock(&DBLINK_LOCK)) != 0) {
+        printf("can't acquire mutex lock: %d\n", ret);
+    }
+    DBLink *link;
+    if ((ret = p_lookupOpenIndex(name, &link)) == SUCCESS) {
+        ret = p_saveSnapshot(link, path, 0);
+    }
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    return ret;
+}
+
+/*
+ Copies a validated snapshot into the environment, durably, under its final name.
+ */
+ErrCode p_copySnapshot(const Snapshot *snap, const char *dest)
+{
+    int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        fprintf(stderrfile, "could not create %s. errno %d\n", dest, errno);
+        return FAILURE;
+    }
+    size_t done = 0;
+    while (done < snap->size) {
+        ssize_t n = write(fd, snap->map + done, snap->size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderrfile, "could not write %s. errno %d\n", dest, errno);
+            close(fd);
+            unlink(dest);
+            return FAILURE;
+        }
+        done += n;
+    }
+    if (fdatasync(fd) != 0) {
+        close(fd);
+        unlink(dest);
+        return FAILURE;
+    }
+    close(fd);
+    return SUCCESS;
+}
+
+/*
+ Replaces the contents of an open index with a snapshot file. The caller holds DBLINK_LOCK.
+ */
+ErrCode p_attachSnapshot(DBLink *link, const char *path)
+{
+    int ret;
+    u_int32_t count;
+    
+    //check the whole file once, so it can be trusted whenever it is mapped later
+    Snapshot *source, *snap = NULL;
+    if (p_mapSnapshot(path, link->type, 1, &source) != SUCCESS) {
+        return FAILURE;
+    }
+    uint32_t seq = link->snapshot == NULL ? 1 : link->snapshot->seq + 1;
+    char *dest = p_snapshotPath(link->file, seq);
+    if (dest == NULL || p_copySnapshot(source, dest) != SUCCESS) {
+        p_unmapSnapshot(source);
+        free(dest);
+        return FAILURE;
+    }
+    p_unmapSnapshot(source);
+    
+    if (p_mapSnapshot(dest, link->type, 0, &snap) != SUCCESS ||
+        (link->side == NULL && p_openSide(link, DB_CREATE) != SUCCESS)) {
+        goto fail;
+    }
+    snap->seq = seq;
+    
+    //the snapshot replaces the index's contents, its tombstones, and the previous snapshot at once
+    DB_TXN *tid;
+    char tag = SNAPSHOT_SEQ_KEY;
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = &tag;
+    key.size = 1;
+    data.data = &seq;
+    data.size = sizeof(seq);
+    if ((ret = env->txn_begin(env, NULL, &tid, 0)) != 0) {
+        env->err(env, ret, "txn_begin in loadSnapshot");
+        goto fail;
+    }
+    if ((ret = link->dbp->truncate(link->dbp, tid, &count, 0)) != 0 ||
+        (ret = link->side->truncate(link->side, tid, &count, 0)) != 0 ||
+        (ret = link->side->put(link->side, tid, &key, &data, 0)) != 0 ||
+        (ret = p_truncateCounts(link, tid)) != 0) {
+        link->dbp->err(link->dbp, ret, "replacing index with snapshot");
+        tid->abort(tid);
+        goto fail;
+    }
+    if ((ret = tid->commit(tid, DB_TXN_SYNC)) != 0) {
+        env->err(env, ret, "DB_TXN->commit in loadSnapshot");
+        goto fail;
+    }
+    
+    Snapshot *old = link->snapshot;
+    __atomic_store_n(&link->snapshot, snap, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&tombstoneGen, 1, __ATOMIC_RELEASE);
+    if (old != NULL) {
+        p_retireSnapshot(link, old);
+    }
+    
+    free(dest);
+    return SUCCESS;
+    
+fail:
+    if (snap != NULL) {
+        p_unmapSnapshot(snap);
+    }
+    unlink(dest);
+    free(dest);
+    return FAILURE;
+}
+
+#pragma mark loadSnapshot
+ErrCode loadSnapshot(const char *name, const char *path)
+{
+    int ret;
+    if ((ret = p_init()) != SUCCESS) {
+        return ret;
+    }
+    //the logical log has no record for replacing an index wholesale
+    if (logicalLog) {
+        return FAILURE;
+    }
+    
+    if ((ret = pthread_mutex_lock(&DBLINK_LOCK)) != 0) {
+        printf("can't acquire mutex lock: %d\n", ret);
+    }
+    DBLink *link;
+    if ((ret = p_lookupOpenIndex(name, &link)) == SUCCESS) {
+        ret = p_attachSnapshot(link, path);
+    }
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    return ret;
+}
+
+#pragma mark logical log recovery and checkpoints
+
+#define LOG_PATH_LEN (sizeof(LOGICAL_PREFIX) + 16)
+
+void p_logPath(char *path, uint32_t gen)
+{
+    snprintf(path, LOG_PATH_LEN, LOGICAL_PREFIX "%u", gen);
+}
+
+/*
+ One recovery thread's share of replay: the ids congruent to part modulo the number of
+ parts. An index only ever has one id, so each is replayed by a single thread in log
+ order, and the threads never touch the same index. Holds the replay handle for the index
+ each of its ids is bound to, and the transaction it applies records in. Bindings carry
+ over from one log file to the next.
+ */
+typedef struct
+    {
+        BDBState    *states;    //indexed by id; the link of an unbound id is NULL
+        uint32_t    numStates;
+        TxnState    *txn;
+        uint32_t    part;
+        uint32_t    numParts;
+        struct Redo *redo;
+        ErrCode     result;     //of the last batch the thread replayed
+    } Replay;
+
+/*
+ Hands the records of the frames read so far to the recovery threads a batch at a time.
+ Every thread scans the whole batch and applies the records of its own ids; this thread
+ replays part 0 itself.
+ */
+typedef struct Redo
+    {
+        Replay          *parts;
+        uint32_t        numParts;
+        pthread_t       *threads;   //replaying parts 1 and up
+        char            *batch;
+        size_t          used;
+        size_t          cap;
+        char            *raw;       //decompressed frame
+        size_t          rawCap;
+        uint64_t        round;      //bumped for every batch handed out
+        uint32_t        busy;       //threads still replaying the current batch
+        int             stop;
+        pthread_mutex_t lock;
+        pthread_cond_t  start;
+        pthread_cond_t  done;
+    } Redo;
+
+//frames are replayed once this much of them has been read
+#define REDO_BATCH_SIZE (4 * 1024 * 1024)
+
+ErrCode p_replayDefine(Replay *replay, uint32_t id, const char *name, uint32_t nameLen,
+                       const char *data, uint32_t dataLen)
+{
+    const char *p = data + 1;
+    uint32_t incarnation;
+    if (dataLen < 2 || id >= (1u << 24) || p_getVarint(&p, data + dataLen, &incarnation) != 0 ||
+        p != data + dataLen) {
+        return FAILURE;
+    }
+    if (id >= replay->numStates) {
+        uint32_t size = id * 2 + 16;
+        BDBState *states = realloc(replay->states, size * sizeof(BDBState));
+        if (states == NULL) {
+            return FAILURE;
+        }
+        memset(states + replay->numStates, 0, (size - replay->numStates) * sizeof(BDBState));
+        replay->states = states;
+        replay->numStates = size;
+    }
+    
+    char *copy = malloc(nameLen + 1);
+    if (copy == NULL) {
+        return FAILURE;
+    }
+    memcpy(copy, name, nameLen);
+    copy[nameLen] = '\0';
+    DBLink *link = p_lookupIndex(copy);
+    free(copy);
+    
+    //an index dropped since takes no more records, even once its name belongs to a new
+    //incarnation; records its id was still logged under after the drop are skipped too
+    BDBState *state = &replay->states[id];
+    memset(state, 0, sizeof(BDBState));
+    if (link != NULL && link->incarnation == incarnation && link->type == (KeyType)(uint8_t)data[0]) {
+        state->dbp = link->dbp;
+        state->type = link->type;
+        state->db_name = link->name;
+        state->link = link;
+    }
+    return SUCCESS;
+}
+
+/*
+ Fills in record from a record's key, as stored in an index of the given type, and its
+ payload; a NULL data stands for a record that must have none.
+ @return FAILURE if either is malformed.
+ */
+ErrCode p_recordFromLog(KeyType type, const char *key, uint32_t keyLen, const char *data, uint32_t dataLen,
+                        Record *record)
+{
+    if ((type == SHORT && keyLen != 4) || (type == INT && keyLen != 8) ||
+        (type == VARCHAR && (keyLen > MAX_VARCHAR_LEN || memchr(key, '\0', keyLen) != NULL))) {
+        return FAILURE;
+    }
+    memset(record, 0, sizeof(Record));
+    DBT keyData;
+    memset(&keyData, 0, sizeof(DBT));
+    keyData.data = (void *)key;
+    keyData.size = keyLen;
+    p_setKeyFromKeyData(&keyData, type, &record->key);
+    
+    if (data == NULL) {
+        return dataLen == 0 ? SUCCESS : FAILURE;
+    }
+    if (dataLen == 0 || dataLen > MAX_PAYLOAD_LEN + 1 || memchr(data, '\0', dataLen) != data + dataLen - 1) {
+        return FAILURE;
+    }
+    memcpy(record->payload, data, dataLen);
+    return SUCCESS;
+}
+
+/*
+ Applies one record to the index it is bound to. Records whose effect is already in the
+ checkpoint are applied again harmlessly, as inserting an existing record or deleting a
+ missing one changes nothing.
+ */
+ErrCode p_replayApply(Replay *replay, BDBState *state, uint8_t op, const char *key, uint32_t keyLen,
+                      const char *data, uint32_t dataLen)
+{
+    ErrCode ret;
+    
+    if (op == LOG_TRUNCATE) {
+        //the truncate needs the index to itself, so the records before it are committed first
+        ret = commitTransaction(replay->txn);
+        replay->txn = NULL;
+        if (ret != SUCCESS) {
+            return ret;
+        }
+        DB_TXN *tid;
+        if (env->txn_begin(env, NULL, &tid, 0) != 0) {
+            return FAILURE;
+        }
+        if (p_truncateLink(state->link, tid) != 0) {
+            tid->abort(tid);
+            return FAILURE;
+        }
+        if (tid->commit(tid, 0) != 0) {
+            return FAILURE;
+        }
+        pthread_mutex_lock(&DBLINK_LOCK);
+        p_forgetSnapshot(state->link);
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        return p_beginTransaction(&replay->txn);
+    }
+    
+    if (op == LOG_DELETE_RANGE) {
+        Record lo, hi;
+        uint8_t bounds = keyLen > 0 ? (uint8_t)key[0] : 0;
+        if (keyLen == 0 ||
+            ((bounds & LOG_RANGE_LO) && p_recordFromLog(state->type, key + 1, keyLen - 1, NULL, 0, &lo) != SUCCESS) ||
+            ((bounds & LOG_RANGE_HI) && p_recordFromLog(state->type, data, dataLen, NULL, 0, &hi) != SUCCESS)) {
+            return FAILURE;
+        }
+        return deleteRange((IdxState*)state, replay->txn, (bounds & LOG_RANGE_LO) ? &lo.key : NULL,
+                           (bounds & LOG_RANGE_HI) ? &hi.key : NULL);
+    }
+    
+    Record record;
+    if (p_recordFromLog(state->type, key, keyLen, op == LOG_DELETE_KEY ? NULL : data, dataLen, &record) != SUCCESS) {
+        return FAILURE;
+    }
+    if (op == LOG_INSERT) {
+        ret = insertRecord((IdxState*)state, replay->txn, &record.key, record.payload);
+    } else {
+        ret = deleteRecord((IdxState*)state, replay->txn, &record);
+    }
+    if (ret == ENTRY_EXISTS || ret == ENTRY_DNE || ret == KEY_NOTFOUND) {
+        return SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ Applies the records of a batch of frames that belong to the replay's ids, in a
+ transaction of their own.
+ @return FAILURE if a record is malformed or could not be applied.
+ */
+ErrCode p_replayRecords(Replay *replay, const char *p, const char *end)
+{
+    ErrCode ret;
+    if ((ret = p_beginTransaction(&replay->txn)) != SUCCESS) {
+        return ret;
+    }
+    while (p < end) {
+        uint8_t op;
+        uint32_t id, keyLen, dataLen;
+        const char *key, *data;
+        if (p_decodeRecord(&p, end, &op, &id, &key, &keyLen, &data, &dataLen) != 0) {
+            return FAILURE;
+        }
+        
+        if (id % replay->numParts != replay->part) {
+            ret = SUCCESS;
+        } else if (op == LOG_DEFINE) {
+            ret = p_replayDefine(replay, id, key, keyLen, data, dataLen);
+        } else if (id < replay->numStates && replay->states[id].link != NULL) {
+            ret = p_replayApply(replay, &replay->states[id], op, key, keyLen, data, dataLen);
+        } else {
+            ret = SUCCESS;
+        }
         if (ret != SUCCESS) {
-            return ret;
+            break;
         }
+    }
+    
+    if (replay->txn == NULL) {
+        return FAILURE;
+    } else if (ret != SUCCESS) {
+        abortTransaction(replay->txn);
     } else {
-        txnState = (TXNState**)&txn;
+        ret = commitTransaction(replay->txn);
     }
+    replay->txn = NULL;
+    return ret;
+}
+
+/*
+ Recovery thread. Replays its part of every batch it is handed until told to stop.
+ */
+void *p_redoThread(void *arg)
+{
+    Replay *replay = (Replay*)arg;
+    Redo *redo = replay->redo;
+    uint64_t round = 0;
     
-    //determine if a cursor exists for this transaction/index combo already
-    CursorLink *prevCursorLink = NULL;
-    CursorLink *cursorLink = (*txnState)->cursorLink;
-    while (cursorLink != NULL) {
-        if (cursorLink->dbp == state->dbp) {
-            *cursor = cursorLink->cursor;
+    pthread_mutex_lock(&redo->lock);
+    while (1) {
+        while (redo->round == round && !redo->stop) {
+            pthread_cond_wait(&redo->start, &redo->lock);
+        }
+        if (redo->stop) {
             break;
-        } else {
-            prevCursorLink = cursorLink;
-            cursorLink = cursorLink->cursorLink;
         }
+        round = redo->round;
+        pthread_mutex_unlock(&redo->lock);
+        
+        ErrCode ret = p_replayRecords(replay, redo->batch, redo->batch + redo->used);
+        
+        pthread_mutex_lock(&redo->lock);
+        replay->result = ret;
+        if (--redo->busy == 0) {
+            pthread_cond_signal(&redo->done);
+        }
+    }
+    pthread_mutex_unlock(&redo->lock);
+    return NULL;
+}
+
+/*
+ Replays the batch on every part at once and empties it.
+ @return FAILURE if any part could not replay it.
+ */
+ErrCode p_redoBatch(Redo *redo)
+{
+    uint32_t i;
+    if (redo->numParts > 1) {
+        pthread_mutex_lock(&redo->lock);
+        redo->busy = redo->numParts - 1;
+        redo->round++;
+        pthread_cond_broadcast(&redo->start);
+        pthread_mutex_unlock(&redo->lock);
     }
     
-    //if the txnState variable didn't have a cursor for this index, make one
-    if (*cursor == NULL) {
-        state->keyNotFound = 0;
-        if ((ret = dbp->cursor(dbp, (*txnState)->tid, cursor, 0)) != 0) {
-            dbp->err(dbp, ret, "Creating new cursor in get()");
+    ErrCode ret = p_replayRecords(&redo->parts[0], redo->batch, redo->batch + redo->used);
+    
+    if (redo->numParts > 1) {
+        pthread_mutex_lock(&redo->lock);
+        while (redo->busy > 0) {
+            pthread_cond_wait(&redo->done, &redo->lock);
+        }
+        pthread_mutex_unlock(&redo->lock);
+        for (i = 1; i < redo->numParts; i++) {
+            if (redo->parts[i].result != SUCCESS) {
+                ret = redo->parts[i].result;
+            }
+        }
+    }
+    redo->used = 0;
+    return ret;
+}
+
+/*
+ Adds the records of a frame to the batch.
+ */
+ErrCode p_redoAppend(Redo *redo, const char *records, size_t len)
+{
+    if (redo->used + len > redo->cap) {
+        size_t cap = redo->cap == 0 ? REDO_BATCH_SIZE : redo->cap;
+        while (cap < redo->used + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(redo->batch, cap);
+        if (grown == NULL) {
             return FAILURE;
         }
+        redo->batch = grown;
+        redo->cap = cap;
+    }
+    memcpy(redo->batch + redo->used, records, len);
+    redo->used += len;
+    return SUCCESS;
+}
+
+/*
+ Stops the recovery threads.
+ */
+void p_finishRedo(Redo *redo)
+{
+    uint32_t i;
+    pthread_mutex_lock(&redo->lock);
+    redo->stop = 1;
+    pthread_cond_broadcast(&redo->start);
+    pthread_mutex_unlock(&redo->lock);
+    for (i = 1; i < redo->numParts; i++) {
+        pthread_join(redo->threads[i], NULL);
+    }
+    
+    for (i = 0; i < redo->numParts; i++) {
+        free(redo->parts[i].states);
+    }
+    pthread_mutex_destroy(&redo->lock);
+    pthread_cond_destroy(&redo->start);
+    pthread_cond_destroy(&redo->done);
+    free(redo->parts);
+    free(redo->threads);
+    free(redo->batch);
+    free(redo->raw);
+}
+
+/*
+ Splits replay into recoveryThreads parts, starting a thread for each part but the first.
+ Fewer parts are used if threads cannot be started.
+ */
+ErrCode p_startRedo(Redo *redo)
+{
+    memset(redo, 0, sizeof(Redo));
+    uint32_t numParts = recoveryThreads;
+    if (numParts == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        numParts = cpus < 1 ? 1 : (cpus > MAX_RECOVERY_THREADS ? MAX_RECOVERY_THREADS : (uint32_t)cpus);
+    }
+    redo->parts = malloc(numParts * sizeof(Replay));
+    redo->threads = malloc(numParts * sizeof(pthread_t));
+    if (redo->parts == NULL || redo->threads == NULL) {
+        free(redo->parts);
+        free(redo->threads);
+        return FAILURE;
+    }
+    memset(redo->parts, 0, numParts * sizeof(Replay));
+    pthread_mutex_init(&redo->lock, NULL);
+    pthread_cond_init(&redo->start, NULL);
+    pthread_cond_init(&redo->done, NULL);
+    
+    //a thread only looks at its part once it is handed the first batch, by which time
+    //every part knows how many there are to split the ids between
+    redo->numParts = 1;
+    while (redo->numParts < numParts) {
+        Replay *replay = &redo->parts[redo->numParts];
+        replay->part = redo->numParts;
+        replay->redo = redo;
+        if (pthread_create(&redo->threads[redo->numParts], NULL, p_redoThread, replay) != 0) {
+            break;
+        }
+        redo->numParts++;
+    }
+    
+    uint32_t i;
+    for (i = 0; i < redo->numParts; i++) {
+        redo->parts[i].part = i;
+        redo->parts[i].numParts = redo->numParts;
+        redo->parts[i].redo = redo;
+    }
+    return SUCCESS;
+}
+
+/*
+ Replays one log file, in batches of frames. A frame that is torn or fails its checksum
+ ends the file; at the end of the last file it is what a crash left behind and is cut
+ off, anywhere else the log is corrupt.
+ */
+ErrCode p_replayLog(Redo *redo, uint32_t gen, int last, uint64_t *bytes, off_t *validEnd)
+{
+    char path[LOG_PATH_LEN];
+    p_logPath(path, gen);
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+        fprintf(stderrfile, "could not open logical log %s. errno %d\n", path, errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return FAILURE;
+    }
+    size_t size = sb.st_size;
+    char *map = NULL;
+    if (size > 0 && (map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderrfile, "could not map logical log %s. errno %d\n", path, errno);
+        close(fd);
+        return FAILURE;
+    }
+    
+    ErrCode ret = SUCCESS;
+    size_t pos = 0;
+    while (pos < size) {
+        LogFrame header;
+        if (size - pos < sizeof(LogFrame)) {
+            break;
+        }
+        memcpy(&header, map + pos, sizeof(LogFrame));
+        const char *body = map + pos + sizeof(LogFrame);
+        if (header.storedLen > size - pos - sizeof(LogFrame)) {
+            break;
+        }
+        const char *records;
+        int decoded = p_decodeFrame(&header, body, &redo->raw, &redo->rawCap, &records);
+        if (decoded < 0) {
+            break;
+        } else if (decoded > 0) {
+            fprintf(stderrfile, "could not decompress frame at offset %lu of %s\n", (unsigned long)pos, path);
+            ret = FAILURE;
+            break;
+        }
         
-        //add the data for this cursor to the CursorLink chain in the TXNState variable
-        CursorLink *newLink = malloc(sizeof(CursorLink));
-        newLink->cursor = *cursor;
-        newLink->dbp = dbp;
-        newLink->cursorLink = NULL;
-        if (prevCursorLink == NULL) {
-            (*txnState)->cursorLink = newLink;
-        } else {
-            prevCursorLink->cursorLink = newLink;
+        if ((ret = p_redoAppend(redo, records, header.rawLen)) != SUCCESS) {
+            break;
+        }
+        pos += sizeof(LogFrame) + header.storedLen;
+        *bytes += header.rawLen;
+        if (redo->used >= REDO_BATCH_SIZE && (ret = p_redoBatch(redo)) != SUCCESS) {
+            fprintf(stderrfile, "could not replay the frames before offset %lu of %s\n", (unsigned long)pos, path);
+            break;
         }
     }
+    if (ret == SUCCESS && redo->used > 0 && (ret = p_redoBatch(redo)) != SUCCESS) {
+        fprintf(stderrfile, "could not replay the frames before offset %lu of %s\n", (unsigned long)pos, path);
+    }
     
-    //put the cursor and transaction information into the index state variable
-    state->tid = (*txnState)->tid->id((*txnState)->tid);
+    if (ret == SUCCESS && pos < size) {
+        if (!last) {
+            fprintf(stderrfile, "logical log %s is corrupt at offset %lu\n", path, (unsigned long)pos);
+            ret = FAILURE;
+        } else {
+            fprintf(stderrfile, "discarding torn logical log frame at offset %lu of %s\n", (unsigned long)pos, path);
+            if (ftruncate(fd, pos) != 0) {
+                ret = FAILURE;
+            }
+        }
+    }
+    *validEnd = pos;
     
-    return SUCCESS;
+    if (map != NULL) {
+        munmap(map, size);
+    }
+    close(fd);
+    return ret;
 }
 
+/*
+ Loads a checkpoint snapshot into the empty DB of its index, in order and a batch per
+ transaction as bulkLoad does, so the index is served from its own DB again.
+ */
+ErrCode p_loadCheckpoint(DBLink *link, const char *path)
+{
+    Snapshot *snap;
+    if (p_mapSnapshot(path, link->type, 1, &snap) != SUCCESS) {
+        return FAILURE;
+    }
+    BDBState state;
+    memset(&state, 0, sizeof(BDBState));
+    state.dbp = link->dbp;
+    state.type = link->type;
+    state.db_name = link->name;
+    state.link = link;
+    BulkWriter writer;
+    writer.state = &state;
+    writer.batch = malloc(BULK_BATCH_ENTRIES * sizeof(BulkEntry));
+    writer.numBatch = 0;
     
-#pragma mark get
-ErrCode get(IdxState *ident, TxnState *txn, Record *record)
+    ErrCode ret = writer.batch == NULL ? FAILURE : SUCCESS;
+    uint64_t i;
+    for (i = 0; i < snap->count && ret == SUCCESS; i++) {
+        DBT key, data;
+        BulkEntry entry;
+        p_snapEntry(snap, i, &key, &data);
+        entry.keySize = key.size;
+        memcpy(entry.key, key.data, key.size);
+        entry.dataSize = data.size;
+        memcpy(entry.data, data.data, data.size);
+        ret = p_bulkAdd(&writer, &entry);
+    }
+    if (ret == SUCCESS) {
+        ret = p_bulkCommit(&writer);
+    }
+    free(writer.batch);
+    p_unmapSnapshot(snap);
+    return ret;
+}
+
+/*
+ Rebuilds every index from its last checkpoint and the logical log written since, then
+ opens the log for appending. BDB's files are not kept consistent without its own log,
+ so they are all removed first and every checkpoint is loaded into a new DB. The first
+ start under the logical log instead takes a checkpoint of whatever the indices hold.
+ */
+ErrCode p_recoverLogical()
 {
-    BDBState *state = (BDBState*)ident;
-    DB *dbp = state->dbp;
     int ret;
+    logBuffer = malloc(LOGICAL_BUFFER_SIZE);
+    logSpare = malloc(LOGICAL_BUFFER_SIZE);
+    logFrame = malloc(sizeof(LogFrame) + p_frameBound(LOGICAL_BUFFER_SIZE, logCompress));
+    if (logBuffer == NULL || logSpare == NULL || logFrame == NULL) {
+        return FAILURE;
+    }
     
-    //save the key into the state so that getNext will behave properly if key is not found
-    memcpy(&(state->lastKey), &(record->key), sizeof(Key));
-    //make it clear when get() was unable to find a valid key
-    state->keyNotFound = 0;
+    char path[LOG_PATH_LEN];
+    uint32_t gen;
+    int fd = open(LOGICAL_MARKER, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderrfile, "could not open %s. errno %d\n", LOGICAL_MARKER, errno);
+            return FAILURE;
+        }
+        p_logPath(path, 0);
+        if ((logFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR)) < 0) {
+            fprintf(stderrfile, "could not create logical log %s. errno %d\n", path, errno);
+            return FAILURE;
+        }
+        logicalLogOpen = 1;
+        return p_checkpointLogical();
+    }
+    if (read(fd, &gen, sizeof(gen)) != sizeof(gen)) {
+        fprintf(stderrfile, "%s is unreadable\n", LOGICAL_MARKER);
+        close(fd);
+        return FAILURE;
+    }
+    close(fd);
+    
+    pthread_mutex_lock(&DBLINK_LOCK);
+    //no index has been created yet if there is no table
+    uint32_t numSlots = dbTable == NULL ? 0 : dbTable->mask + 1;
+    uint32_t i;
+    for (i = 0; i < numSlots; i++) {
+        DBLink *link = dbTable->slots[i];
+        if (link == NULL || link == DROPPED_SLOT) {
+            continue;
+        }
+        char *sideName = p_sideName(link->file);
+        char *countsName = p_countsName(link->file);
+        char *ckpt = p_checkpointPath(link->file);
+        if (sideName == NULL || countsName == NULL || ckpt == NULL) {
+            free(sideName);
+            free(countsName);
+            free(ckpt);
+            pthread_mutex_unlock(&DBLINK_LOCK);
+            return FAILURE;
+        }
+        if ((ret = env->dbremove(env, NULL, link->file, NULL, DB_AUTO_COMMIT)) != 0 && ret != ENOENT) {
+            env->err(env, ret, "DB_ENV->dbremove: %s", link->name);
+        }
+        if ((ret = env->dbremove(env, NULL, sideName, NULL, DB_AUTO_COMMIT)) != 0 && ret != ENOENT) {
+            env->err(env, ret, "DB_ENV->dbremove: %s", sideName);
+        }
+        if ((ret = env->dbremove(env, NULL, countsName, NULL, DB_AUTO_COMMIT)) != 0 && ret != ENOENT) {
+            env->err(env, ret, "DB_ENV->dbremove: %s", countsName);
+        }
+        free(sideName);
+        free(countsName);
+        
+        if (p_lookupOpenIndex(link->name, &link) != SUCCESS) {
+            fprintf(stderrfile, "could not reopen %s\n", link->name);
+            free(ckpt);
+            pthread_mutex_unlock(&DBLINK_LOCK);
+            return FAILURE;
+        }
+        free(ckpt);
+    }
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    
+    //nothing else runs until recovery is done, so the indices are loaded without DBLINK_LOCK;
+    //an index created since the last checkpoint has no snapshot and starts empty
+    for (i = 0; i < numSlots; i++) {
+        DBLink *link = dbTable->slots[i];
+        if (link == NULL || link == DROPPED_SLOT) {
+            continue;
+        }
+        char *ckpt = p_checkpointPath(link->file);
+        if (ckpt == NULL || (access(ckpt, F_OK) == 0 && p_loadCheckpoint(link, ckpt) != SUCCESS)) {
+            fprintf(stderrfile, "could not restore %s from its checkpoint\n", link->name);
+            free(ckpt);
+            return FAILURE;
+        }
+        free(ckpt);
+    }
+    
+    //the indices are independent of each other, so their records are replayed in parallel
+    Redo redo;
+    if (p_startRedo(&redo) != SUCCESS) {
+        return FAILURE;
+    }
+    uint64_t bytes = 0;
+    off_t validEnd = 0;
+    ErrCode result;
+    while (1) {
+        p_logPath(path, gen + 1);
+        int last = access(path, F_OK) != 0;
+        if ((result = p_replayLog(&redo, gen, last, &bytes, &validEnd)) != SUCCESS || last) {
+            break;
+        }
+        gen++;
+    }
+    p_finishRedo(&redo);
+    if (result != SUCCESS) {
+        return FAILURE;
+    }
+    
+    p_logPath(path, gen);
+    if ((logFd = open(path, O_WRONLY | O_APPEND)) < 0) {
+        fprintf(stderrfile, "could not open logical log %s. errno %d\n", path, errno);
+        return FAILURE;
+    }
+    logGen = gen;
+    logOffset = validEnd;
+    //a long replay makes the checkpointer take a checkpoint soon
+    logBytesSinceCheckpoint = bytes;
+    logicalLogOpen = 1;
+    return SUCCESS;
+}
 
-    DBT key, data;
-    memset(&key, 0, sizeof(DBT));
-    memset(&data, 0, sizeof(DBT));
-    data.data = record->payload;
-    data.ulen = MAX_PAYLOAD_LEN+1;
+/*
+ Takes a checkpoint under the logical log. The log moves on to a new file that starts
+ by defining every index, each index is saved to its checkpoint snapshot, and the marker
+ is moved to the new file, after which older files are removed. Transactions keep
+ committing throughout; the snapshots are taken after the switch, so replaying the new
+ file on top of them only repeats changes they may already hold. DBLINK_LOCK is only
+ held while the switch is made and the indices are collected.
+ */
+ErrCode p_checkpointLogical()
+{
+    char path[LOG_PATH_LEN];
+    ErrCode result = FAILURE;
+    DBLink **links = NULL;
+    uint32_t numLinks = 0;
+    uint32_t i;
     
-    data.flags = DB_DBT_MALLOC;
+    pthread_mutex_lock(&DBLINK_LOCK);
+    int locked = 1;
+    uint32_t numSlots = dbTable == NULL ? 0 : dbTable->mask + 1;
+    pthread_mutex_lock(&LOG_WRITE_LOCK);
+    uint32_t gen = logGen + 1;
+    p_logPath(path, gen);
+    int fd = -1;
+    if (p_drainLogical() != SUCCESS || p_syncLogical() != SUCCESS ||
+        (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR)) < 0) {
+        pthread_mutex_unlock(&LOG_WRITE_LOCK);
+        goto finish;
+    }
+    close(logFd);
+    logFd = fd;
+    logGen = gen;
+    logOffset = 0;
+    __atomic_store_n(&logBytesSinceCheckpoint, 0, __ATOMIC_RELAXED);
     
-    record->key.type = state->type;
-    if (p_setKeyDataFromKey(&record->key, &key) < 0) {
-        dbp->errx(dbp,"bad insert key type");
-        memset(record->payload, 0, MAX_PAYLOAD_LEN);
-        return KEY_NOTFOUND;
+    size_t size = 0;
+    for (i = 0; i < numSlots; i++) {
+        DBLink *link = dbTable->slots[i];
+        if (link != NULL && link != DROPPED_SLOT) {
+            size += LOG_RECORD_OVERHEAD + strlen(link->name) + LOG_DEFINE_PAYLOAD;
+        }
+    }
+    char *defines = malloc(size + 1);
+    if (defines == NULL) {
+        pthread_mutex_unlock(&LOG_WRITE_LOCK);
+        goto finish;
+    }
+    size_t len = 0;
+    for (i = 0; i < numSlots; i++) {
+        DBLink *link = dbTable->slots[i];
+        if (link != NULL && link != DROPPED_SLOT) {
+            char payload[LOG_DEFINE_PAYLOAD];
+            uint32_t payloadLen = p_definePayload(link, payload);
+            len += p_encodeRecord(defines + len, LOG_DEFINE, link->id, link->name, strlen(link->name),
+                                  payload, payloadLen);
+        }
+    }
+    ErrCode ret = len == 0 ? SUCCESS : p_writeFrame(defines, len);
+    free(defines);
+    if (ret != SUCCESS || p_syncLogical() != SUCCESS) {
+        pthread_mutex_unlock(&LOG_WRITE_LOCK);
+        goto finish;
     }
+    pthread_mutex_unlock(&LOG_WRITE_LOCK);
     
-    TXNState *txnState;
-    DBC *cursor = NULL;
-    ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
-    if (ret != SUCCESS) {
+    //the indices are saved with references to them instead of DBLINK_LOCK, so
+    //they can be opened, created and dropped while the checkpoint runs
+    links = malloc((numSlots + 1) * sizeof(DBLink *));
+    if (links == NULL) {
         goto finish;
     }
+    for (i = 0; i < numSlots; i++) {
+        DBLink *link = dbTable->slots[i];
+        if (link == NULL || link == DROPPED_SLOT) {
+            continue;
+        }
+        if (p_lookupOpenIndex(link->name, &link) != SUCCESS || !p_acquireLink(link)) {
+            fprintf(stderrfile, "could not checkpoint %s\n", link->name);
+            goto finish;
+        }
+        links[numLinks++] = link;
+    }
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    locked = 0;
     
-#if DB_VERSION_MINOR>=7
-    if ((ret = cursor->get(cursor, &key, &data, DB_SET)) != 0) {
-#else
-    if ((ret = cursor->c_get(cursor, &key, &data, DB_SET)) != 0) {
-#endif
-        memset(record->payload, 0, MAX_PAYLOAD_LEN);
-        if (ret == DB_LOCK_DEADLOCK) {
-            ret = DEADLOCK;
+    //the snapshots read committed records without holding their locks, so writers carry on;
+    //whatever a snapshot misses was committed after the switch and is replayed from the new file
+    for (i = 0; i < numLinks; i++) {
+        char *ckpt = p_checkpointPath(links[i]->file);
+        if (ckpt == NULL || p_saveSnapshot(links[i], ckpt, DB_READ_COMMITTED) != SUCCESS) {
+            fprintf(stderrfile, "could not checkpoint %s\n", links[i]->name);
+            free(ckpt);
             goto finish;
         }
-        state->keyNotFound = 1;
-        ret = KEY_NOTFOUND;
+        free(ckpt);
+    }
+    
+    //replay starts from the new file once the marker says so
+    if ((fd = open(LOGICAL_MARKER ".tmp", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0) {
         goto finish;
     }
-        
-    memcpy(record->payload, data.data, data.size < MAX_PAYLOAD_LEN ? data.size : MAX_PAYLOAD_LEN);
-    ret = SUCCESS;
+    if (write(fd, &gen, sizeof(gen)) != sizeof(gen) || fdatasync(fd) != 0 ||
+        rename(LOGICAL_MARKER ".tmp", LOGICAL_MARKER) != 0) {
+        fprintf(stderrfile, "could not write %s\n", LOGICAL_MARKER);
+        close(fd);
+        unlink(LOGICAL_MARKER ".tmp");
+        goto finish;
+    }
+    close(fd);
     
-    //whether return value is success or failure, if we opened a transaction for this function call
-    //we need to close it before we return
-finish:
-    //if we opened a transaction for this call, close it
-    if (txn == NULL) {
-        if (ret == SUCCESS) {
-            if (txnState == NULL) {
-            }
-            ret = commitTransaction((TxnState*)txnState);
-        } else {
-            abortTransaction((TxnState*)txnState);
+    //files left by earlier failed checkpoints go too
+    uint32_t old = gen;
+    while (old-- > 0) {
+        p_logPath(path, old);
+        if (unlink(path) != 0) {
+            break;
         }
     }
-    //return the ErrCode
-    return ret;
+    result = SUCCESS;
+    
+finish:
+    if (locked) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+    }
+    for (i = 0; i < numLinks; i++) {
+        p_releaseLink(links[i]);
+    }
+    free(links);
+    return result;
+}
+
+#pragma mark backups
+
+/*
+ A backup is BACKUP_MAGIC followed by frames in the logical log's format, holding a
+ LOG_DEFINE record for each index followed by a LOG_INSERT record for each of its records,
+ and ends with an empty frame. Frames are compressed whenever LZ4 is available.
+ */
+#define BACKUP_MAGIC "IDXBACK1"
+#define BACKUP_MAGIC_LEN 8
+
+typedef struct
+    {
+        int         fd;
+        uint32_t    id;         //id of the index being written
+        char        *buffer;    //records of the frame being filled
+        size_t      fill;
+        char        *frame;
+    } BackupWriter;
+
+ErrCode p_backupFlush(BackupWriter *writer)
+{
+    size_t size = p_encodeFrame(writer->buffer, writer->fill, 1, writer->frame);
+    writer->fill = 0;
+    if (p_writeAll(writer->fd, writer->frame, size) != SUCCESS) {
+        fprintf(stderrfile, "could not write backup. errno %d\n", errno);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+ErrCode p_backupRecord(BackupWriter *writer, uint8_t op, const void *key, uint32_t keyLen,
+                       const void *data, uint32_t dataLen)
+{
+    if (writer->fill + LOG_RECORD_OVERHEAD + keyLen + dataLen > LOGICAL_BUFFER_SIZE &&
+        p_backupFlush(writer) != SUCCESS) {
+        return FAILURE;
+    }
+    writer->fill += p_encodeRecord(writer->buffer + writer->fill, op, writer->id, key, keyLen, data, dataLen);
+    return SUCCESS;
+}
+
+ErrCode p_backupEntry(void *context, const DBT *key, const DBT *data)
+{
+    return p_backupRecord(context, LOG_INSERT, key->data, key->size, data->data, data->size);
+}
+
+ErrCode p_backupLink(BackupWriter *writer, DBLink *link, DB_TXN *tid)
+{
+    uint8_t type = (uint8_t)link->type;
+    writer->id = link->id;
+    if (p_backupRecord(writer, LOG_DEFINE, link->name, strlen(link->name), &type, 1) != SUCCESS) {
+        return FAILURE;
+    }
+    return p_scanLink(link, tid, p_backupEntry, writer);
 }
-    
-#pragma mark getNext
-ErrCode getNext(IdxState *idxState, TxnState *txn, Record *record)
+
+#pragma mark backupIndex
+ErrCode backupIndex(const char *name, int fd)
 {
-    BDBState *state = (BDBState*)idxState;
-    DB *dbp = state->dbp;
     int ret;
+    if ((ret = p_init()) != SUCCESS) {
+        return ret;
+    }
     
-    DBT key, data;
-    memset(&key, 0, sizeof(key));
-    memset(&data, 0, sizeof(data));
-    data.data = record->payload;
-    data.ulen = MAX_PAYLOAD_LEN+1;
+    BackupWriter writer;
+    memset(&writer, 0, sizeof(BackupWriter));
+    writer.fd = fd;
+    writer.buffer = malloc(LOGICAL_BUFFER_SIZE);
+    writer.frame = malloc(sizeof(LogFrame) + p_frameBound(LOGICAL_BUFFER_SIZE, 1));
+    if (writer.buffer == NULL || writer.frame == NULL) {
+        free(writer.buffer);
+        free(writer.frame);
+        return FAILURE;
+    }
     
-    //retrieve or create a cursor for this index/txn combination (creating a txn if necessary)
-    TXNState *txnState;
-    DBC *cursor = NULL;
-    ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
-    if (ret != SUCCESS) {
+    DB_TXN *tid = NULL;
+    DBLink **links = NULL;
+    uint32_t numLinks = 0, i;
+    ErrCode result = FAILURE;
+    if (p_writeAll(fd, BACKUP_MAGIC, BACKUP_MAGIC_LEN) != SUCCESS) {
+        fprintf(stderrfile, "could not write backup. errno %d\n", errno);
         goto finish;
     }
     
-    //if the last call to get() was given a key not in the DB, getNext() should find
-    //the first key in the DB after that key, rather than starting at the beginning
-    if (state->keyNotFound == 1) {
-        state->keyNotFound = 0;
-        if (p_setKeyDataFromKey(&state->lastKey, &key) < 0) {
-            dbp->errx(dbp,"bad insert key type");
-            memset(record->payload, 0, MAX_PAYLOAD_LEN);
-            return KEY_NOTFOUND;
-        }
-#if DB_VERSION_MINOR>=7
-        if ((ret = cursor->get(cursor, &key, &data, DB_SET_RANGE)) != 0) {
-#else
-        if ((ret = cursor->c_get(cursor, &key, &data, DB_SET_RANGE)) != 0) {
-#endif
-            dbp->err(dbp, ret, "DBcursor->get");
-            memset(record->payload, 0, MAX_PAYLOAD_LEN);
-            if (ret == DB_LOCK_DEADLOCK) {
-                ret = DEADLOCK;
-                goto finish;
-            }
-            ret = DB_END;
-            goto finish;
+    //the indices and the transaction reading them are picked together under DBLINK_LOCK, then
+    //the backup holds references to the indices, so they can be created and dropped meanwhile
+    if ((ret = pthread_mutex_lock(&DBLINK_LOCK)) != 0) {
+        printf("can't acquire mutex lock: %d\n", ret);
+    }
+    uint32_t numSlots = dbTable == NULL ? 0 : dbTable->mask + 1;
+    links = malloc((numSlots + 1) * sizeof(DBLink *));
+    if (links == NULL) {
+        pthread_mutex_unlock(&DBLINK_LOCK);
+        goto finish;
+    }
+    if (name != NULL) {
+        DBLink *link;
+        if ((result = p_lookupOpenIndex(name, &link)) == SUCCESS && p_acquireLink(link)) {
+            links[numLinks++] = link;
+        } else if (result == SUCCESS) {
+            result = DB_DNE;
         }
     } else {
-#if DB_VERSION_MINOR>=7
-        if ((ret = cursor->get(cursor, &key, &data, DB_NEXT)) != 0) {
-#else
-        if ((ret = cursor->c_get(cursor, &key, &data, DB_NEXT)) != 0) {
-#endif
-            dbp->err(dbp, ret, "DBcursor->get");
-            memset(record->payload, 0, MAX_PAYLOAD_LEN);
-            
-            if (ret == DB_LOCK_DEADLOCK) {
-                ret = DEADLOCK;
-                goto finish;
+        for (i = 0; i < numSlots; i++) {
+            DBLink *link = dbTable->slots[i];
+            if (link == NULL || link == DROPPED_SLOT) {
+                continue;
             }
-            ret = DB_END;
+            if ((result = p_lookupOpenIndex(link->name, &link)) != SUCCESS) {
+                break;
+            }
+            if (p_acquireLink(link)) {
+                links[numLinks++] = link;
+            }
+        }
+    }
+    //a snapshot transaction reads every index as of its start without taking read locks;
+    //without multiversion reads, the backup's read locks hold up writers until it is done
+    if (result == SUCCESS && (ret = env->txn_begin(env, NULL, &tid, multiversion ? SNAPSHOT_TXN_FLAGS : 0)) != 0) {
+        env->err(env, ret, "txn_begin in backupIndex");
+        tid = NULL;
+        result = FAILURE;
+    }
+    pthread_mutex_unlock(&DBLINK_LOCK);
+    if (result != SUCCESS) {
+        goto finish;
+    }
+    
+    for (i = 0; i < numLinks; i++) {
+        if ((result = p_backupLink(&writer, links[i], tid)) != SUCCESS) {
             goto finish;
         }
     }
     
-    //insert the retrieved data into a Record and return it
-        
-    Key k;
-    memset(&k, 0, sizeof(Key));
-    if (state->type == VARCHAR) {
-        k.type = VARCHAR;
-        memcpy(k.keyval.charkey, key.data, key.size < MAX_VARCHAR_LEN ? key.size : MAX_VARCHAR_LEN);
-    } else if (state->type == SHORT) {
-        uint32_t i;
-        uint8_t *data = key.data;
-        
-        i = ((uint32_t)data[3])
-        | (((uint32_t)data[2]) << 8)
-        | (((uint32_t)data[1]) << 16)
-        | (((uint32_t)data[0]) << 24);
-        i ^= 0x80000000;
-        
-        k.type = SHORT;
-        k.keyval.shortkey = *((int32_t *)&i);
-    } else if (state->type == INT) {
-        uint64_t i;
-        uint8_t *data = key.data;
-        
-        i = ((uint64_t)data[7])
-        | (((uint64_t)data[6]) << 8)
-        | (((uint64_t)data[5]) << 16)
-        | (((uint64_t)data[4]) << 24)
-        | (((uint64_t)data[3]) << 32)
-        | (((uint64_t)data[2]) << 40)
-        | (((uint64_t)data[1]) << 48)
-        | (((uint64_t)data[0]) << 56);
-        i ^= 0x8000000000000000LL;
-        
-        k.type = INT;
-        k.keyval.intkey = *((int64_t *)&i);
-    }
-    memcpy(&record->key, &k, sizeof(Key));
-    memcpy(record->payload, data.data, data.size < MAX_PAYLOAD_LEN ? data.size : MAX_PAYLOAD_LEN);
+    //the empty frame marks the backup as complete
+    result = FAILURE;
+    if ((writer.fill > 0 && p_backupFlush(&writer) != SUCCESS) || p_backupFlush(&writer) != SUCCESS) {
+        goto finish;
+    }
+    result = SUCCESS;
     
-    ret = SUCCESS;
-        
-    //whether return value is success or failure, if we opened a transaction for this function call
-    //we need to close it before we return
 finish:
-    //if we opened a transaction for this call, close it
-    if (txn == NULL) {
-        if (ret == SUCCESS) {
-            ret = commitTransaction((TxnState*)txnState);
-        } else {
-            abortTransaction((TxnState*)txnState);
+    if (tid != NULL) {
+        tid->commit(tid, 0);
+    }
+    for (i = 0; i < numLinks; i++) {
+        p_releaseLink(links[i]);
+    }
+    free(links);
+    free(writer.buffer);
+    free(writer.frame);
+    return result;
+}
+
+/*
+ Reads up to len bytes, stopping early only at the end of the file or on an error.
+ @return the number of bytes read.
+ */
+size_t p_readAll(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
         }
+        done += n;
     }
-    //return the ErrCode
-    return ret;
+    return done;
 }
 
-#pragma mark insertRecord
-ErrCode insertRecord(IdxState *ident, TxnState *txn, Key *k, const char* payload)
+/*
+ Handle for the index each id of a backup is bound to, and the transaction its records
+ are inserted in.
+ */
+typedef struct
+    {
+        IdxState    **handles;  //indexed by id; NULL for an unbound id
+        uint32_t    numHandles;
+        TxnState    *txn;
+    } Restore;
+
+/*
+ Binds an id to the index named by a LOG_DEFINE record, creating the index if it does
+ not exist and emptying it if it does.
+ */
+ErrCode p_restoreDefine(Restore *restore, uint32_t id, const char *name, uint32_t nameLen,
+                        const char *data, uint32_t dataLen)
 {
-    BDBState *state = (BDBState*)ident;
-    DB *dbp = state->dbp;
-    TXNState *txnState = (TXNState*)txn;
-    int ret;
-    
-    //prepare the key and data for insert
-    DBT key, data;
-    memset(&key, 0, sizeof(key));
-    memset(&data, 0, sizeof(data));
-    
-    data.flags = DB_DBT_MALLOC;
-    
-    if (p_setKeyDataFromKey(k, &key) < 0) {
-        dbp->errx(dbp,"bad insert key type");
+    ErrCode ret;
+    if (dataLen != 1 || id >= (1u << 24) || nameLen == 0 || memchr(name, '\0', nameLen) != NULL) {
         return FAILURE;
     }
-    
-    //make a non-const copy of the payload to give to the BDB library
-    char payload_copy[MAX_PAYLOAD_LEN + 1];
-    memcpy(payload_copy, payload, strlen(payload)+1);
-    data.data = payload_copy;
-    data.size = strlen(payload)+1;
-    
-    //insert key and data
-    if ((ret = dbp->put(dbp, txnState == NULL ? NULL : txnState->tid, &key, &data, 0)) != 0) {
-        dbp->err(dbp, ret, "DB->put");
-        if (ret == DB_KEYEXIST) {
-            dbp->errx(dbp, "entry (%s, %s) exists", k->keyval.charkey, payload);
-            return ENTRY_EXISTS;
-        } else if (ret == DB_LOCK_DEADLOCK) {
-            return DEADLOCK;
+    KeyType type = (KeyType)(uint8_t)data[0];
+    if (type != SHORT && type != INT && type != VARCHAR) {
+        return FAILURE;
+    }
+    if (id >= restore->numHandles) {
+        uint32_t size = id * 2 + 16;
+        IdxState **handles = realloc(restore->handles, size * sizeof(IdxState *));
+        if (handles == NULL) {
+            return FAILURE;
         }
+        memset(handles + restore->numHandles, 0, (size - restore->numHandles) * sizeof(IdxState *));
+        restore->handles = handles;
+        restore->numHandles = size;
+    }
+    if (restore->handles[id] != NULL) {
+        closeIndex(restore->handles[id]);
+        restore->handles[id] = NULL;
+    }
+    
+    //a new index keeps the copy of its name for good
+    char *copy = malloc(nameLen + 1);
+    if (copy == NULL) {
         return FAILURE;
     }
+    memcpy(copy, name, nameLen);
+    copy[nameLen] = '\0';
+    ret = create(type, copy);
+    int created = ret == SUCCESS;
+    if (ret != SUCCESS && ret != DB_EXISTS) {
+        free(copy);
+        return ret;
+    }
     
-    return SUCCESS;
+    if ((ret = openIndex(copy, &restore->handles[id])) == SUCCESS) {
+        if ((p_handleState(restore->handles[id]))->type != type) {
+            fprintf(stderrfile, "index %s exists with another key type than in the backup\n", copy);
+            ret = FAILURE;
+        } else {
+            while ((ret = truncateIndex(copy)) == DEADLOCK)
+                ;
+        }
+    }
+    if (!created) {
+        free(copy);
+    }
+    return ret;
 }
 
+/*
+ Inserts the records of one frame, committing before each index it starts and at its end.
+ Retrying a frame after a deadlock is harmless, as records already inserted are skipped.
+ */
+ErrCode p_restoreRecords(Restore *restore, const char *p, const char *end)
+{
+    ErrCode ret;
+    while (p < end) {
+        uint8_t op;
+        uint32_t id, keyLen, dataLen;
+        const char *key, *data;
+        if (p_decodeRecord(&p, end, &op, &id, &key, &keyLen, &data, &dataLen) != 0) {
+            return FAILURE;
+        }
         
-#pragma mark deleteRecord
-ErrCode deleteRecord(IdxState *ident, TxnState *txn, Record *theRecord)
+        if (op == LOG_DEFINE) {
+            ret = commitTransaction(restore->txn);
+            restore->txn = NULL;
+            if (ret != SUCCESS || (ret = p_restoreDefine(restore, id, key, keyLen, data, dataLen)) != SUCCESS ||
+                (ret = beginTransaction(&restore->txn)) != SUCCESS) {
+                return ret;
+            }
+            continue;
+        }
+        
+        if (op != LOG_INSERT || id >= restore->numHandles || restore->handles[id] == NULL) {
+            return FAILURE;
+        }
+        Record record;
+        BDBState *state = p_handleState(restore->handles[id]);
+        if (p_recordFromLog(state->type, key, keyLen, data, dataLen, &record) != SUCCESS) {
+            return FAILURE;
+        }
+        ret = insertRecord((IdxState*)state, restore->txn, &record.key, record.payload);
+        if (ret != SUCCESS && ret != ENTRY_EXISTS) {
+            return ret;
+        }
+    }
+    ret = commitTransaction(restore->txn);
+    restore->txn = NULL;
+    return ret;
+}
+
+#pragma mark restoreBackup
+ErrCode restoreBackup(int fd)
 {
-    BDBState *state = (BDBState*)ident;
-    DB *dbp = state->dbp;
     int ret;
+    if ((ret = p_init()) != SUCCESS) {
+        return ret;
+    }
     
-    Key k = theRecord->key;
-
-    DBT key, data;
-    memset(&key, 0, sizeof(key));
-    memset(&data, 0, sizeof(data));
-    
-    data.flags = DB_DBT_MALLOC;
-    
-    if (p_setKeyDataFromKey(&k, &key) < 0) {
-        dbp->errx(dbp,"bad insert key type");
-        return KEY_NOTFOUND;
+    char magic[BACKUP_MAGIC_LEN];
+    if (p_readAll(fd, magic, BACKUP_MAGIC_LEN) != BACKUP_MAGIC_LEN || memcmp(magic, BACKUP_MAGIC, BACKUP_MAGIC_LEN) != 0) {
+        fprintf(stderrfile, "not a backup\n");
+        return FAILURE;
     }
     
-    TXNState *txnState = (TXNState*)txn;
-    DBC *cursor = NULL;
+    //a frame is only stored compressed when that makes it smaller than its records
+    char *body = malloc(LOGICAL_BUFFER_SIZE);
+    if (body == NULL) {
+        return FAILURE;
+    }
+    char *raw = NULL;
+    size_t rawCap = 0;
+    Restore restore;
+    memset(&restore, 0, sizeof(Restore));
     
-    if (memcmp(theRecord->payload, NULL_PAYLOAD, MAX_PAYLOAD_LEN) == 0) {
-        //delete all records associated with the key if no payload is specified
-        if ((ret = dbp->del(dbp, txnState == NULL ? NULL : txnState->tid, &key, 0)) != 0) {
-            dbp->err(dbp, ret, "dbp->del");
-            if (ret == DB_NOTFOUND) {
-                return KEY_NOTFOUND;
-            } else if (ret == DB_LOCK_DEADLOCK) {
-                return DEADLOCK;
-            }
-            return FAILURE;
+    for (;;) {
+        LogFrame header;
+        const char *records;
+        if (p_readAll(fd, &header, sizeof(LogFrame)) != sizeof(LogFrame)) {
+            fprintf(stderrfile, "backup is incomplete\n");
+            ret = FAILURE;
+            break;
         }
-        
-        return SUCCESS;
-    } else {
-        //otherwise delete a specific pair with a cursor
-        data.data = theRecord->payload;
-        data.size = strlen(theRecord->payload)+1;
-        
-        ret = p_prepTxnCursor(state, txn, &txnState, &cursor);
-        if (ret != SUCCESS) {
-            goto finish;
+        if (header.rawLen > LOGICAL_BUFFER_SIZE || header.storedLen > header.rawLen ||
+            p_readAll(fd, body, header.storedLen) != header.storedLen ||
+            p_decodeFrame(&header, body, &raw, &rawCap, &records) != 0) {
+            fprintf(stderrfile, "backup is damaged or cannot be read here\n");
+            ret = FAILURE;
+            break;
         }
-        
-        
-        //point the cursor at the entry to be deleted
-#if DB_VERSION_MINOR>=7
-        if ((ret = cursor->get(cursor, &key, &data, DB_GET_BOTH)) != 0) {
-#else
-        if ((ret = cursor->c_get(cursor, &key, &data, DB_GET_BOTH)) != 0) {
-#endif
-            dbp->err(dbp, ret, "cursor->get in delete");
-            
-            if (ret == DB_LOCK_DEADLOCK) {
-                ret = DEADLOCK;
-                goto finish;
-            }
-            
-            ret = ENTRY_DNE;
-            goto finish;
+        if (header.rawLen == 0) {
+            ret = SUCCESS;
+            break;
         }
         
-        //delete the entry pointed to by the cursor
-#if DB_VERSION_MINOR>=7
-        if ((ret = cursor->del(cursor, 0)) != 0) {
-#else
-        if ((ret = cursor->c_del(cursor, 0)) != 0) {
-#endif
-            dbp->err(dbp, ret, "cursor->del");
-            
-            if (ret == DB_LOCK_DEADLOCK) {
-                ret = DEADLOCK;
-                goto finish;
+        do {
+            if ((ret = beginTransaction(&restore.txn)) != SUCCESS) {
+                break;
             }
-            ret = FAILURE;
-            goto finish;
+            ret = p_restoreRecords(&restore, records, records + header.rawLen);
+            if (ret != SUCCESS && restore.txn != NULL) {
+                abortTransaction(restore.txn);
+                restore.txn = NULL;
+            }
+        } while (ret == DEADLOCK);
+        if (ret != SUCCESS) {
+            fprintf(stderrfile, "could not restore backup\n");
+            break;
         }
-        
-        ret = SUCCESS;
     }
-            
-    //whether return value is success or failure, if we opened a transaction for this function call
-    //we need to close it before we return
-finish:
-    //if we opened a transaction for this call, close it
-    if (txn == NULL) {
-        if (ret == SUCCESS) {
-            ret = commitTransaction((TxnState*)txnState);
-        } else {
-            abortTransaction((TxnState*)txnState);
+    
+    uint32_t i;
+    for (i = 0; i < restore.numHandles; i++) {
+        if (restore.handles[i] != NULL) {
+            closeIndex(restore.handles[i]);
         }
     }
-    //return the ErrCode
+    free(restore.handles);
+    free(raw);
+    free(body);
     return ret;
 }
-
-
@@ -120,6 +120,39 @@ typedef enum KeyType
         VARCHAR
     } KeyType;
 
+/**
+ Victim selection policies for resolving lock conflicts between transactions.
+ DEADLOCK_DETECT_DEFAULT lets the storage engine pick an arbitrary victim.
+ DEADLOCK_ABORT_YOUNGEST orders transactions by their begin timestamp and always
+ aborts the most recently begun one, so older transactions always make progress.
+ DEADLOCK_ABORT_MINWRITE aborts the transaction holding the fewest write locks,
+ minimizing the amount of work rolled back per abort.
+ */
+typedef enum DeadlockPolicy
+    {
+        DEADLOCK_DETECT_DEFAULT,
+        DEADLOCK_ABORT_YOUNGEST,
+        DEADLOCK_ABORT_MINWRITE
+    } DeadlockPolicy;
+
+/**
+ How much of a committed transaction is guaranteed to survive a crash.
+ DURABILITY_SYNC flushes the log to disk before each commit returns.
+ DURABILITY_GROUP also waits for the log to reach disk, but concurrent commits share
+ a single flush.
+ DURABILITY_ASYNC returns as soon as the commit is logged in memory; the log is
+ flushed in the background, so a crash loses at most the last loss window of commits.
+ DURABILITY_IN_MEMORY keeps the log in memory only; it can only be chosen for the
+ whole environment and gives no guarantee across a crash.
+ */
+typedef enum Durability
+    {
+        DURABILITY_SYNC,
+        DURABILITY_GROUP,
+        DURABILITY_ASYNC,
+        DURABILITY_IN_MEMORY
+    } Durability;
+
 /**
  Stores the key value, whether it is a short, an int or a varchar.
  @type defines what kind of key it is
@@ -147,6 +180,160 @@ typedef struct
     } Record;
 
 
+/**
+ Selects how deadlocks between transactions are resolved. Must be called
+ before the first call to any other function in this API, since the policy
+ is fixed when the environment is created.
+
+ @param policy the DeadlockPolicy to use for the lifetime of the process
+ @return ErrCode
+ SUCCESS if the policy will be used for the environment.
+ FAILURE if the environment already exists or the policy is not recognized.
+ */
+ErrCode setDeadlockPolicy(DeadlockPolicy policy);
+
+/**
+ Selects the default durability of every commit, including calls made outside of a
+ transaction. Must be called before the first call to any other function in this API,
+ since the log is configured when the environment is created.
+
+ @param mode the Durability to use by default
+ @param lossWindowMs for DURABILITY_ASYNC, the longest time a commit may stay
+ unflushed; ignored for the other modes
+ @return ErrCode
+ SUCCESS if the mode will be used for the environment.
+ FAILURE if the environment already exists or the arguments are not valid.
+ */
+ErrCode setDurability(Durability mode, uint32_t lossWindowMs);
+
+/**
+ Routes the engine's log and page I/O through io_uring. Every write still waits for its
+ own completion and reports its own errors, but the writes of all threads share one
+ queue, so writeback from many threads overlaps on the device, and reads only wait for
+ writes to the same bytes. If the kernel does not support io_uring, the plain system
+ calls are used. Must be called before the first call to any other function in this API.
+
+ @param queueDepth the number of I/O operations that may be outstanding at once
+ @return ErrCode
+ SUCCESS if I/O will go through io_uring when the environment is created.
+ FAILURE if the environment already exists or queueDepth is zero.
+ */
+ErrCode setAsyncIO(uint32_t queueDepth);
+
+/**
+ Sets how many threads replay the logical log at startup (see setLogicalLog). Records are
+ split between the threads by index, so each index is rebuilt by one thread in log order
+ while the threads rebuild different indices at once. By default one thread is used for
+ every online processor. The log only holds committed transactions, so there is nothing
+ to undo; BDB's own recovery without the logical log is not affected. Must be called
+ before the first call to any other function in this API.
+
+ @param threads the number of threads to replay the logical log with
+ @return ErrCode
+ SUCCESS if the threads will be used at startup.
+ FAILURE if the environment already exists or threads is zero.
+ */
+ErrCode setRecoveryThreads(uint32_t threads);
+
+/**
+ Bounds how long recovery may take after a crash. A background checkpointer writes
+ dirty pages incrementally and checkpoints often enough that the log left to replay
+ stays within the target; older log files are removed. The target is turned into an
+ amount of log assuming recovery replays 16MB a second. May be called at any time.
+
+ @param seconds the longest acceptable recovery time, in seconds
+ @return ErrCode
+ SUCCESS if the target will be used by the checkpointer.
+ FAILURE if the target is zero or too large.
+ */
+ErrCode setRecoveryTarget(uint32_t seconds);
+
+/**
+ Logs committed changes as logical records (index, key, payload and operation, with
+ variable-length sizes) instead of BDB's page images, so log volume follows the size of
+ each change. Index contents are checkpointed as snapshots and rebuilt from the latest
+ checkpoint and the log at startup. Commits honour the selected Durability as before.
+ Must be called before the first call to any other function in this API, and for every
+ later run on the same environment.
+
+ @param compress nonzero to compress each block of log with LZ4
+ @return ErrCode
+ SUCCESS if the logical log will be used when the environment is created.
+ FAILURE if the environment already exists, the durability is DURABILITY_IN_MEMORY,
+ or compression was asked for but LZ4 is not available.
+ */
+ErrCode setLogicalLog(int compress);
+
+/**
+ Chooses whether every index is opened for multiversion reads, so that backupIndex reads
+ a snapshot without holding up writers. This is on by default where BDB supports it. The
+ cost falls on every workload: each transaction that changes a page first copies it,
+ which takes cache space and I/O until no reader needs the old copy. Turned off, a
+ backup's read locks make writers wait until the backup is done.
+ Must be called before the first call to any other function in this API.
+
+ @param enable nonzero to use multiversion reads
+ @return ErrCode
+ SUCCESS if indices will be opened so when the environment is created.
+ FAILURE if the environment already exists, or multiversion reads were asked for but
+ the BDB version does not support them.
+ */
+ErrCode setMultiversion(int enable);
+
+/**
+ Keeps a count of records for every index, in a second btree whose internal pages hold
+ the number of records below them, so that countRange and getByRank take time
+ logarithmic in the size of the index. Every write to an index also writes its counts,
+ and since each of those changes the counts along the path from the root, writers to the
+ same index wait for each other until they commit. Counts missing from an index that
+ was used without them are rebuilt by reading it through when it is first opened. Must
+ be called before the first call to any other function in this API.
+
+ @param enable nonzero to keep record counts
+ @return ErrCode
+ SUCCESS if record counts will be kept once the environment is created.
+ FAILURE if the environment already exists.
+ */
+ErrCode setRecordCounts(int enable);
+
+/**
+ Sets the memory budget of the page cache, split into partitions that each have their
+ own hash table and latches, so that threads working on different pages rarely contend.
+ Pages read by getNext are the first to be evicted, so long scans do not push out the
+ pages that point lookups keep coming back to. Must be called before the first call to
+ any other function in this API; otherwise BDB's default cache size is used.
+
+ @param bytes the total size of the cache
+ @param partitions the number of partitions to split it into
+ @return ErrCode
+ SUCCESS if the cache will be sized so when the environment is created.
+ FAILURE if the environment already exists, or partitions is zero or leaves a
+ partition smaller than a megabyte.
+ */
+ErrCode setCacheSize(uint64_t bytes, uint32_t partitions);
+
+/**
+ Counters of the page cache since the environment was created.
+ */
+typedef struct
+    {
+        uint64_t hits;          //page requests found in the cache
+        uint64_t misses;        //page requests that had to read the page in
+        uint64_t evictions;     //pages evicted to make room for others
+        uint64_t cacheBytes;    //size of the cache
+        uint32_t partitions;
+    } CacheStats;
+
+/**
+ Reads the counters of the page cache.
+
+ @param stats filled in with the counters
+ @return ErrCode
+ SUCCESS if the counters were read.
+ FAILURE if they could not be read.
+ */
+ErrCode getCacheStats(CacheStats *stats);
+
 /**
  Creates a new index data structure to be used by any thread.
 
@@ -179,9 +366,101 @@ ErrCode openIndex(const char *name, IdxState **idxState);
  SUCCESS if succesfully closed index.
  DB_DNE is the DB never existed or was already closed by someone else.
  FAILURE if could not close DB for some other reason.
+ Closing an idxState again returns DB_DNE, also after a later openIndex has reused its
+ handle, which stays open for that caller.
  **/
 ErrCode closeIndex(IdxState *idxState);
 
+/**
+ Removes an index and everything stored in it, releasing all of its storage at once
+ rather than deleting it record by record. The name may be create()d again afterwards.
+ Every IdxState still open on the index becomes invalid: calls made through it return
+ DB_DNE, and closeIndex closes it but returns DB_DNE. Calls already in progress on
+ other threads finish on the dropped index, and its storage is released once the last
+ IdxState and transaction using it have been closed.
+
+ @param name the unique name specifying the index being dropped
+ @return ErrCode
+ SUCCESS if the index was dropped.
+ DB_DNE if no index of that name has been create()d.
+ FAILURE if the index could not be dropped for some other reason.
+ */
+ErrCode dropIndex(const char *name);
+
+/**
+ Removes every record from an index, releasing its storage at once rather than deleting
+ it record by record. Open IdxStates on the index remain valid and find it empty. It does
+ not wait for active transactions using the index; whatever they wrote to it before the
+ call is discarded along with the rest of its records.
+
+ @param name the unique name specifying the index being emptied
+ @return ErrCode
+ SUCCESS if the index was emptied.
+ DB_DNE if no index of that name has been create()d.
+ FAILURE if the index could not be emptied for some other reason.
+ */
+ErrCode truncateIndex(const char *name);
+
+/**
+ Writes the current contents of an index to a snapshot file that loadSnapshot can
+ serve it from. The records are read in a single transaction, and the file is
+ replaced atomically once it is complete.
+
+ @param name the name of the index
+ @param path the file to write
+ @return ErrCode
+ SUCCESS if the snapshot was written.
+ DB_DNE if there is no index with that name.
+ FAILURE if the snapshot could not be written.
+ */
+ErrCode saveSnapshot(const char *name, const char *path);
+
+/**
+ Replaces the contents of an index with a snapshot written by saveSnapshot. The file is
+ copied into the environment and mapped into memory, and get and getNext read its records
+ in place, without rebuilding the index. Records inserted or deleted afterwards are kept
+ apart from the snapshot until the next loadSnapshot, and the index keeps using the
+ snapshot after a restart. The index must not be in use by any other thread.
+
+ @param name the name of the index
+ @param path the snapshot to load
+ @return ErrCode
+ SUCCESS if the index now holds exactly the records in the snapshot.
+ DB_DNE if there is no index with that name.
+ FAILURE if the file is not a valid snapshot for the index's key type, or could not be loaded,
+ or the logical log is in use.
+ */
+ErrCode loadSnapshot(const char *name, const char *path);
+
+/**
+ Writes a consistent copy of one index, or of every index, to a file descriptor, for
+ example a file, pipe or socket. The records are read as of a single point in time.
+ With multiversion reads, the default, that takes no read locks, so insertRecord and
+ deleteRecord carry on meanwhile; after setMultiversion(0) they wait for the backup
+ where it has read. Indices can be
+ created and dropped during a backup; one dropped meanwhile is still backed up whole.
+
+ @param name the name of the index, or NULL to back up every index
+ @param fd where to write the backup
+ @return ErrCode
+ SUCCESS if the whole backup was written.
+ DB_DNE if there is no index with that name.
+ FAILURE if the backup could not be read or written completely.
+ */
+ErrCode backupIndex(const char *name, int fd);
+
+/**
+ Reads a backup written by backupIndex from a file descriptor. Each index in the backup
+ is created if it does not exist, and has its contents replaced by the backup's if it does.
+
+ @param fd where to read the backup from
+ @return ErrCode
+ SUCCESS if the whole backup was restored.
+ FAILURE if the backup is damaged or incomplete, or an index it holds exists with another
+ key type. The indices restored before the problem was found keep their restored contents.
+ */
+ErrCode restoreBackup(int fd);
+
 /**
  Signals the beginning of a transaction.  Each thread can have only
  one outstanding transaction running at a time.
@@ -221,6 +500,19 @@ ErrCode abortTransaction(TxnState *txn);
  */
 ErrCode commitTransaction(TxnState *txn);
 
+/**
+ Overrides the environment's durability for the commit of one transaction.
+ Has no effect in an environment using DURABILITY_IN_MEMORY.
+
+ @param txn The state variable for the transaction.
+ @param mode DURABILITY_SYNC, DURABILITY_GROUP or DURABILITY_ASYNC
+ @return ErrCode
+ SUCCESS if the mode will be used when the transaction commits.
+ TXN_DNE if there is no transaction.
+ FAILURE if the mode cannot be chosen per transaction.
+ */
+ErrCode setTransactionDurability(TxnState *txn, Durability mode);
+
 /**
  Retrieve the first record associated with the given key value; if
  more than one record exists with this key, return the first record
@@ -246,6 +538,26 @@ ErrCode commitTransaction(TxnState *txn);
  */
 ErrCode get(IdxState *idxState, TxnState *txn, Record *record);
 
+/**
+ Retrieves the first record for each of several keys, as a get for each would. The keys
+ are looked up in index order by one cursor and each distinct key only once, within one
+ transaction if none is given. A following getNext continues from the largest key.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param records Records containing the keys being retrieved, into which the payloads
+ are copied
+ @param n the number of records
+ @param results filled in with get's ErrCode for each record: SUCCESS or KEY_NOTFOUND, or,
+ for the records not looked up when the batch stops early, the ErrCode it returns
+ @return ErrCode
+ SUCCESS if every key was looked up.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the keys could not be looked up for some other reason.
+ */
+ErrCode getBatch(IdxState *idxState, TxnState *txn, Record *records, int n, ErrCode *results);
+
 /**
  Retrieve the record following the previous record retrieved by get or
  getNext. If no such call has occurred since the current transaction
@@ -274,6 +586,196 @@ ErrCode get(IdxState *idxState, TxnState *txn, Record *record);
  */
 ErrCode getNext(IdxState *idxState, TxnState *txn, Record *record);
 
+/**
+ Retrieve the record preceding the previous record retrieved by get,
+ getNext or getPrev. If no such call has occurred since the current
+ transaction began, or if this is called from outside of a transaction,
+ this returns the last record in the index. Records are returned in
+ descending order by key, the reverse of the order getNext returns them in.
+
+ If get returned KEY_NOT_FOUND for a key k, invoking getPrev will
+ return the last key before k.
+
+ @param idxState The state variable for the index whose previous Record
+ is to be returned
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param record Record through which the previous key/payload pair is returned
+ @return ErrCode
+ SUCCESS if successfully retrieved and returned the previous record in the DB.
+ DB_END if reached the beginning of the DB.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if could not retrieve previous record for some other reason.
+ */
+ErrCode getPrev(IdxState *idxState, TxnState *txn, Record *record);
+
+/**
+ Retrieves the records whose keys lie between lo and hi, both included, in the order
+ getNext would return them. Records are read from the index a buffer at a time rather
+ than one call at a time. Within a transaction, getNext afterwards returns the record
+ following the last one retrieved.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param lo the smallest key to retrieve, or NULL to start at the first record
+ @param hi the largest key to retrieve, or NULL to go on to the last record
+ @param out the records retrieved
+ @param max the number of records out has room for
+ @param count set to the number of records retrieved
+ @return ErrCode
+ SUCCESS if out was filled; more records in the range may follow.
+ DB_END if every record left in the range was retrieved.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if max is not positive or the records could not be retrieved for some other reason.
+ */
+ErrCode scanRange(IdxState *idxState, TxnState *txn, const Key *lo, const Key *hi,
+                  Record *out, int max, int *count);
+
+/**
+ Receives the records of scanRangeCallback one by one.
+ @return SUCCESS to go on with the scan; anything else stops it.
+ */
+typedef ErrCode (*RecordCallback)(void *context, const Record *record);
+
+/**
+ Passes the records whose keys lie between lo and hi, both included, to a callback in
+ the order getNext would return them, as scanRange does.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param lo the smallest key to pass, or NULL to start at the first record
+ @param hi the largest key to pass, or NULL to go on to the last record
+ @param callback called with each record
+ @param context passed to the callback
+ @return ErrCode
+ SUCCESS if every record in the range was passed to the callback.
+ the callback's ErrCode if it stopped the scan.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the records could not be retrieved for some other reason.
+ */
+ErrCode scanRangeCallback(IdxState *idxState, TxnState *txn, const Key *lo, const Key *hi,
+                          RecordCallback callback, void *context);
+
+/**
+ Retrieves the records whose keys lie between lo and hi, both included, in the order
+ getPrev would return them, largest key first. Within a transaction, getPrev afterwards
+ returns the record preceding the last one retrieved.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param lo the smallest key to retrieve, or NULL to go on to the first record
+ @param hi the largest key to retrieve, or NULL to start at the last record
+ @param out the records retrieved
+ @param max the number of records out has room for
+ @param count set to the number of records retrieved
+ @return ErrCode
+ SUCCESS if out was filled; more records in the range may follow.
+ DB_END if every record left in the range was retrieved.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if max is not positive or the records could not be retrieved for some other reason.
+ */
+ErrCode scanRangeReverse(IdxState *idxState, TxnState *txn, const Key *lo, const Key *hi,
+                         Record *out, int max, int *count);
+
+/**
+ A record returned by getView or getNextView without being copied into a Record.
+ @value key: The key as the index stores it, followed by a NUL: the characters of a
+ VARCHAR key, or a SHORT or INT key as 4 or 8 big-endian bytes with the sign bit
+ flipped, so that keys of one index compare with memcmp. keyFromView decodes it.
+ @value payload: The payload, a null-terminated C string of payloadLen characters.
+ Both stay valid until the transaction they were read in commits or aborts.
+ */
+typedef struct
+    {
+        const char  *key;
+        uint32_t    keyLen;
+        const char  *payload;
+        uint32_t    payloadLen;
+    } RecordView;
+
+/**
+ Behaves as get, but returns the record as a view valid until the transaction ends,
+ sparing the caller a copy into a Record.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used; views need one
+ @param key the key to retrieve
+ @param view the record retrieved
+ @return ErrCode
+ SUCCESS if the entry was found.
+ KEY_NOTFOUND if the key was not found.
+ TXN_DNE if txn is NULL.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the record could not be retrieved for some other reason.
+ */
+ErrCode getView(IdxState *idxState, TxnState *txn, const Key *key, RecordView *view);
+
+/**
+ Behaves as getNext, but returns the record as a view valid until the transaction ends.
+ getView, getNextView, get and getNext share one position in the index.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used; views need one
+ @param view the next record
+ @return ErrCode
+ SUCCESS if the next record was retrieved.
+ DB_END if reached the end of the DB.
+ TXN_DNE if txn is NULL.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the record could not be retrieved for some other reason.
+ */
+ErrCode getNextView(IdxState *idxState, TxnState *txn, RecordView *view);
+
+/**
+ Decodes the key of a view read from an index with keys of the given type.
+ */
+void keyFromView(const RecordView *view, KeyType type, Key *key);
+
+/**
+ Counts the records whose keys lie between lo and hi, both included. The position
+ getNext continues from is left as it was. The count is exact and is read from the
+ record counts kept with setRecordCounts, in time logarithmic in the size of the index.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param lo the smallest key to count, or NULL to start at the first record
+ @param hi the largest key to count, or NULL to go on to the last record
+ @param count set to the number of records
+ @return ErrCode
+ SUCCESS if the records were counted.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the index keeps no record counts, or the records could not be counted for
+ some other reason.
+ */
+ErrCode countRange(IdxState *idxState, TxnState *txn, const Key *lo, const Key *hi, uint64_t *count);
+
+/**
+ Retrieves the record that getNext would return after rank others when called after
+ beginning a transaction, so that rank 0 is the first record. Within a transaction,
+ getNext afterwards returns the record following it; together with countRange this
+ splits an index into even ranges. The record is found from the record counts kept with
+ setRecordCounts, in time logarithmic in the size of the index, or in its square for an
+ index loaded from a snapshot.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param rank the number of records before the one to retrieve
+ @param record the record retrieved
+ @return ErrCode
+ SUCCESS if the record was retrieved.
+ DB_END if the index has no more than rank records.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the index keeps no record counts, or the record could not be retrieved for
+ some other reason.
+ */
+ErrCode getByRank(IdxState *idxState, TxnState *txn, uint64_t rank, Record *record);
+
 /**
  Insert a payload associated with the given key. An identical key can
  be used multiple times, but only with unique payloads.  If this is
@@ -318,6 +820,157 @@ ErrCode insertRecord(IdxState *idxState, TxnState *txn, Key *k, const char* payl
  */
 ErrCode deleteRecord(IdxState *idxState, TxnState *txn, Record *record);
 
+/**
+ Inserts several records, as insertRecord would each one. The records are applied in
+ index order and within one transaction if none is given, so the batch is committed
+ once; identical records in the batch are inserted in the order given.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param records the records to insert
+ @param n the number of records
+ @param results filled in with insertRecord's ErrCode for each record: SUCCESS or ENTRY_EXISTS
+ @return ErrCode
+ SUCCESS if every record was applied.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the records could not be inserted for some other reason.
+ */
+ErrCode insertRecords(IdxState *idxState, TxnState *txn, Record *records, int n, ErrCode *results);
+
+/**
+ Deletes several records, as deleteRecord would each one, in index order and within one
+ transaction if none is given.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param records the records to delete; as for deleteRecord, a zeroed payload deletes every
+ record with the key
+ @param n the number of records
+ @param results filled in with deleteRecord's ErrCode for each record: SUCCESS,
+ ENTRY_DNE or KEY_NOTFOUND
+ @return ErrCode
+ SUCCESS if every record was applied.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the records could not be deleted for some other reason.
+ */
+ErrCode deleteRecords(IdxState *idxState, TxnState *txn, Record *records, int n, ErrCode *results);
+
+/**
+ Deletes every record whose key lies between lo and hi, both included, as one write:
+ the logical log holds a single record for it, and without a transaction it is
+ committed all at once or not at all. The work grows with the number of records in the
+ range, unless the range takes in every record, when the index is truncated instead. In
+ an index loaded by loadSnapshot, the snapshot records in the range share one range
+ tombstone, however many there are.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param lo the smallest key to delete, or NULL to start at the first record
+ @param hi the largest key to delete, or NULL to go on to the last record
+ @return ErrCode
+ SUCCESS if the range was deleted, whether or not it held any records.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the range could not be deleted for some other reason.
+ */
+ErrCode deleteRange(IdxState *idxState, TxnState *txn, const Key *lo, const Key *hi);
+
+/**
+ Replaces every payload the key has with the one given, or inserts it if the key has
+ none, as one write.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param k key of the record
+ @param payload the key's only payload afterwards
+ @return ErrCode
+ SUCCESS if the key now has just this payload.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the record could not be written for some other reason.
+ */
+ErrCode upsertRecord(IdxState *idxState, TxnState *txn, Key *k, const char *payload);
+
+/**
+ Inserts the record only if its key is not yet in the index.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param k key of the record
+ @param payload payload of the record
+ @return ErrCode
+ SUCCESS if the record was inserted.
+ ENTRY_EXISTS if the key already has a payload, whatever it is.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the record could not be inserted for some other reason.
+ */
+ErrCode insertIfAbsent(IdxState *idxState, TxnState *txn, Key *k, const char *payload);
+
+/**
+ Replaces the record (k, expected) with (k, replacement), if it is in the index.
+
+ @param idxState The state variable for this thread
+ @param txn The transaction state to be used (or NULL if not in a transaction)
+ @param k key of the record
+ @param expected the payload to replace
+ @param replacement the payload to put in its place
+ @return ErrCode
+ SUCCESS if the record was swapped.
+ ENTRY_DNE if the key does not have the expected payload.
+ ENTRY_EXISTS if the key already has the replacement payload as well, which is left
+ as it was.
+ DB_DNE if the index has been dropped.
+ DEADLOCK if this call could not complete because of deadlock.
+ FAILURE if the record could not be swapped for some other reason.
+ */
+ErrCode compareAndSwap(IdxState *idxState, TxnState *txn, Key *k, const char *expected, const char *replacement);
+
+/**
+ Supplies the records for bulkLoad, one per call.
+
+ @param context the context pointer given to bulkLoad
+ @param record Record to fill with the next key/payload pair
+ @return ErrCode
+ SUCCESS if record holds the next record.
+ DB_END if there are no more records.
+ Any other value stops the load and is returned by bulkLoad.
+ */
+typedef ErrCode (*RecordIterator)(void *context, Record *record);
+
+/**
+ Inserts a large number of records far faster than one insertRecord per record. The
+ input is sorted first, in runs spilled to temporary files if it does not fit in memory,
+ and then inserted in key order in large transactions, so the index is filled page by
+ page and each batch of records costs a single commit. Records that are already in the
+ index, or repeated in the input, are skipped. Must be called from outside of a
+ transaction; if it fails, the batches committed before the failure stay in the index.
+
+ @param idxState The state variable for this thread
+ @param next the iterator supplying the records; their keys must be of the index's type
+ @param context passed to every call of next
+ @return ErrCode
+ SUCCESS if every record is now in the index.
+ DB_DNE if the index was dropped.
+ FAILURE if a record could not be read or inserted, or a key has the wrong type.
+ */
+ErrCode bulkLoad(IdxState *idxState, RecordIterator next, void *context);
+
+/**
+ Bulk loads the records stored in a file, as bulkLoad does. The file holds Record
+ structures back to back, as written with fwrite.
+
+ @param idxState The state variable for this thread
+ @param path the file to load
+ @return ErrCode
+ SUCCESS if every record in the file is now in the index.
+ DB_DNE if the index was dropped.
+ FAILURE if the file could not be read, or a record could not be inserted.
+ */
+ErrCode bulkLoadFile(IdxState *idxState, const char *path);
+
 #ifdef __cplusplus
 }
 #endif
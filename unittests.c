@@ -31,18 +31,32 @@ This is version 1.0, released December 12, 2008.
 
 #include "server.h"
 
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 IdxState *idx;
 
 char *primary_index = "primary_index";
 char *secondary_index = "secondary_index";
 char *terciary_index = "terciary_index";
+char *drop_index = "drop_index";
+char *snapshot_index = "snapshot_index";
+const char *snapshot_file = "snapshot_test.snap";
+char *bulk_index = "bulk_index";
+const char *bulk_file = "bulk_test.records";
+char *backup_index = "backup_index";
+const char *restart_dir = "restart_test";
+char *restart_index = "restart_index";
+char *restart_dropped = "restart_dropped";
+char *restart_logged = "restart_logged";
+char *restart_recreated = "restart_recreated";
 
 char *a_key = "a_key";
 char *b_key = "b_key";
@@ -313,6 +327,1117 @@ static void *secondary_index_func()
 }
 
 
+/*
+ Tests that truncateIndex empties an index while leaving its handles usable, and that
+ dropIndex invalidates outstanding handles and frees the name for a new index.
+ */
+static int drop_truncate_tests(void)
+{
+    int errCode;
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    Key k;
+    k.type = INT;
+    k.keyval.intkey = 42;
+    
+    if ((errCode = create(INT, drop_index)) != SUCCESS) {
+        printf("could not create index to drop\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = openIndex(drop_index, &idx)) != SUCCESS) {
+        printf("could not open index to drop\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = insertRecord(idx, NULL, &k, value_one)) != SUCCESS) {
+        printf("could not insert (42,1) before truncate\n");
+        return EXIT_FAILURE;
+    }
+    
+    //after truncating, the same handle should see an empty index
+    if ((errCode = truncateIndex(drop_index)) != SUCCESS) {
+        printf("could not truncate index\n");
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k;
+    if ((errCode = get(idx, NULL, &record)) != KEY_NOTFOUND) {
+        printf("get after truncate did not report KEY_NOTFOUND\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = insertRecord(idx, NULL, &k, value_two)) != SUCCESS) {
+        printf("could not insert (42,2) after truncate\n");
+        return EXIT_FAILURE;
+    }
+    
+    //a transaction still using the index does not hold a truncate up, and loses what it
+    //wrote to the index before it
+    k.keyval.intkey = 43;
+    if (beginTransaction(&txn) != SUCCESS || insertRecord(idx, txn, &k, value_one) != SUCCESS ||
+        truncateIndex(drop_index) != SUCCESS || commitTransaction(txn) != SUCCESS) {
+        printf("could not truncate an index a transaction was using\n");
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k;
+    if ((errCode = get(idx, NULL, &record)) != KEY_NOTFOUND) {
+        printf("a write from before the truncate survived it\n");
+        return EXIT_FAILURE;
+    }
+    k.keyval.intkey = 42;
+    
+    //after dropping, the open handle and the name should both be gone
+    if ((errCode = dropIndex(drop_index)) != SUCCESS) {
+        printf("could not drop index\n");
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k;
+    if ((errCode = get(idx, NULL, &record)) != DB_DNE) {
+        printf("get through a dropped index's handle did not report DB_DNE\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = closeIndex(idx)) != DB_DNE) {
+        printf("closeIndex on a dropped index did not report DB_DNE\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = openIndex(drop_index, &idx)) != DB_DNE) {
+        printf("opened an index after it was dropped\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = dropIndex(drop_index)) != DB_DNE) {
+        printf("dropped an index twice\n");
+        return EXIT_FAILURE;
+    }
+    
+    //the name can be reused, and the new index starts out empty
+    if ((errCode = create(INT, drop_index)) != SUCCESS) {
+        printf("could not re-create dropped index\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = openIndex(drop_index, &idx)) != SUCCESS) {
+        printf("could not open re-created index\n");
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k;
+    if ((errCode = get(idx, NULL, &record)) != KEY_NOTFOUND) {
+        printf("re-created index still holds old records\n");
+        return EXIT_FAILURE;
+    }
+    
+    //a handle closed twice reports DB_DNE the second time, even once a later close has
+    //pushed it out of this thread's handle cache
+    IdxState *second;
+    if ((errCode = openIndex(drop_index, &second)) != SUCCESS) {
+        printf("could not open re-created index a second time\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = closeIndex(idx)) != SUCCESS || (errCode = closeIndex(second)) != SUCCESS) {
+        printf("could not close re-created index\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = closeIndex(idx)) != DB_DNE || (errCode = closeIndex(second)) != DB_DNE) {
+        printf("closing a handle twice did not report DB_DNE\n");
+        return EXIT_FAILURE;
+    }
+    
+    //nor does closing it again once its handle has been reopened close the new owner's
+    IdxState *third;
+    if ((errCode = openIndex(drop_index, &third)) != SUCCESS) {
+        printf("could not reopen re-created index\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = closeIndex(idx)) != DB_DNE || (errCode = closeIndex(second)) != DB_DNE) {
+        printf("closing a stale handle did not report DB_DNE\n");
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k;
+    if ((errCode = get(third, NULL, &record)) != KEY_NOTFOUND || (errCode = closeIndex(third)) != SUCCESS) {
+        printf("closing a stale handle closed the reopened one\n");
+        return EXIT_FAILURE;
+    }
+    
+    //a transaction that wrote to an index before it was dropped can go on to use the index
+    //re-created under its name, and commits without mixing up the two
+    if ((errCode = openIndex(drop_index, &idx)) != SUCCESS || (errCode = beginTransaction(&txn)) != SUCCESS) {
+        printf("could not start a transaction on the index to drop\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = insertRecord(idx, txn, &k, value_one)) != SUCCESS) {
+        printf("could not insert (42,1) in a transaction before the drop\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = dropIndex(drop_index)) != SUCCESS || (errCode = create(INT, drop_index)) != SUCCESS ||
+        (errCode = openIndex(drop_index, &second)) != SUCCESS) {
+        printf("could not drop and re-create an index a transaction is using\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = insertRecord(second, txn, &k, value_two)) != SUCCESS ||
+        (errCode = commitTransaction(txn)) != SUCCESS) {
+        printf("could not use the re-created index in the same transaction\n");
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k;
+    if ((errCode = get(second, NULL, &record)) != SUCCESS || strcmp(record.payload, value_two) != 0) {
+        printf("re-created index did not get the transaction's insert\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = closeIndex(idx)) != DB_DNE || (errCode = closeIndex(second)) != SUCCESS) {
+        printf("could not close the dropped and the re-created index\n");
+        return EXIT_FAILURE;
+    }
+    
+    printf("successfully passed drop and truncate tests!\n");
+    return EXIT_SUCCESS;
+}
+
+/*
+ Loads an index from a snapshot and checks that later inserts and deletes are merged with
+ the snapshot's records in key order, and that saving again folds them in.
+ */
+static int snapshot_tests(void)
+{
+    int errCode;
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    Key k;
+    int64_t expectedKeys[] = {1, 1, 2, 3};
+    const char *expectedPayloads[4];
+    int i;
+    k.type = INT;
+    
+    if ((errCode = create(INT, snapshot_index)) != SUCCESS ||
+        (errCode = openIndex(snapshot_index, &idx)) != SUCCESS) {
+        printf("could not create index for snapshot\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 1; i <= 3; i++) {
+        k.keyval.intkey = i;
+        if ((errCode = insertRecord(idx, NULL, &k, value_one)) != SUCCESS) {
+            printf("could not insert (%d,1) before snapshot\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    k.keyval.intkey = 2;
+    if ((errCode = insertRecord(idx, NULL, &k, value_two)) != SUCCESS) {
+        printf("could not insert (2,2) before snapshot\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = saveSnapshot(snapshot_index, snapshot_file)) != SUCCESS) {
+        printf("could not save snapshot\n");
+        return EXIT_FAILURE;
+    }
+    
+    //loading replaces whatever the index held since the snapshot was saved
+    k.keyval.intkey = 4;
+    if ((errCode = insertRecord(idx, NULL, &k, value_one)) != SUCCESS) {
+        printf("could not insert (4,1) after saving snapshot\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = loadSnapshot(snapshot_index, snapshot_file)) != SUCCESS) {
+        printf("could not load snapshot\n");
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = k;
+    if ((errCode = get(idx, NULL, &record)) != KEY_NOTFOUND) {
+        printf("loading a snapshot kept a record that was not in it\n");
+        return EXIT_FAILURE;
+    }
+    
+    k.keyval.intkey = 2;
+    if ((errCode = insertRecord(idx, NULL, &k, value_one)) != ENTRY_EXISTS) {
+        printf("inserted a record that is already in the snapshot\n");
+        return EXIT_FAILURE;
+    }
+    k.keyval.intkey = 1;
+    if ((errCode = insertRecord(idx, NULL, &k, value_two)) != SUCCESS) {
+        printf("could not insert (1,2) over a snapshot\n");
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key.type = INT;
+    record.key.keyval.intkey = 2;
+    strcpy(record.payload, value_one);
+    if ((errCode = deleteRecord(idx, NULL, &record)) != SUCCESS) {
+        printf("could not delete (2,1) from a snapshot\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = deleteRecord(idx, NULL, &record)) != ENTRY_DNE) {
+        printf("deleted (2,1) from a snapshot twice\n");
+        return EXIT_FAILURE;
+    }
+    
+    //a scan should see the snapshot and the later changes as one index
+    expectedPayloads[0] = value_one;
+    expectedPayloads[1] = value_two;
+    expectedPayloads[2] = value_two;
+    expectedPayloads[3] = value_one;
+    for (i = 0; i < 2; i++) {
+        int j;
+        if ((errCode = beginTransaction(&txn)) != SUCCESS) {
+            printf("could not begin snapshot scan\n");
+            return EXIT_FAILURE;
+        }
+        for (j = 0; j < 4; j++) {
+            if ((errCode = getNext(idx, txn, &record)) != SUCCESS ||
+                record.key.keyval.intkey != expectedKeys[j] || strcmp(record.payload, expectedPayloads[j]) != 0) {
+                printf("snapshot scan returned the wrong record at %d\n", j);
+                return EXIT_FAILURE;
+            }
+        }
+        if ((errCode = getNext(idx, txn, &record)) != DB_END) {
+            printf("snapshot scan did not end\n");
+            return EXIT_FAILURE;
+        }
+        if ((errCode = commitTransaction(txn)) != SUCCESS) {
+            printf("could not commit snapshot scan\n");
+            return EXIT_FAILURE;
+        }
+        
+        //saving and loading again should leave the same records
+        if (i == 0 && ((errCode = saveSnapshot(snapshot_index, snapshot_file)) != SUCCESS ||
+                       (errCode = loadSnapshot(snapshot_index, snapshot_file)) != SUCCESS)) {
+            printf("could not fold changes into a new snapshot\n");
+            return EXIT_FAILURE;
+        }
+    }
+    
+    //a range scan reads through the snapshot as well
+    Record range[8];
+    Key lo, hi;
+    int count;
+    lo.type = hi.type = INT;
+    lo.keyval.intkey = 1;
+    hi.keyval.intkey = 2;
+    if ((errCode = scanRange(idx, NULL, &lo, &hi, range, 8, &count)) != DB_END || count != 3 ||
+        range[0].key.keyval.intkey != 1 || range[2].key.keyval.intkey != 2) {
+        printf("range scan of a snapshot returned the wrong records\n");
+        return EXIT_FAILURE;
+    }
+    
+    //counts leave out snapshot records deleted since it was loaded
+    uint64_t counted;
+    record.key.keyval.intkey = 3;
+    strcpy(record.payload, value_one);
+    if ((errCode = deleteRecord(idx, NULL, &record)) != SUCCESS ||
+        (errCode = countRange(idx, NULL, &lo, NULL, &counted)) != SUCCESS || counted != 3 ||
+        (errCode = getByRank(idx, NULL, 2, &record)) != SUCCESS || record.key.keyval.intkey != 2) {
+        printf("counting a snapshot went wrong. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    
+    //and reads backwards through it
+    if ((errCode = beginTransaction(&txn)) != SUCCESS) {
+        printf("could not begin reverse snapshot scan\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 2; i >= 0; i--) {
+        if ((errCode = getPrev(idx, txn, &record)) != SUCCESS ||
+            record.key.keyval.intkey != expectedKeys[i] || strcmp(record.payload, expectedPayloads[i]) != 0) {
+            printf("reverse snapshot scan returned the wrong record at %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((errCode = getPrev(idx, txn, &record)) != DB_END || (errCode = commitTransaction(txn)) != SUCCESS) {
+        printf("reverse snapshot scan did not end\n");
+        return EXIT_FAILURE;
+    }
+    
+    //a scan skips snapshot records deleted after it started, and sees them again once that is aborted
+    Record deleted;
+    memset(&deleted, 0, sizeof(Record));
+    deleted.key.type = INT;
+    deleted.key.keyval.intkey = 2;
+    strcpy(deleted.payload, value_two);
+    if ((errCode = beginTransaction(&txn)) != SUCCESS ||
+        (errCode = getNext(idx, txn, &record)) != SUCCESS || record.key.keyval.intkey != 1 ||
+        (errCode = deleteRecord(idx, txn, &deleted)) != SUCCESS ||
+        (errCode = getNext(idx, txn, &record)) != SUCCESS || record.key.keyval.intkey != 1 ||
+        (errCode = getNext(idx, txn, &record)) != DB_END ||
+        (errCode = abortTransaction(txn)) != SUCCESS) {
+        printf("scan read a snapshot record deleted during it. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key = deleted.key;
+    if ((errCode = get(idx, NULL, &record)) != SUCCESS || strcmp(record.payload, value_two) != 0) {
+        printf("aborting a snapshot delete lost the record. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+
+    //a range delete tombstones the snapshot records in it
+    if ((errCode = deleteRange(idx, NULL, &lo, &lo)) != SUCCESS ||
+        (errCode = countRange(idx, NULL, NULL, NULL, &counted)) != SUCCESS || counted != 1) {
+        printf("range delete from a snapshot failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    
+    //a record inserted again splits the range tombstone around it, and deleting the
+    //whole index merges every tombstone into one range
+    k.keyval.intkey = 1;
+    if ((errCode = insertRecord(idx, NULL, &k, value_two)) != SUCCESS ||
+        (errCode = countRange(idx, NULL, NULL, NULL, &counted)) != SUCCESS || counted != 2 ||
+        (errCode = getByRank(idx, NULL, 0, &record)) != SUCCESS || record.key.keyval.intkey != 1 ||
+        strcmp(record.payload, value_two) != 0) {
+        printf("reinserting into a range tombstone failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    if ((errCode = deleteRange(idx, NULL, NULL, NULL)) != SUCCESS ||
+        (errCode = countRange(idx, NULL, NULL, NULL, &counted)) != SUCCESS || counted != 0 ||
+        (errCode = beginTransaction(&txn)) != SUCCESS ||
+        (errCode = getNext(idx, txn, &record)) != DB_END ||
+        (errCode = getPrev(idx, txn, &record)) != DB_END ||
+        (errCode = commitTransaction(txn)) != SUCCESS) {
+        printf("deleting a whole snapshot index failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    k.keyval.intkey = 2;
+    if ((errCode = insertRecord(idx, NULL, &k, value_two)) != SUCCESS ||
+        (errCode = countRange(idx, NULL, NULL, NULL, &counted)) != SUCCESS || counted != 1) {
+        printf("reinserting into a whole-index range tombstone failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = closeIndex(idx)) != SUCCESS || (errCode = dropIndex(snapshot_index)) != SUCCESS) {
+        printf("could not drop snapshot index\n");
+        return EXIT_FAILURE;
+    }
+    unlink(snapshot_file);
+    
+    printf("successfully passed snapshot tests!\n");
+    return EXIT_SUCCESS;
+}
+
+
+#define BULK_RECORDS 5000
+
+/*
+ Supplies every key below BULK_RECORDS / 2 twice, with two payloads, in scrambled order,
+ followed by a repeat of the first record.
+ */
+static ErrCode bulk_iterator(void *context, Record *record)
+{
+    int *next = (int *)context;
+    int i = *next;
+    if (i > BULK_RECORDS) {
+        return DB_END;
+    }
+    (*next)++;
+    if (i == BULK_RECORDS) {
+        i = 0;
+    }
+    record->key.type = INT;
+    record->key.keyval.intkey = (i * 7919) % (BULK_RECORDS / 2);
+    strcpy(record->payload, i < BULK_RECORDS / 2 ? value_one : value_two);
+    return SUCCESS;
+}
+
+static ErrCode count_records(void *context, const Record *record)
+{
+    (*(int *)context)++;
+    return SUCCESS;
+}
+
+static int bulk_load_tests(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    int errCode;
+    int next = 0;
+    int i;
+    
+    if ((errCode = create(INT, bulk_index)) != SUCCESS ||
+        (errCode = openIndex(bulk_index, &idx)) != SUCCESS) {
+        printf("could not create index for bulk load\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = bulkLoad(idx, bulk_iterator, &next)) != SUCCESS) {
+        printf("bulk load failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    
+    //a few more records from a file, with keys after the loaded ones
+    FILE *out = fopen(bulk_file, "w");
+    if (out == NULL) {
+        printf("could not write bulk load file\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < 10; i++) {
+        memset(&record, 0, sizeof(Record));
+        record.key.type = INT;
+        record.key.keyval.intkey = BULK_RECORDS + 9 - i;
+        strcpy(record.payload, small_payload);
+        fwrite(&record, sizeof(Record), 1, out);
+    }
+    fclose(out);
+    if ((errCode = bulkLoadFile(idx, bulk_file)) != SUCCESS) {
+        printf("bulk load from file failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    //loading records the index already has leaves them once
+    if ((errCode = bulkLoadFile(idx, bulk_file)) != SUCCESS) {
+        printf("bulk load of records already loaded failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    unlink(bulk_file);
+    
+    //every record is there once, in order
+    if ((errCode = beginTransaction(&txn)) != SUCCESS) {
+        printf("could not begin bulk load scan\n");
+        return EXIT_FAILURE;
+    }
+    int64_t last = -1;
+    int count = 0;
+    memset(&record, 0, sizeof(Record));
+    while ((errCode = getNext(idx, txn, &record)) == SUCCESS) {
+        if (record.key.keyval.intkey < last) {
+            printf("bulk loaded records are out of order\n");
+            return EXIT_FAILURE;
+        }
+        last = record.key.keyval.intkey;
+        count++;
+    }
+    if (errCode != DB_END || count != BULK_RECORDS + 10) {
+        printf("bulk load left %d records instead of %d\n", count, BULK_RECORDS + 10);
+        return EXIT_FAILURE;
+    }
+    if ((errCode = commitTransaction(txn)) != SUCCESS) {
+        printf("could not commit bulk load scan\n");
+        return EXIT_FAILURE;
+    }
+    
+    //a scan that has started reading ahead still sees a step back and its own inserts
+    int64_t aheadKeys[] = {4, 4, 5, 5, 6, 6, 6};
+    const char *aheadPayloads[] = {value_one, value_two, value_one, value_two, value_one, value_two, small_payload};
+    if ((errCode = beginTransaction(&txn)) != SUCCESS) {
+        printf("could not begin read-ahead scan\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < 10; i++) {
+        if ((errCode = getNext(idx, txn, &record)) != SUCCESS || record.key.keyval.intkey != i / 2 ||
+            strcmp(record.payload, i % 2 == 0 ? value_one : value_two) != 0) {
+            printf("scan returned the wrong record at %d while starting to read ahead\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((errCode = getPrev(idx, txn, &record)) != SUCCESS || record.key.keyval.intkey != 4 ||
+        strcmp(record.payload, value_one) != 0) {
+        printf("getPrev after reading ahead returned the wrong record\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 1; i < 7; i++) {
+        if (i == 5) {
+            Key k = record.key;
+            if ((errCode = insertRecord(idx, txn, &k, small_payload)) != SUCCESS) {
+                printf("could not insert during read-ahead scan\n");
+                return EXIT_FAILURE;
+            }
+        }
+        if ((errCode = getNext(idx, txn, &record)) != SUCCESS || record.key.keyval.intkey != aheadKeys[i] ||
+            strcmp(record.payload, aheadPayloads[i]) != 0) {
+            printf("read-ahead scan returned the wrong record at %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((errCode = abortTransaction(txn)) != SUCCESS) {
+        printf("could not abort read-ahead scan\n");
+        return EXIT_FAILURE;
+    }
+    
+    //a batch of lookups, out of order and with a repeated and a missing key
+    Record batch[4];
+    ErrCode results[4];
+    int64_t batchKeys[] = {BULK_RECORDS + 2, 7, -1, 7};
+    const char *batchPayloads[] = {small_payload, value_one, NULL, value_one};
+    memset(batch, 0, sizeof(batch));
+    for (i = 0; i < 4; i++) {
+        batch[i].key.type = INT;
+        batch[i].key.keyval.intkey = batchKeys[i];
+    }
+    if ((errCode = getBatch(idx, NULL, batch, 4, results)) != SUCCESS) {
+        printf("batched get failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < 4; i++) {
+        if (batchPayloads[i] == NULL ? results[i] != KEY_NOTFOUND :
+            results[i] != SUCCESS || strcmp(batch[i].payload, batchPayloads[i]) != 0) {
+            printf("batched get returned the wrong result for key %d\n", (int)batchKeys[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    //a range scan that fills its buffer leaves getNext to carry on after it
+    Record range[8];
+    Key lo, hi;
+    lo.type = hi.type = INT;
+    lo.keyval.intkey = 10;
+    hi.keyval.intkey = 12;
+    if ((errCode = beginTransaction(&txn)) != SUCCESS) {
+        printf("could not begin range scan\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = scanRange(idx, txn, &lo, &hi, range, 4, &count)) != SUCCESS || count != 4 ||
+        range[0].key.keyval.intkey != 10 || range[3].key.keyval.intkey != 11 ||
+        strcmp(range[3].payload, value_two) != 0) {
+        printf("range scan returned the wrong records\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = getNext(idx, txn, &record)) != SUCCESS || record.key.keyval.intkey != 12) {
+        printf("getNext did not carry on after a range scan\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = commitTransaction(txn)) != SUCCESS) {
+        printf("could not commit range scan\n");
+        return EXIT_FAILURE;
+    }
+    count = 0;
+    if ((errCode = scanRangeCallback(idx, NULL, NULL, NULL, count_records, &count)) != SUCCESS ||
+        count != BULK_RECORDS + 10) {
+        printf("range scan callback saw %d records instead of %d\n", count, BULK_RECORDS + 10);
+        return EXIT_FAILURE;
+    }
+    
+    //views read in a transaction stay valid as later ones are read
+    RecordView first, second;
+    Key viewKey;
+    if ((errCode = beginTransaction(&txn)) != SUCCESS) {
+        printf("could not begin view reads\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = getView(idx, txn, &lo, &first)) != SUCCESS ||
+        (errCode = getNextView(idx, txn, &second)) != SUCCESS ||
+        first.payloadLen != strlen(first.payload) || first.keyLen != 8) {
+        printf("view reads failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    keyFromView(&first, INT, &viewKey);
+    if (viewKey.keyval.intkey != 10 || first.payload == second.payload) {
+        printf("view read returned the wrong record\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = commitTransaction(txn)) != SUCCESS) {
+        printf("could not commit view reads\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = getView(idx, NULL, &lo, &first)) != TXN_DNE) {
+        printf("view read without a transaction returned %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    
+    //counts and ranks agree with what a scan sees
+    uint64_t counted;
+    if ((errCode = countRange(idx, NULL, &lo, &hi, &counted)) != SUCCESS || counted != 6 ||
+        (errCode = countRange(idx, NULL, NULL, NULL, &counted)) != SUCCESS || counted != BULK_RECORDS + 10) {
+        printf("range count failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    if ((errCode = getByRank(idx, NULL, 23, &record)) != SUCCESS || record.key.keyval.intkey != 11 ||
+        strcmp(record.payload, value_two) != 0 || getByRank(idx, NULL, counted, &record) != DB_END) {
+        printf("getByRank returned the wrong record\n");
+        return EXIT_FAILURE;
+    }
+    
+    //a descending scan from the top of a range, then getPrev carrying on below it
+    if ((errCode = beginTransaction(&txn)) != SUCCESS) {
+        printf("could not begin reverse scan\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = scanRangeReverse(idx, txn, &lo, &hi, range, 4, &count)) != SUCCESS || count != 4 ||
+        range[0].key.keyval.intkey != 12 || range[3].key.keyval.intkey != 11) {
+        printf("reverse range scan returned the wrong records\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = getPrev(idx, txn, &record)) != SUCCESS || record.key.keyval.intkey != 10 ||
+        (errCode = scanRangeReverse(idx, txn, &lo, &hi, range, 8, &count)) != DB_END || count != 6 ||
+        (errCode = getPrev(idx, txn, &record)) != SUCCESS || record.key.keyval.intkey != 9) {
+        printf("getPrev did not carry on after a reverse range scan\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = commitTransaction(txn)) != SUCCESS) {
+        printf("could not commit reverse scan\n");
+        return EXIT_FAILURE;
+    }
+    
+    //batched writes report each record's outcome, repeats included
+    memset(batch, 0, sizeof(batch));
+    for (i = 0; i < 3; i++) {
+        batch[i].key.type = INT;
+        batch[i].key.keyval.intkey = i < 2 ? BULK_RECORDS + 20 : 3;
+        strcpy(batch[i].payload, value_one);
+    }
+    if ((errCode = insertRecords(idx, NULL, batch, 3, results)) != SUCCESS ||
+        results[0] != SUCCESS || results[1] != ENTRY_EXISTS || results[2] != ENTRY_EXISTS) {
+        printf("batched insert returned the wrong results\n");
+        return EXIT_FAILURE;
+    }
+    batch[1].key.keyval.intkey = -1;
+    memset(batch[1].payload, 0, sizeof(batch[1].payload));
+    strcpy(batch[2].payload, "absent");
+    if ((errCode = deleteRecords(idx, NULL, batch, 3, results)) != SUCCESS ||
+        results[0] != SUCCESS || results[1] != KEY_NOTFOUND || results[2] != ENTRY_DNE) {
+        printf("batched delete returned the wrong results\n");
+        return EXIT_FAILURE;
+    }
+    
+    //a range delete takes every record in the range and nothing else
+    lo.keyval.intkey = 100;
+    hi.keyval.intkey = 199;
+    if ((errCode = deleteRange(idx, NULL, &lo, &hi)) != SUCCESS ||
+        (errCode = countRange(idx, NULL, &lo, &hi, &counted)) != SUCCESS || counted != 0 ||
+        (errCode = countRange(idx, NULL, NULL, NULL, &counted)) != SUCCESS || counted != BULK_RECORDS - 190) {
+        printf("range delete failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    
+    //an upsert leaves the key one payload, which only a matching swap replaces
+    lo.keyval.intkey = 10;
+    if ((errCode = upsertRecord(idx, NULL, &lo, value_one)) != SUCCESS ||
+        (errCode = countRange(idx, NULL, &lo, &lo, &counted)) != SUCCESS || counted != 1 ||
+        (errCode = insertIfAbsent(idx, NULL, &lo, value_two)) != ENTRY_EXISTS) {
+        printf("upsert failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    record.key = lo;
+    if ((errCode = compareAndSwap(idx, NULL, &lo, value_two, value_one)) != ENTRY_DNE ||
+        (errCode = compareAndSwap(idx, NULL, &lo, value_one, value_two)) != SUCCESS ||
+        (errCode = get(idx, NULL, &record)) != SUCCESS ||
+        strcmp(record.payload, value_two) != 0) {
+        printf("compare and swap failed. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = closeIndex(idx)) != SUCCESS || (errCode = dropIndex(bulk_index)) != SUCCESS) {
+        printf("could not drop bulk load index\n");
+        return EXIT_FAILURE;
+    }
+    
+    printf("successfully passed bulk load tests!\n");
+    return EXIT_SUCCESS;
+}
+
+static int backup_tests(void)
+{
+    IdxState *idx;
+    TxnState *txn;
+    Record record;
+    Key k;
+    int errCode;
+    int i;
+    k.type = VARCHAR;
+    
+    if ((errCode = create(VARCHAR, backup_index)) != SUCCESS ||
+        (errCode = openIndex(backup_index, &idx)) != SUCCESS) {
+        printf("could not create index for backup\n");
+        return EXIT_FAILURE;
+    }
+    strcpy(k.keyval.charkey, a_key);
+    if ((errCode = insertRecord(idx, NULL, &k, value_one)) != SUCCESS ||
+        (errCode = insertRecord(idx, NULL, &k, value_two)) != SUCCESS) {
+        printf("could not insert records before backup\n");
+        return EXIT_FAILURE;
+    }
+    strcpy(k.keyval.charkey, b_key);
+    if ((errCode = insertRecord(idx, NULL, &k, value_one)) != SUCCESS) {
+        printf("could not insert records before backup\n");
+        return EXIT_FAILURE;
+    }
+    
+    FILE *backup = tmpfile();
+    if (backup == NULL) {
+        printf("could not create backup file\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = backupIndex(backup_index, fileno(backup))) != SUCCESS) {
+        printf("could not back up index. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    if ((errCode = backupIndex(c_key, fileno(backup))) != DB_DNE) {
+        printf("backed up an index that does not exist\n");
+        return EXIT_FAILURE;
+    }
+    
+    //restoring undoes whatever changed since the backup
+    if ((errCode = insertRecord(idx, NULL, &k, value_two)) != SUCCESS) {
+        printf("could not insert (b_key,2) after backup\n");
+        return EXIT_FAILURE;
+    }
+    rewind(backup);
+    if ((errCode = restoreBackup(fileno(backup))) != SUCCESS) {
+        printf("could not restore backup. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    fclose(backup);
+    
+    const char *expectedKeys[] = {a_key, a_key, b_key};
+    const char *expectedPayloads[] = {value_one, value_two, value_one};
+    if ((errCode = beginTransaction(&txn)) != SUCCESS) {
+        printf("could not begin scan of restored index\n");
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    for (i = 0; i < 3; i++) {
+        if ((errCode = getNext(idx, txn, &record)) != SUCCESS ||
+            strcmp(record.key.keyval.charkey, expectedKeys[i]) != 0 ||
+            strcmp(record.payload, expectedPayloads[i]) != 0) {
+            printf("restored record %d is not the one backed up\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((errCode = getNext(idx, txn, &record)) != DB_END) {
+        printf("restoring a backup kept a record that was not in it\n");
+        return EXIT_FAILURE;
+    }
+    if ((errCode = commitTransaction(txn)) != SUCCESS) {
+        printf("could not commit scan of restored index\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = closeIndex(idx)) != SUCCESS || (errCode = dropIndex(backup_index)) != SUCCESS) {
+        printf("could not drop backup index\n");
+        return EXIT_FAILURE;
+    }
+    
+    printf("successfully passed backup tests!\n");
+    return EXIT_SUCCESS;
+}
+
+/*
+ Runs body as one lifetime of the library in a child process working in restart_dir, and
+ returns its exit status. The child exits without closing anything, as if it crashed, so
+ the next child sees what a restart recovers. This process has not started the library.
+ */
+static int run_restart_child(int (*body)(void))
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+        if (chdir(restart_dir) != 0) {
+            _exit(EXIT_FAILURE);
+        }
+        int result = body();
+        fflush(stdout);
+        _exit(result);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+        return EXIT_FAILURE;
+    }
+    return WEXITSTATUS(status);
+}
+
+static int restart_create(void)
+{
+    if (create(INT, restart_index) != SUCCESS || create(VARCHAR, restart_dropped) != SUCCESS) {
+        printf("could not create indices before restart\n");
+        return EXIT_FAILURE;
+    }
+    if (dropIndex(restart_dropped) != SUCCESS) {
+        printf("could not drop index before restart\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int restart_catalog(void)
+{
+    IdxState *idx;
+    if (openIndex(restart_index, &idx) != SUCCESS) {
+        printf("index created before restart is missing from the catalog\n");
+        return EXIT_FAILURE;
+    }
+    if (closeIndex(idx) != SUCCESS) {
+        printf("could not close index after restart\n");
+        return EXIT_FAILURE;
+    }
+    if (openIndex(restart_dropped, &idx) != DB_DNE) {
+        printf("index dropped before restart came back\n");
+        return EXIT_FAILURE;
+    }
+    if (create(INT, restart_index) != DB_EXISTS) {
+        printf("re-created an index loaded from the catalog\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ Writes more logical log than recovery could replay within a one-second target, and
+ waits for the checkpointer to move the log on to a new file and remove the old one.
+ */
+static int restart_recovery_target(void)
+{
+    IdxState *idx;
+    if (setLogicalLog(0) != SUCCESS || setDurability(DURABILITY_ASYNC, 50) != SUCCESS ||
+        setRecoveryTarget(1) != SUCCESS) {
+        printf("could not set up the logical log before first use\n");
+        return EXIT_FAILURE;
+    }
+    if (openIndex(restart_index, &idx) != SUCCESS) {
+        printf("could not open index to fill the logical log\n");
+        return EXIT_FAILURE;
+    }
+    
+    //a one-second target allows 16MB of log, and every record logs over 100 bytes
+    static Record records[1000];
+    ErrCode results[1000];
+    int64_t next = 0;
+    int batch, i;
+    for (batch = 0; batch < 160; batch++) {
+        for (i = 0; i < 1000; i++) {
+            memset(&records[i], 0, sizeof(Record));
+            records[i].key.type = INT;
+            records[i].key.keyval.intkey = next++;
+            memset(records[i].payload, 'p', MAX_PAYLOAD_LEN - 1);
+        }
+        if (insertRecords(idx, NULL, records, 1000, results) != SUCCESS) {
+            printf("could not fill the logical log\n");
+            return EXIT_FAILURE;
+        }
+    }
+    
+    //the first start under the logical log checkpointed into logical.1
+    for (i = 0; i < 100 && access("ENV/logical.1", F_OK) == 0; i++) {
+        usleep(100 * 1000);
+    }
+    if (access("ENV/logical.1", F_OK) == 0) {
+        printf("checkpointer let the log grow past the recovery target\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ Routes I/O through io_uring from the start, or through the plain calls where the kernel
+ has none, and checks that the indices still read and write.
+ */
+static int restart_async_io(void)
+{
+    if (setLogicalLog(0) != SUCCESS || setAsyncIO(0) != FAILURE || setAsyncIO(64) != SUCCESS) {
+        printf("could not set asynchronous I/O before first use\n");
+        return EXIT_FAILURE;
+    }
+    
+    IdxState *idx;
+    Key k;
+    Record record;
+    k.type = INT;
+    k.keyval.intkey = -1;
+    memset(&record, 0, sizeof(Record));
+    record.key = k;
+    if (openIndex(restart_index, &idx) != SUCCESS || insertRecord(idx, NULL, &k, value_one) != SUCCESS ||
+        get(idx, NULL, &record) != SUCCESS || strcmp(record.payload, value_one) != 0) {
+        printf("could not use an index with asynchronous I/O\n");
+        return EXIT_FAILURE;
+    }
+    if (setAsyncIO(64) != FAILURE) {
+        printf("changed asynchronous I/O after the environment was created\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ Opens the indices without the default multiversion reads and backs them all up under read locks.
+ */
+static int restart_multiversion(void)
+{
+    if (setLogicalLog(0) != SUCCESS || setMultiversion(0) != SUCCESS) {
+        printf("could not disable multiversion reads before first use\n");
+        return EXIT_FAILURE;
+    }
+    int fd = open("multiversion.backup", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0 || backupIndex(NULL, fd) != SUCCESS) {
+        printf("could not back up without multiversion reads\n");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+/*
+ Opens the file of the logical log that replay ends with, as named by its checkpoint marker.
+ */
+static int restart_open_log(int flags)
+{
+    uint32_t gen;
+    int fd = open("ENV/logical.ckpt", O_RDONLY);
+    if (fd < 0 || read(fd, &gen, sizeof(gen)) != sizeof(gen)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    char path[64];
+    snprintf(path, sizeof(path), "ENV/logical.%u", gen);
+    return open(path, flags);
+}
+
+/*
+ Logs a VARCHAR key of every length, so key sizes take both one and two varint bytes,
+ and deletes one of them. Nothing is checkpointed before the child exits, so the next
+ start only finds these records by replaying the log.
+ */
+static int restart_logical_write(void)
+{
+    IdxState *idx;
+    Key k;
+    Record record;
+    int len;
+    if (setLogicalLog(0) != SUCCESS || setDurability(DURABILITY_SYNC, 0) != SUCCESS) {
+        printf("could not set up the logical log before the environment exists\n");
+        return EXIT_FAILURE;
+    }
+    if (create(VARCHAR, restart_logged) != SUCCESS || openIndex(restart_logged, &idx) != SUCCESS) {
+        printf("could not create an index under the logical log\n");
+        return EXIT_FAILURE;
+    }
+    k.type = VARCHAR;
+    for (len = 1; len <= MAX_VARCHAR_LEN; len++) {
+        memset(k.keyval.charkey, 'k', len);
+        k.keyval.charkey[len] = '\0';
+        if (insertRecord(idx, NULL, &k, value_one) != SUCCESS) {
+            printf("could not log a key of length %d\n", len);
+            return EXIT_FAILURE;
+        }
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key.type = VARCHAR;
+    strcpy(record.key.keyval.charkey, "k");
+    strcpy(record.payload, value_one);
+    if (deleteRecord(idx, NULL, &record) != SUCCESS) {
+        printf("could not log a delete\n");
+        return EXIT_FAILURE;
+    }
+    
+    //the second incarnation of an index takes over the id of the first
+    k.type = VARCHAR;
+    strcpy(k.keyval.charkey, a_key);
+    if (create(VARCHAR, restart_recreated) != SUCCESS || openIndex(restart_recreated, &idx) != SUCCESS ||
+        insertRecord(idx, NULL, &k, value_one) != SUCCESS || closeIndex(idx) != SUCCESS ||
+        dropIndex(restart_recreated) != SUCCESS) {
+        printf("could not log the first incarnation of an index\n");
+        return EXIT_FAILURE;
+    }
+    strcpy(k.keyval.charkey, b_key);
+    if (create(VARCHAR, restart_recreated) != SUCCESS || openIndex(restart_recreated, &idx) != SUCCESS ||
+        insertRecord(idx, NULL, &k, value_two) != SUCCESS) {
+        printf("could not log the second incarnation of an index\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ Leaves part of a frame at the end of the log, as a crash during a write would. Replay,
+ split between threads by index, cuts it off and restores every record logged before it.
+ */
+static int restart_logical_replay(void)
+{
+    static const char torn[] = "part of a frame";
+    int fd = restart_open_log(O_WRONLY | O_APPEND);
+    struct stat before, after;
+    if (fd < 0 || fstat(fd, &before) != 0 || write(fd, torn, sizeof(torn)) != sizeof(torn)) {
+        printf("could not tear the end of the logical log\n");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    
+    IdxState *idx;
+    if (setLogicalLog(0) != SUCCESS || setRecoveryThreads(0) != FAILURE || setRecoveryThreads(4) != SUCCESS ||
+        setRecordCounts(1) != SUCCESS) {
+        printf("could not set recovery threads before first use\n");
+        return EXIT_FAILURE;
+    }
+    if (openIndex(restart_logged, &idx) != SUCCESS) {
+        printf("could not recover from a torn logical log\n");
+        return EXIT_FAILURE;
+    }
+    if ((fd = restart_open_log(O_RDONLY)) < 0 || fstat(fd, &after) != 0 || after.st_size != before.st_size) {
+        printf("replay did not cut off the torn frame\n");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    
+    //the records are counted as replay puts them back
+    uint64_t counted;
+    if (countRange(idx, NULL, NULL, NULL, &counted) != SUCCESS || counted != MAX_VARCHAR_LEN - 1) {
+        printf("replay did not count the records it restored\n");
+        return EXIT_FAILURE;
+    }
+    
+    Record record;
+    int len;
+    for (len = 1; len <= MAX_VARCHAR_LEN; len++) {
+        memset(&record, 0, sizeof(Record));
+        record.key.type = VARCHAR;
+        memset(record.key.keyval.charkey, 'k', len);
+        ErrCode expected = len == 1 ? KEY_NOTFOUND : SUCCESS;
+        if (get(idx, NULL, &record) != expected || (expected == SUCCESS && strcmp(record.payload, value_one) != 0)) {
+            printf("replay restored the wrong record for a key of length %d\n", len);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    //only the records of the index's current incarnation come back
+    if (openIndex(restart_recreated, &idx) != SUCCESS) {
+        printf("replay lost a recreated index\n");
+        return EXIT_FAILURE;
+    }
+    memset(&record, 0, sizeof(Record));
+    record.key.type = VARCHAR;
+    strcpy(record.key.keyval.charkey, a_key);
+    if (get(idx, NULL, &record) != KEY_NOTFOUND) {
+        printf("replay applied a dropped incarnation's record to its successor\n");
+        return EXIT_FAILURE;
+    }
+    strcpy(record.key.keyval.charkey, b_key);
+    if (get(idx, NULL, &record) != SUCCESS || strcmp(record.payload, value_two) != 0) {
+        printf("replay lost the record of a recreated index\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ Tests what survives a restart, with each lifetime of the library in its own process.
+ */
+static int restart_tests(void)
+{
+    int result = EXIT_FAILURE;
+    system("rm -rf restart_test");
+    if (mkdir(restart_dir, S_IRWXU) != 0) {
+        printf("could not create %s\n", restart_dir);
+        return EXIT_FAILURE;
+    }
+    
+    if (run_restart_child(restart_create) != EXIT_SUCCESS ||
+        run_restart_child(restart_catalog) != EXIT_SUCCESS ||
+        run_restart_child(restart_recovery_target) != EXIT_SUCCESS ||
+        run_restart_child(restart_async_io) != EXIT_SUCCESS ||
+        run_restart_child(restart_multiversion) != EXIT_SUCCESS ||
+        run_restart_child(restart_logical_write) != EXIT_SUCCESS ||
+        run_restart_child(restart_logical_replay) != EXIT_SUCCESS) {
+        goto done;
+    }
+    
+    printf("successfully passed restart tests!\n");
+    result = EXIT_SUCCESS;
+done:
+    system("rm -rf restart_test");
+    return result;
+}
+
+
 #ifndef RUNNING_SPEED_TEST
 int main(void)
 {
@@ -354,11 +1479,119 @@ int run_unittests(void)
     k_d.type = VARCHAR;
     memcpy(k_d.keyval.charkey, d_key, strlen(d_key)+1);
     
+    //restarts run in child processes, before this one starts the library
+    if (restart_tests() != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    
+    //the deadlock policy can be chosen only before the environment exists
+    if ((errCode = setDeadlockPolicy(DEADLOCK_ABORT_YOUNGEST)) != SUCCESS) {
+        printf("could not set deadlock policy before first use\n");
+        return EXIT_FAILURE;
+    }
+    
+    //group commit exercises the background log flusher for every test commit
+    if ((errCode = setDurability(DURABILITY_GROUP, 0)) != SUCCESS) {
+        printf("could not set durability before first use\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = setCacheSize(64 * 1024 * 1024, 0)) != FAILURE ||
+        (errCode = setCacheSize(64 * 1024 * 1024, 4)) != SUCCESS) {
+        printf("cache size was not validated\n");
+        return EXIT_FAILURE;
+    }
+    
+    //countRange and getByRank need the indices to keep record counts
+    if ((errCode = setRecordCounts(1)) != SUCCESS) {
+        printf("could not keep record counts before first use\n");
+        return EXIT_FAILURE;
+    }
+    
     //create the primary index
     if ((errCode = create(VARCHAR, primary_index)) != SUCCESS) {
         printf("could not create primary index\n");
         return EXIT_FAILURE;
     }
+    
+    if ((errCode = setDeadlockPolicy(DEADLOCK_DETECT_DEFAULT)) != FAILURE) {
+        printf("deadlock policy was changed after the environment was created\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = setAsyncIO(64)) != FAILURE) {
+        printf("I/O layer was changed after the environment was created\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = setRecoveryThreads(4)) != FAILURE) {
+        printf("recovery threads were changed after the environment was created\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = setLogicalLog(0)) != FAILURE) {
+        printf("logical log was enabled after the environment was created\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = setMultiversion(0)) != FAILURE) {
+        printf("multiversion reads were disabled after the environment was created\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = setDurability(DURABILITY_SYNC, 0)) != FAILURE) {
+        printf("durability was changed after the environment was created\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = setCacheSize(64 * 1024 * 1024, 1)) != FAILURE) {
+        printf("cache size was changed after the environment was created\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = setRecordCounts(0)) != FAILURE) {
+        printf("record counts were changed after the environment was created\n");
+        return EXIT_FAILURE;
+    }
+    
+    //BDB may add its own overhead to the size asked for
+    CacheStats stats, later;
+    if ((errCode = getCacheStats(&stats)) != SUCCESS) {
+        printf("could not read cache statistics\n");
+        return EXIT_FAILURE;
+    }
+    if (stats.cacheBytes < 64 * 1024 * 1024 || stats.partitions != 4) {
+        printf("cache has %llu bytes in %u partitions instead of 64MB in 4\n",
+               (unsigned long long)stats.cacheBytes, stats.partitions);
+        return EXIT_FAILURE;
+    }
+    
+    //a lookup goes through the cache, whether or not it finds its key
+    IdxState *statsIdx;
+    Record statsRecord;
+    memset(&statsRecord, 0, sizeof(Record));
+    statsRecord.key.type = VARCHAR;
+    strcpy(statsRecord.key.keyval.charkey, a_key);
+    if ((errCode = openIndex(primary_index, &statsIdx)) != SUCCESS ||
+        ((errCode = get(statsIdx, NULL, &statsRecord)) != SUCCESS && errCode != KEY_NOTFOUND) ||
+        (errCode = getCacheStats(&later)) != SUCCESS || (errCode = closeIndex(statsIdx)) != SUCCESS) {
+        printf("could not read through the cache. ErrCode = %d\n", errCode);
+        return EXIT_FAILURE;
+    }
+    if (later.hits + later.misses <= stats.hits + stats.misses) {
+        printf("a lookup did not show up in the cache statistics\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = setTransactionDurability(NULL, DURABILITY_ASYNC)) != TXN_DNE) {
+        printf("set durability of a nonexistent transaction\n");
+        return EXIT_FAILURE;
+    }
+    
+    if ((errCode = setRecoveryTarget(0)) != FAILURE || (errCode = setRecoveryTarget(5)) != SUCCESS) {
+        printf("recovery target was not validated\n");
+        return EXIT_FAILURE;
+    }
   
     if (pthread_create(&tran_test_thread, NULL, test_transaction_func, NULL) != 0) {
         return EXIT_FAILURE;
@@ -983,6 +2216,22 @@ multi_tbl_txn:
     pthread_join(tran_test_thread, NULL);
     pthread_join(sec_test_thread, NULL);
     
+    if (drop_truncate_tests() != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    
+    if (snapshot_tests() != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    
+    if (bulk_load_tests() != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    
+    if (backup_tests() != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    
     if ((DID_SECONDARY_PASS == 1) && (DID_TRANSACTION_PASS == 1)) {
         return EXIT_SUCCESS;
     } else {\